@@ -0,0 +1,85 @@
+#pragma once
+
+#include "compiler.h"
+#include "pipeline.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+/// Runs the front end on the given source, optionally with optimizations,
+/// up to right before finalize(). Aborts on error, as benchmark inputs are
+/// expected to be valid.
+inline AbstractInstrStream compile_abstract(std::string_view source, bool optimize = true) {
+    auto lines = split_lines(source);
+    auto tokens = parse(lines, "<bench>");
+    if (!tokens) {
+        fmt::print(stderr, "bench: {}\n", tokens.error);
+        std::abort();
+    }
+    auto abstracts = translate(tokens.value());
+    if (!abstracts) {
+        fmt::print(stderr, "bench: {}\n", abstracts.error);
+        std::abort();
+    }
+    auto abstract_instrs = abstracts.move();
+    if (optimize) {
+        (void)optimize_peephole(abstract_instrs);
+        (void)optimize_strength_reduce(abstract_instrs);
+        (void)optimize_loops(abstract_instrs);
+    }
+    return abstract_instrs;
+}
+
+/// Like compile_abstract(), followed by finalize().
+inline InstrStream compile(std::string_view source, bool optimize = true) {
+    auto instrs = finalize(compile_abstract(source, optimize));
+    if (!instrs) {
+        fmt::print(stderr, "bench: {}\n", instrs.error);
+        std::abort();
+    }
+    return instrs.move();
+}
+
+/// Resident set size of this process, in bytes, as reported by /proc/self/status.
+inline size_t current_rss() {
+    auto* file = std::fopen("/proc/self/status", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[256];
+    size_t kib = 0;
+    while (std::fgets(line, sizeof(line), file)) {
+        if (std::string_view(line).starts_with("VmRSS:")) {
+            kib = std::strtoull(line + 6, nullptr, 10);
+            break;
+        }
+    }
+    std::fclose(file);
+    return kib * 1024;
+}
+
+/// Wall clock timer, prints the elapsed time when stopped.
+class Timer {
+public:
+    explicit Timer(std::string_view name)
+        : m_name(name)
+        , m_start(std::chrono::steady_clock::now()) { }
+
+    double stop() {
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+        fmt::print("  {:<40} {:>10.3f} ms\n", m_name, elapsed);
+        return elapsed;
+    }
+
+private:
+    std::string_view m_name;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+}
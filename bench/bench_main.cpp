@@ -0,0 +1,967 @@
+#include "bench.h"
+#include "bytecode.h"
+#include "decompiler.h"
+#include "dense.h"
+#include "embed.h"
+#include "instruction.h"
+#include "interpreter.h"
+#include "lanes.h"
+#include "placement.h"
+#include "profile.h"
+#include "server.h"
+#include "symbols.h"
+#include "task.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <latch>
+#include <optional>
+#include <thread>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Benchmarks are plain functions, selected by name on the command line.
+// Run `mcl-bench` without arguments to run all of them.
+
+/// Memory used by each suspended VmTask, with many tasks alive at once.
+static void bench_suspended_tasks() {
+    constexpr size_t task_count = 10'000;
+    auto instrs = bench::compile(":loop\n"
+                                 "push 1\n"
+                                 "print\n"
+                                 "jmp :loop\n");
+    size_t output_bytes = 0;
+    Executor executor([&](Executor::TaskId, std::string_view out) { output_bytes += out.size(); });
+
+    auto rss_before = bench::current_rss();
+    bench::Timer spawn_timer("spawn");
+    for (size_t i = 0; i < task_count; ++i) {
+        executor.spawn(InstrStream(instrs), TaskConfig { .budget = 1000, .output_limit = 512 });
+    }
+    spawn_timer.stop();
+    // one round, so every task has run and is now suspended mid-program
+    bench::Timer round_timer("one round");
+    executor.run_once();
+    round_timer.stop();
+    auto rss_after = bench::current_rss();
+
+    fmt::print("  {} suspended tasks, {} bytes of output\n", task_count, output_bytes);
+    fmt::print("  sizeof(Vm) = {} bytes\n", sizeof(Vm));
+    fmt::print("  rss per suspended task: {} bytes\n", (rss_after - rss_before) / task_count);
+}
+
+/// `div`/`mod` by a constant, with and without strength reduction.
+static void bench_constant_divisor() {
+    constexpr std::string_view source = "push 20000000\n"
+                                        ":loop\n"
+                                        "dup\n"
+                                        "push 7\n"
+                                        "mod\n"
+                                        "pop\n"
+                                        "dup\n"
+                                        "push 1024\n"
+                                        "div\n"
+                                        "pop\n"
+                                        "push 1\n"
+                                        "sub\n"
+                                        "dup\n"
+                                        "jnz :loop\n";
+    for (bool optimize : { false, true }) {
+        auto instrs = bench::compile(source, optimize);
+        bench::Timer timer(optimize ? "divc/divp2" : "div/mod");
+        auto err = execute(std::move(instrs));
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+        }
+    }
+}
+
+/// A loop with a body too large for the L1 cache, in the fixed size and the
+/// dense encoding.
+static void bench_dense_code() {
+    constexpr size_t body_blocks = 20'000;
+    std::string source = "push 200\n:loop\n";
+    for (size_t i = 0; i < body_blocks; ++i) {
+        source += "push 3\nadd\npush 3\nsub\n";
+    }
+    source += "dec\ndup\njnz :loop\n";
+    auto instrs = bench::compile(source, false);
+    auto dense = encode_dense(instrs);
+    if (!dense) {
+        fmt::print("  error: {}\n", dense.error);
+        return;
+    }
+    fmt::print("  {} instructions: {} bytes fixed, {} bytes dense\n", instrs.size(), instrs.size() * sizeof(Instr), dense.value().size());
+    {
+        bench::Timer timer("fixed");
+        auto err = execute(std::move(instrs));
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+        }
+    }
+    {
+        bench::Timer timer("dense");
+        auto err = execute_dense(dense.move());
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+        }
+    }
+}
+
+/// The interpreter running pre-decoded ops and arguments, against running the
+/// packed Instr union directly.
+static void bench_decoded_layout() {
+    constexpr std::string_view source = "push 30000000\n"
+                                        ":loop\n"
+                                        "push 12\n"
+                                        "push -7\n"
+                                        "add\n"
+                                        "pop\n"
+                                        "push -1\n"
+                                        "add\n"
+                                        "dup\n"
+                                        "jnz :loop\n";
+    for (bool predecode : { false, true }) {
+        auto instrs = bench::compile(source, false);
+        bench::Timer timer(predecode ? "pre-decoded ops and args" : "Instr union");
+        auto err = execute(std::move(instrs), VmConfig { .stack_size = 0, .predecode = predecode });
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+        }
+    }
+}
+
+/// Front end throughput on generated code with one label per three instructions.
+static void bench_profile_guided() {
+    // a loop whose common path has to jump over the rare one
+    constexpr std::string_view source = "push 0\n"
+                                        ":loop\n"
+                                        "dup\n"
+                                        "push 16\n"
+                                        "mod\n"
+                                        "push 0\n"
+                                        "je :rare\n"
+                                        "push 1\n"
+                                        "add\n"
+                                        "jmp :next\n"
+                                        ":rare\n"
+                                        "push 3\n"
+                                        "add\n"
+                                        ":next\n"
+                                        "dup\n"
+                                        "push 300000000\n"
+                                        "jl :loop\n"
+                                        "pop\n";
+    const auto abstracts = bench::compile_abstract(source);
+    auto instrs = finalize(AbstractInstrStream(abstracts));
+    if (!instrs) {
+        fmt::print("  error: {}\n", instrs.error);
+        return;
+    }
+    std::vector<Op> ops;
+    std::vector<size_t> pcs;
+    for (const auto& instr : instrs.value()) {
+        pcs.push_back(ops.size());
+        ops.push_back(instr.s.op);
+    }
+    ExecStats stats;
+    auto err = execute(InstrStream(instrs.value()), VmConfig { .stack_size = 0, .predecode = true, .profile = true }, &stats);
+    if (err) {
+        fmt::print("  error: {}\n", err.error);
+        return;
+    }
+    auto optimized = abstracts;
+    ProfileReport report;
+    err = optimize_profile(optimized, make_profile(ops, pcs, stats.profile), &report);
+    if (err) {
+        fmt::print("  error: {}\n", err.error);
+        return;
+    }
+    auto optimized_instrs = finalize(std::move(optimized));
+    for (auto* program : { &instrs.value(), &optimized_instrs.value() }) {
+        ExecStats counted;
+        bench::Timer timer(program == &instrs.value() ? "without profile" : "with profile");
+        err = execute(InstrStream(*program), {}, &counted);
+        timer.stop();
+        fmt::print("  ({} instructions executed)\n", counted.instructions);
+    }
+    fmt::print("  {} jumps inverted, {} removed, {} added\n", report.inverted_jumps, report.removed_jumps, report.added_jumps);
+}
+
+static void bench_traces() {
+    // a loop which mostly shuffles the stack, summing 0..n-1; not optimized,
+    // so that the shuffling stays
+    constexpr std::string_view source = "push 0\n"
+                                        "push 0\n"
+                                        ":loop\n"
+                                        "swap\n"
+                                        "over\n"
+                                        "add\n"
+                                        "swap\n"
+                                        "inc\n"
+                                        "dup\n"
+                                        "push 200000000\n"
+                                        "jn :loop\n"
+                                        "pop\n";
+    const auto instrs = bench::compile(source, false);
+    for (const bool trace : { false, true }) {
+        ExecStats stats;
+        bench::Timer timer(trace ? "traced" : "interpreted");
+        auto err = execute(InstrStream(instrs), VmConfig { .stack_size = 0, .predecode = true, .profile = false, .trace = trace }, &stats);
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+            return;
+        }
+        if (trace) {
+            fmt::print("  ({} traces, {} iterations in traces)\n", stats.traces.recorded, stats.traces.iterations);
+        }
+    }
+}
+
+/// examples/primes.mcl on the stack interpreter and as register code, with
+/// and without optimizations.
+static void bench_registers() {
+    constexpr std::string_view source = "push 10001231\n"
+                                        "push 1\n"
+                                        ":loop\n"
+                                        "push 1\n"
+                                        "add\n"
+                                        "over\n"
+                                        "over\n"
+                                        "je :prime\n"
+                                        "over\n"
+                                        "over\n"
+                                        "mod\n"
+                                        "push 0\n"
+                                        "je :not_prime\n"
+                                        "jmp :loop\n"
+                                        ":not_prime\n"
+                                        "halt\n"
+                                        ":prime\n"
+                                        "halt\n";
+    for (const bool optimize : { false, true }) {
+        const auto instrs = bench::compile(source, optimize);
+        for (const bool registers : { false, true }) {
+            const VmConfig cfg { .stack_size = 0, .predecode = true, .profile = false, .trace = false, .checked_arith = false, .registers = registers };
+            const auto name = fmt::format("{}, {}", optimize ? "optimized" : "unoptimized", registers ? "register code" : "stack interpreter");
+            bench::Timer timer(name);
+            auto err = execute(InstrStream(instrs), cfg);
+            timer.stop();
+            ExecStats stats;
+            if (!err) {
+                err = execute(InstrStream(instrs), cfg, &stats);
+            }
+            if (err) {
+                fmt::print("  error: {}\n", err.error);
+                return;
+            }
+            fmt::print("  ({} instructions dispatched)\n", stats.instructions);
+        }
+    }
+}
+
+/// examples/primes_input.mcl over many inputs, one Vm per input against
+/// lockstep lanes, for odd numbers (most of which stop early) and for primes
+/// (which all run the whole loop).
+static void bench_lanes() {
+    constexpr std::string_view source = "push 1\n"
+                                        ":loop\n"
+                                        "push 1\n"
+                                        "add\n"
+                                        "over\n"
+                                        "over\n"
+                                        "je :prime\n"
+                                        "over\n"
+                                        "over\n"
+                                        "mod\n"
+                                        "push 0\n"
+                                        "je :not_prime\n"
+                                        "jmp :loop\n"
+                                        ":not_prime\n"
+                                        "push 0\n"
+                                        "print\n"
+                                        "halt\n"
+                                        ":prime\n"
+                                        "push 1\n"
+                                        "print\n"
+                                        "halt\n";
+    const auto is_prime = [](int64_t p) {
+        for (int64_t i = 2; i * i <= p; ++i) {
+            if (p % i == 0) {
+                return false;
+            }
+        }
+        return p > 1;
+    };
+    std::vector<LaneInput> odd;
+    std::vector<LaneInput> primes;
+    for (int64_t p = 10'001; odd.size() < 20'000; p += 2) {
+        odd.push_back({ p });
+    }
+    for (int64_t p = 100'001; primes.size() < 2'000; p += 2) {
+        if (is_prime(p)) {
+            primes.push_back({ p });
+        }
+    }
+    const auto instrs = bench::compile(source);
+    for (const auto& [name, inputs] : { std::pair { "odd numbers", &odd }, std::pair { "primes", &primes } }) {
+        std::string expected;
+        {
+            const auto label = fmt::format("{}, one vm per input", name);
+            bench::Timer timer(label);
+            for (const auto& input : *inputs) {
+                auto vm = Vm::create(InstrStream(instrs)).move();
+                vm.stack.stack[0] = input[0];
+                vm.stack.stack_top = 1;
+                if (run(vm, UINT64_MAX) != VmStatus::Halted) {
+                    fmt::print("  error: {}\n", vm.error.error);
+                    return;
+                }
+                expected += vm.output;
+            }
+            timer.stop();
+        }
+        LaneStats stats;
+        const auto label = fmt::format("{}, lanes", name);
+        bench::Timer timer(label);
+        auto runs = execute_lanes(InstrStream(instrs), *inputs, {}, &stats);
+        timer.stop();
+        if (!runs) {
+            fmt::print("  error: {}\n", runs.error);
+            return;
+        }
+        std::string output;
+        for (const auto& lane : runs.value()) {
+            output += lane.output;
+        }
+        fmt::print("  ({:.2f} lanes per instruction, {} divergences, {} runs in the interpreter{})\n",
+            double(stats.lane_instructions) / double(stats.group_instructions), stats.divergences, stats.scalar_runs,
+            output == expected ? "" : ", OUTPUT DIFFERS");
+    }
+}
+
+static void bench_checked_arith() {
+    // a loop which is mostly arithmetic, computing a hash of 0..n-1
+    constexpr std::string_view source = "push 0\n"
+                                        "push 0\n"
+                                        ":loop\n"
+                                        "swap\n"
+                                        "push 31\n"
+                                        "mul\n"
+                                        "push 1000000007\n"
+                                        "mod\n"
+                                        "over\n"
+                                        "add\n"
+                                        "swap\n"
+                                        "inc\n"
+                                        "dup\n"
+                                        "push 100000000\n"
+                                        "jn :loop\n"
+                                        "pop\n";
+    const auto instrs = bench::compile(source);
+    for (const bool checked : { false, true }) {
+        bench::Timer timer(checked ? "checked" : "wrapping");
+        auto err = execute(InstrStream(instrs), VmConfig { .stack_size = 0, .predecode = true, .profile = false, .trace = false, .checked_arith = checked });
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+            return;
+        }
+    }
+}
+
+/// Latency of a request to the server, for a program it has to compile and
+/// for one it has cached, against compiling and running in-process.
+static void bench_server() {
+    constexpr size_t request_count = 1000;
+    std::string source;
+    for (size_t i = 0; i < 200; ++i) {
+        source += fmt::format("push {}\npush {}\nadd\npop\n", i, i * 3);
+    }
+    source += "halt\n";
+    const auto socket_path = fmt::format("/tmp/mcl-bench-{}.sock", getpid());
+    std::atomic<bool> stop { false };
+    Error serve_err;
+    std::thread server([&] { serve_err = serve(ServerConfig { .socket_path = socket_path, .workers = 1, .log_requests = false }, &stop); });
+    // the server is up once it accepts connections
+    ClientResult result;
+    for (size_t attempt = 0; attempt < 100; ++attempt) {
+        result = run_on_server(socket_path, ClientRequest { .name = "<warmup>", .source = "halt\n" }, stdout);
+        if (!result.error) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::FILE* null_out = std::fopen("/dev/null", "w");
+    if (!result.error && null_out) {
+        bench::Timer uncached_timer("uncached requests");
+        for (size_t i = 0; i < request_count && !result.error; ++i) {
+            // a different name each time misses the cache
+            result = run_on_server(socket_path, ClientRequest { .name = fmt::format("<bench {}>", i), .source = source }, null_out);
+        }
+        uncached_timer.stop();
+        bench::Timer cached_timer("cached requests");
+        for (size_t i = 0; i < request_count && !result.error; ++i) {
+            result = run_on_server(socket_path, ClientRequest { .name = "<bench>", .source = source }, null_out);
+        }
+        cached_timer.stop();
+        bench::Timer local_timer("in-process compile and run");
+        for (size_t i = 0; i < request_count; ++i) {
+            (void)execute(bench::compile(source), VmConfig {}, nullptr);
+        }
+        local_timer.stop();
+    }
+    if (null_out) {
+        std::fclose(null_out);
+    }
+    stop = true;
+    server.join();
+    if (result.error || serve_err) {
+        fmt::print("  error: {}\n", result.error ? result.error.error : serve_err.error);
+        return;
+    }
+    fmt::print("  {} requests each\n", request_count);
+}
+
+/// Time from starting `mcl --exec` and `mcl-run` on a compiled program until
+/// its first output arrives, with the program printing in its first
+/// instructions. Both are looked for next to mcl-bench.
+static void bench_startup() {
+    constexpr size_t spawn_count = 200;
+    char self[4096] {};
+    std::string dir(self, size_t(std::max<ssize_t>(readlink("/proc/self/exe", self, sizeof(self)), 0)));
+    dir.erase(dir.rfind('/') + 1);
+    const auto filename = fmt::format("/tmp/mcl-bench-{}.mclb", getpid());
+    Bytecode bytecode { .header = {}, .instrs = bench::compile("push 1\nprint\nhalt\n") };
+    if (auto err = write_bytecode(filename, bytecode)) {
+        fmt::print("  error: {}\n", err.error);
+        return;
+    }
+    const std::vector<std::pair<std::string, std::vector<std::string>>> commands {
+        { "mcl --exec", { fmt::format("{}mcl", dir), "--exec", filename } },
+        { "mcl-run", { fmt::format("{}mcl-run", dir), filename } },
+    };
+    for (const auto& [name, args] : commands) {
+        if (access(args[0].c_str(), X_OK) != 0) {
+            fmt::print("  {:<40} not found at '{}'\n", name, args[0]);
+            continue;
+        }
+        std::vector<char*> argv;
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        double total_ms = 0;
+        double min_ms = 1e9;
+        for (size_t i = 0; i < spawn_count; ++i) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                fmt::print("  error: pipe() failed: {}\n", std::strerror(errno));
+                return;
+            }
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+            posix_spawn_file_actions_addclose(&actions, fds[0]);
+            const auto start = std::chrono::steady_clock::now();
+            pid_t pid = 0;
+            const int spawn_err = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+            posix_spawn_file_actions_destroy(&actions);
+            close(fds[1]);
+            char first = 0;
+            const auto got = spawn_err == 0 ? read(fds[0], &first, 1) : -1;
+            const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            close(fds[0]);
+            if (spawn_err == 0) {
+                waitpid(pid, nullptr, 0);
+            }
+            if (got != 1) {
+                fmt::print("  error: '{}' printed nothing\n", name);
+                return;
+            }
+            total_ms += ms;
+            min_ms = std::min(min_ms, ms);
+        }
+        fmt::print("  {:<40} {:>10.3f} ms on average, {:.3f} ms at least\n", name, total_ms / double(spawn_count), min_ms);
+    }
+    std::remove(filename.c_str());
+    fmt::print("  {} runs each\n", spawn_count);
+}
+
+static void bench_label_heavy() {
+    constexpr size_t label_count = 200'000;
+    std::vector<std::string> lines;
+    lines.reserve(label_count * 4);
+    for (size_t i = 0; i < label_count; ++i) {
+        lines.push_back(fmt::format(":label_{}", i));
+        lines.push_back(fmt::format("push {}", i));
+        lines.emplace_back("dup");
+        // alternate between forward and backward references
+        lines.push_back(fmt::format("jz :label_{}", i % 2 == 0 ? (i + 7) % label_count : i / 2));
+    }
+    bench::Timer parse_timer("parse");
+    auto tokens = parse(lines, "<bench>");
+    parse_timer.stop();
+    bench::Timer translate_timer("translate");
+    auto abstracts = translate(tokens.value());
+    translate_timer.stop();
+
+    // the label table on its own, against the std::unordered_map it replaced
+    std::vector<std::string> names;
+    for (const auto& abstract : abstracts.value()) {
+        if (abstract.unresolved_label.has_value()) {
+            names.push_back(abstract.unresolved_label.value());
+        }
+    }
+    {
+        bench::Timer timer("labels: std::unordered_map");
+        std::unordered_map<std::string, size_t> map;
+        size_t sum = 0;
+        for (const auto& name : names) {
+            sum += map.try_emplace(name, map.size()).first->second;
+        }
+        timer.stop();
+        fmt::print("  ({} distinct, checksum {})\n", map.size(), sum);
+    }
+    {
+        bench::Timer timer("labels: SymbolTable");
+        SymbolTable table;
+        size_t sum = 0;
+        for (const auto& name : names) {
+            sum += table.intern(name);
+        }
+        timer.stop();
+        fmt::print("  ({} distinct, checksum {})\n", table.size(), sum);
+    }
+
+    bench::Timer finalize_timer("finalize");
+    auto instrs = finalize(abstracts.move());
+    const auto ms = finalize_timer.stop();
+    if (!instrs) {
+        fmt::print("  error: {}\n", instrs.error);
+        return;
+    }
+    fmt::print("  {:.1f} M labels/s in finalize\n", double(label_count) / ms / 1000.0);
+}
+
+/// parse() and translate() against their chunked versions, on one thread and
+/// on one per hardware thread.
+static void bench_chunked_front_end() {
+    constexpr size_t line_count = 400'000;
+    std::vector<std::string> lines;
+    lines.reserve(line_count);
+    for (size_t i = 0; lines.size() < line_count; ++i) {
+        lines.push_back(fmt::format(":label_{}", i));
+        lines.push_back(fmt::format("push {} # a comment", i * 7919));
+        lines.emplace_back("dup");
+        lines.push_back(fmt::format("jz :label_{}", i / 2));
+    }
+    {
+        bench::Timer timer("parse() and translate()");
+        auto tokens = parse(lines, "<bench>");
+        auto abstracts = tokens ? translate(tokens.value()) : Result<AbstractInstrStream>("{}", tokens.error);
+        const auto ms = timer.stop();
+        if (!abstracts) {
+            fmt::print("  error: {}\n", abstracts.error);
+            return;
+        }
+        fmt::print("  {:.1f} k lines/s, {} instructions\n", double(line_count) / ms, abstracts.value().size());
+    }
+    for (const size_t threads : { size_t(1), size_t(0) }) {
+        const ChunkConfig cfg { .threads = threads };
+        bench::Timer timer(threads == 1 ? "chunked, one thread" : "chunked, all hardware threads");
+        auto tokens = parse_chunked(lines, "<bench>", cfg);
+        auto abstracts = tokens ? translate_chunked(tokens.value(), cfg) : Result<AbstractInstrStream>("{}", tokens.error);
+        const auto ms = timer.stop();
+        if (!abstracts) {
+            fmt::print("  error: {}\n", abstracts.error);
+            return;
+        }
+        fmt::print("  {:.1f} k lines/s, {} instructions\n", double(line_count) / ms, abstracts.value().size());
+    }
+}
+
+/// Decompiling a large file with one thread, and with one per hardware thread.
+static void bench_decompile() {
+    constexpr size_t label_count = 500'000;
+    std::string source;
+    for (size_t i = 0; i < label_count; ++i) {
+        source += fmt::format(":label_{}\npush {}\ndup\njz :label_{}\n", i, i * 7919, (i * 31) % label_count);
+    }
+    Bytecode bytecode { .header = {}, .instrs = bench::compile(source, false) };
+    const auto filename = fmt::format("/tmp/mcl-bench-{}.mclb", getpid());
+    auto err = write_bytecode(filename, bytecode);
+    std::FILE* null_out = std::fopen("/dev/null", "w");
+    for (const size_t threads : { size_t(1), size_t(0) }) {
+        if (err || !null_out) {
+            break;
+        }
+        SourceMap source_map;
+        bench::Timer timer(threads == 1 ? "one thread" : "all hardware threads");
+        auto res = decompile_file(filename, null_out, DecompileConfig { .threads = threads }, &source_map);
+        timer.stop();
+        if (!res) {
+            err = Error("{}", res.error);
+            break;
+        }
+        fmt::print("  ({} instructions, {} labels, {} bytes)\n", res.value().instructions, res.value().labels, res.value().bytes);
+    }
+    if (null_out) {
+        std::fclose(null_out);
+    }
+    std::remove(filename.c_str());
+    if (err) {
+        fmt::print("  error: {}\n", err.error);
+    }
+}
+
+namespace {
+// Error and Result as they were before ErrorMessage: an eagerly formatted
+// std::string, and the value in a std::optional next to it.
+struct EagerError {
+    EagerError() = default;
+    template<typename... Args>
+    EagerError(fmt::format_string<Args...> s, Args&&... args)
+        : is_error(true)
+        , error(fmt::format(s, std::forward<Args>(args)...)) { }
+    bool is_error { false };
+    std::string error { "Success" };
+    operator bool() const { return is_error; }
+};
+
+template<typename T>
+struct EagerResult {
+    template<typename... Args>
+    EagerResult(fmt::format_string<Args...> s, Args&&... args)
+        : is_error(true)
+        , error(fmt::format(s, std::forward<Args>(args)...)) { }
+    EagerResult(T&& value)
+        : result(std::move(value)) { }
+    operator bool() const { return !is_error; }
+    std::optional<T> result { std::nullopt };
+    bool is_error { false };
+    std::string error { "Success" };
+};
+
+template<typename R>
+[[gnu::noinline]] R check_value(int64_t value) {
+    if (value < 0) {
+        return { "Negative value {} at {}:{}", value, "<bench>", 42 };
+    }
+    return bool(value & 1);
+}
+}
+
+/// Error and Result against the eagerly formatted versions they replaced, on
+/// their own and in the front end.
+static void bench_error_results() {
+    constexpr int64_t rounds = 20'000'000;
+    fmt::print("  sizeof: Error {} (was {}), Result<bool> {} (was {})\n", sizeof(Error), sizeof(EagerError),
+        sizeof(Result<bool>), sizeof(EagerResult<bool>));
+    for (const bool failing : { false, true }) {
+        const auto run = [&]<typename R>(std::string_view kind) {
+            const std::string name = fmt::format("{}, {}", kind, failing ? "failing" : "succeeding");
+            bench::Timer timer(name);
+            size_t sum = 0;
+            for (int64_t i = 0; i < rounds; ++i) {
+                auto res = check_value<R>(failing ? -i : i);
+                sum += res ? 1u : 0u;
+            }
+            const auto ms = timer.stop();
+            fmt::print("  {:.1f} M results/s (checksum {})\n", double(rounds) / ms / 1000.0, sum);
+        };
+        run.operator()<EagerResult<bool>>("eager Result<bool>");
+        run.operator()<Result<bool>>("Result<bool>");
+    }
+
+    // the front end, which returns a Result or Error from every step
+    std::string source;
+    for (size_t i = 0; i < 50'000; ++i) {
+        source += fmt::format(":l{}\npush {}\npush 3\nmul\npush 1\nadd\ndup\njz :l{}\npop\n", i, i, i / 2);
+    }
+    {
+        bench::Timer timer("parse, translate and finalize, 450k lines");
+        const auto instrs = bench::compile(source, false);
+        const auto ms = timer.stop();
+        fmt::print("  {:.1f} M lines/s ({} instructions)\n", 450'000.0 / ms / 1000.0, instrs.size());
+    }
+    // a short program, many times, so that the errors of each pass add up
+    std::string fold_source;
+    for (size_t i = 0; i < 1'000; ++i) {
+        fold_source += fmt::format("push {}\npush 3\nmul\npush 1\nadd\ndup\nprint\npop\n", i);
+    }
+    const auto abstracts = bench::compile_abstract(fold_source, false);
+    bench::Timer timer("optimize_peephole, 8k lines, 20 times");
+    for (size_t i = 0; i < 20; ++i) {
+        auto copy = abstracts;
+        if (auto err = optimize_peephole(copy)) {
+            fmt::print("  error: {}\n", err.error);
+            return;
+        }
+    }
+    timer.stop();
+}
+
+/// Kilobytes of this process's memory in transparent huge pages, from
+/// /proc/self/smaps_rollup.
+static size_t anon_huge_kib() {
+    auto* file = std::fopen("/proc/self/smaps_rollup", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[256];
+    size_t kib = 0;
+    while (std::fgets(line, sizeof(line), file)) {
+        if (std::string_view(line).starts_with("AnonHugePages:")) {
+            kib = std::strtoull(line + 14, nullptr, 10);
+            break;
+        }
+    }
+    std::fclose(file);
+    return kib;
+}
+
+/// Many VMs at once, each running a program of 1M instructions on its own
+/// thread, with the memory placements of placement.h. The program jumps
+/// between blocks in a scrambled order, so that nearly every block is on
+/// another page, which is where the TLB entries saved by huge pages show.
+/// Each thread creates its VM, which copies and decodes the program, before
+/// they all start.
+static void bench_placement() {
+    constexpr uint64_t block_count = 250'000;
+    constexpr uint64_t iterations = 10;
+    // block i is at position (i * stride) % block_count of the program, and
+    // the stride is coprime to the count, so that every block is there once
+    constexpr uint64_t stride = 7'919;
+    std::vector<uint64_t> at_position(block_count);
+    for (uint64_t i = 0; i < block_count; ++i) {
+        at_position[i * stride % block_count] = i;
+    }
+    std::string source = fmt::format("push {}\n:loop\njmp :b0\n", iterations);
+    for (const auto block : at_position) {
+        const auto next = block + 1 == block_count ? std::string("end") : fmt::format("b{}", block + 1);
+        source += fmt::format(":b{}\ndup\npop\njmp :{}\n", block, next);
+    }
+    source += ":end\ndec\ndup\njnz :loop\nhalt\n";
+    const auto instrs = bench::compile(source, false);
+    const uint64_t instructions_per_vm = iterations * (3 * block_count + 4) + 2;
+    const size_t vm_count = std::max<size_t>(8, 2 * std::thread::hardware_concurrency());
+    struct Variant {
+        const char* name;
+        Placement placement;
+        bool pin;
+    };
+    const Variant variants[] = {
+        { "malloc", {}, false },
+        { "prefaulted stacks", { .huge_pages = HugePages::Off, .prefault = true }, false },
+        { "transparent huge pages", { .huge_pages = HugePages::Transparent, .prefault = true }, false },
+        { "explicit huge pages", { .huge_pages = HugePages::Explicit, .prefault = true }, false },
+        { "transparent, pinned", { .huge_pages = HugePages::Transparent, .prefault = true }, true },
+    };
+    for (const auto& variant : variants) {
+        std::latch created { std::ptrdiff_t(vm_count) };
+        std::latch start { 1 };
+        std::atomic<uint64_t> instructions { 0 };
+        std::atomic<bool> failed { false };
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < vm_count; ++i) {
+            threads.emplace_back([&, i] {
+                if (variant.pin) {
+                    (void)pin_thread(i);
+                }
+                auto created_vm = Vm::create(InstrStream(instrs), VmConfig { .placement = variant.placement });
+                created.count_down();
+                start.wait();
+                if (!created_vm) {
+                    failed = true;
+                    return;
+                }
+                auto vm = created_vm.move();
+                if (run(vm, UINT64_MAX) != VmStatus::Halted) {
+                    failed = true;
+                }
+                instructions += instructions_per_vm;
+            });
+        }
+        created.wait();
+        const auto huge_kib = anon_huge_kib();
+        bench::Timer timer(variant.name);
+        start.count_down();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const auto ms = timer.stop();
+        if (failed) {
+            fmt::print("  error: a VM didn't halt\n");
+            return;
+        }
+        fmt::print("  {:.0f} M instructions/s, {} MiB in transparent huge pages\n", double(instructions) / ms / 1000.0, huge_kib / 1024);
+    }
+    fmt::print("  {} VMs on {} CPUs\n", vm_count, allowed_cpu_count());
+}
+
+/// optimize_peephole() on a large program in which most instructions are
+/// rewritten, some several times over.
+static void bench_peephole() {
+    std::string source;
+    for (size_t i = 0; i < 50'000; ++i) {
+        source += fmt::format(":l{}\npush {}\ndup\nmul\npush 1\nadd\nswap\nswap\npush 0\nje :l{}\ndup\npop\nprint\n", i, i % 1000, i);
+    }
+    const auto abstracts = bench::compile_abstract(source, false);
+    auto copy = abstracts;
+    bench::Timer timer("optimize_peephole, 600k lines");
+    if (auto err = optimize_peephole(copy)) {
+        fmt::print("  error: {}\n", err.error);
+        return;
+    }
+    const auto ms = timer.stop();
+    fmt::print("  {:.1f} M instructions/s ({} to {} instructions)\n", double(abstracts.size()) / ms / 1000.0, abstracts.size(), copy.size());
+}
+
+/// op_from_string() against a std::unordered_map of the mnemonics.
+static void bench_mnemonic_lookup() {
+    constexpr size_t rounds = 200'000;
+    std::vector<std::string> words;
+    std::unordered_map<std::string_view, Op> map;
+    for (uint8_t op = PUSH; op <= RET; ++op) {
+        words.emplace_back(to_string(Op(op)));
+        map.emplace(to_string(Op(op)), Op(op));
+    }
+    words.emplace_back("not_a_mnemonic");
+    size_t sum = 0;
+    {
+        bench::Timer timer("std::unordered_map");
+        for (size_t i = 0; i < rounds; ++i) {
+            for (const auto& word : words) {
+                auto it = map.find(word);
+                sum += it == map.end() ? 0 : size_t(it->second);
+            }
+        }
+        const auto ms = timer.stop();
+        fmt::print("  {:.1f} M lookups/s\n", double(rounds * words.size()) / ms / 1000.0);
+    }
+    {
+        bench::Timer timer("op_from_string");
+        for (size_t i = 0; i < rounds; ++i) {
+            for (const auto& word : words) {
+                sum += op_from_string(word);
+            }
+        }
+        const auto ms = timer.stop();
+        fmt::print("  {:.1f} M lookups/s\n", double(rounds * words.size()) / ms / 1000.0);
+    }
+    fmt::print("  (checksum {})\n", sum);
+}
+
+/// A kernel embedded with embed.h, against the same source through the
+/// interpreter, with `input` on the stack.
+template<EmbeddedSource Source>
+static void bench_embedded_kernel(std::string_view name, int64_t input) {
+    for (const bool optimize : { false, true }) {
+        auto instrs = bench::compile(fmt::format("push {}\n{}", input, Source.view()), optimize);
+        const auto label = fmt::format("{}, {} interpreter", name, optimize ? "optimized" : "unoptimized");
+        bench::Timer timer(label);
+        auto err = execute(std::move(instrs));
+        timer.stop();
+        if (err) {
+            fmt::print("  error: {}\n", err.error);
+        }
+    }
+    std::array<int64_t, 16> stack { input };
+    const auto label = fmt::format("{}, embedded", name);
+    bench::Timer timer(label);
+    const auto result = run_embedded<Source>(stack, 1, [](int64_t) { });
+    timer.stop();
+    fmt::print("  {} at pc {}, {} on top\n", to_string(result.status), result.pc, stack[result.height - 1]);
+}
+
+/// Kernels embedded with embed.h against the interpreter: the primes loop,
+/// which mostly waits for the division, and a sum, which is all stack
+/// shuffling. Also the time compiling one at runtime takes.
+static void bench_embedded() {
+    static constexpr EmbeddedSource primes = "push 1\n"
+                                             ":loop\n"
+                                             "inc\n"
+                                             "over\n"
+                                             "over\n"
+                                             "je :prime\n"
+                                             "over\n"
+                                             "over\n"
+                                             "mod\n"
+                                             "jz :not_prime\n"
+                                             "jmp :loop\n"
+                                             ":not_prime\n"
+                                             "push 0\n"
+                                             "halt\n"
+                                             ":prime\n"
+                                             "push 1\n"
+                                             "halt\n";
+    // sums i * 3 + 1 for i from the input down to 1
+    static constexpr EmbeddedSource sum = "push 0\n"
+                                          ":loop\n"
+                                          "over\n"
+                                          "push 3\n"
+                                          "mul\n"
+                                          "inc\n"
+                                          "add\n"
+                                          "swap\n"
+                                          "dec\n"
+                                          "swap\n"
+                                          "over\n"
+                                          "jnz :loop\n"
+                                          "swap\n"
+                                          "pop\n";
+    {
+        bench::Timer timer("primes, parse, translate, optimize and finalize");
+        for (size_t i = 0; i < 10'000; ++i) {
+            (void)bench::compile(primes.view());
+        }
+        const auto ms = timer.stop();
+        fmt::print("  {:.2f} us per compile\n", ms * 1000.0 / 10'000);
+    }
+    bench_embedded_kernel<primes>("primes", 10'001'231);
+    bench_embedded_kernel<sum>("sum", 20'000'000);
+}
+
+int main(int argc, char** argv) {
+    const std::vector<std::pair<std::string_view, std::function<void()>>> benchmarks {
+        { "suspended-tasks", bench_suspended_tasks },
+        { "constant-divisor", bench_constant_divisor },
+        { "dense-code", bench_dense_code },
+        { "decoded-layout", bench_decoded_layout },
+        { "profile-guided", bench_profile_guided },
+        { "traces", bench_traces },
+        { "registers", bench_registers },
+        { "lanes", bench_lanes },
+        { "checked-arith", bench_checked_arith },
+        { "server", bench_server },
+        { "startup", bench_startup },
+        { "label-heavy", bench_label_heavy },
+        { "chunked-front-end", bench_chunked_front_end },
+        { "decompile", bench_decompile },
+        { "mnemonic-lookup", bench_mnemonic_lookup },
+        { "error-results", bench_error_results },
+        { "peephole", bench_peephole },
+        { "placement", bench_placement },
+        { "embedded", bench_embedded },
+    };
+    for (const auto& [name, fn] : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || name == argv[i];
+        }
+        if (selected) {
+            fmt::print("{}:\n", name);
+            fn();
+        }
+    }
+}
@@ -3,6 +3,9 @@
 option(${PROJECT_NAME}_WARNINGS_AS_ERRORS "Treat compiler warnings as errors." OFF)
 option(${PROJECT_NAME}_CHECKOUT_GIT_SUBMODULES "If git is found, initialize all submodules." ON)
 option(${PROJECT_NAME}_ENABLE_UNIT_TESTING "Enable unit tests for the projects (from the `test` subfolder)." ON)
+option(${PROJECT_NAME}_ENABLE_BENCHMARKS "Enable the benchmarks (from the `bench` subfolder)." OFF)
+option(${PROJECT_NAME}_ENABLE_FUZZING "Enable the differential fuzzer (from the `fuzz` subfolder), a libFuzzer target when building with Clang." OFF)
+option(${PROJECT_NAME}_STATIC_RUNNER "Link `mcl-run` statically on Linux, so that it starts faster." ON)
 option(${PROJECT_NAME}_ENABLE_CLANG_TIDY "Enable static analysis with Clang-Tidy." OFF)
 option(${PROJECT_NAME}_ENABLE_CPPCHECK "Enable static analysis with Cppcheck." OFF)
 # TODO Implement code coverage
@@ -0,0 +1,605 @@
+#include "compiler.h"
+#include "dense.h"
+#include "instruction.h"
+#include "interpreter.h"
+#include "lanes.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Differential fuzzer: turns the input into a random, well-formed program,
+// compiles it with different sets of optimizations, runs each on every
+// engine, and aborts if any of them prints something else or fails
+// differently than the unoptimized program on the plain interpreter.
+//
+// With clang, this is a libFuzzer target. Otherwise it's built with
+// MCL_FUZZ_STANDALONE, and runs random inputs itself, or replays the given
+// files; see main() at the end.
+
+namespace {
+
+/// Hands out the bytes of the input as choices. Once it's used up, every
+/// choice is 0, which always picks the shortest way to finish the program.
+class Choices {
+public:
+    Choices(const uint8_t* data, size_t size)
+        : m_data(data)
+        , m_size(size) { }
+
+    uint8_t byte() { return m_offset < m_size ? m_data[m_offset++] : 0; }
+    /// A number in [0, n).
+    size_t below(size_t n) { return byte() % n; }
+    /// True with a probability of about `percent` %.
+    bool chance(size_t percent) { return below(100) < percent; }
+    bool used_up() const { return m_offset >= m_size; }
+
+    /// A constant for `push`, mostly small, sometimes large enough to
+    /// overflow when multiplied.
+    int64_t value() {
+        switch (below(8)) {
+        case 0:
+            return -int64_t(below(10));
+        case 1: {
+            int64_t large = 0;
+            for (int i = 0; i < 6; ++i) {
+                large = large << 8 | byte();
+            }
+            // fits into the 56 bits of an instruction
+            return below(2) == 0 ? large : -large;
+        }
+        default:
+            return int64_t(below(20));
+        }
+    }
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_offset { 0 };
+};
+
+/// Generates programs which never pop below the values they were given and
+/// always terminate: every statement leaves the stack as high as it found it,
+/// jumps only go forward or to the start of a counted loop, and nothing
+/// consumes the values below the stack height a statement started with, which
+/// include the counters of the loops around it.
+class Generator {
+public:
+    Generator(Choices& in, bool checked)
+        : m_in(in)
+        , m_checked(checked) { }
+
+    std::string generate() {
+        emit("push {}", m_in.value());
+        emit("push {}", m_in.value());
+        statements(0, 2, MUTABLE_TOP);
+        emit("print");
+        emit("print");
+        emit("halt");
+        for (const auto& subroutine : m_subroutines) {
+            m_source += subroutine.source;
+        }
+        return std::move(m_source);
+    }
+
+private:
+    static constexpr size_t MAX_NESTING = 3;
+    static constexpr size_t MAX_STATEMENTS = 200;
+    static constexpr size_t MAX_SUBROUTINES = 6;
+
+    /// Which value below the height a statement starts with it may change.
+    enum Mutable {
+        /// The top value, as at the top level.
+        MUTABLE_TOP,
+        /// The value below the top, the accumulator of a loop whose counter
+        /// is on top.
+        MUTABLE_SECOND,
+    };
+
+    template<typename... Args>
+    void emit(fmt::format_string<Args...> s, Args&&... args) {
+        m_source += fmt::format(s, std::forward<Args>(args)...);
+        m_source += '\n';
+    }
+
+    std::string label() { return fmt::format("l{}", m_labels++); }
+
+    void statements(size_t nesting, size_t depth, Mutable mut) {
+        const size_t count = 1 + m_in.below(6);
+        for (size_t i = 0; i < count && m_statements < MAX_STATEMENTS && !m_in.used_up(); ++i) {
+            ++m_statements;
+            statement(nesting, depth, mut);
+        }
+    }
+
+    void statement(size_t nesting, size_t depth, Mutable mut) {
+        switch (m_in.below(11)) {
+        case 0:
+        case 1:
+        case 2:
+            expression(depth, 0);
+            break;
+        case 9:
+            call(nesting, depth, mut);
+            break;
+        case 3:
+        case 4:
+            update(depth, mut);
+            break;
+        case 5:
+        case 6:
+            branch(nesting, depth, mut);
+            break;
+        case 7:
+        case 8:
+            if (nesting < MAX_NESTING) {
+                loop(nesting, depth);
+            }
+            break;
+        default:
+            if (m_in.chance(10)) {
+                emit("halt");
+            } else {
+                // dead code, which the optimizer may drop
+                const auto skip = label();
+                emit("jmp :{}", skip);
+                expression(depth, 0);
+                emit(":{}", skip);
+            }
+            break;
+        }
+    }
+
+    /// Operations on `owned` values on top of a stack of `depth` values in
+    /// total, which may read any value but only consume the owned ones. Ends
+    /// with `keep` owned values, printing or popping the others.
+    void expression(size_t depth, size_t owned, size_t keep = 0) {
+        const size_t count = 1 + m_in.below(8);
+        for (size_t i = 0; i < count; ++i) {
+            const size_t height = depth + owned;
+            switch (m_in.below(12)) {
+            case 0:
+                emit("push {}", m_in.value());
+                ++owned;
+                break;
+            case 1:
+                emit("dup");
+                ++owned;
+                break;
+            case 2:
+                emit("{}", height >= 2 ? "over" : "dup");
+                ++owned;
+                break;
+            case 3:
+                if (height >= 2) {
+                    emit("dup2");
+                    owned += 2;
+                }
+                break;
+            case 4:
+                if (owned >= 2) {
+                    emit("swap");
+                }
+                break;
+            case 5:
+            case 6:
+            case 7:
+                if (owned >= 2) {
+                    constexpr std::string_view ops[] = { "add", "sub", "mul" };
+                    emit("{}", ops[m_in.below(3)]);
+                    --owned;
+                }
+                break;
+            case 8:
+                if (owned >= 1) {
+                    emit("{}", m_in.below(2) == 0 ? "inc" : "dec");
+                }
+                break;
+            case 9:
+            case 10:
+                divide(owned);
+                break;
+            default:
+                if (owned >= 1 && owned > keep) {
+                    emit("{}", m_in.below(2) == 0 ? "print" : "pop");
+                    --owned;
+                }
+                break;
+            }
+        }
+        while (owned > keep) {
+            emit("{}", m_in.below(3) == 0 ? "pop" : "print");
+            --owned;
+        }
+        while (owned < keep) {
+            emit("push {}", m_in.value());
+            ++owned;
+        }
+    }
+
+    void divide(size_t& owned) {
+        const auto op = m_in.below(2) == 0 ? "div" : "mod";
+        if (m_checked && owned >= 2) {
+            // any divisor, checked arithmetic faults on INT64_MIN / -1 too
+            emit("{}", op);
+            --owned;
+        } else if (owned >= 1) {
+            // without checks, INT64_MIN / -1 traps, so only divide by
+            // constants the optimizer turns into shifts and multiplications
+            emit("push {}", m_in.below(2) == 0 ? int64_t(1) << m_in.below(10) : int64_t(2 + m_in.below(15)));
+            emit("{}", op);
+        }
+    }
+
+    /// Replaces the mutable value by an expression of it.
+    void update(size_t depth, Mutable mut) {
+        if (mut == MUTABLE_SECOND) {
+            emit("swap");
+        }
+        expression(depth - 1, 1, 1);
+        if (mut == MUTABLE_SECOND) {
+            emit("swap");
+        }
+    }
+
+    void branch(size_t nesting, size_t depth, Mutable mut) {
+        const auto otherwise = label();
+        constexpr std::string_view jumps[] = { "je", "jn", "jl", "jg", "jle", "jge" };
+        switch (m_in.below(4)) {
+        case 0:
+            emit("dup");
+            emit("push {}", m_in.value());
+            emit("{} :{}", jumps[m_in.below(6)], otherwise);
+            break;
+        case 1:
+            emit("over");
+            emit("over");
+            emit("{} :{}", jumps[m_in.below(6)], otherwise);
+            break;
+        case 2:
+            emit("dup");
+            emit("{} :{}", m_in.below(2) == 0 ? "jz" : "jnz", otherwise);
+            break;
+        default:
+            // becomes `modjz`/`modjnz`
+            if (m_checked) {
+                emit("over");
+                emit("over");
+            } else {
+                emit("dup");
+                emit("push {}", 2 + m_in.below(9));
+            }
+            emit("mod");
+            emit("{} :{}", m_in.below(2) == 0 ? "jz" : "jnz", otherwise);
+            break;
+        }
+        statements(nesting, depth, mut);
+        if (m_in.chance(50)) {
+            const auto end = label();
+            emit("jmp :{}", end);
+            emit(":{}", otherwise);
+            statements(nesting, depth, mut);
+            emit(":{}", end);
+        } else {
+            emit(":{}", otherwise);
+        }
+    }
+
+    /// Calls a subroutine which is a statement at this depth, reusing one
+    /// with the same depth and mutable value, or generating a new one, which
+    /// goes after the main program.
+    void call(size_t nesting, size_t depth, Mutable mut) {
+        for (const auto& subroutine : m_subroutines) {
+            if (subroutine.depth == depth && subroutine.mut == mut && m_in.below(2) == 0) {
+                emit("call :{}", subroutine.label);
+                return;
+            }
+        }
+        if (m_subroutines.size() + m_generating >= MAX_SUBROUTINES) {
+            return;
+        }
+        const auto name = fmt::format("f{}", m_labels++);
+        emit("call :{}", name);
+        auto caller = std::exchange(m_source, {});
+        ++m_generating;
+        emit(":{}", name);
+        statements(nesting, depth, mut);
+        emit("ret");
+        --m_generating;
+        m_subroutines.push_back({ .label = name, .depth = depth, .mut = mut, .source = std::exchange(m_source, std::move(caller)) });
+    }
+
+    /// A loop with an accumulator and a counter, counting down to 0 or up to
+    /// a limit, in the shapes the loop optimizations look for.
+    void loop(size_t nesting, size_t depth) {
+        const auto start = label();
+        // only the outermost loops run long enough for traces to get hot
+        const int64_t iterations = 1 + int64_t(nesting == 0 && m_in.chance(30) ? m_in.below(250) : m_in.below(12));
+        emit("push {}", m_in.value());
+        const bool down = m_in.below(2) == 0;
+        emit("push {}", down ? iterations : 0);
+        emit(":{}", start);
+        statements(nesting + 1, depth + 2, MUTABLE_SECOND);
+        if (down) {
+            emit("dec");
+            emit("dup");
+            emit("jnz :{}", start);
+        } else {
+            emit("inc");
+            emit("dup");
+            emit("push {}", iterations);
+            emit("jl :{}", start);
+        }
+        emit("pop");
+        emit("{}", m_in.below(2) == 0 ? "print" : "pop");
+    }
+
+    Choices& m_in;
+    bool m_checked;
+    std::string m_source {};
+    size_t m_labels { 0 };
+    size_t m_statements { 0 };
+    struct Subroutine {
+        std::string label;
+        size_t depth;
+        Mutable mut;
+        std::string source;
+    };
+    std::vector<Subroutine> m_subroutines {};
+    /// Subroutines whose body is being generated, which can't be called yet.
+    size_t m_generating { 0 };
+};
+
+/// How a program ended, and what it printed until then.
+struct Outcome {
+    std::string output {};
+    bool finished { false };
+    /// The error without its pc, which differs between optimization levels.
+    std::string error {};
+};
+
+std::string without_pc(const std::string& error) {
+    const auto at = error.find(" pc=");
+    return at == std::string::npos ? error : error.substr(0, at);
+}
+
+enum class Level {
+    None,
+    /// optimize_peephole().
+    Peephole,
+    /// All optimizations `mcl` runs by default.
+    All,
+};
+
+constexpr std::string_view level_name(Level level) {
+    switch (level) {
+    case Level::None:
+        return "no optimizations";
+    case Level::Peephole:
+        return "peephole";
+    case Level::All:
+        return "all optimizations";
+    }
+    return "";
+}
+
+InstrStream compile(const std::string& source, Level level, bool checked) {
+    auto lines = split_lines(source);
+    auto tokens = parse(lines, "<fuzz>");
+    auto abstracts = tokens ? translate(tokens.value()) : Result<AbstractInstrStream>("{}", tokens.error);
+    Error err;
+    if (!abstracts) {
+        err = Error("{}", abstracts.error);
+    }
+    auto abstract_instrs = abstracts ? abstracts.move() : AbstractInstrStream {};
+    if (!err && level == Level::All) {
+        err = optimize_inline(abstract_instrs);
+    }
+    if (!err && level != Level::None) {
+        err = optimize_peephole(abstract_instrs, checked);
+    }
+    if (!err && level == Level::All) {
+        err = optimize_strength_reduce(abstract_instrs);
+        if (!err) {
+            err = optimize_loops(abstract_instrs);
+        }
+    }
+    auto instrs = err ? Result<InstrStream>("{}", err.error) : finalize(std::move(abstract_instrs));
+    if (!instrs) {
+        // the generator only writes valid programs
+        fmt::print(stderr, "Failed to compile with {}: {}\n\n{}", level_name(level), instrs.error, source);
+        std::abort();
+    }
+    return instrs.move();
+}
+
+/// Runs execute() or execute_dense(), which print to stdout, and collects
+/// what they print.
+template<typename Execute>
+Outcome capture(Execute&& execute_fn) {
+    std::fflush(stdout);
+    std::FILE* file = std::tmpfile();
+    const int saved = dup(STDOUT_FILENO);
+    if (!file || saved < 0) {
+        std::perror("fuzz: failed to capture stdout");
+        std::abort();
+    }
+    dup2(fileno(file), STDOUT_FILENO);
+    const Error err = execute_fn();
+    std::fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    Outcome outcome { .output = {}, .finished = true, .error = err ? without_pc(err.error) : std::string {} };
+    std::rewind(file);
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        outcome.output.append(buffer, n);
+    }
+    std::fclose(file);
+    return outcome;
+}
+
+/// Runs through run(), suspending every `slice` instructions, for at most
+/// `budget` instructions.
+Outcome run_budgeted(const InstrStream& instrs, const VmConfig& cfg, uint64_t slice, uint64_t budget) {
+    auto vm_res = Vm::create(InstrStream(instrs), cfg);
+    if (!vm_res) {
+        return Outcome { .output = {}, .finished = true, .error = vm_res.error };
+    }
+    auto vm = vm_res.move();
+    Outcome outcome;
+    uint64_t used = 0;
+    while (used < budget) {
+        const auto status = run(vm, slice);
+        if (status == VmStatus::BudgetExhausted) {
+            used += slice;
+        } else if (status == VmStatus::Halted || status == VmStatus::Faulted) {
+            outcome.finished = true;
+            if (status == VmStatus::Faulted) {
+                outcome.error = without_pc(vm.error.error);
+            }
+            break;
+        }
+    }
+    outcome.output = std::move(vm.output);
+    return outcome;
+}
+
+void check(const Outcome& expected, const Outcome& actual, std::string_view engine, Level level, bool checked, const std::string& source) {
+    if (expected.output == actual.output && expected.error == actual.error) {
+        return;
+    }
+    fmt::print(stderr, "Mismatch on {} with {}{}:\n"
+                       "expected error '{}', got '{}'\n"
+                       "expected output:\n{}\ngot output:\n{}\n"
+                       "program:\n{}",
+        engine, level_name(level), checked ? " and --checked-arith" : "", expected.error, actual.error,
+        expected.output, actual.output, source);
+    std::abort();
+}
+
+}
+
+/// Programs the generator writes run at most a few million instructions, so
+/// one which uses this up is a bug in the generator.
+constexpr uint64_t BUDGET = 100'000'000;
+
+// libFuzzer calls this, but doesn't declare it in a header
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    Choices in(data, size);
+    const bool checked = in.chance(50);
+    // instructions between suspending in the budgeted engine
+    const uint64_t slice = 1 + uint64_t(in.byte()) * (1 + in.below(64));
+    const auto source = Generator(in, checked).generate();
+
+    const auto reference_instrs = compile(source, Level::None, checked);
+    const VmConfig cfg { .stack_size = 0, .predecode = true, .profile = false, .trace = false, .checked_arith = checked, .registers = false };
+    const auto expected = run_budgeted(reference_instrs, cfg, BUDGET, BUDGET);
+    if (!expected.finished) {
+        fmt::print(stderr, "Program didn't finish within {} instructions:\n{}", BUDGET, source);
+        std::abort();
+    }
+    for (const auto level : { Level::None, Level::Peephole, Level::All }) {
+        const auto instrs = level == Level::None ? reference_instrs : compile(source, level, checked);
+        check(expected, run_budgeted(instrs, cfg, slice, BUDGET), "run() in slices", level, checked, source);
+        check(expected, capture([&] { return execute(InstrStream(instrs), cfg); }), "execute()", level, checked, source);
+        auto fixed_cfg = cfg;
+        fixed_cfg.predecode = false;
+        check(expected, capture([&] { return execute(InstrStream(instrs), fixed_cfg); }), "execute() without predecoding", level, checked, source);
+        auto dense = encode_dense(instrs);
+        if (!dense) {
+            fmt::print(stderr, "Failed to encode with {}: {}\n\n{}", level_name(level), dense.error, source);
+            std::abort();
+        }
+        check(expected, capture([&] { return execute_dense(dense.move(), cfg); }), "execute_dense()", level, checked, source);
+        if (!checked) {
+            // traces and register code don't check arithmetic
+            auto trace_cfg = cfg;
+            trace_cfg.trace = true;
+            check(expected, capture([&] { return execute(InstrStream(instrs), trace_cfg); }), "execute() with traces", level, checked, source);
+            auto registers_cfg = cfg;
+            registers_cfg.registers = true;
+            check(expected, capture([&] { return execute(InstrStream(instrs), registers_cfg); }), "execute() with register code", level, checked, source);
+            // values below what the program works with don't change what it
+            // does, but make two groups of lanes
+            std::vector<LaneInput> inputs(LANE_COUNT);
+            for (size_t i = 0; i < inputs.size(); i += 2) {
+                inputs[i].push_back(int64_t(i));
+            }
+            auto runs = execute_lanes(InstrStream(instrs), inputs, cfg);
+            if (!runs) {
+                fmt::print(stderr, "Failed to run lanes with {}: {}\n\n{}", level_name(level), runs.error, source);
+                std::abort();
+            }
+            for (const auto& lane : runs.value()) {
+                check(expected, Outcome { .output = lane.output, .finished = true, .error = lane.error ? without_pc(lane.error.error) : std::string {} },
+                    "execute_lanes()", level, checked, source);
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef MCL_FUZZ_STANDALONE
+
+#include <fstream>
+#include <iterator>
+#include <random>
+
+/// Without libFuzzer: `mcl-fuzz [-runs=N] [-seed=S] [-max_len=N]` runs N
+/// random inputs, and `mcl-fuzz FILE...` replays inputs, like a libFuzzer
+/// target does.
+int main(int argc, char** argv) {
+    uint64_t runs = 10'000;
+    uint64_t seed = 0;
+    size_t max_len = 512;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg(argv[i]);
+        if (arg.starts_with("-runs=")) {
+            runs = std::strtoull(argv[i] + 6, nullptr, 10);
+        } else if (arg.starts_with("-seed=")) {
+            seed = std::strtoull(argv[i] + 6, nullptr, 10);
+        } else if (arg.starts_with("-max_len=")) {
+            max_len = std::max<size_t>(1, std::strtoull(argv[i] + 9, nullptr, 10));
+        } else {
+            files.emplace_back(arg);
+        }
+    }
+    for (const auto& file : files) {
+        std::ifstream stream(file, std::ios::binary);
+        const std::vector<uint8_t> input { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        fmt::print(stderr, "{}: ok\n", file);
+    }
+    if (!files.empty()) {
+        return 0;
+    }
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> input;
+    for (uint64_t run = 0; run < runs; ++run) {
+        input.resize(rng() % max_len);
+        for (auto& byte : input) {
+            byte = uint8_t(rng());
+        }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        if ((run + 1) % 1000 == 0) {
+            fmt::print(stderr, "{} runs\n", run + 1);
+        }
+    }
+    fmt::print(stderr, "{} runs, no mismatches\n", runs);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#include "bytecode.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+/// Checks a header read from the start of a file of `file_size` bytes.
+static Error check_header(const std::string& filename, const BytecodeHeader& header, size_t file_size) {
+    if (header.version > BYTECODE_VERSION) {
+        return Error("'{}' has bytecode version {}, but only versions up to {} are supported.", filename, header.version, BYTECODE_VERSION);
+    }
+    if ((header.flags & ~(BYTECODE_DENSE | BYTECODE_SOURCE_MAP)) != 0) {
+        return Error("'{}' has unknown flags 0x{:x}.", filename, header.flags);
+    }
+    const bool dense = (header.flags & BYTECODE_DENSE) != 0;
+    if (header.code_size > file_size - sizeof(header) || (!dense && header.code_size % sizeof(Instr) != 0)) {
+        return Error("'{}' is corrupt: invalid code size {}.", filename, header.code_size);
+    }
+    return {};
+}
+
+Result<Bytecode> read_bytecode(const std::string& filename) {
+    FilePtr file(std::fopen(filename.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        return { "Failed to open '{}': {}", filename, std::strerror(errno) };
+    }
+    if (std::fseek(file.get(), 0, SEEK_END) != 0) {
+        return { "Failed to read '{}': {}", filename, std::strerror(errno) };
+    }
+    const auto file_size = size_t(std::ftell(file.get()));
+    std::rewind(file.get());
+
+    Bytecode bytecode {};
+    BytecodeHeader header {};
+    if (file_size >= sizeof(header)
+        && std::fread(&header, sizeof(header), 1, file.get()) == 1
+        && std::memcmp(header.magic, BytecodeHeader {}.magic, sizeof(header.magic)) == 0) {
+        auto err = check_header(filename, header, file_size);
+        if (err) {
+            return { "{}", err.error };
+        }
+        bytecode.header = header;
+    } else {
+        // no header, the whole file is instructions
+        std::rewind(file.get());
+        bytecode.header.code_size = file_size;
+    }
+    const auto code_size = size_t(bytecode.header.code_size);
+
+    if ((bytecode.header.flags & BYTECODE_DENSE) != 0) {
+        bytecode.dense.resize(code_size);
+        if (std::fread(bytecode.dense.data(), 1, code_size, file.get()) != code_size) {
+            return { "Failed to read '{}': {}", filename, std::strerror(errno) };
+        }
+        auto err = validate_dense(bytecode.dense);
+        if (err) {
+            return { "'{}' is corrupt: {}", filename, err.error };
+        }
+        return bytecode;
+    }
+    bytecode.instrs.resize(code_size / sizeof(Instr));
+    if (std::fread(bytecode.instrs.data(), sizeof(Instr), bytecode.instrs.size(), file.get()) != bytecode.instrs.size()) {
+        return { "Failed to read '{}': {}", filename, std::strerror(errno) };
+    }
+    return bytecode;
+}
+
+Error write_bytecode(const std::string& filename, const Bytecode& bytecode) {
+    FilePtr file(std::fopen(filename.c_str(), "wb"), &std::fclose);
+    if (!file) {
+        return Error("Failed to open '{}' for writing: {}", filename, std::strerror(errno));
+    }
+    auto header = bytecode.header;
+    const bool dense = (header.flags & BYTECODE_DENSE) != 0;
+    const void* code = dense ? static_cast<const void*>(bytecode.dense.data()) : static_cast<const void*>(bytecode.instrs.data());
+    header.code_size = dense ? bytecode.dense.size() : bytecode.instrs.size() * sizeof(Instr);
+    std::vector<uint8_t> source_map;
+    if (!bytecode.source_map.rows.empty()) {
+        header.flags = uint16_t(header.flags | BYTECODE_SOURCE_MAP);
+        source_map = serialize_source_map(bytecode.source_map);
+    } else {
+        header.flags = uint16_t(header.flags & ~BYTECODE_SOURCE_MAP);
+    }
+    const auto section_size = uint64_t(source_map.size());
+    if (std::fwrite(&header, sizeof(header), 1, file.get()) != 1
+        || std::fwrite(code, 1, header.code_size, file.get()) != header.code_size
+        || (!source_map.empty()
+            && (std::fwrite(&section_size, sizeof(section_size), 1, file.get()) != 1
+                || std::fwrite(source_map.data(), 1, source_map.size(), file.get()) != source_map.size()))) {
+        return Error("Failed to write '{}': {}", filename, std::strerror(errno));
+    }
+    return {};
+}
+
+Result<SourceMap> read_source_map(const std::string& filename) {
+    FilePtr file(std::fopen(filename.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        return { "Failed to open '{}': {}", filename, std::strerror(errno) };
+    }
+    BytecodeHeader header {};
+    if (std::fread(&header, sizeof(header), 1, file.get()) != 1
+        || std::memcmp(header.magic, BytecodeHeader {}.magic, sizeof(header.magic)) != 0
+        || (header.flags & BYTECODE_SOURCE_MAP) == 0) {
+        return { "'{}' has no source map.", filename };
+    }
+    uint64_t section_size = 0;
+    if (std::fseek(file.get(), long(sizeof(header) + header.code_size), SEEK_SET) != 0
+        || std::fread(&section_size, sizeof(section_size), 1, file.get()) != 1) {
+        return { "'{}' is corrupt: the source map is missing.", filename };
+    }
+    // don't trust the size before checking it against the file
+    const auto start = std::ftell(file.get());
+    if (start < 0 || std::fseek(file.get(), 0, SEEK_END) != 0 || uint64_t(std::ftell(file.get()) - start) < section_size) {
+        return { "'{}' is corrupt: the source map is cut off.", filename };
+    }
+    std::fseek(file.get(), start, SEEK_SET);
+    std::vector<uint8_t> data(section_size);
+    if (std::fread(data.data(), 1, data.size(), file.get()) != data.size()) {
+        return { "Failed to read '{}': {}", filename, std::strerror(errno) };
+    }
+    auto map = deserialize_source_map(data);
+    if (!map) {
+        return { "'{}' is corrupt: {}", filename, map.error };
+    }
+    return map.move();
+}
+
+Error write_source_map(const std::string& filename, const SourceMap& map) {
+    FilePtr file(std::fopen(filename.c_str(), "wb"), &std::fclose);
+    if (!file) {
+        return Error("Failed to open '{}' for writing: {}", filename, std::strerror(errno));
+    }
+    const auto data = serialize_source_map(map);
+    if (std::fwrite(data.data(), 1, data.size(), file.get()) != data.size()) {
+        return Error("Failed to write '{}': {}", filename, std::strerror(errno));
+    }
+    return {};
+}
+
+Result<MappedBytecode> MappedBytecode::open(const std::string& filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return { "Failed to open '{}': {}", filename, std::strerror(errno) };
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        const int err = errno;
+        close(fd);
+        return { "Failed to read '{}': {}", filename, std::strerror(err) };
+    }
+    MappedBytecode mapped;
+    mapped.m_size = size_t(st.st_size);
+    if (mapped.m_size != 0) {
+        void* data = mmap(nullptr, mapped.m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        const int err = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            return { "Failed to map '{}': {}", filename, std::strerror(err) };
+        }
+        // read front to back, so let the kernel read ahead
+        madvise(data, mapped.m_size, MADV_SEQUENTIAL);
+        mapped.m_data = static_cast<const uint8_t*>(data);
+    } else {
+        close(fd);
+    }
+
+    BytecodeHeader header {};
+    if (mapped.m_size >= sizeof(header)) {
+        std::memcpy(&header, mapped.m_data, sizeof(header));
+    }
+    if (mapped.m_size >= sizeof(header) && std::memcmp(header.magic, BytecodeHeader {}.magic, sizeof(header.magic)) == 0) {
+        auto err = check_header(filename, header, mapped.m_size);
+        if (err) {
+            return { "{}", err.error };
+        }
+        mapped.m_header = header;
+        mapped.m_code_offset = sizeof(header);
+    } else {
+        // no header, the whole file is instructions
+        mapped.m_header.code_size = mapped.m_size - mapped.m_size % sizeof(Instr);
+    }
+    if ((mapped.m_header.flags & BYTECODE_DENSE) != 0) {
+        auto err = validate_dense(mapped.dense());
+        if (err) {
+            return { "'{}' is corrupt: {}", filename, err.error };
+        }
+    }
+    return mapped;
+}
+
+MappedBytecode::MappedBytecode(MappedBytecode&& other) noexcept
+    : m_header(other.m_header)
+    , m_data(std::exchange(other.m_data, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+    , m_code_offset(other.m_code_offset) {
+}
+
+MappedBytecode& MappedBytecode::operator=(MappedBytecode&& other) noexcept {
+    if (this != &other) {
+        if (m_data) {
+            munmap(const_cast<uint8_t*>(m_data), m_size);
+        }
+        m_header = other.m_header;
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_code_offset = other.m_code_offset;
+    }
+    return *this;
+}
+
+MappedBytecode::~MappedBytecode() {
+    if (m_data) {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+}
+
+std::span<const Instr> MappedBytecode::instrs() const {
+    if ((m_header.flags & BYTECODE_DENSE) != 0 || m_data == nullptr) {
+        return {};
+    }
+    // the mapping is page aligned, and the header keeps Instrs aligned
+    return { reinterpret_cast<const Instr*>(m_data + m_code_offset), size_t(m_header.code_size) / sizeof(Instr) };
+}
+
+std::span<const uint8_t> MappedBytecode::dense() const {
+    if ((m_header.flags & BYTECODE_DENSE) == 0 || m_data == nullptr) {
+        return {};
+    }
+    return { m_data + m_code_offset, size_t(m_header.code_size) };
+}
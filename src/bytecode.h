@@ -0,0 +1,91 @@
+#pragma once
+
+#include "compiler.h"
+#include "dense.h"
+#include "error.h"
+#include "source_map.h"
+#include <cstdint>
+#include <span>
+#include <string>
+
+/// Version of the .mclb format written by this build. Readers accept any
+/// version up to and including this one.
+constexpr uint16_t BYTECODE_VERSION = 1;
+
+/// Bits in BytecodeHeader::flags.
+enum BytecodeFlags : uint16_t {
+    /// The code is in the variable-length encoding from dense.h, instead of
+    /// fixed size instructions.
+    BYTECODE_DENSE = 1 << 0,
+    /// The code is followed by a source map section: its size in bytes as a
+    /// uint64_t, followed by the output of serialize_source_map().
+    BYTECODE_SOURCE_MAP = 1 << 1,
+};
+
+/// Header at the start of a .mclb file, followed by `code_size` bytes of
+/// instructions, and optionally by sections (see BytecodeFlags). All values
+/// are in native byte order.
+///
+/// Files written before the header existed start directly with the
+/// instructions; read_bytecode() still accepts those.
+struct BytecodeHeader {
+    char magic[4] { 'M', 'C', 'L', 'B' };
+    uint16_t version { BYTECODE_VERSION };
+    /// BytecodeFlags. Readers reject files with flags they don't know.
+    uint16_t flags { 0 };
+    /// Number of values the program's stack should hold, or 0 if the program
+    /// doesn't care. Only a hint, the runtime may override it.
+    uint64_t stack_size { 0 };
+    /// Size of the instructions following the header, in bytes.
+    uint64_t code_size { 0 };
+};
+static_assert(sizeof(BytecodeHeader) == 24);
+
+struct Bytecode {
+    BytecodeHeader header;
+    /// The code, unless the header has BYTECODE_DENSE.
+    InstrStream instrs;
+    /// The code, if the header has BYTECODE_DENSE.
+    DenseCode dense {};
+    /// Written as a section if it has any rows. read_bytecode() leaves this
+    /// empty, see read_source_map().
+    SourceMap source_map {};
+};
+
+/// Reads the header and the code, but none of the sections.
+[[nodiscard]] Result<Bytecode> read_bytecode(const std::string& filename);
+/// Reads only the source map section, so it's only loaded when needed, like
+/// when reporting a fault. Fails if the file doesn't have one.
+[[nodiscard]] Result<SourceMap> read_source_map(const std::string& filename);
+/// Writes only a source map, in the format of the section, for code which
+/// isn't in a .mclb file, like decompiled source.
+[[nodiscard]] Error write_source_map(const std::string& filename, const SourceMap& map);
+[[nodiscard]] Error write_bytecode(const std::string& filename, const Bytecode& bytecode);
+
+/// A .mclb file mapped into memory, to look at large files without reading
+/// them into memory first. The code is checked like read_bytecode() does.
+class MappedBytecode {
+public:
+    [[nodiscard]] static Result<MappedBytecode> open(const std::string& filename);
+    MappedBytecode(MappedBytecode&& other) noexcept;
+    MappedBytecode& operator=(MappedBytecode&& other) noexcept;
+    MappedBytecode(const MappedBytecode&) = delete;
+    MappedBytecode& operator=(const MappedBytecode&) = delete;
+    ~MappedBytecode();
+
+    const BytecodeHeader& header() const { return m_header; }
+    /// The code, unless the header has BYTECODE_DENSE.
+    std::span<const Instr> instrs() const;
+    /// The code, if the header has BYTECODE_DENSE.
+    std::span<const uint8_t> dense() const;
+    size_t file_size() const { return m_size; }
+
+private:
+    MappedBytecode() = default;
+
+    BytecodeHeader m_header {};
+    const uint8_t* m_data { nullptr };
+    size_t m_size { 0 };
+    /// Where the code starts, 0 for files without a header.
+    size_t m_code_offset { 0 };
+};
@@ -0,0 +1,218 @@
+#include "cfg.h"
+#include "instruction.h"
+#include <algorithm>
+#include <cstdint>
+#include <unordered_set>
+
+/// Index of the last instruction in [begin, end) which isn't a label, or
+/// `end` if there is none.
+static size_t last_instr(const AbstractInstrStream& abstracts, size_t begin, size_t end) {
+    for (size_t i = end; i > begin; --i) {
+        if (abstracts[i - 1].instr.s.op != NOT_AN_INSTRUCTION) {
+            return i - 1;
+        }
+    }
+    return end;
+}
+
+Result<Cfg> build_cfg(const AbstractInstrStream& abstracts) {
+    Cfg cfg;
+    // find leaders: the first instruction, every label, and everything after a jump, call, halt or ret
+    std::vector<bool> is_leader(abstracts.size() + 1, false);
+    is_leader[0] = true;
+    for (size_t i = 0; i < abstracts.size(); ++i) {
+        const auto& abstract = abstracts[i];
+        const auto op = abstract.instr.s.op;
+        if (op == NOT_AN_INSTRUCTION) {
+            // consecutive labels belong to the same block
+            if (i == 0 || abstracts[i - 1].instr.s.op != NOT_AN_INSTRUCTION) {
+                is_leader[i] = true;
+            }
+        } else if (op_accepts_label_argument(op)) {
+            if (!abstract.unresolved_label.has_value()) {
+                return { "{}: Jump to a raw address, can't build a control flow graph.", to_string(abstract.location) };
+            }
+            is_leader[i + 1] = true;
+        } else if (op == HALT || op == RET) {
+            is_leader[i + 1] = true;
+        }
+    }
+    for (size_t i = 0; i < abstracts.size(); ++i) {
+        if (is_leader[i]) {
+            cfg.blocks.push_back(BasicBlock { .begin = i, .end = i });
+        }
+        cfg.blocks.back().end = i + 1;
+        if (abstracts[i].instr.s.op == NOT_AN_INSTRUCTION) {
+            cfg.label_blocks[abstracts[i].unresolved_label.value()] = cfg.blocks.size() - 1;
+        }
+    }
+    if (cfg.blocks.empty()) {
+        cfg.blocks.push_back(BasicBlock { .begin = 0, .end = 0 });
+    }
+    // blocks right after a call, where any `ret` may go
+    std::vector<size_t> return_sites;
+    for (size_t b = 0; b + 1 < cfg.blocks.size(); ++b) {
+        const auto last = last_instr(abstracts, cfg.blocks[b].begin, cfg.blocks[b].end);
+        if (last != cfg.blocks[b].end && abstracts[last].instr.s.op == CALL) {
+            return_sites.push_back(b + 1);
+        }
+    }
+
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        auto& block = cfg.blocks[b];
+        const auto last = last_instr(abstracts, block.begin, block.end);
+        const bool has_next = b + 1 < cfg.blocks.size();
+        if (last == block.end) {
+            // only labels
+            if (has_next) {
+                block.succs.push_back(b + 1);
+            }
+            continue;
+        }
+        const auto& abstract = abstracts[last];
+        const auto op = abstract.instr.s.op;
+        if (op_accepts_label_argument(op)) {
+            const auto& label = abstract.unresolved_label.value();
+            auto it = cfg.label_blocks.find(label);
+            if (it == cfg.label_blocks.end()) {
+                return { "{}: Could not find label '{}'.", to_string(abstract.location), label };
+            }
+            block.succs.push_back(it->second);
+            // a call continues after it once the subroutine returns
+            if (op != JMP && has_next && it->second != b + 1) {
+                block.succs.push_back(b + 1);
+            }
+        } else if (op == RET) {
+            block.succs = return_sites;
+        } else if (op != HALT && has_next) {
+            block.succs.push_back(b + 1);
+        }
+    }
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        for (auto succ : cfg.blocks[b].succs) {
+            cfg.blocks[succ].preds.push_back(b);
+        }
+    }
+    return cfg;
+}
+
+std::vector<size_t> immediate_dominators(const Cfg& cfg) {
+    // Cooper, Harvey, Kennedy: "A Simple, Fast Dominance Algorithm"
+    const auto n = cfg.blocks.size();
+    if (n == 0) {
+        return {};
+    }
+    std::vector<size_t> postorder;
+    postorder.reserve(n);
+    {
+        // iterative dfs, as programs can be deep enough to overflow the native stack
+        std::vector<bool> visited(n, false);
+        std::vector<std::pair<size_t, size_t>> dfs { { 0, 0 } };
+        visited[0] = true;
+        while (!dfs.empty()) {
+            auto& [block, next_succ] = dfs.back();
+            if (next_succ < cfg.blocks[block].succs.size()) {
+                auto succ = cfg.blocks[block].succs[next_succ++];
+                if (!visited[succ]) {
+                    visited[succ] = true;
+                    dfs.emplace_back(succ, 0);
+                }
+            } else {
+                postorder.push_back(block);
+                dfs.pop_back();
+            }
+        }
+    }
+    std::vector<size_t> order(n, SIZE_MAX);
+    for (size_t i = 0; i < postorder.size(); ++i) {
+        order[postorder[i]] = i;
+    }
+
+    std::vector<size_t> idoms(n, SIZE_MAX);
+    idoms[0] = 0;
+    const auto intersect = [&](size_t a, size_t b) {
+        while (a != b) {
+            while (order[a] < order[b]) {
+                a = idoms[a];
+            }
+            while (order[b] < order[a]) {
+                b = idoms[b];
+            }
+        }
+        return a;
+    };
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // reverse postorder, skipping the entry
+        for (auto it = postorder.rbegin() + 1; it != postorder.rend(); ++it) {
+            size_t new_idom = SIZE_MAX;
+            for (auto pred : cfg.blocks[*it].preds) {
+                if (idoms[pred] == SIZE_MAX) {
+                    continue;
+                }
+                new_idom = new_idom == SIZE_MAX ? pred : intersect(pred, new_idom);
+            }
+            if (idoms[*it] != new_idom) {
+                idoms[*it] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    return idoms;
+}
+
+bool dominates(const std::vector<size_t>& idoms, size_t a, size_t b) {
+    if (idoms[b] == SIZE_MAX) {
+        return false;
+    }
+    while (b != a) {
+        if (b == 0) {
+            return false;
+        }
+        b = idoms[b];
+    }
+    return true;
+}
+
+bool NaturalLoop::contains(size_t block) const {
+    return std::binary_search(blocks.begin(), blocks.end(), block);
+}
+
+std::vector<NaturalLoop> find_natural_loops(const Cfg& cfg) {
+    const auto idoms = immediate_dominators(cfg);
+    std::vector<NaturalLoop> loops;
+    std::unordered_map<size_t, size_t> loop_of_header;
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        for (auto succ : cfg.blocks[b].succs) {
+            if (!dominates(idoms, succ, b)) {
+                continue;
+            }
+            // back edge b -> succ
+            auto [it, inserted] = loop_of_header.try_emplace(succ, loops.size());
+            if (inserted) {
+                loops.push_back(NaturalLoop { .header = succ, .latches = {}, .blocks = { succ } });
+            }
+            auto& loop = loops[it->second];
+            loop.latches.push_back(b);
+            // walk backwards from the latch until the header
+            std::unordered_set<size_t> members(loop.blocks.begin(), loop.blocks.end());
+            std::vector<size_t> worklist { b };
+            while (!worklist.empty()) {
+                auto block = worklist.back();
+                worklist.pop_back();
+                if (idoms[block] == SIZE_MAX || !members.insert(block).second) {
+                    continue;
+                }
+                loop.blocks.push_back(block);
+                for (auto pred : cfg.blocks[block].preds) {
+                    worklist.push_back(pred);
+                }
+            }
+        }
+    }
+    for (auto& loop : loops) {
+        std::sort(loop.blocks.begin(), loop.blocks.end());
+    }
+    return loops;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// A straight-line range of abstract instructions, which is only entered at
+/// the beginning and only left at the end.
+struct BasicBlock {
+    /// Range [begin, end) in the AbstractInstrStream, including labels.
+    size_t begin;
+    size_t end;
+    std::vector<size_t> succs {};
+    std::vector<size_t> preds {};
+};
+
+/// Control flow graph of an AbstractInstrStream. Block 0 is the entry.
+struct Cfg {
+    std::vector<BasicBlock> blocks {};
+    /// Label name to the index of the block the label starts.
+    std::unordered_map<std::string, size_t> label_blocks {};
+};
+
+/// Builds the control flow graph. Fails if the program contains jumps to raw
+/// addresses, as their targets can't be known before finalize(). A `call`
+/// goes to the subroutine and to the instruction after it, where it returns
+/// to, and a `ret` to the instruction after every call, as it isn't known
+/// which subroutine it belongs to.
+[[nodiscard]] Result<Cfg> build_cfg(const AbstractInstrStream& abstracts);
+
+/// Immediate dominator of each block. The entry block is its own immediate
+/// dominator, unreachable blocks have SIZE_MAX.
+std::vector<size_t> immediate_dominators(const Cfg& cfg);
+
+/// Whether block `a` dominates block `b`, given the result of immediate_dominators().
+bool dominates(const std::vector<size_t>& idoms, size_t a, size_t b);
+
+/// A natural loop: all blocks which can reach a back edge to the header
+/// without going through the header.
+struct NaturalLoop {
+    size_t header;
+    /// Blocks with a back edge to the header.
+    std::vector<size_t> latches {};
+    /// All blocks of the loop, sorted, including the header.
+    std::vector<size_t> blocks {};
+
+    bool contains(size_t block) const;
+};
+
+/// Finds all natural loops. Loops sharing a header are merged into one.
+std::vector<NaturalLoop> find_natural_loops(const Cfg& cfg);
+
+/// Fuses `inc; dup2; jcc` into `incjcc` and `dup2; mod; jz/jnz` into
+/// `modjz/modjnz`, where the first instruction is `eligible`. Fused-away
+/// instructions are marked in `remove` instead of being removed.
+void fuse_superinstructions(AbstractInstrStream& abstracts, const std::vector<bool>& eligible, std::vector<bool>& remove);
+
+/// Removes the instructions marked in `remove`, keeping the order of the rest.
+void remove_marked(AbstractInstrStream& abstracts, const std::vector<bool>& remove);
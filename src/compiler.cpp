@@ -1,46 +1,51 @@
 #include "compiler.h"
 #include "abstract_instruction.h"
+#include "dense.h"
+#include "divide.h"
 #include "instruction.h"
+#include "lexer.h"
 #include "source_location.h"
+#include "symbols.h"
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
-#include <cctype>
-#include <climits>
+#include <iterator>
 #include <ranges>
-#include <regex>
 #include <span>
 #include <string>
-#include <unordered_map>
-
-static inline std::string& ltrim_inplace(std::string& str) {
-    auto it2 = std::find_if(str.begin(), str.end(), [](char ch) { return !std::isspace<char>(ch, std::locale::classic()); });
-    str.erase(str.begin(), it2);
-    return str;
-}
-
-static inline std::string& rtrim_inplace(std::string& str) {
-    auto it1 = std::find_if(str.rbegin(), str.rend(), [](char ch) { return !std::isspace<char>(ch, std::locale::classic()); });
-    str.erase(it1.base(), str.end());
-    return str;
-}
-
-static inline std::string ltrim(const std::string& str_in) {
-    auto str = str_in;
-    auto it2 = std::find_if(str.begin(), str.end(), [](char ch) { return !std::isspace<char>(ch, std::locale::classic()); });
-    str.erase(str.begin(), it2);
-    return str;
-}
-
-static inline std::string rtrim(const std::string& str_in) {
-    auto str = str_in;
-    auto it1 = std::find_if(str.rbegin(), str.rend(), [](char ch) { return !std::isspace<char>(ch, std::locale::classic()); });
-    str.erase(it1.base(), str.end());
-    return str;
-}
-
-static inline std::string trim(const std::string& str) {
-    auto res = str;
-    return ltrim_inplace(rtrim_inplace(res));
+#include <thread>
+
+Error parse_line(const std::string& raw_line, SourceLocation& loc, TokenStream& tokens) {
+    Error err;
+    for_each_word(raw_line, [&](std::string_view word, size_t column) {
+        loc.col_start = column;
+        loc.col_end = loc.col_start + word.size();
+        // check if the word is a string, integer, etc.
+        switch (const auto kind = classify_word(word)) {
+        case WordKind::Name:
+            tokens.emplace_back(std::string(word), loc);
+            return true;
+        case WordKind::Integer:
+        case WordKind::HexInteger:
+            if (const auto value = word_value(word, kind)) {
+                tokens.emplace_back(*value, loc);
+                return true;
+            }
+            // out of range for i64
+            if (kind == WordKind::HexInteger) {
+                err = Error("{}: (Hexadecimal) integer too large.", to_string(loc));
+            } else {
+                err = Error("{}: Integer too large.", to_string(loc));
+            }
+            return false;
+        case WordKind::Invalid:
+            break;
+        }
+        err = Error("{}: Invalid token '{}'.", to_string(loc), word);
+        return false;
+    });
+    return err;
 }
 
 Result<TokenStream> parse(const std::span<std::string>& lines, const std::string& filename) {
@@ -51,72 +56,12 @@ Result<TokenStream> parse(const std::span<std::string>& lines, const std::string
         .col_start = 0,
         .col_end = 0,
     };
-    const std::string_view valid_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-0123456789:";
-
     for (const auto& raw_line : lines) {
         // keep track of line count, do first so it starts at 1
         ++loc.line;
-
-        auto line = trim(raw_line);
-
-        std::string::size_type word_start = 0;
-
-        const std::regex re_str(R"(:?[a-zA-Z_][a-zA-Z_0-9]*)");
-        const std::regex re_int(R"([-+]?[0-9]+)");
-        const std::regex re_hex(R"([-+]?0x[0-9a-f]+)");
-        const std::regex re_comment(R"(#.*)");
-
-        line = std::regex_replace(line, re_comment, "");
-        if (line.empty()) {
-            continue;
-        }
-
-        while (true) {
-            // isolate a word
-            if (word_start >= line.size()) {
-                break;
-            }
-            auto word_end = line.find_first_not_of(valid_chars, word_start);
-            if (word_end == word_start) {
-                ++word_start;
-                continue;
-            }
-            std::string word_untrimmed = line.substr(word_start, word_end - word_start);
-            // trim left, see difference
-            auto word = ltrim(word_untrimmed);
-            auto left_trimmed_n = (word_untrimmed.size() - word.size());
-            loc.col_start = word_start + 1 + left_trimmed_n;
-            loc.col_end = loc.col_start + word.size();
-            // check if the word is a string, integer, etc.
-            if (std::regex_match(word, re_str)) {
-                tokens.emplace_back(word, loc);
-            } else if (std::regex_match(word, re_int)) {
-                char* end;
-                int64_t i = std::strtoll(word.c_str(), &end, 10);
-                if (i == LLONG_MAX || i == LLONG_MIN) {
-                    // out of range for i64
-                    return { "{}: Integer too large.", to_string(loc) };
-                } else if (i == 0 && end == word.c_str()) {
-                    return { "{}: Not an integer.", to_string(loc) };
-                }
-                tokens.emplace_back(i, loc);
-            } else if (std::regex_match(word, re_hex)) {
-                char* end;
-                int64_t i = std::strtoll(word.c_str(), &end, 16);
-                if (i == LLONG_MAX || i == LLONG_MIN) {
-                    // out of range for i64
-                    return { "{}: (Hexadecimal) integer too large.", to_string(loc) };
-                } else if (i == 0 && end == word.c_str()) {
-                    return { "{}: Not a valid (hexadecimal) integer.", to_string(loc) };
-                }
-                tokens.emplace_back(i, loc);
-            } else {
-                return { "{}: Invalid token '{}'.", to_string(loc), word };
-            }
-            if (word_end == std::string::npos) {
-                break;
-            }
-            word_start = word_end + 1;
+        auto err = parse_line(raw_line, loc, tokens);
+        if (err) {
+            return { "{}", err.error };
         }
     }
     return tokens;
@@ -132,13 +77,12 @@ static inline bool can_consume(const std::span<const Token>& span) {
     return !span.empty();
 }
 
-Result<AbstractInstrStream> translate(const TokenStream& tokens) {
-    AbstractInstrStream result;
-    std::span<const Token> span(tokens.begin(), tokens.end());
+Error translate_partial(std::span<const Token>& span, AbstractInstrStream& result, bool more_input) {
     while (!span.empty()) {
+        const auto instr_start = span;
         auto verb = consume(span);
         if (!verb.is_str) {
-            return { "{}: Expected instruction, instead got '{}'", to_string(verb.loc), verb.i64 };
+            return Error("{}: Expected instruction, instead got '{}'", to_string(verb.loc), verb.i64);
         }
         if (verb.str.starts_with(':')) {
             // is label, so create an abstract instruction which simply holds the label
@@ -159,17 +103,22 @@ Result<AbstractInstrStream> translate(const TokenStream& tokens) {
             auto op = op_from_string(verb.str);
             if (op == NOT_AN_INSTRUCTION) {
                 // invalid instr
-                return { "{}: Invalid instruction '{}'.", to_string(verb.loc), verb.str };
+                return Error("{}: Invalid instruction '{}'.", to_string(verb.loc), verb.str);
             }
             if (op_requires_i64_argument(op)) {
                 if (!can_consume(span)) {
-                    return { "{}: '{}' expects an i64 argument, but no argument was provided.", to_string(verb.loc), verb.str };
+                    if (more_input) {
+                        // the argument may still come
+                        span = instr_start;
+                        return {};
+                    }
+                    return Error("{}: '{}' expects an i64 argument, but no argument was provided.", to_string(verb.loc), verb.str);
                 }
                 auto arg = consume(span);
                 if (!arg.is_i64) {
                     if (!op_accepts_label_argument(op)) {
                         // TODO: check if it's an instruction, give an error about "missing" argument instead
-                        return { "{}: '{}' expects an i64 argument, but given argument '{}' has the wrong type.", to_string(verb.loc), verb.str, arg.str };
+                        return Error("{}: '{}' expects an i64 argument, but given argument '{}' has the wrong type.", to_string(verb.loc), verb.str, arg.str);
                     }
                     if (arg.str.starts_with(':')) {
                         // is label
@@ -190,15 +139,18 @@ Result<AbstractInstrStream> translate(const TokenStream& tokens) {
                             .unresolved_label = arg.str.substr(1),
                         });
                     } else {
-                        return { "{}: '{}' expects an i64 argument (or a label), but given argument '{}' has the wrong type.", to_string(verb.loc), verb.str, arg.str };
+                        return Error("{}: '{}' expects an i64 argument (or a label), but given argument '{}' has the wrong type.", to_string(verb.loc), verb.str, arg.str);
                     }
                 } else {
+                    if (arg.i64 < INSTR_VAL_MIN || arg.i64 > INSTR_VAL_MAX) {
+                        return Error("{}: Argument {} of '{}' doesn't fit into the 56 bits an instruction holds.", to_string(arg.loc), arg.i64, verb.str);
+                    }
                     // TODO: If the instruction stretches over two lines, the columns are wrong here.
-                    result.push_back(AbstractInstr {
+                    auto& abstract = result.emplace_back(AbstractInstr {
                         .instr = {
                             .s = {
                                 .op = op,
-                                .val = arg.i64,
+                                .val = 0,
                             },
                         },
                         .location = {
@@ -210,6 +162,7 @@ Result<AbstractInstrStream> translate(const TokenStream& tokens) {
                         .unresolved_symbol = std::nullopt,
                         .unresolved_label = std::nullopt,
                     });
+                    set_instr_val(abstract.instr, arg.i64);
                 }
             } else {
                 result.push_back(AbstractInstr {
@@ -231,41 +184,183 @@ Result<AbstractInstrStream> translate(const TokenStream& tokens) {
             }
         }
     }
+    return {};
+}
+
+Result<AbstractInstrStream> translate(const TokenStream& tokens) {
+    AbstractInstrStream result;
+    std::span<const Token> span(tokens.begin(), tokens.end());
+    auto err = translate_partial(span, result, false);
+    if (err) {
+        return { "{}", err.error };
+    }
     return result;
 }
 
-static inline void populate_labels(const AbstractInstrStream& abstracts, std::unordered_map<std::string, size_t>& labels) {
+size_t TokenChunks::token_count() const {
+    size_t count = 0;
+    for (const auto& chunk : chunks) {
+        count += chunk.size();
+    }
+    return count;
+}
+
+/// Calls `work(i)` for every i in [0, count), on up to cfg.threads threads.
+template<typename Work>
+static void for_each_chunk(size_t count, const ChunkConfig& cfg, Work&& work) {
+    const size_t thread_count = std::min(count, cfg.threads != 0 ? cfg.threads : std::max<size_t>(1, std::thread::hardware_concurrency()));
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            work(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next { 0 };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) {
+                work(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/// Whether the token is an instruction which takes the next token as its
+/// argument. Taken as an argument itself, it would be an error.
+static bool expects_argument(const Token& token) {
+    return token.is_str && !token.str.starts_with(':') && op_requires_i64_argument(op_from_string(token.str));
+}
+
+Result<TokenChunks> parse_chunked(std::span<const std::string> lines, const std::string& filename, const ChunkConfig& cfg) {
+    const size_t chunk_lines = std::max<size_t>(cfg.chunk_lines, 1);
+    const size_t chunk_count = (lines.size() + chunk_lines - 1) / chunk_lines;
+    TokenChunks result {
+        .chunks = std::vector<TokenStream>(chunk_count),
+        .continued = std::vector<bool>(chunk_count, false),
+    };
+    std::vector<Error> errors(chunk_count);
+    for_each_chunk(chunk_count, cfg, [&](size_t i) {
+        SourceLocation loc {
+            .file = filename,
+            .line = i * chunk_lines,
+            .col_start = 0,
+            .col_end = 0,
+        };
+        const size_t end = std::min(lines.size(), (i + 1) * chunk_lines);
+        for (size_t line = i * chunk_lines; line < end; ++line) {
+            ++loc.line;
+            auto err = parse_line(lines[line], loc, result.chunks[i]);
+            if (err) {
+                errors[i] = std::move(err);
+                return;
+            }
+        }
+    });
+    for (const auto& err : errors) {
+        if (err) {
+            return { "{}", err.error };
+        }
+    }
+    const Token* last = nullptr;
+    for (size_t i = 0; i < chunk_count; ++i) {
+        if (!result.chunks[i].empty()) {
+            result.continued[i] = last && expects_argument(*last);
+            last = &result.chunks[i].back();
+        }
+    }
+    return result;
+}
+
+Result<AbstractInstrStream> translate_chunked(const TokenChunks& tokens, const ChunkConfig& cfg) {
+    const size_t chunk_count = tokens.chunks.size();
+    std::vector<AbstractInstrStream> translated(chunk_count);
+    std::vector<Error> errors(chunk_count);
+    // whether the chunk ends in an instruction whose argument is in a later chunk
+    std::vector<bool> dangling(chunk_count, false);
+    for_each_chunk(chunk_count, cfg, [&](size_t i) {
+        std::span<const Token> span(tokens.chunks[i]);
+        if (tokens.continued[i]) {
+            span = span.subspan(1);
+        }
+        errors[i] = translate_partial(span, translated[i], true);
+        dangling[i] = !span.empty();
+    });
+    size_t total = 0;
+    for (const auto& chunk : translated) {
+        total += chunk.size() + 1;
+    }
+    AbstractInstrStream result;
+    result.reserve(total);
+    // every chunk starts at an instruction if all chunks before it were
+    // translated without error, so the first error is the one translate() finds
+    for (size_t i = 0; i < chunk_count; ++i) {
+        if (errors[i]) {
+            return { "{}", errors[i].error };
+        }
+        std::move(translated[i].begin(), translated[i].end(), std::back_inserter(result));
+        translated[i] = {};
+        if (dangling[i]) {
+            TokenStream instr { tokens.chunks[i].back() };
+            for (size_t next = i + 1; next < chunk_count; ++next) {
+                if (!tokens.chunks[next].empty()) {
+                    instr.push_back(tokens.chunks[next].front());
+                    break;
+                }
+            }
+            std::span<const Token> span(instr);
+            auto err = translate_partial(span, result, false);
+            if (err) {
+                return { "{}", err.error };
+            }
+        }
+    }
+    return result;
+}
+
+/// Label addresses, indexed by the label's id in the SymbolTable.
+static inline void populate_labels(const AbstractInstrStream& abstracts, SymbolTable& labels, std::vector<size_t>& addresses) {
     size_t addr_counter = 0;
     for (const auto& abstract : abstracts) {
         if (abstract.instr.s.op == NOT_AN_INSTRUCTION) {
             // set label address to next instruction's address
             // "unresolved" is abused here, and is in fact helping resolve it later
-            labels[abstract.unresolved_label.value()] = addr_counter;
+            const auto id = labels.intern(abstract.unresolved_label.value());
+            if (id == addresses.size()) {
+                addresses.push_back(addr_counter);
+            } else {
+                addresses[id] = addr_counter;
+            }
         } else {
             ++addr_counter;
         }
     }
 }
 
-static inline Error resolve_labels(const std::unordered_map<std::string, size_t>& labels, AbstractInstrStream& abstracts) {
+static inline Error resolve_labels(const SymbolTable& labels, const std::vector<size_t>& addresses, AbstractInstrStream& abstracts) {
     for (auto& abstract : abstracts) {
         if (abstract.instr.s.op != NOT_AN_INSTRUCTION
             && abstract.unresolved_label.has_value()) {
             // has a label which needs to be resolved
-            auto u_label = abstract.unresolved_label.value();
-            if (!labels.contains(u_label)) {
+            const auto& u_label = abstract.unresolved_label.value();
+            const auto id = labels.find(u_label);
+            if (id == SymbolTable::NO_SYMBOL) {
                 return Error("{}: Could not find label '{}'.", to_string(abstract.location), u_label);
             }
-            abstract.instr.s.val = int64_t(labels.at(u_label));
+            set_instr_val(abstract.instr, int64_t(addresses[id]));
         }
     }
     return {};
 }
 
-Result<InstrStream> finalize(AbstractInstrStream&& abstracts) {
-    std::unordered_map<std::string, size_t> labels;
-    populate_labels(abstracts, labels);
-    auto err = resolve_labels(labels, abstracts);
+Result<InstrStream> finalize(AbstractInstrStream&& abstracts, SourceMap* source_map) {
+    SymbolTable labels;
+    std::vector<size_t> addresses;
+    populate_labels(abstracts, labels, addresses);
+    auto err = resolve_labels(labels, addresses, abstracts);
     if (err) {
         return { "Failed to resolve label(s): {}", err.error };
     }
@@ -275,218 +370,53 @@ Result<InstrStream> finalize(AbstractInstrStream&& abstracts) {
 
     for (const auto& abstract : abstracts) {
         if (abstract.instr.s.op != NOT_AN_INSTRUCTION) {
+            if (source_map) {
+                source_map->add(instrs.size(), abstract.location);
+            }
             instrs.push_back(abstract.instr);
         }
     }
     return instrs;
 }
 
-/// Replace `push 1; add` with `inc`
-static Error optimize_substitute_inc(AbstractInstrStream& abstracts) {
-    std::vector<size_t> to_remove {};
-    for (size_t i = 0; i < abstracts.size() - 1; ++i) {
-        Op& op = abstracts[i].instr.s.op;
-        Op& next_op = abstracts[i + 1].instr.s.op;
-
-        int64_t val = abstracts[i].instr.s.val;
-        if (op == PUSH && val == 1
-            && next_op == ADD) {
-            to_remove.push_back(i + 1);
-            op = INC;
-            val = 0;
-        }
-        abstracts[i].instr.s.val = val;
-    }
-    std::reverse(to_remove.begin(), to_remove.end());
-    for (size_t i : to_remove) {
-        abstracts.erase(abstracts.begin() + long(i));
-    }
-    return {};
-}
-
-/// Replace `push 1; sub` with `dec`
-static Error optimize_substitute_dec(AbstractInstrStream& abstracts) {
-    std::vector<size_t> to_remove {};
-    for (size_t i = 0; i < abstracts.size() - 1; ++i) {
-        Op& op = abstracts[i].instr.s.op;
-        Op& next_op = abstracts[i + 1].instr.s.op;
-
-        int64_t val = abstracts[i].instr.s.val;
-        if (op == PUSH && val == 1
-            && next_op == SUB) {
-            to_remove.push_back(i + 1);
-            op = DEC;
-            val = 0;
-        }
-        abstracts[i].instr.s.val = val;
-    }
-    std::reverse(to_remove.begin(), to_remove.end());
-    for (size_t i : to_remove) {
-        abstracts.erase(abstracts.begin() + long(i));
-    }
-    return {};
-}
-
-/// Replace `push 0; je` with `jz`
-static Error optimize_substitute_jz(AbstractInstrStream& abstracts) {
-    std::vector<size_t> to_remove {};
-    for (size_t i = 0; i < abstracts.size() - 1; ++i) {
-        Op& op = abstracts[i].instr.s.op;
-        Op& next_op = abstracts[i + 1].instr.s.op;
-
-        int64_t val = abstracts[i].instr.s.val;
-        if (op == PUSH && val == 0
-            && next_op == JE) {
-            to_remove.push_back(i);
-            next_op = JZ;
-        }
-    }
-    std::reverse(to_remove.begin(), to_remove.end());
-    for (size_t i : to_remove) {
-        abstracts.erase(abstracts.begin() + long(i));
-    }
-    return {};
-}
-
-/// Replace `push 0; jn` with `jnz`
-static Error optimize_substitute_jnz(AbstractInstrStream& abstracts) {
-    std::vector<size_t> to_remove {};
-    for (size_t i = 0; i < abstracts.size() - 1; ++i) {
-        Op& op = abstracts[i].instr.s.op;
-        Op& next_op = abstracts[i + 1].instr.s.op;
-
-        int64_t val = abstracts[i].instr.s.val;
-        if (op == PUSH && val == 0
-            && next_op == JN) {
-            to_remove.push_back(i);
-            next_op = JNZ;
-        }
-    }
-    std::reverse(to_remove.begin(), to_remove.end());
-    for (size_t i : to_remove) {
-        abstracts.erase(abstracts.begin() + long(i));
-    }
-    return {};
-}
-
-/// Replace `over; over` with `dup2`
-static Error optimize_substitute_dup2(AbstractInstrStream& abstracts) {
-    std::vector<size_t> to_remove {};
-    for (size_t i = 0; i < abstracts.size() - 1; ++i) {
-        Op& op = abstracts[i].instr.s.op;
-        Op& next_op = abstracts[i + 1].instr.s.op;
-        if (op == OVER && next_op == OVER) {
-            to_remove.push_back(i + 1);
-            op = DUP2;
-        }
-    }
-    std::reverse(to_remove.begin(), to_remove.end());
-    for (size_t i : to_remove) {
-        abstracts.erase(abstracts.begin() + long(i));
+Result<DenseCode> finalize_dense(AbstractInstrStream&& abstracts) {
+    auto instrs = finalize(std::move(abstracts));
+    if (!instrs) {
+        return { "{}", instrs.error };
     }
-    return {};
+    return encode_dense(instrs.value());
 }
 
-Error optimize_substitute(AbstractInstrStream& abstracts) {
+/// Replace `push C; div` and `push C; mod` with `divp2`/`modp2` if C is a
+/// power of two, or with `divc`/`modc` otherwise, which divide by
+/// multiplication with a precomputed magic number instead.
+Error optimize_strength_reduce(AbstractInstrStream& abstracts) {
     if (abstracts.size() < 2) {
         return {};
     }
-    auto err = optimize_substitute_inc(abstracts);
-    if (err) {
-        return err;
-    }
-    err = optimize_substitute_dec(abstracts);
-    if (err) {
-        return err;
-    }
-    err = optimize_substitute_jz(abstracts);
-    if (err) {
-        return err;
-    }
-    err = optimize_substitute_jnz(abstracts);
-    if (err) {
-        return err;
-    }
-    err = optimize_substitute_dup2(abstracts);
-    if (err) {
-        return err;
-    }
-    return {};
-}
-
-/// Folds `add` of constants to the addition result
-/// Returns true if there was a change made, false if not. This allows
-/// executing it in a loop until no further changes can be made.
-static Result<bool> optimize_fold_arith(AbstractInstrStream& abstracts) {
     std::vector<size_t> to_remove {};
-    bool changed = false;
-    for (size_t i = 0; i < abstracts.size() - 2; ++i) {
+    for (size_t i = 0; i + 1 < abstracts.size(); ++i) {
         auto& instr0 = abstracts[i].instr.s;
         auto& instr1 = abstracts[i + 1].instr.s;
-        auto& instr2 = abstracts[i + 2].instr.s;
-
-        if (instr0.op == PUSH && instr1.op == PUSH
-            && (instr2.op == ADD
-                || instr2.op == SUB
-                || instr2.op == MUL
-                || instr2.op == DIV
-                || instr2.op == MOD)) {
-            to_remove.push_back(i + 1);
-            to_remove.push_back(i + 2);
-            switch (uint8_t(instr2.op)) {
-            case ADD:
-                instr0.val += instr1.val;
-                break;
-            case SUB:
-                instr0.val -= instr1.val;
-                break;
-            case MUL:
-                instr0.val *= instr1.val;
-                break;
-            case DIV:
-                instr0.val /= instr1.val;
-                break;
-            case MOD:
-                instr0.val %= instr1.val;
-                break;
-            default:
-                assert(!bool("unreachable code"));
-                break;
-            }
-            changed = true;
-        } else if (instr0.op == PUSH && instr1.op == INC) {
-            to_remove.push_back(i + 1);
-            ++instr0.val;
-            changed = true;
-        } else if (instr0.op == PUSH && instr1.op == DEC) {
-            to_remove.push_back(i + 1);
-            --instr0.val;
-            changed = true;
+        const int64_t divisor = instr0.val;
+        if (instr0.op != PUSH || abstracts[i].unresolved_label.has_value()
+            || (instr1.op != DIV && instr1.op != MOD)
+            || !has_div_magic(divisor)) {
+            continue;
+        }
+        const bool is_div = instr1.op == DIV;
+        if ((divisor & (divisor - 1)) == 0) {
+            instr0.op = is_div ? DIVP2 : MODP2;
+            instr0.val = std::countr_zero(uint64_t(divisor));
+        } else {
+            instr0.op = is_div ? DIVC : MODC;
         }
+        to_remove.push_back(i + 1);
+        ++i;
     }
     std::reverse(to_remove.begin(), to_remove.end());
     for (size_t i : to_remove) {
         abstracts.erase(abstracts.begin() + long(i));
     }
-    return changed;
-}
-
-Error optimize_fold(AbstractInstrStream& abstracts) {
-    if (abstracts.size() < 3) {
-        return {};
-    }
-    while (true) {
-        bool changed = false;
-        auto res = optimize_fold_arith(abstracts);
-        if (!res) {
-            return { "Failed: {}", res.error };
-        } else if (res.value()) {
-            changed = true;
-        }
-
-        if (!changed) {
-            break;
-        }
-    }
     return {};
 }
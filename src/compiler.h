@@ -2,6 +2,8 @@
 
 #include "abstract_instruction.h"
 #include "error.h"
+#include "source_map.h"
+#include <optional>
 #include <span>
 #include <vector>
 
@@ -32,11 +34,108 @@ using AbstractInstrStream = std::vector<AbstractInstr>;
 using InstrStream = std::vector<Instr>;
 
 Result<TokenStream> parse(const std::span<std::string>& lines, const std::string& filename);
+/// Parses a single line, appending its tokens. `loc` has to hold the file and
+/// the number of the line.
+Error parse_line(const std::string& raw_line, SourceLocation& loc, TokenStream& tokens);
 Result<AbstractInstrStream> translate(const TokenStream& tokens);
+/// Translates whole instructions from the front of `tokens`, appending them to
+/// `out` and removing them from `tokens`. With `more_input`, an instruction
+/// whose argument is missing is left in `tokens`, as the argument may still
+/// follow on the next line.
+Error translate_partial(std::span<const Token>& tokens, AbstractInstrStream& out, bool more_input);
+
+/// Tokens of consecutive chunks of lines, see parse_chunked().
+struct TokenChunks {
+    std::vector<TokenStream> chunks {};
+    /// Whether the first token of each chunk is the argument of the last
+    /// instruction of the chunk before, so it's translated with that one.
+    std::vector<bool> continued {};
+
+    size_t token_count() const;
+};
+
+struct ChunkConfig {
+    /// 0 uses one thread per hardware thread.
+    size_t threads { 0 };
+    /// Number of lines parsed and translated as one piece of work.
+    size_t chunk_lines { 64 * 1024 };
+};
+
+/// Like parse(), but splits the lines into chunks which are parsed on several
+/// threads. If several chunks fail, the error is that of the first one, so
+/// it's the same as the one parse() reports.
+Result<TokenChunks> parse_chunked(std::span<const std::string> lines, const std::string& filename, const ChunkConfig& cfg = {});
+/// Like translate() over all tokens of the chunks in order, translating the
+/// chunks on several threads. Reports the same error as translate() would.
+Result<AbstractInstrStream> translate_chunked(const TokenChunks& tokens, const ChunkConfig& cfg = {});
 
 // do optimization steps between translate() and finalize()
 
-Error optimize_substitute(AbstractInstrStream& abstracts);
-Error optimize_fold(AbstractInstrStream& abstracts);
+/// What optimize_inline() did with the calls of one subroutine.
+struct InlineReport {
+    /// Label the subroutine is called by.
+    std::string label;
+    /// Instructions which can run between entering the subroutine and its
+    /// `ret`, not counting those of subroutines it calls.
+    size_t instrs;
+    size_t inlined_calls;
+    size_t kept_calls;
+    /// Whether the subroutine itself was removed, as nothing calls it any more.
+    bool removed;
+};
+
+/// Replaces calls of small subroutines, and of larger ones inside loops, by a
+/// copy of the subroutine, and then removes the code which can't be reached
+/// any more, like subroutines which aren't called any more. Run it before the
+/// other passes, so that they see across the calls it inlined. Fills in
+/// `reports`, if given, with one entry per subroutine.
+Error optimize_inline(AbstractInstrStream& abstracts, std::vector<InlineReport>* reports = nullptr);
+
+/// Something optimize_peephole() found wrong with an operation on constants.
+struct FoldDiagnostic {
+    SourceLocation location;
+    std::string message;
+};
+
+/// Rewrites short sequences of instructions by the rule table in
+/// peephole.cpp, in one pass: shorter forms like `inc` for `push 1; add`,
+/// arithmetic on constants, and stack shuffling which cancels out. A rewrite
+/// is matched again with the instructions before it, so that `push 1; push
+/// 2; push 3; add; add` folds into `push 6`.
+///
+/// An operation on constants which overflows, or divides by zero, is reported
+/// in `diagnostics`, if given. Overflowing `add`, `sub`, `mul`, `inc` and
+/// `dec` are folded into the wrapped result, as the interpreter computes it,
+/// unless `checked_arith` is set, in which case they are left for the
+/// interpreter to fault on (see VmConfig::checked_arith). Divisions by zero,
+/// and `INT64_MIN / -1`, are never folded.
+Error optimize_peephole(AbstractInstrStream& abstracts, bool checked_arith = false, std::vector<FoldDiagnostic>* diagnostics = nullptr);
+// run after optimize_peephole(), as it hides constant divisors from folding
+Error optimize_strength_reduce(AbstractInstrStream& abstracts);
+
+/// What optimize_loops() found out about one natural loop.
+struct LoopReport {
+    /// Label of the loop header.
+    std::string header;
+    /// Number of basic blocks in the loop.
+    size_t blocks;
+    /// Stack slot of the induction variable when entering the loop, counted
+    /// from the top of the stack (0 = top), if one was found.
+    std::optional<size_t> induction_slot;
+    /// How much the induction variable changes per iteration.
+    int64_t induction_step;
+    /// Stack slot of the value the induction variable is compared against.
+    std::optional<size_t> bound_slot;
+    /// Instructions executed per iteration, if all iterations take the same
+    /// path, before and after the optimization.
+    std::optional<size_t> instrs_before;
+    std::optional<size_t> instrs_after;
+};
+
+// run after the other passes, as it relies on `inc` and `dup2`.
+// fills in `reports`, if given, with one entry per loop.
+Error optimize_loops(AbstractInstrStream& abstracts, std::vector<LoopReport>* reports = nullptr);
 
-Result<InstrStream> finalize(AbstractInstrStream&& abstracts);
+/// If `source_map` is given, a row for the location of every instruction is
+/// added to it.
+Result<InstrStream> finalize(AbstractInstrStream&& abstracts, SourceMap* source_map = nullptr);
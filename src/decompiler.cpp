@@ -0,0 +1,248 @@
+#include "decompiler.h"
+#include "bytecode.h"
+#include "dense.h"
+#include "instruction.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fmt/format.h>
+#include <iterator>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+/// Labels are syllables of a consonant and a vowel, so they can be read out
+/// loud: the index in base 75, with at least three syllables.
+static void append_label_name(std::string& out, size_t index) {
+    constexpr std::string_view consonants = "bdfghklmnprstvz";
+    constexpr std::string_view vowels = "aeiou";
+    constexpr size_t base = consonants.size() * vowels.size();
+    char syllables[32];
+    size_t count = 0;
+    do {
+        syllables[count++] = char(index % base);
+        index /= base;
+    } while (index != 0 || count < 3);
+    while (count > 0) {
+        const auto digit = size_t(syllables[--count]);
+        out.push_back(consonants[digit / vowels.size()]);
+        out.push_back(vowels[digit % vowels.size()]);
+    }
+}
+
+namespace {
+
+/// Output of one chunk of instructions.
+struct Chunk {
+    std::string text {};
+    /// Line of each instruction, counted from the first line of the chunk.
+    /// Only filled if a source map is made.
+    std::vector<uint32_t> lines {};
+    size_t line_count { 0 };
+    bool done { false };
+};
+
+struct DecompileInput {
+    std::span<const Instr> instrs;
+    /// Jump targets, sorted and without duplicates.
+    std::vector<size_t> targets;
+};
+
+}
+
+/// Most `halt`s written after the last instruction, to give a jump target
+/// past it its address.
+constexpr size_t MAX_END_PADDING = 64 * 1024;
+
+static size_t label_index(const std::vector<size_t>& targets, size_t target) {
+    return size_t(std::lower_bound(targets.begin(), targets.end(), target) - targets.begin());
+}
+
+static void format_chunk(const DecompileInput& input, size_t begin, size_t end, bool with_lines, Chunk& chunk) {
+    auto& text = chunk.text;
+    // most lines are short, so this is usually the only allocation
+    text.reserve((end - begin) * 16);
+    if (with_lines) {
+        chunk.lines.reserve(end - begin);
+    }
+    auto out = std::back_inserter(text);
+    size_t line = 0;
+    size_t next_label = label_index(input.targets, begin);
+    for (size_t pc = begin; pc < end; ++pc) {
+        if (next_label < input.targets.size() && input.targets[next_label] == pc) {
+            text.append("\n:");
+            append_label_name(text, next_label);
+            fmt::format_to(out, " \t # addr={}\n", pc);
+            ++next_label;
+            line += 2;
+        }
+        if (with_lines) {
+            chunk.lines.push_back(uint32_t(line));
+        }
+        const auto& instr = input.instrs[pc];
+        text.append(to_string(instr.s.op));
+        if (op_accepts_label_argument(instr.s.op)) {
+            const auto target = size_t(instr.s.val);
+            text.append(" :");
+            append_label_name(text, label_index(input.targets, target));
+            fmt::format_to(out, " \t # ->{}", target);
+        } else if (op_requires_i64_argument(instr.s.op)) {
+            const auto val = int64_t(instr.s.val);
+            if (val > 100'000 && val % 1000 != 0) {
+                fmt::format_to(out, " 0x{:x}", val);
+            } else {
+                fmt::format_to(out, " {}", val);
+            }
+        }
+        text.push_back('\n');
+        ++line;
+    }
+    chunk.line_count = line;
+}
+
+/// Formats the chunks on `thread_count` threads, and hands each to `write` in
+/// order as soon as it and all before it are done. Only a few chunks are
+/// formatted ahead of the one being written, to bound memory use.
+template<typename Write>
+static void format_in_order(const DecompileInput& input, const DecompileConfig& cfg, bool with_lines, Write&& write) {
+    const size_t chunk_size = std::max<size_t>(cfg.chunk_size, 1);
+    const size_t chunk_count = (input.instrs.size() + chunk_size - 1) / chunk_size;
+    const size_t thread_count = std::min(chunk_count, cfg.threads != 0 ? cfg.threads : std::max<size_t>(1, std::thread::hardware_concurrency()));
+    const size_t window = thread_count * 2;
+    std::vector<Chunk> chunks(chunk_count);
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<size_t> next_chunk { 0 };
+    size_t written = 0;
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = next_chunk++; i < chunk_count; i = next_chunk++) {
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&] { return i < written + window; });
+                }
+                Chunk chunk;
+                format_chunk(input, i * chunk_size, std::min(input.instrs.size(), (i + 1) * chunk_size), with_lines, chunk);
+                chunk.done = true;
+                {
+                    std::lock_guard lock(mutex);
+                    chunks[i] = std::move(chunk);
+                }
+                cv.notify_all();
+            }
+        });
+    }
+    for (size_t i = 0; i < chunk_count; ++i) {
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&] { return chunks[i].done; });
+        }
+        write(i * chunk_size, chunks[i]);
+        {
+            std::lock_guard lock(mutex);
+            chunks[i] = Chunk { .text = {}, .lines = {}, .line_count = 0, .done = true };
+            written = i + 1;
+        }
+        cv.notify_all();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+Result<DecompileStats> decompile_file(const std::string& filename, std::FILE* out, const DecompileConfig& cfg, SourceMap* source_map) {
+    auto mapped = MappedBytecode::open(filename);
+    if (!mapped) {
+        return { "{}", mapped.error };
+    }
+    const auto& header = mapped.value().header();
+    std::string preamble = fmt::format("# decompiled from '{}'\n"
+                                       "# labels are named in the order of their address\n",
+        filename);
+    // dense code is decoded, as its jumps target byte offsets
+    InstrStream decoded;
+    DecompileInput input;
+    if ((header.flags & BYTECODE_DENSE) != 0) {
+        auto decoded_res = decode_dense(mapped.value().dense());
+        if (!decoded_res) {
+            return { "{}", decoded_res.error };
+        }
+        decoded = decoded_res.move();
+        input.instrs = decoded;
+        preamble += fmt::format("# dense encoding, {} bytes\n", header.code_size);
+    } else {
+        input.instrs = mapped.value().instrs();
+    }
+    if (header.stack_size != 0) {
+        preamble += fmt::format("# compiled with --stack-size={}\n", header.stack_size);
+    }
+    const auto end = std::find_if(input.instrs.begin(), input.instrs.end(), [](const Instr& instr) { return instr.s.op == NOT_AN_INSTRUCTION; });
+    const bool truncated = end != input.instrs.end();
+    input.instrs = input.instrs.first(size_t(end - input.instrs.begin()));
+
+    for (const auto& instr : input.instrs) {
+        if (op_accepts_label_argument(instr.s.op)) {
+            input.targets.push_back(size_t(instr.s.val));
+        }
+    }
+    std::sort(input.targets.begin(), input.targets.end());
+    input.targets.erase(std::unique(input.targets.begin(), input.targets.end()), input.targets.end());
+
+    DecompileStats stats { .instructions = input.instrs.size(), .labels = input.targets.size(), .bytes = 0 };
+    Error write_err;
+    const auto write = [&](std::string_view text) {
+        if (!write_err && std::fwrite(text.data(), 1, text.size(), out) != text.size()) {
+            write_err = Error("Failed to write the decompiled source: {}", std::strerror(errno));
+        }
+        stats.bytes += text.size();
+    };
+    write(preamble);
+    // lines are counted from 1, and the preamble ends in a newline
+    size_t line = 1 + size_t(std::count(preamble.begin(), preamble.end(), '\n'));
+    SourceLocation loc { .file = cfg.output_name, .line = 0, .col_start = 1, .col_end = 1 };
+    format_in_order(input, cfg, source_map != nullptr, [&](size_t first_pc, const Chunk& chunk) {
+        write(chunk.text);
+        if (source_map) {
+            for (size_t i = 0; i < chunk.lines.size(); ++i) {
+                const auto op = input.instrs[first_pc + i].s.op;
+                loc.line = line + chunk.lines[i];
+                loc.col_end = 1 + to_string(op).size();
+                source_map->add(first_pc + i, loc);
+            }
+        }
+        line += chunk.line_count;
+    });
+    // jumps to the end or past it still need their label. The gap up to a
+    // label past the end is filled with `halt`, which is what running off the
+    // end does too, so that the label gets its address back when compiled.
+    std::string epilogue;
+    size_t addr = input.instrs.size();
+    for (size_t i = label_index(input.targets, input.instrs.size()); i < input.targets.size(); ++i) {
+        const auto target = input.targets[i];
+        if (target - input.instrs.size() > MAX_END_PADDING) {
+            return { "A jump targets address {}, which is too far past the last instruction at {} to be decompiled.", target, input.instrs.size() - 1 };
+        }
+        if (addr < target) {
+            epilogue += fmt::format("\n# padding up to addr={}\n", target);
+        }
+        for (; addr < target; ++addr) {
+            epilogue.append("halt\n");
+        }
+        epilogue.append("\n:");
+        append_label_name(epilogue, i);
+        epilogue += fmt::format(" \t # addr={}\n", target);
+    }
+    if (truncated) {
+        epilogue += "# encountered NOT_AN_INSTRUCTION, assuming end of file\n";
+    }
+    write(epilogue);
+    if (write_err) {
+        return { "{}", write_err.error };
+    }
+    return stats;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "error.h"
+#include "source_map.h"
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+/// Turns .mclb files back into source, which compiles into the same
+/// instructions again.
+///
+/// Labels are placed at every jump target, and named by the order of their
+/// address, so decompiling the same file always gives the same output. Jumps
+/// past the last instruction get their label by padding the end with `halt`,
+/// which is what running off the end does, so such files compile into the
+/// same instructions followed by the padding. Files jumping more than 64k
+/// instructions past the end are refused. The file is mapped instead of
+/// read, and the output is formatted by several threads in chunks of
+/// instructions, which are written in order as they complete.
+
+struct DecompileConfig {
+    /// Threads formatting the output. 0 selects one per hardware thread.
+    size_t threads { 0 };
+    /// Number of instructions formatted into one piece of output.
+    size_t chunk_size { 64 * 1024 };
+    /// Name of the output, as the file of the rows in the source map.
+    std::string output_name { "<decompiled>" };
+};
+
+struct DecompileStats {
+    size_t instructions { 0 };
+    size_t labels { 0 };
+    /// Bytes written to the output.
+    size_t bytes { 0 };
+};
+
+/// Writes the source of the .mclb file to `out`. If `source_map` is given,
+/// it's filled with the location of every instruction in the output, so that
+/// a pc can be looked up in the decompiled source.
+[[nodiscard]] Result<DecompileStats> decompile_file(const std::string& filename, std::FILE* out, const DecompileConfig& cfg = {}, SourceMap* source_map = nullptr);
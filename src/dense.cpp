@@ -0,0 +1,171 @@
+#include "dense.h"
+#include <algorithm>
+#include <optional>
+
+uint8_t dense_size_class(int64_t value, uint8_t min_class) {
+    for (uint8_t size_class = min_class; size_class < DENSE_IMM_SIZES.size() - 1; ++size_class) {
+        const auto bits = 8 * DENSE_IMM_SIZES[size_class];
+        const auto limit = int64_t(1) << (bits - 1);
+        if (value >= -limit && value < limit) {
+            return size_class;
+        }
+    }
+    return DENSE_IMM_SIZES.size() - 1;
+}
+
+bool dense_set_imm(uint8_t* at, int64_t value) {
+    const auto size_class = uint8_t(*at >> DENSE_SIZE_SHIFT);
+    if (dense_size_class(value, size_class) != size_class) {
+        return false;
+    }
+    for (size_t i = 0; i < DENSE_IMM_SIZES[size_class]; ++i) {
+        at[1 + i] = uint8_t(uint64_t(value) >> (8 * i));
+    }
+    return true;
+}
+
+/// Like dense_imm(), but never reads past the end of the instruction.
+static int64_t read_imm(std::span<const uint8_t> code, size_t offset) {
+    const auto size = DENSE_IMM_SIZES[code[offset] >> DENSE_SIZE_SHIFT];
+    uint64_t raw = 0;
+    for (size_t i = 0; i < size; ++i) {
+        raw |= uint64_t(code[offset + 1 + i]) << (8 * i);
+    }
+    const auto unused_bits = 64 - 8 * size;
+    return int64_t(raw << unused_bits) >> unused_bits;
+}
+
+Result<DenseCode> encode_dense(std::span<const Instr> instrs) {
+    const auto min_class = [](Op op) -> uint8_t {
+        return op == DIVC || op == MODC ? 2 : 0;
+    };
+    std::vector<uint8_t> classes(instrs.size(), 0);
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        const auto& instr = instrs[i].s;
+        if (op_accepts_label_argument(instr.op)) {
+            if (instr.val < 0 || size_t(instr.val) > instrs.size()) {
+                return { "Jump target {} is out of range. pc={}", int64_t(instr.val), i };
+            }
+        } else if (op_requires_i64_argument(instr.op)) {
+            classes[i] = dense_size_class(instr.val, min_class(instr.op));
+        }
+    }
+    // Jumps start out short and are widened until all targets fit. As they
+    // only ever grow, this terminates.
+    std::vector<size_t> offsets(instrs.size() + 1, 0);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            const auto op = instrs[i].s.op;
+            offsets[i + 1] = offsets[i] + 1 + (op_requires_i64_argument(op) ? DENSE_IMM_SIZES[classes[i]] : 0);
+        }
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            if (op_accepts_label_argument(instrs[i].s.op)) {
+                const auto needed = dense_size_class(int64_t(offsets[size_t(instrs[i].s.val)]), classes[i]);
+                if (needed != classes[i]) {
+                    classes[i] = needed;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    DenseCode code(offsets.back(), 0);
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        const auto& instr = instrs[i].s;
+        auto* at = code.data() + offsets[i];
+        *at = uint8_t(instr.op | (classes[i] << DENSE_SIZE_SHIFT));
+        if (op_requires_i64_argument(instr.op)) {
+            const auto value = op_accepts_label_argument(instr.op) ? int64_t(offsets[size_t(instr.val)]) : int64_t(instr.val);
+            if (!dense_set_imm(at, value)) {
+                return { "Value {} doesn't fit into the encoded instruction. pc={}", value, i };
+            }
+        }
+    }
+    return code;
+}
+
+/// Offset of every instruction in the code, followed by the size of the code.
+static Result<std::vector<size_t>> instruction_offsets(std::span<const uint8_t> code) {
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    while (offset < code.size()) {
+        const auto op = dense_op(&code[offset]);
+        if (op == NOT_AN_INSTRUCTION || op > RET) {
+            return { "Invalid instruction 0x{:02x} at offset {}.", code[offset], offset };
+        }
+        const auto length = DENSE_LENGTHS[code[offset]];
+        if (length > code.size() - offset) {
+            return { "Truncated instruction '{}' at offset {}.", to_string(op), offset };
+        }
+        offsets.push_back(offset);
+        offset += length;
+    }
+    offsets.push_back(offset);
+    return offsets;
+}
+
+/// Index of the instruction at the byte offset, if one starts there.
+static std::optional<size_t> index_of(const std::vector<size_t>& offsets, int64_t offset) {
+    auto it = std::lower_bound(offsets.begin(), offsets.end(), size_t(offset));
+    if (offset < 0 || it == offsets.end() || *it != size_t(offset)) {
+        return std::nullopt;
+    }
+    return size_t(it - offsets.begin());
+}
+
+Result<InstrStream> decode_dense(std::span<const uint8_t> code) {
+    auto offsets_res = instruction_offsets(code);
+    if (!offsets_res) {
+        return { "{}", offsets_res.error };
+    }
+    const auto& offsets = offsets_res.value();
+    InstrStream instrs;
+    instrs.reserve(offsets.size() - 1);
+    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+        const auto op = dense_op(&code[offsets[i]]);
+        int64_t value = 0;
+        if (op_requires_i64_argument(op)) {
+            value = read_imm(code, offsets[i]);
+        }
+        if (op_accepts_label_argument(op)) {
+            auto target = index_of(offsets, value);
+            if (!target.has_value()) {
+                return { "Jump to offset {}, which is not the start of an instruction. offset={}", value, offsets[i] };
+            }
+            value = int64_t(*target);
+        }
+        Instr instr {};
+        instr.s.op = op;
+        set_instr_val(instr, value);
+        instrs.push_back(instr);
+    }
+    return instrs;
+}
+
+Error validate_dense(std::span<const uint8_t> code) {
+    auto offsets_res = instruction_offsets(code);
+    if (!offsets_res) {
+        return Error("{}", offsets_res.error);
+    }
+    const auto& offsets = offsets_res.value();
+    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+        const auto op = dense_op(&code[offsets[i]]);
+        if (op_accepts_label_argument(op)) {
+            const auto target = read_imm(code, offsets[i]);
+            if (!index_of(offsets, target).has_value()) {
+                return Error("Jump to offset {}, which is not the start of an instruction. offset={}", target, offsets[i]);
+            }
+        }
+    }
+    return {};
+}
+
+std::vector<size_t> dense_offsets(std::span<const uint8_t> code) {
+    std::vector<size_t> offsets;
+    for (size_t offset = 0; offset < code.size(); offset += DENSE_LENGTHS[code[offset]]) {
+        offsets.push_back(offset);
+    }
+    return offsets;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include "instruction.h"
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+/// Variable-length encoding of an InstrStream, which is much smaller than the
+/// fixed 8 bytes per instruction.
+///
+/// Every instruction starts with one byte: the low 6 bits are the Op, the high
+/// 2 bits select the size of the immediate which follows, if the op takes one
+/// (see DENSE_IMM_SIZES). Immediates are little-endian and sign-extended.
+/// Jump targets are byte offsets into the code instead of instruction indices.
+using DenseCode = std::vector<uint8_t>;
+
+constexpr uint8_t DENSE_OP_MASK = 0x3f;
+constexpr uint8_t DENSE_SIZE_SHIFT = 6;
+/// Size of the immediate in bytes, by size class.
+constexpr std::array<uint8_t, 4> DENSE_IMM_SIZES { 1, 2, 4, 7 };
+/// Zero bytes a loaded program has after its code, so that decoding an
+/// immediate can always read 8 bytes at once.
+constexpr size_t DENSE_PADDING = 8;
+
+static_assert(RET <= DENSE_OP_MASK, "ops have to fit into the low bits of the op byte");
+
+/// Length of an encoded instruction in bytes, including the op byte, by op byte.
+constexpr std::array<uint8_t, 256> DENSE_LENGTHS = [] {
+    std::array<uint8_t, 256> lengths {};
+    for (size_t byte = 0; byte < lengths.size(); ++byte) {
+        const auto op = Op(byte & DENSE_OP_MASK);
+        lengths[byte] = uint8_t(1 + (op_requires_i64_argument(op) ? DENSE_IMM_SIZES[byte >> DENSE_SIZE_SHIFT] : 0));
+    }
+    return lengths;
+}();
+
+/// Size of the immediate of the instruction at `at`. Computed from a packed
+/// constant instead of looked up in DENSE_IMM_SIZES, as the interpreter has
+/// this on its critical path and shifting is faster than another load.
+inline size_t dense_imm_size(const uint8_t* at) {
+    constexpr uint32_t packed = DENSE_IMM_SIZES[0] | DENSE_IMM_SIZES[1] << 8 | DENSE_IMM_SIZES[2] << 16 | uint32_t(DENSE_IMM_SIZES[3]) << 24;
+    return (packed >> (8 * (*at >> DENSE_SIZE_SHIFT))) & 0xff;
+}
+
+inline Op dense_op(const uint8_t* at) {
+    return Op(*at & DENSE_OP_MASK);
+}
+
+/// Decodes the immediate of the instruction at `at`. Reads 8 bytes after the
+/// op byte, no matter the size of the immediate.
+inline int64_t dense_imm(const uint8_t* at) {
+    uint64_t raw;
+    std::memcpy(&raw, at + 1, sizeof(raw));
+    if constexpr (std::endian::native == std::endian::big) {
+        raw = __builtin_bswap64(raw);
+    }
+    const auto shift = 64 - 8 * dense_imm_size(at);
+    return int64_t(raw << shift) >> shift;
+}
+
+/// Smallest size class at or above `min_class` which can hold the value.
+uint8_t dense_size_class(int64_t value, uint8_t min_class = 0);
+
+/// Overwrites the immediate of the instruction at `at`, keeping its size.
+/// Returns false if the value doesn't fit.
+bool dense_set_imm(uint8_t* at, int64_t value);
+
+/// Encodes the instructions, converting jump targets to byte offsets.
+/// `divc` and `modc` always get at least a 32 bit immediate, as the loader
+/// replaces it with an index into its table of magic numbers.
+[[nodiscard]] Result<DenseCode> encode_dense(std::span<const Instr> instrs);
+
+/// Decodes dense code back into instructions, converting jump targets back to
+/// instruction indices. Fails if the code is malformed.
+[[nodiscard]] Result<InstrStream> decode_dense(std::span<const uint8_t> code);
+
+/// Byte offset of every instruction in the code, by instruction index. The
+/// code has to be valid.
+std::vector<size_t> dense_offsets(std::span<const uint8_t> code);
+
+/// Checks that the code consists of whole, valid instructions, so that it can
+/// be run without further checks.
+[[nodiscard]] Error validate_dense(std::span<const uint8_t> code);
+
+/// finalize(), followed by encode_dense().
+[[nodiscard]] Result<DenseCode> finalize_dense(AbstractInstrStream&& abstracts);
@@ -0,0 +1,48 @@
+#include "divide.h"
+#include <cassert>
+
+DivMagic div_magic(int64_t divisor) {
+    assert(has_div_magic(divisor));
+    constexpr uint64_t two63 = uint64_t(1) << 63;
+    const uint64_t ad = divisor < 0 ? uint64_t(-divisor) : uint64_t(divisor);
+    const uint64_t t = two63 + (uint64_t(divisor) >> 63);
+    const uint64_t anc = t - 1 - t % ad; // absolute value of nc
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta = 0;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            ++q2;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    DivMagic magic {};
+    magic.divisor = divisor;
+    magic.multiplier = int64_t(q2 + 1);
+    if (divisor < 0) {
+        magic.multiplier = int64_t(-(q2 + 1));
+    }
+    magic.shift = p - 64;
+    if (divisor > 0 && magic.multiplier < 0) {
+        magic.add = 1;
+    } else if (divisor < 0 && magic.multiplier > 0) {
+        magic.add = -1;
+    } else {
+        magic.add = 0;
+    }
+    return magic;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+
+/// Constants to divide by a fixed divisor with a multiplication and shifts
+/// instead of a hardware division, see div_magic().
+struct DivMagic {
+    int64_t divisor;
+    int64_t multiplier;
+    /// +1 or -1 if the dividend has to be added to / subtracted from the high
+    /// half of the product, 0 otherwise.
+    int64_t add;
+    int shift;
+};
+
+/// Whether div_magic() can be used for the divisor. True for any divisor
+/// except -1, 0, 1 and INT64_MIN.
+inline bool has_div_magic(int64_t divisor) {
+    return divisor > 1 || (divisor < -1 && divisor != INT64_MIN);
+}
+
+/// Computes the magic multiplier and shift for signed division by `divisor`
+/// (Hacker's Delight, 2nd ed., 10-4). Requires has_div_magic(divisor).
+DivMagic div_magic(int64_t divisor);
+
+/// Equivalent to `a / m.divisor`, truncating towards zero.
+inline int64_t div_by_magic(int64_t a, const DivMagic& m) {
+    auto q = int64_t((__int128(m.multiplier) * a) >> 64);
+    // may wrap, which is intended
+    q = int64_t(uint64_t(q) + uint64_t(m.add) * uint64_t(a));
+    q >>= m.shift;
+    // round towards zero
+    q += int64_t(uint64_t(q) >> 63);
+    return q;
+}
+
+/// Equivalent to `a % m.divisor`.
+inline int64_t mod_by_magic(int64_t a, const DivMagic& m) {
+    return int64_t(uint64_t(a) - uint64_t(div_by_magic(a, m)) * uint64_t(m.divisor));
+}
+
+/// Equivalent to `a / (1 << shift)`, truncating towards zero, for 0 < shift < 63.
+inline int64_t div_by_pow2(int64_t a, int64_t shift) {
+    // negative dividends need a bias of divisor - 1 to round towards zero
+    const auto bias = int64_t(uint64_t(a >> 63) >> (64 - shift));
+    return (a + bias) >> shift;
+}
+
+/// Equivalent to `a % (1 << shift)`, for 0 < shift < 63.
+inline int64_t mod_by_pow2(int64_t a, int64_t shift) {
+    return int64_t(uint64_t(a) - (uint64_t(div_by_pow2(a, shift)) << shift));
+}
+
+/// Remembers the last divisor of `div` and `mod`. Once the same divisor was
+/// seen often enough in a row, its magic number is computed, and division by
+/// it is done by multiplication until the divisor changes.
+struct DivisorCache {
+    /// Number of times in a row a divisor has to be seen before its magic
+    /// number is computed, as computing it costs much more than one division.
+    static constexpr uint32_t THRESHOLD = 16;
+
+    int64_t divisor { 0 };
+    uint32_t hits { 0 };
+    bool ready { false };
+    DivMagic magic {};
+};
+
+/// Returns the magic number for the divisor if it has been seen often enough in
+/// a row, or nullptr if a hardware division should be used.
+inline const DivMagic* cached_div_magic(DivisorCache& cache, int64_t divisor) {
+    if (divisor != cache.divisor) {
+        cache.divisor = divisor;
+        cache.hits = 0;
+        cache.ready = false;
+        return nullptr;
+    }
+    if (cache.ready) {
+        return &cache.magic;
+    }
+    if (++cache.hits == DivisorCache::THRESHOLD && has_div_magic(divisor)) {
+        cache.magic = div_magic(divisor);
+        cache.ready = true;
+        return &cache.magic;
+    }
+    return nullptr;
+}
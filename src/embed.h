@@ -0,0 +1,548 @@
+#pragma once
+
+#include "fold.h"
+#include "instruction.h"
+#include "lexer.h"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// MCL programs compiled together with the C++ code they're embedded in.
+///
+/// \code{.cpp}
+/// std::array<int64_t, 16> stack { 12 };
+/// auto result = run_embedded<"dup\nmul\nprint\n">(stack, 1, [](int64_t value) { fmt::print("{}\n", value); });
+/// \endcode
+///
+/// The source goes through the same lexer and mnemonic lookup as parse() and
+/// translate(), its labels are resolved like finalize() does, and constants
+/// are folded like optimize_peephole() does, all while the C++ code is compiled,
+/// so mistakes in the source are compile errors. Each basic block is then
+/// instantiated as one function, with the values of `push` and the targets of
+/// jumps as constants, so nothing is dispatched within a block, and blocks
+/// call the blocks after them directly; only jumps backwards go through a
+/// table of the blocks.
+///
+/// Arithmetic wraps around, like in the interpreter without checks. Faults
+/// end the run with an EmbeddedStatus instead of an Error, so that nothing of
+/// mcl has to be linked. Jumps to raw addresses aren't supported, as folding
+/// moves the instructions.
+
+/// MCL source as a template argument, from a string literal.
+template<size_t N>
+struct EmbeddedSource {
+    char text[N] {};
+
+    consteval EmbeddedSource(const char (&source)[N]) {
+        std::copy_n(source, N, text);
+    }
+
+    constexpr std::string_view view() const { return { text, N - 1 }; }
+};
+
+struct EmbeddedInstr {
+    Op op;
+    /// The value of `push`, or the block a jump or `call` goes to.
+    int64_t val;
+};
+
+struct EmbeddedBlock {
+    /// Range [begin, end) of instructions.
+    size_t begin;
+    size_t end;
+    /// How many values below the height the block starts at it reads.
+    size_t needs;
+    /// How far above that height the stack grows at most in the block.
+    size_t grows;
+};
+
+struct EmbeddedCompiled {
+    std::vector<EmbeddedInstr> instrs {};
+    std::vector<EmbeddedBlock> blocks {};
+};
+
+/// Called where the source of an embedded program has an error, which makes
+/// the constant evaluation fail, as it isn't constexpr. The compiler shows the
+/// call, and so the message. Not defined, as it's never called at runtime.
+void embedded_source_error(const char* message);
+
+/// Whether the op ends a basic block of an embedded program.
+constexpr bool embedded_ends_block(Op op) {
+    return op_accepts_label_argument(op) || op == HALT || op == RET || op == CLEAR;
+}
+
+/// Compiles the source of an embedded program. Only meant for constant
+/// evaluation, see embedded_program().
+constexpr EmbeddedCompiled compile_embedded(std::string_view source) {
+    struct Word {
+        std::string_view text;
+        int64_t value;
+        bool is_name;
+    };
+    std::vector<Word> words;
+    for (size_t start = 0; start < source.size();) {
+        const auto end = std::min(source.find('\n', start), source.size());
+        for_each_word(source.substr(start, end - start), [&](std::string_view text, size_t) {
+            const auto kind = classify_word(text);
+            if (kind == WordKind::Invalid) {
+                embedded_source_error("Invalid token.");
+            } else if (kind == WordKind::Name) {
+                words.push_back({ text, 0, true });
+            } else if (const auto value = word_value(text, kind)) {
+                words.push_back({ text, *value, false });
+            } else {
+                embedded_source_error("Integer too large.");
+            }
+            return true;
+        });
+        start = end + 1;
+    }
+
+    // like an AbstractInstrStream, with labels as NOT_AN_INSTRUCTION
+    struct Abstract {
+        Op op;
+        int64_t val;
+        std::string_view label;
+    };
+    std::vector<Abstract> abstracts;
+    for (size_t i = 0; i < words.size(); ++i) {
+        const auto& verb = words[i];
+        if (!verb.is_name) {
+            embedded_source_error("Expected instruction, instead got a number.");
+        }
+        if (verb.text.starts_with(':')) {
+            abstracts.push_back({ NOT_AN_INSTRUCTION, 0, verb.text.substr(1) });
+            continue;
+        }
+        auto op = op_from_string(verb.text);
+        if (op == NOT_AN_INSTRUCTION) {
+            embedded_source_error("Invalid instruction.");
+        }
+        Abstract abstract { op, 0, {} };
+        if (op_requires_i64_argument(op)) {
+            if (i + 1 == words.size()) {
+                embedded_source_error("Instruction expects an argument, but no argument was provided.");
+            }
+            const auto& arg = words[++i];
+            if (op_accepts_label_argument(op)) {
+                if (!arg.is_name || !arg.text.starts_with(':')) {
+                    embedded_source_error("Jumps only go to labels in embedded programs.");
+                }
+                abstract.label = arg.text.substr(1);
+            } else if (arg.is_name) {
+                embedded_source_error("Instruction expects an i64 argument.");
+            } else {
+                abstract.val = arg.value;
+            }
+        }
+        // divisions by constants are left to the C++ compiler, as `push; div`
+        if (op == DIVP2 || op == MODP2) {
+            if (abstract.val < 0 || abstract.val > 62) {
+                embedded_source_error("Shift out of range.");
+            }
+            abstract.val = int64_t(1) << abstract.val;
+        }
+        if (op == DIVP2 || op == MODP2 || op == DIVC || op == MODC) {
+            abstracts.push_back({ PUSH, abstract.val, {} });
+            abstract = { op == DIVP2 || op == DIVC ? DIV : MOD, 0, {} };
+        }
+        abstracts.push_back(abstract);
+    }
+
+    // folding, as in optimize_peephole() without checked arithmetic
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i + 1 < abstracts.size(); ++i) {
+            if (abstracts[i].op != PUSH) {
+                continue;
+            }
+            const auto next = abstracts[i + 1].op;
+            int64_t result = 0;
+            if (next == PUSH && i + 2 < abstracts.size()) {
+                const auto op = abstracts[i + 2].op;
+                if (op != ADD && op != SUB && op != MUL && op != DIV && op != MOD) {
+                    continue;
+                }
+                const auto outcome = fold_binary(op, abstracts[i].val, abstracts[i + 1].val, result);
+                if (outcome != FoldOutcome::Folded && outcome != FoldOutcome::Overflow) {
+                    // faults when executed
+                    continue;
+                }
+                abstracts.erase(abstracts.begin() + long(i) + 1, abstracts.begin() + long(i) + 3);
+            } else if (next == INC || next == DEC) {
+                (void)fold_binary(next == INC ? ADD : SUB, abstracts[i].val, 1, result);
+                abstracts.erase(abstracts.begin() + long(i) + 1);
+            } else {
+                continue;
+            }
+            abstracts[i].val = result;
+            changed = true;
+        }
+    }
+
+    // labels, the last one of a name wins like in finalize()
+    std::vector<std::pair<std::string_view, size_t>> labels;
+    EmbeddedCompiled compiled;
+    for (const auto& abstract : abstracts) {
+        if (abstract.op != NOT_AN_INSTRUCTION) {
+            compiled.instrs.push_back({ abstract.op, abstract.val });
+            continue;
+        }
+        const auto it = std::find_if(labels.begin(), labels.end(), [&](const auto& label) { return label.first == abstract.label; });
+        if (it != labels.end()) {
+            it->second = compiled.instrs.size();
+        } else {
+            labels.emplace_back(abstract.label, compiled.instrs.size());
+        }
+    }
+    const auto count = compiled.instrs.size();
+    std::vector<bool> leaders(count + 1, false);
+    leaders[0] = true;
+    size_t pc = 0;
+    for (const auto& abstract : abstracts) {
+        if (abstract.op == NOT_AN_INSTRUCTION) {
+            continue;
+        }
+        if (op_accepts_label_argument(abstract.op)) {
+            const auto it = std::find_if(labels.begin(), labels.end(), [&](const auto& label) { return label.first == abstract.label; });
+            if (it == labels.end()) {
+                embedded_source_error("Could not find label.");
+            }
+            compiled.instrs[pc].val = int64_t(it->second);
+            leaders[it->second] = true;
+        }
+        if (embedded_ends_block(abstract.op)) {
+            leaders[pc + 1] = true;
+        }
+        ++pc;
+    }
+
+    // blocks, and how the stack height changes in each
+    std::vector<size_t> block_of(count + 1, 0);
+    for (size_t begin = 0; begin < count;) {
+        size_t end = begin + 1;
+        while (end < count && !leaders[end]) {
+            ++end;
+        }
+        int64_t height = 0;
+        int64_t lowest = 0;
+        int64_t highest = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const auto effect = op_stack_effect(compiled.instrs[i].op);
+            lowest = std::min(lowest, height - effect.pops);
+            height += effect.pushes - effect.pops;
+            highest = std::max(highest, height);
+        }
+        std::fill(block_of.begin() + long(begin), block_of.begin() + long(end), compiled.blocks.size());
+        compiled.blocks.push_back({ begin, end, size_t(-lowest), size_t(highest) });
+        begin = end;
+    }
+    // jumping to the end, or falling off it, halts
+    block_of[count] = compiled.blocks.size();
+    for (auto& instr : compiled.instrs) {
+        if (op_accepts_label_argument(instr.op)) {
+            instr.val = int64_t(block_of[size_t(instr.val)]);
+        }
+    }
+    return compiled;
+}
+
+template<size_t InstrCount, size_t BlockCount>
+struct EmbeddedProgram {
+    std::array<EmbeddedInstr, InstrCount> instrs {};
+    std::array<EmbeddedBlock, BlockCount> blocks {};
+};
+
+/// The compiled program, in arrays, as std::vector can't outlive constant
+/// evaluation.
+template<EmbeddedSource Source>
+consteval auto embedded_program() {
+    constexpr auto sizes = [] {
+        const auto compiled = compile_embedded(Source.view());
+        return std::pair { compiled.instrs.size(), compiled.blocks.size() };
+    }();
+    const auto compiled = compile_embedded(Source.view());
+    EmbeddedProgram<sizes.first, sizes.second> program;
+    std::copy(compiled.instrs.begin(), compiled.instrs.end(), program.instrs.begin());
+    std::copy(compiled.blocks.begin(), compiled.blocks.end(), program.blocks.begin());
+    return program;
+}
+
+enum class EmbeddedStatus : uint8_t {
+    /// By `halt`, or by running off the end.
+    Halted,
+    DivisionByZero,
+    /// INT64_MIN / -1, which traps in the interpreter.
+    DivisionOverflow,
+    StackUnderflow,
+    StackOverflow,
+    CallStackOverflow,
+    ReturnWithoutCall,
+};
+
+constexpr std::string_view to_string(EmbeddedStatus status) {
+    switch (status) {
+    case EmbeddedStatus::Halted:
+        return "Halted";
+    case EmbeddedStatus::DivisionByZero:
+        return "Division by zero";
+    case EmbeddedStatus::DivisionOverflow:
+        return "Integer overflow in division";
+    case EmbeddedStatus::StackUnderflow:
+        return "Stack underflow";
+    case EmbeddedStatus::StackOverflow:
+        return "Stack overflow";
+    case EmbeddedStatus::CallStackOverflow:
+        return "Call stack overflow";
+    case EmbeddedStatus::ReturnWithoutCall:
+        return "Return without a call";
+    }
+    return "Halted";
+}
+
+struct EmbeddedResult {
+    EmbeddedStatus status;
+    /// The instruction which halted or faulted, counted in the folded program,
+    /// or the number of instructions if it ran off the end.
+    size_t pc;
+    /// Number of values left on the stack.
+    size_t height;
+};
+
+/// Most nested `call`s in an embedded program.
+constexpr size_t EMBEDDED_MAX_CALL_DEPTH = 256;
+
+/// The functions an embedded program is instantiated as, see run_embedded().
+template<EmbeddedSource Source>
+class EmbeddedKernel {
+public:
+    static constexpr auto program = embedded_program<Source>();
+
+    template<typename Print>
+    static EmbeddedResult run(std::span<int64_t> stack, size_t height, Print& print) {
+        State<Print> s {
+            .base = stack.data(),
+            .top = stack.data() + height,
+            .limit = stack.data() + stack.size(),
+            .print = print,
+        };
+        constexpr auto blocks = []<size_t... B>(std::index_sequence<B...>) {
+            return std::array<size_t (*)(State<Print>&), sizeof...(B)> { &loop<B, Print>... };
+        }(std::make_index_sequence<program.blocks.size()>());
+        for (size_t b = 0; b < blocks.size();) {
+            b = blocks[b](s);
+        }
+        return { s.status, s.pc, size_t(s.top - s.base) };
+    }
+
+private:
+    /// Returned instead of the next block by a block which ends the run.
+    static constexpr size_t STOP = SIZE_MAX;
+
+    template<typename Print>
+    struct State {
+        int64_t* base;
+        int64_t* top;
+        int64_t* limit;
+        Print& print;
+        EmbeddedStatus status { EmbeddedStatus::Halted };
+        size_t pc { program.instrs.size() };
+        size_t call_depth { 0 };
+        std::array<size_t, EMBEDDED_MAX_CALL_DEPTH> calls {};
+    };
+
+    template<typename Print>
+    static size_t fault(State<Print>& s, EmbeddedStatus status, size_t pc) {
+        s.status = status;
+        s.pc = pc;
+        return STOP;
+    }
+
+    /// Runs block B, for as long as it's what the blocks after it jump back
+    /// to, so that a loop stays in one function.
+    template<size_t B, typename Print>
+    static size_t loop(State<Print>& s) {
+        size_t next;
+        do {
+            next = block<B, Print>(s);
+        } while (next == B);
+        return next;
+    }
+
+    template<size_t B, typename Print>
+    static size_t block(State<Print>& s) {
+        static constexpr auto info = program.blocks[B];
+        static constexpr bool ends_in_control = embedded_ends_block(program.instrs[info.end - 1].op);
+        static constexpr size_t body_end = ends_in_control ? info.end - 1 : info.end;
+        if (size_t(s.top - s.base) < info.needs) [[unlikely]] {
+            return fault(s, EmbeddedStatus::StackUnderflow, info.begin);
+        }
+        if (size_t(s.limit - s.top) < info.grows) [[unlikely]] {
+            return fault(s, EmbeddedStatus::StackOverflow, info.begin);
+        }
+        const bool ok = [&]<size_t... I>(std::index_sequence<I...>) {
+            return (step<info.begin + I>(s) && ...);
+        }(std::make_index_sequence<body_end - info.begin>());
+        if (!ok) [[unlikely]] {
+            return STOP;
+        }
+        if constexpr (ends_in_control) {
+            return control<body_end, B>(s);
+        } else {
+            return go<B + 1, B>(s);
+        }
+    }
+
+    /// Continues with block Next after block B. Going forward, that's a call
+    /// of the next block, which the C++ compiler turns into a jump, so that
+    /// only jumps backwards, which loop, go back to the dispatch in run().
+    template<size_t Next, size_t B, typename Print>
+    [[gnu::always_inline]] static size_t go(State<Print>& s) {
+        if constexpr (Next > B && Next < program.blocks.size()) {
+            return block<Next, Print>(s);
+        } else {
+            return Next;
+        }
+    }
+
+    /// Runs an instruction which doesn't end a block. False if it faulted.
+    template<size_t PC, typename Print>
+    [[gnu::always_inline]] static bool step(State<Print>& s) {
+        static constexpr auto instr = program.instrs[PC];
+        auto*& top = s.top;
+        if constexpr (instr.op == PUSH) {
+            *top++ = instr.val;
+        } else if constexpr (instr.op == POP) {
+            --top;
+        } else if constexpr (instr.op == ADD || instr.op == SUB || instr.op == MUL) {
+            const auto b = uint64_t(*--top);
+            const auto a = uint64_t(top[-1]);
+            top[-1] = int64_t(instr.op == ADD ? a + b : instr.op == SUB ? a - b : a * b);
+        } else if constexpr (instr.op == DIV || instr.op == MOD) {
+            const auto b = *--top;
+            const auto a = top[-1];
+            if (b == 0) [[unlikely]] {
+                fault(s, EmbeddedStatus::DivisionByZero, PC);
+                return false;
+            }
+            if (a == INT64_MIN && b == -1) [[unlikely]] {
+                fault(s, EmbeddedStatus::DivisionOverflow, PC);
+                return false;
+            }
+            top[-1] = instr.op == DIV ? a / b : a % b;
+        } else if constexpr (instr.op == INC || instr.op == DEC) {
+            top[-1] = int64_t(instr.op == INC ? uint64_t(top[-1]) + 1 : uint64_t(top[-1]) - 1);
+        } else if constexpr (instr.op == PRINT) {
+            s.print(*--top);
+        } else if constexpr (instr.op == DUP) {
+            top[0] = top[-1];
+            ++top;
+        } else if constexpr (instr.op == DUP2) {
+            top[0] = top[-2];
+            top[1] = top[-1];
+            top += 2;
+        } else if constexpr (instr.op == SWAP) {
+            std::swap(top[-1], top[-2]);
+        } else if constexpr (instr.op == OVER) {
+            top[0] = top[-2];
+            ++top;
+        } else {
+            static_assert(instr.op == NOT_AN_INSTRUCTION, "op not handled in embedded programs");
+        }
+        return true;
+    }
+
+    /// Runs the instruction which ends block B, and returns the next block.
+    template<size_t PC, size_t B, typename Print>
+    [[gnu::always_inline]] static size_t control(State<Print>& s) {
+        static constexpr auto instr = program.instrs[PC];
+        static constexpr auto target = size_t(instr.val);
+        auto*& top = s.top;
+        if constexpr (instr.op == HALT) {
+            s.pc = PC;
+            return STOP;
+        } else if constexpr (instr.op == CLEAR) {
+            top = s.base;
+            return go<B + 1, B>(s);
+        } else if constexpr (instr.op == JMP) {
+            return go<target, B>(s);
+        } else if constexpr (instr.op >= JE && instr.op <= JLE) {
+            const auto b = *--top;
+            const auto a = *--top;
+            if (compare<instr.op>(a, b)) {
+                return go<target, B>(s);
+            }
+            return go<B + 1, B>(s);
+        } else if constexpr (instr.op == JZ || instr.op == JNZ) {
+            const auto a = *--top;
+            if ((a == 0) == (instr.op == JZ)) {
+                return go<target, B>(s);
+            }
+            return go<B + 1, B>(s);
+        } else if constexpr (instr.op >= INCJE && instr.op <= INCJLE) {
+            top[-1] = int64_t(uint64_t(top[-1]) + 1);
+            if (compare<Op(instr.op - INCJE + JE)>(top[-2], top[-1])) {
+                return go<target, B>(s);
+            }
+            return go<B + 1, B>(s);
+        } else if constexpr (instr.op == MODJZ || instr.op == MODJNZ) {
+            const auto a = top[-2];
+            const auto b = top[-1];
+            if (b == 0) [[unlikely]] {
+                return fault(s, EmbeddedStatus::DivisionByZero, PC);
+            }
+            if (a == INT64_MIN && b == -1) [[unlikely]] {
+                return fault(s, EmbeddedStatus::DivisionOverflow, PC);
+            }
+            if ((a % b == 0) == (instr.op == MODJZ)) {
+                return go<target, B>(s);
+            }
+            return go<B + 1, B>(s);
+        } else if constexpr (instr.op == CALL) {
+            if (s.call_depth == EMBEDDED_MAX_CALL_DEPTH) [[unlikely]] {
+                return fault(s, EmbeddedStatus::CallStackOverflow, PC);
+            }
+            s.calls[s.call_depth++] = B + 1;
+            return go<target, B>(s);
+        } else {
+            static_assert(instr.op == RET);
+            if (s.call_depth == 0) [[unlikely]] {
+                return fault(s, EmbeddedStatus::ReturnWithoutCall, PC);
+            }
+            return s.calls[--s.call_depth];
+        }
+    }
+
+    template<Op op>
+    static constexpr bool compare(int64_t a, int64_t b) {
+        if constexpr (op == JE) {
+            return a == b;
+        } else if constexpr (op == JN) {
+            return a != b;
+        } else if constexpr (op == JG) {
+            return a > b;
+        } else if constexpr (op == JL) {
+            return a < b;
+        } else if constexpr (op == JGE) {
+            return a >= b;
+        } else {
+            static_assert(op == JLE);
+            return a <= b;
+        }
+    }
+};
+
+/// Runs the embedded program on `stack`, which holds `height` values to begin
+/// with, the last one on top, and has room for stack.size() values. Calls
+/// `print(value)` for each value the program prints. The values the program
+/// leaves on the stack are its first `height` values afterwards, with the
+/// height from the result.
+template<EmbeddedSource Source, typename Print>
+EmbeddedResult run_embedded(std::span<int64_t> stack, size_t height, Print&& print) {
+    return EmbeddedKernel<Source>::run(stack, height, print);
+}
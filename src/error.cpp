@@ -0,0 +1,36 @@
+#include "error.h"
+
+#include <fmt/args.h>
+
+std::string ErrorMessage::str() const {
+    if (!m_payload) {
+        return "Success";
+    }
+    const auto& payload = *m_payload;
+    fmt::dynamic_format_arg_store<fmt::format_context> store;
+    store.reserve(payload.count, 0);
+    for (size_t i = 0; i < payload.count; ++i) {
+        const uint64_t value = payload.values[i];
+        switch (payload.kinds[i]) {
+        case ArgKind::Int:
+            store.push_back(int64_t(value));
+            break;
+        case ArgKind::UInt:
+            store.push_back(value);
+            break;
+        case ArgKind::Double:
+            store.push_back(std::bit_cast<double>(value));
+            break;
+        case ArgKind::Bool:
+            store.push_back(value != 0);
+            break;
+        case ArgKind::Char:
+            store.push_back(char(value));
+            break;
+        case ArgKind::String:
+            store.push_back(std::string_view(payload.strings).substr(size_t(value >> 32), size_t(value & 0xffffffff)));
+            break;
+        }
+    }
+    return fmt::vformat(payload.format, store);
+}
@@ -1,8 +1,132 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cstdint>
 #include <fmt/core.h>
-#include <optional>
+#include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/// The message of an Error or a failed Result.
+///
+/// Instead of a formatted string, it keeps the format string it was created
+/// with, which identifies the kind of error and serves as its code, and the
+/// arguments, as integers or copies of strings. They're only formatted once the
+/// message is displayed, with fmt ("{}") or str(). An empty message, meaning
+/// success, is a null pointer, so creating, moving and destroying one never
+/// allocates.
+class ErrorMessage {
+public:
+    /// Most arguments of any message in the tree.
+    static constexpr size_t MAX_ARGS = 8;
+
+    ErrorMessage() = default;
+
+    template<typename... Args>
+    explicit ErrorMessage(fmt::format_string<Args...> s, Args&&... args)
+        : m_payload(std::make_unique<Payload>()) {
+        static_assert(sizeof...(Args) <= MAX_ARGS, "too many arguments for an ErrorMessage");
+        const fmt::string_view format = s;
+        m_payload->format = std::string_view(format.data(), format.size());
+        if constexpr (sizeof...(Args) == 1 && (std::is_same_v<std::remove_cvref_t<Args>, ErrorMessage> && ...)) {
+            // passing on another message as is, as in Error("{}", err.error)
+            if (m_payload->format == "{}") {
+                ((*m_payload = *args.m_payload), ...);
+                return;
+            }
+        }
+        (store(args), ...);
+    }
+
+    ErrorMessage(const ErrorMessage& other)
+        : m_payload(other.m_payload ? std::make_unique<Payload>(*other.m_payload) : nullptr) { }
+    ErrorMessage(ErrorMessage&&) noexcept = default;
+    ErrorMessage& operator=(const ErrorMessage& other) {
+        if (this != &other) {
+            m_payload = other.m_payload ? std::make_unique<Payload>(*other.m_payload) : nullptr;
+        }
+        return *this;
+    }
+    ErrorMessage& operator=(ErrorMessage&&) noexcept = default;
+
+    /// True if this is the message of "success".
+    bool empty() const { return !m_payload; }
+    /// The format string the message was created with, or "" if empty().
+    std::string_view code() const { return m_payload ? m_payload->format : std::string_view {}; }
+    /// Formats the message. "Success" if empty().
+    std::string str() const;
+    operator std::string() const { return str(); }
+
+private:
+    enum class ArgKind : uint8_t {
+        Int,
+        UInt,
+        Double,
+        Bool,
+        Char,
+        /// offset << 32 | size in Payload::strings
+        String,
+    };
+
+    struct Payload {
+        std::string_view format {};
+        uint8_t count { 0 };
+        ArgKind kinds[MAX_ARGS] {};
+        uint64_t values[MAX_ARGS] {};
+        std::string strings {};
+    };
+
+    template<typename T>
+    void store(const T& arg) {
+        using U = std::remove_cvref_t<T>;
+        if constexpr (std::is_same_v<U, ErrorMessage>) {
+            store_string(arg.str());
+        } else if constexpr (std::is_same_v<U, bool>) {
+            store_value(ArgKind::Bool, arg ? 1 : 0);
+        } else if constexpr (std::is_same_v<U, char>) {
+            store_value(ArgKind::Char, uint8_t(arg));
+        } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+            store_value(ArgKind::Int, uint64_t(int64_t(arg)));
+        } else if constexpr (std::is_integral_v<U>) {
+            store_value(ArgKind::UInt, uint64_t(arg));
+        } else if constexpr (std::is_floating_point_v<U>) {
+            store_value(ArgKind::Double, std::bit_cast<uint64_t>(double(arg)));
+        } else if constexpr (std::is_convertible_v<const U&, std::string_view>) {
+            store_string(std::string_view(arg));
+        } else {
+            store_string(fmt::format("{}", arg));
+        }
+    }
+
+    void store_value(ArgKind kind, uint64_t value) {
+        m_payload->kinds[m_payload->count] = kind;
+        m_payload->values[m_payload->count] = value;
+        ++m_payload->count;
+    }
+
+    void store_string(std::string_view str) {
+        store_value(ArgKind::String, uint64_t(m_payload->strings.size()) << 32 | uint64_t(str.size()));
+        m_payload->strings.append(str);
+    }
+
+    std::unique_ptr<Payload> m_payload {};
+};
+
+template<>
+struct fmt::formatter<ErrorMessage> {
+    constexpr auto parse(fmt::format_parse_context& ctx) { return ctx.begin(); }
+
+    template<typename FormatContext>
+    auto format(const ErrorMessage& message, FormatContext& ctx) const {
+        const auto str = message.str();
+        return std::copy(str.begin(), str.end(), ctx.out());
+    }
+};
 
 /// The Error class represents an error or the absence of an
 /// error. It behaves like a bool, depending on context.
@@ -40,7 +164,8 @@ struct Error {
     /// Constructs a "non-error" / empty error, which is not considered
     /// to be an error. Use this as the "no error occurred" return value.
     Error() = default;
-    /// Constructs an error with a message. Accepts fmt::format() arguments.
+    /// Constructs an error with a message. Accepts fmt::format() arguments,
+    /// which are only formatted when the message is displayed.
     ///
     /// Example:
     ///
@@ -52,40 +177,121 @@ struct Error {
     /// \endcode
     template<typename... Args>
     Error(fmt::format_string<Args...> s, Args&&... args)
-        : is_error(true)
-        , error(fmt::format(s, std::forward<Args>(args)...)) { }
+        : error(s, std::forward<Args>(args)...) { }
 
-    /// Whether this error represents an error (true) or success (false).
-    /// Use operator bool() instead of reading this if possible.
-    bool is_error { false };
-    /// The error message. Is a valid string even if is_error is false, but will
-    /// be "Success".
-    std::string error { "Success" };
+    /// The error message. Empty if this isn't an error, and displayed as
+    /// "Success" then.
+    ErrorMessage error {};
 
     /// Implicit conversion to boolean.
     /// True if this Error contains an error, false if not.
-    operator bool() const { return is_error; }
+    operator bool() const { return !error.empty(); }
 };
 
-// TODO: Add docs
-
+/// Either a value or an error message, like Error. Converts to true if it
+/// holds a value. The value is stored in place, and only exists if there's no
+/// error.
+///
+/// \code{.cpp}
+/// Result<int> parse_digit(char c) {
+///     if (c < '0' || c > '9') {
+///         return { "'{}' is not a digit", c };
+///     }
+///     return c - '0';
+/// }
+/// \endcode
 template<typename T>
-struct Result {
+class Result {
+public:
     template<typename... Args>
     Result(fmt::format_string<Args...> s, Args&&... args)
-        : is_error(true)
-        , error(fmt::format(s, std::forward<Args>(args)...)) { }
+        : error(s, std::forward<Args>(args)...) { }
 
     Result(T&& value)
-        : result(std::move(value)) {
+        : m_has_value(true) {
+        new (&m_value) T(std::move(value));
     }
 
-    operator bool() const { return !is_error; }
+    Result(const Result& other)
+        : error(other.error)
+        , m_has_value(other.m_has_value) {
+        if (m_has_value) {
+            new (&m_value) T(other.m_value);
+        }
+    }
+
+    Result(Result&& other) noexcept(std::is_nothrow_move_constructible_v<T>)
+        : error(std::move(other.error))
+        , m_has_value(other.m_has_value) {
+        if (m_has_value) {
+            new (&m_value) T(std::move(other.m_value));
+        }
+    }
 
-    T&& move() { return std::move(result.value()); }
-    const T& value() const { return result.value(); }
+    Result& operator=(const Result& other) {
+        if (this != &other) {
+            // copied first, so that nothing has changed if it throws
+            auto message = other.error;
+            assign(other.m_has_value, other.m_value);
+            error = std::move(message);
+        }
+        return *this;
+    }
+
+    Result& operator=(Result&& other) noexcept(std::is_nothrow_move_constructible_v<T> && std::is_nothrow_move_assignable_v<T>) {
+        if (this != &other) {
+            assign(other.m_has_value, std::move(other.m_value));
+            error = std::move(other.error);
+        }
+        return *this;
+    }
+
+    ~Result() {
+        if (m_has_value) {
+            m_value.~T();
+        }
+    }
+
+    operator bool() const { return m_has_value && error.empty(); }
+
+    /// The value. Throws std::logic_error if this failed without one, so
+    /// check the Result first.
+    T&& move() {
+        check_has_value();
+        return std::move(m_value);
+    }
+    const T& value() const {
+        check_has_value();
+        return m_value;
+    }
+
+    /// The error message, empty if this holds a value. Assigning a message
+    /// makes this a failed Result, which still destroys the value it held.
+    ErrorMessage error {};
+
+private:
+    void check_has_value() const {
+        if (!m_has_value) {
+            throw std::logic_error(fmt::format("Result without a value accessed, its error is: {}", error));
+        }
+    }
+
+    /// Takes the value of another Result, which has one if `has_value`.
+    template<typename U>
+    void assign(bool has_value, U&& value) {
+        if (m_has_value && has_value) {
+            m_value = std::forward<U>(value);
+        } else if (has_value) {
+            new (&m_value) T(std::forward<U>(value));
+            m_has_value = true;
+        } else if (m_has_value) {
+            m_value.~T();
+            m_has_value = false;
+        }
+    }
 
-    std::optional<T> result { std::nullopt };
-    bool is_error { false };
-    std::string error { "Success" };
+    bool m_has_value { false };
+    union {
+        T m_value;
+    };
 };
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "instruction.h"
+#include <cassert>
+#include <cstdint>
+
+enum class FoldOutcome {
+    Folded,
+    /// The result doesn't fit into 64 bits, and is the wrapped result instead.
+    Overflow,
+    /// Can't be computed, as the hardware division traps.
+    DivisionByZero,
+    DivisionOverflow,
+};
+
+/// Computes `a op b` for `add`, `sub`, `mul`, `div` and `mod` without
+/// undefined behavior. Constant folding in optimize_peephole() and in embed.h.
+constexpr FoldOutcome fold_binary(Op op, int64_t a, int64_t b, int64_t& result) {
+    switch (op) {
+    case ADD:
+        return __builtin_add_overflow(a, b, &result) ? FoldOutcome::Overflow : FoldOutcome::Folded;
+    case SUB:
+        return __builtin_sub_overflow(a, b, &result) ? FoldOutcome::Overflow : FoldOutcome::Folded;
+    case MUL:
+        return __builtin_mul_overflow(a, b, &result) ? FoldOutcome::Overflow : FoldOutcome::Folded;
+    case DIV:
+    case MOD:
+        if (b == 0) {
+            return FoldOutcome::DivisionByZero;
+        }
+        // traps on x86 for `mod` too
+        if (a == INT64_MIN && b == -1) {
+            return FoldOutcome::DivisionOverflow;
+        }
+        result = op == DIV ? a / b : a % b;
+        return FoldOutcome::Folded;
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case INC:
+    case DEC:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case PUSH:
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+    case RET:
+        break;
+    }
+    assert(!bool("unreachable code"));
+    return FoldOutcome::DivisionByZero;
+}
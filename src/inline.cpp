@@ -0,0 +1,302 @@
+#include "cfg.h"
+#include "compiler.h"
+#include "instruction.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/// Subroutines of up to this many instructions are inlined at every call, as
+/// the copy is hardly larger than the call.
+static constexpr size_t MAX_INLINED_INSTRS = 8;
+/// Calls inside loops run often, so larger subroutines are inlined there.
+static constexpr size_t MAX_HOT_INLINED_INSTRS = 64;
+/// Calls in an inlined copy are inlined too, up to this depth.
+static constexpr size_t MAX_INLINE_DEPTH = 4;
+
+namespace {
+
+/// The blocks a subroutine runs through until it returns.
+struct Subroutine {
+    std::string label;
+    /// Sorted, so that a block which falls through is copied right before the
+    /// block it falls into.
+    std::vector<size_t> blocks {};
+    /// Labels which the jumps in these blocks go to. The copies leave out the
+    /// others, so that they don't split the code around the call into blocks.
+    std::unordered_set<std::string> jump_targets {};
+    /// Index of the last instruction of the last block, if it's a `ret`,
+    /// which a copy drops instead of jumping over nothing.
+    size_t final_ret { SIZE_MAX };
+    size_t instrs { 0 };
+    /// Whether the last block runs off the end of the program, which halts it.
+    bool runs_off_end { false };
+};
+
+class Inliner {
+public:
+    Inliner(const AbstractInstrStream& abstracts, const Cfg& cfg)
+        : m_abstracts(abstracts)
+        , m_cfg(cfg)
+        , m_in_loop(abstracts.size(), false) {
+        for (const auto& loop : find_natural_loops(cfg)) {
+            for (auto b : loop.blocks) {
+                std::fill(m_in_loop.begin() + long(cfg.blocks[b].begin), m_in_loop.begin() + long(cfg.blocks[b].end), true);
+            }
+        }
+    }
+
+    /// The program with calls inlined.
+    AbstractInstrStream run();
+
+    bool inlined_any() const;
+
+    std::vector<InlineReport> reports() const;
+
+private:
+    size_t subroutine(const std::string& label);
+    bool should_inline(size_t call, size_t sub, bool hot) const;
+    void emit_copy(size_t sub, const SourceLocation& location, bool hot);
+
+    const AbstractInstrStream& m_abstracts;
+    const Cfg& m_cfg;
+    std::vector<bool> m_in_loop;
+    std::vector<Subroutine> m_subs {};
+    std::unordered_map<std::string, size_t> m_sub_index {};
+    std::vector<size_t> m_inlined {};
+    std::vector<size_t> m_kept {};
+    /// The subroutines whose copies are being emitted, outermost first.
+    std::vector<size_t> m_expanding {};
+    AbstractInstrStream m_result {};
+    size_t m_copies { 0 };
+};
+
+}
+
+/// Follows the control flow from the label's block, without going into the
+/// subroutines it calls and without following `ret`.
+size_t Inliner::subroutine(const std::string& label) {
+    auto [it, inserted] = m_sub_index.try_emplace(label, m_subs.size());
+    if (!inserted) {
+        return it->second;
+    }
+    Subroutine sub { .label = label };
+    const auto& blocks = m_cfg.blocks;
+    std::vector<bool> seen(blocks.size(), false);
+    std::vector<size_t> work { m_cfg.label_blocks.at(label) };
+    seen[work.back()] = true;
+    while (!work.empty()) {
+        const auto b = work.back();
+        work.pop_back();
+        sub.blocks.push_back(b);
+        Op last = NOT_AN_INSTRUCTION;
+        for (size_t i = blocks[b].begin; i < blocks[b].end; ++i) {
+            const auto& abstract = m_abstracts[i];
+            if (abstract.instr.s.op == NOT_AN_INSTRUCTION) {
+                continue;
+            }
+            last = abstract.instr.s.op;
+            ++sub.instrs;
+            if (last != CALL && abstract.unresolved_label.has_value()) {
+                sub.jump_targets.insert(abstract.unresolved_label.value());
+            }
+        }
+        const bool has_next = b + 1 < blocks.size();
+        if (!has_next && last != HALT && last != JMP && last != RET) {
+            sub.runs_off_end = true;
+        }
+        if (last == RET) {
+            continue;
+        }
+        for (auto succ : blocks[b].succs) {
+            // a call continues after the call once the subroutine returns
+            if (last == CALL && succ != b + 1) {
+                continue;
+            }
+            if (!seen[succ]) {
+                seen[succ] = true;
+                work.push_back(succ);
+            }
+        }
+    }
+    std::sort(sub.blocks.begin(), sub.blocks.end());
+    const auto& final_block = blocks[sub.blocks.back()];
+    for (size_t i = final_block.end; i > final_block.begin; --i) {
+        if (m_abstracts[i - 1].instr.s.op != NOT_AN_INSTRUCTION) {
+            if (m_abstracts[i - 1].instr.s.op == RET) {
+                sub.final_ret = i - 1;
+            }
+            break;
+        }
+    }
+    m_subs.push_back(std::move(sub));
+    m_inlined.push_back(0);
+    m_kept.push_back(0);
+    return it->second;
+}
+
+bool Inliner::should_inline(size_t call, size_t sub, bool hot) const {
+    const auto& subroutine = m_subs[sub];
+    if (subroutine.instrs > (hot ? MAX_HOT_INLINED_INSTRS : MAX_INLINED_INSTRS)) {
+        return false;
+    }
+    // recursion stays a call
+    if (m_expanding.size() >= MAX_INLINE_DEPTH || std::find(m_expanding.begin(), m_expanding.end(), sub) != m_expanding.end()) {
+        return false;
+    }
+    const auto& blocks = m_cfg.blocks;
+    return !std::any_of(subroutine.blocks.begin(), subroutine.blocks.end(), [&](size_t b) {
+        return call >= blocks[b].begin && call < blocks[b].end;
+    });
+}
+
+/// Emits a copy of the subroutine in place of a call, where each `ret` jumps
+/// to after the copy, and its labels are renamed. Calls in it which are worth
+/// inlining too are replaced by another copy.
+void Inliner::emit_copy(size_t sub, const SourceLocation& location, bool hot) {
+    m_expanding.push_back(sub);
+    const auto prefix = fmt::format("__inline_{}", m_copies++);
+    bool returns = false;
+    for (auto b : m_subs[sub].blocks) {
+        for (size_t i = m_cfg.blocks[b].begin; i < m_cfg.blocks[b].end; ++i) {
+            auto copy = m_abstracts[i];
+            const auto op = copy.instr.s.op;
+            if (op == CALL) {
+                const auto callee = subroutine(copy.unresolved_label.value());
+                if (should_inline(i, callee, hot)) {
+                    ++m_inlined[callee];
+                    emit_copy(callee, copy.location, hot);
+                } else {
+                    ++m_kept[callee];
+                    m_result.push_back(std::move(copy));
+                }
+                continue;
+            }
+            if (op == NOT_AN_INSTRUCTION && !m_subs[sub].jump_targets.contains(copy.unresolved_label.value())) {
+                continue;
+            }
+            if (op == RET) {
+                if (i == m_subs[sub].final_ret) {
+                    continue;
+                }
+                copy.instr.s.op = JMP;
+                copy.unresolved_label = prefix;
+                returns = true;
+            } else if (copy.unresolved_label.has_value()) {
+                // jumps only go to blocks of the subroutine, which are copied too
+                copy.unresolved_label = fmt::format("{}_{}", prefix, copy.unresolved_label.value());
+            }
+            m_result.push_back(std::move(copy));
+        }
+    }
+    if (m_subs[sub].runs_off_end) {
+        m_result.push_back(AbstractInstr { .instr = { .s = { .op = HALT, .val = 0 } }, .location = location, .unresolved_symbol = std::nullopt, .unresolved_label = std::nullopt });
+    }
+    if (returns) {
+        m_result.push_back(AbstractInstr { .instr = { .s = { .op = NOT_AN_INSTRUCTION, .val = 0 } }, .location = location, .unresolved_symbol = std::nullopt, .unresolved_label = prefix });
+    }
+    m_expanding.pop_back();
+}
+
+AbstractInstrStream Inliner::run() {
+    m_result.reserve(m_abstracts.size());
+    for (size_t i = 0; i < m_abstracts.size(); ++i) {
+        const auto& abstract = m_abstracts[i];
+        if (abstract.instr.s.op == CALL) {
+            const auto sub = subroutine(abstract.unresolved_label.value());
+            if (should_inline(i, sub, m_in_loop[i])) {
+                ++m_inlined[sub];
+                emit_copy(sub, abstract.location, m_in_loop[i]);
+                continue;
+            }
+            ++m_kept[sub];
+        }
+        m_result.push_back(abstract);
+    }
+    return std::move(m_result);
+}
+
+bool Inliner::inlined_any() const {
+    return std::any_of(m_inlined.begin(), m_inlined.end(), [](size_t n) { return n > 0; });
+}
+
+std::vector<InlineReport> Inliner::reports() const {
+    std::vector<InlineReport> reports;
+    for (size_t sub = 0; sub < m_subs.size(); ++sub) {
+        reports.push_back({
+            .label = m_subs[sub].label,
+            .instrs = m_subs[sub].instrs,
+            .inlined_calls = m_inlined[sub],
+            .kept_calls = m_kept[sub],
+            .removed = false,
+        });
+    }
+    return reports;
+}
+
+/// Removes the blocks which can't be reached from the entry, like the
+/// originals of subroutines whose calls were all inlined. Jumps to them can
+/// only come from blocks which are removed too. Returns the labels which were
+/// removed.
+static std::unordered_set<std::string> remove_dead_blocks(AbstractInstrStream& abstracts) {
+    auto cfg_res = build_cfg(abstracts);
+    if (!cfg_res || abstracts.empty()) {
+        return {};
+    }
+    const auto& cfg = cfg_res.value();
+    std::vector<bool> reachable(cfg.blocks.size(), false);
+    std::vector<size_t> work { 0 };
+    reachable[0] = true;
+    while (!work.empty()) {
+        const auto b = work.back();
+        work.pop_back();
+        for (auto succ : cfg.blocks[b].succs) {
+            if (!reachable[succ]) {
+                reachable[succ] = true;
+                work.push_back(succ);
+            }
+        }
+    }
+    std::unordered_set<std::string> removed_labels;
+    std::vector<bool> remove(abstracts.size(), false);
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        const auto& block = cfg.blocks[b];
+        if (reachable[b]) {
+            continue;
+        }
+        for (size_t i = block.begin; i < block.end; ++i) {
+            remove[i] = true;
+            if (abstracts[i].instr.s.op == NOT_AN_INSTRUCTION) {
+                removed_labels.insert(abstracts[i].unresolved_label.value());
+            }
+        }
+    }
+    remove_marked(abstracts, remove);
+    return removed_labels;
+}
+
+Error optimize_inline(AbstractInstrStream& abstracts, std::vector<InlineReport>* reports) {
+    const bool has_calls = std::any_of(abstracts.begin(), abstracts.end(), [](const AbstractInstr& abstract) {
+        return abstract.instr.s.op == CALL;
+    });
+    if (!has_calls) {
+        return {};
+    }
+    auto cfg_res = build_cfg(abstracts);
+    if (!cfg_res) {
+        // not an error, there's just nothing we can do for this program
+        return {};
+    }
+    Inliner inliner(abstracts, cfg_res.value());
+    abstracts = inliner.run();
+    auto found = inliner.reports();
+    const auto removed = inliner.inlined_any() ? remove_dead_blocks(abstracts) : std::unordered_set<std::string> {};
+    if (reports) {
+        for (auto& report : found) {
+            report.removed = removed.contains(report.label);
+        }
+        *reports = std::move(found);
+    }
+    return {};
+}
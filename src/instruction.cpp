@@ -1,141 +1,77 @@
 #include "instruction.h"
 
-#include <unordered_map>
+bool op_requires_str_argument(Op op) {
+    if (op < PUSH && op > OVER) {
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool op_is_conditional_jump(Op op) {
+    return op_accepts_label_argument(op) && op != JMP && op != CALL;
+}
 
-std::string_view to_string(Op op) {
+Op invert_condition(Op op) {
     switch (op) {
+    case JE:
+        return JN;
+    case JN:
+        return JE;
+    case JG:
+        return JLE;
+    case JLE:
+        return JG;
+    case JL:
+        return JGE;
+    case JGE:
+        return JL;
+    case JZ:
+        return JNZ;
+    case JNZ:
+        return JZ;
+    case INCJE:
+        return INCJN;
+    case INCJN:
+        return INCJE;
+    case INCJG:
+        return INCJLE;
+    case INCJLE:
+        return INCJG;
+    case INCJL:
+        return INCJGE;
+    case INCJGE:
+        return INCJL;
+    case MODJZ:
+        return MODJNZ;
+    case MODJNZ:
+        return MODJZ;
     case NOT_AN_INSTRUCTION:
-        return "not_an_instruction";
-    case PUSH:
-        return "push";
     case POP:
-        return "pop";
     case ADD:
-        return "add";
     case INC:
-        return "inc";
     case DEC:
-        return "dec";
     case SUB:
-        return "sub";
     case MUL:
-        return "mul";
     case DIV:
-        return "div";
     case MOD:
-        return "mod";
     case PRINT:
-        return "print";
     case HALT:
-        return "halt";
     case DUP:
-        return "dup";
     case DUP2:
-        return "dup2";
     case SWAP:
-        return "swap";
     case CLEAR:
-        return "clear";
     case OVER:
-        return "over";
-    case JE:
-        return "je";
-    case JN:
-        return "jn";
-    case JG:
-        return "jg";
-    case JL:
-        return "jl";
-    case JGE:
-        return "jge";
-    case JLE:
-        return "jle";
+    case PUSH:
     case JMP:
-        return "jmp";
-    case JZ:
-        return "jz";
-    case JNZ:
-        return "jnz";
-    }
-    return "not_an_instruction";
-}
-
-Op op_from_string(const std::string& str) {
-    if (str == "push") {
-        return PUSH;
-    } else if (str == "pop") {
-        return POP;
-    } else if (str == "add") {
-        return ADD;
-    } else if (str == "inc") {
-        return INC;
-    } else if (str == "dec") {
-        return DEC;
-    } else if (str == "sub") {
-        return SUB;
-    } else if (str == "mul") {
-        return MUL;
-    } else if (str == "div") {
-        return DIV;
-    } else if (str == "mod") {
-        return MOD;
-    } else if (str == "print") {
-        return PRINT;
-    } else if (str == "halt") {
-        return HALT;
-    } else if (str == "dup") {
-        return DUP;
-    } else if (str == "dup2") {
-        return DUP2;
-    } else if (str == "swap") {
-        return SWAP;
-    } else if (str == "clear") {
-        return CLEAR;
-    } else if (str == "over") {
-        return OVER;
-    } else if (str == "je") {
-        return JE;
-    } else if (str == "jn") {
-        return JN;
-    } else if (str == "jg") {
-        return JG;
-    } else if (str == "jl") {
-        return JL;
-    } else if (str == "jge") {
-        return JGE;
-    } else if (str == "jle") {
-        return JLE;
-    } else if (str == "jmp") {
-        return JMP;
-    } else if (str == "jz") {
-        return JZ;
-    } else if (str == "jnz") {
-        return JNZ;
-    } else {
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case CALL:
+    case RET:
         return NOT_AN_INSTRUCTION;
     }
+    return NOT_AN_INSTRUCTION;
 }
 
-bool op_requires_i64_argument(Op op) {
-    if (op < PUSH) {
-        return false;
-    } else {
-        return true;
-    }
-}
-
-bool op_requires_str_argument(Op op) {
-    if (op < PUSH && op > OVER) {
-        return true;
-    } else {
-        return false;
-    }
-}
-
-bool op_accepts_label_argument(Op op) {
-    if (op >= JE) {
-        return true;
-    } else {
-        return false;
-    }
-}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <string_view>
+#include <utility>
 
 enum Op : uint8_t {
     NOT_AN_INSTRUCTION = 0x00, // is label or invalid instruction
@@ -41,13 +44,374 @@ enum Op : uint8_t {
     // special
     JZ,
     JNZ,
+
+    // Appended after the jumps, so that the bytecode of all instructions
+    // above stays the same. Use the op_* functions instead of comparing ops.
+
+    // with argument
+    DIVP2, // divide by 2^val
+    MODP2, // modulo 2^val
+    DIVC, // divide by the constant val
+    MODC, // modulo the constant val
+
+    // fused loop instructions, with label argument
+    INCJE, // inc; dup2; je
+    INCJN, // inc; dup2; jn
+    INCJG, // inc; dup2; jg
+    INCJL, // inc; dup2; jl
+    INCJGE, // inc; dup2; jge
+    INCJLE, // inc; dup2; jle
+    MODJZ, // dup2; mod; jz
+    MODJNZ, // dup2; mod; jnz
+
+    // subroutines
+    CALL, // with label argument, pushes the return address
+    RET,
 };
 
-std::string_view to_string(Op op);
-Op op_from_string(const std::string& str);
-bool op_requires_i64_argument(Op op);
+constexpr bool op_requires_i64_argument(Op op);
 bool op_requires_str_argument(Op op);
-bool op_accepts_label_argument(Op op);
+constexpr bool op_accepts_label_argument(Op op);
+/// Whether the op is a jump which may or may not be taken. `call` isn't one.
+bool op_is_conditional_jump(Op op);
+/// The conditional jump which jumps exactly when `op` doesn't, or
+/// NOT_AN_INSTRUCTION if op isn't a conditional jump.
+Op invert_condition(Op op);
+
+constexpr bool op_accepts_label_argument(Op op) {
+    switch (op) {
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+        return true;
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case ADD:
+    case INC:
+    case DEC:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case PUSH:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case RET:
+        return false;
+    }
+    return false;
+}
+
+constexpr bool op_requires_i64_argument(Op op) {
+    switch (op) {
+    case PUSH:
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+        return true;
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case ADD:
+    case INC:
+    case DEC:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case RET:
+        return false;
+    }
+    return false;
+}
+
+// constexpr, so that embed.h can look up mnemonics at C++ compile time
+
+constexpr std::string_view to_string(Op op) {
+    switch (op) {
+    case NOT_AN_INSTRUCTION:
+        return "not_an_instruction";
+    case PUSH:
+        return "push";
+    case POP:
+        return "pop";
+    case ADD:
+        return "add";
+    case INC:
+        return "inc";
+    case DEC:
+        return "dec";
+    case SUB:
+        return "sub";
+    case MUL:
+        return "mul";
+    case DIV:
+        return "div";
+    case MOD:
+        return "mod";
+    case PRINT:
+        return "print";
+    case HALT:
+        return "halt";
+    case DUP:
+        return "dup";
+    case DUP2:
+        return "dup2";
+    case SWAP:
+        return "swap";
+    case CLEAR:
+        return "clear";
+    case OVER:
+        return "over";
+    case JE:
+        return "je";
+    case JN:
+        return "jn";
+    case JG:
+        return "jg";
+    case JL:
+        return "jl";
+    case JGE:
+        return "jge";
+    case JLE:
+        return "jle";
+    case JMP:
+        return "jmp";
+    case JZ:
+        return "jz";
+    case JNZ:
+        return "jnz";
+    case DIVP2:
+        return "divp2";
+    case MODP2:
+        return "modp2";
+    case DIVC:
+        return "divc";
+    case MODC:
+        return "modc";
+    case INCJE:
+        return "incje";
+    case INCJN:
+        return "incjn";
+    case INCJG:
+        return "incjg";
+    case INCJL:
+        return "incjl";
+    case INCJGE:
+        return "incjge";
+    case INCJLE:
+        return "incjle";
+    case MODJZ:
+        return "modjz";
+    case MODJNZ:
+        return "modjnz";
+    case CALL:
+        return "call";
+    case RET:
+        return "ret";
+    }
+    return "not_an_instruction";
+}
+
+/// All mnemonics, for op_from_string().
+inline constexpr std::pair<std::string_view, Op> MNEMONICS[] = {
+    { "push", PUSH },
+    { "pop", POP },
+    { "add", ADD },
+    { "inc", INC },
+    { "dec", DEC },
+    { "sub", SUB },
+    { "mul", MUL },
+    { "div", DIV },
+    { "mod", MOD },
+    { "print", PRINT },
+    { "halt", HALT },
+    { "dup", DUP },
+    { "dup2", DUP2 },
+    { "swap", SWAP },
+    { "clear", CLEAR },
+    { "over", OVER },
+    { "je", JE },
+    { "jn", JN },
+    { "jg", JG },
+    { "jl", JL },
+    { "jge", JGE },
+    { "jle", JLE },
+    { "jmp", JMP },
+    { "jz", JZ },
+    { "jnz", JNZ },
+    { "divp2", DIVP2 },
+    { "modp2", MODP2 },
+    { "divc", DIVC },
+    { "modc", MODC },
+    { "incje", INCJE },
+    { "incjn", INCJN },
+    { "incjg", INCJG },
+    { "incjl", INCJL },
+    { "incjge", INCJGE },
+    { "incjle", INCJLE },
+    { "modjz", MODJZ },
+    { "modjnz", MODJNZ },
+    { "call", CALL },
+    { "ret", RET },
+};
+
+inline constexpr size_t MNEMONIC_SLOTS = 256;
+
+constexpr uint32_t mnemonic_hash(std::string_view str, uint32_t seed) {
+    // FNV-1a, with the seed as offset basis
+    uint32_t hash = seed;
+    for (char c : str) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    return hash % MNEMONIC_SLOTS;
+}
+
+/// A perfect hash of the mnemonics, found at compile time: the first seed for
+/// which no two mnemonics hash to the same slot, and the slots it results in.
+struct MnemonicTable {
+    uint32_t seed;
+    std::array<Op, MNEMONIC_SLOTS> slots;
+};
+
+inline constexpr MnemonicTable MNEMONIC_TABLE = [] {
+    for (uint32_t seed = 2166136261u;; ++seed) {
+        MnemonicTable table { seed, {} };
+        bool collision = false;
+        for (const auto& [name, op] : MNEMONICS) {
+            auto& slot = table.slots[mnemonic_hash(name, seed)];
+            if (slot != NOT_AN_INSTRUCTION) {
+                collision = true;
+                break;
+            }
+            slot = op;
+        }
+        if (!collision) {
+            return table;
+        }
+    }
+}();
+
+constexpr Op op_from_string(std::string_view str) {
+    const auto op = MNEMONIC_TABLE.slots[mnemonic_hash(str, MNEMONIC_TABLE.seed)];
+    // the slot may hold a different mnemonic with the same hash
+    if (op == NOT_AN_INSTRUCTION || to_string(op) != str) {
+        return NOT_AN_INSTRUCTION;
+    }
+    return op;
+}
+
+/// How an op changes the stack: it needs `pops` values on the stack, and
+/// leaves `pushes` values in their place. For example, `dup` is 1 -> 2.
+/// `clear` is the only op which can't be described like this, and is 0 -> 0.
+struct StackEffect {
+    uint8_t pops;
+    uint8_t pushes;
+};
+constexpr StackEffect op_stack_effect(Op op) {
+    switch (op) {
+    case NOT_AN_INSTRUCTION:
+    case HALT:
+    case CLEAR:
+    case JMP:
+    case CALL:
+    case RET:
+        return { 0, 0 };
+    case POP:
+    case PRINT:
+    case JZ:
+    case JNZ:
+        return { 1, 0 };
+    case PUSH:
+        return { 0, 1 };
+    case INC:
+    case DEC:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+        return { 1, 1 };
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+        return { 2, 1 };
+    case DUP:
+        return { 1, 2 };
+    case DUP2:
+        return { 2, 4 };
+    case SWAP:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+        return { 2, 2 };
+    case OVER:
+        return { 2, 3 };
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+        return { 2, 0 };
+    }
+    return { 0, 0 };
+}
 
 union Instr {
     struct {
@@ -57,3 +421,14 @@ union Instr {
     uint64_t v;
 };
 static_assert(sizeof(Instr) == sizeof(uint64_t));
+
+/// Range of Instr::s.val.
+constexpr int64_t INSTR_VAL_MIN = -(int64_t(1) << 55);
+constexpr int64_t INSTR_VAL_MAX = (int64_t(1) << 55) - 1;
+
+/// Sets Instr::s.val, keeping the low 56 bits of `val` like a plain
+/// assignment would. Masked explicitly, so that -Wconversion can tell that
+/// nothing else is lost; callers check INSTR_VAL_MIN/MAX where it matters.
+constexpr void set_instr_val(Instr& instr, int64_t val) {
+    instr.s.val = (val & (INSTR_VAL_MAX + 1)) != 0 ? (val & INSTR_VAL_MAX) + INSTR_VAL_MIN : val & INSTR_VAL_MAX;
+}
@@ -1,18 +1,131 @@
 #include "interpreter.h"
 #include "instruction.h"
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
 
-static inline void push(Stack& stack, int64_t value) {
-    // This is the only stack check we leave in release builds,
-    // because this is easily reached with *valid* code.
-    if (stack.stack_top + 1 >= stack.stack.size()) [[unlikely]] {
-        fmt::print("FATAL: Stack check failed, tried to push onto full stack.\n");
-        std::abort();
+Result<Stack> Stack::create(size_t size, const Placement& placement) {
+    if (size == 0) {
+        size = DEFAULT_STACK_SIZE;
+    }
+    const auto page_size = size_t(sysconf(_SC_PAGESIZE));
+    if (size > (SIZE_MAX - 2 * page_size) / sizeof(int64_t)) {
+        return { "Stack size of {} values is too large.", size };
+    }
+    const auto data_size = (size * sizeof(int64_t) + page_size - 1) / page_size * page_size;
+    const auto mapping_size = data_size + page_size;
+    void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return { "Failed to map a stack of {} values: {}", size, std::strerror(errno) };
+    }
+    auto* guard = static_cast<char*>(mapping) + data_size;
+    if (mprotect(guard, page_size, PROT_NONE) != 0) {
+        munmap(mapping, mapping_size);
+        return { "Failed to protect the stack guard page: {}", std::strerror(errno) };
     }
+    if (placement.prefault) {
+        prefault(mapping, data_size);
+    }
+    Stack stack;
+    // the last slot sits right below the guard page
+    stack.stack = reinterpret_cast<int64_t*>(guard) - size;
+    stack.size = size;
+    stack.mapping = mapping;
+    stack.mapping_size = mapping_size;
+    return stack;
+}
+
+Stack::Stack(Stack&& other) noexcept
+    : stack(std::exchange(other.stack, nullptr))
+    , size(std::exchange(other.size, 0))
+    , stack_top(std::exchange(other.stack_top, 0))
+    , mapping(std::exchange(other.mapping, nullptr))
+    , mapping_size(std::exchange(other.mapping_size, 0)) {
+}
+
+Stack& Stack::operator=(Stack&& other) noexcept {
+    if (this != &other) {
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+        stack = std::exchange(other.stack, nullptr);
+        size = std::exchange(other.size, 0);
+        stack_top = std::exchange(other.stack_top, 0);
+        mapping = std::exchange(other.mapping, nullptr);
+        mapping_size = std::exchange(other.mapping_size, 0);
+    }
+    return *this;
+}
+
+Stack::~Stack() {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+/// The guard page of the stack which the current thread is running on, and
+/// where to go if it's hit.
+struct StackGuard {
+    uintptr_t begin;
+    uintptr_t end;
+    sigjmp_buf on_overflow;
+};
+
+static thread_local StackGuard* t_stack_guard = nullptr;
+static struct sigaction s_previous_segv_action {};
+
+static void on_segv(int sig, siginfo_t* info, void* ucontext) {
+    auto* guard = t_stack_guard;
+    auto addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    if (guard && addr >= guard->begin && addr < guard->end) {
+        siglongjmp(guard->on_overflow, 1);
+    }
+    // not a stack overflow, so hand it to whoever was there before us
+    if (s_previous_segv_action.sa_flags & SA_SIGINFO) {
+        s_previous_segv_action.sa_sigaction(sig, info, ucontext);
+    } else if (s_previous_segv_action.sa_handler != SIG_DFL && s_previous_segv_action.sa_handler != SIG_IGN) {
+        s_previous_segv_action.sa_handler(sig);
+    } else {
+        // returning re-executes the faulting instruction, which then crashes as usual
+        sigaction(SIGSEGV, &s_previous_segv_action, nullptr);
+    }
+}
+
+static void install_segv_handler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        struct sigaction action {};
+        action.sa_sigaction = on_segv;
+        // SA_NODEFER, so that SIGSEGV isn't left blocked after jumping out of the handler
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &s_previous_segv_action);
+    });
+}
+
+/// Working copy of a Stack's pointer and top, used by the interpreter loop.
+/// As a local, it can live in registers instead of being reloaded after every
+/// store to the stack memory. Written back whenever the loop is left.
+struct StackRegs {
+    int64_t* stack;
+    size_t stack_top;
+};
+
+static inline void push(StackRegs& stack, int64_t value) {
+    // No bounds check here: pushing onto a full stack hits the guard page.
     stack.stack[stack.stack_top] = value;
     ++stack.stack_top;
 }
 
-static inline int64_t pop(Stack& stack) {
+static inline int64_t pop(StackRegs& stack) {
 #ifdef _DEBUG
     if (stack.stack_top == 0) {
         fmt::print("FATAL: Stack check failed, tried to pop from empty stack.\n");
@@ -22,7 +135,7 @@ static inline int64_t pop(Stack& stack) {
     return stack.stack[--stack.stack_top];
 }
 
-static inline void pop_ignore(Stack& stack) {
+static inline void pop_ignore(StackRegs& stack) {
 #ifdef _DEBUG
     if (stack.stack_top == 0) {
         fmt::print("FATAL: Stack check failed, tried to pop from empty stack.\n");
@@ -32,7 +145,7 @@ static inline void pop_ignore(Stack& stack) {
     --stack.stack_top;
 }
 
-static inline int64_t at_offset(Stack& stack, int64_t offset) {
+static inline int64_t at_offset(StackRegs& stack, int64_t offset) {
 #ifdef _DEBUG
     if (int64_t(stack.stack_top) + offset < 0 || offset > 0) {
         fmt::print("FATAL: Stack check failed, tried access invalid stack position '{}'.\n", int64_t(stack.stack_top) + offset);
@@ -42,7 +155,7 @@ static inline int64_t at_offset(Stack& stack, int64_t offset) {
     return stack.stack[size_t(int64_t(stack.stack_top) + offset)];
 }
 
-static inline void swap(Stack& stack, int64_t o1, int64_t o2) {
+static inline void swap(StackRegs& stack, int64_t o1, int64_t o2) {
 #ifdef _DEBUG
     if (int64_t(stack.stack_top) + o1 < 0 || o1 > 0) {
         fmt::print("FATAL: Stack check failed, tried to swap with invalid stack position '{}'.\n", int64_t(stack.stack_top) + o1);
@@ -57,7 +170,7 @@ static inline void swap(Stack& stack, int64_t o1, int64_t o2) {
         stack.stack[size_t(int64_t(stack.stack_top) + o2)]);
 }
 
-static inline void inc(Stack& stack) {
+static inline void inc(StackRegs& stack) {
 #ifdef _DEBUG
     if (stack.stack_top < 1) {
         fmt::print("FATAL: Stack check failed, tried to increment top value, but the stack is empty.\n");
@@ -67,7 +180,7 @@ static inline void inc(Stack& stack) {
     ++stack.stack[stack.stack_top - 1];
 }
 
-static inline void dec(Stack& stack) {
+static inline void dec(StackRegs& stack) {
 #ifdef _DEBUG
     if (stack.stack_top < 1) {
         fmt::print("FATAL: Stack check failed, tried to increment top value, but the stack is empty.\n");
@@ -77,99 +190,483 @@ static inline void dec(Stack& stack) {
     --stack.stack[stack.stack_top - 1];
 }
 
-static inline void dup2(Stack& stack) {
+static inline void dup2(StackRegs& stack) {
 #ifdef _DEBUG
     if (stack.stack_top < 2) {
         fmt::print("FATAL: Stack check failed, tried to dup top 2 values, but the stack has <2 elements.\n");
         std::abort();
     }
 #endif
-    std::copy(stack.stack.data() + stack.stack_top - 2, stack.stack.data() + stack.stack_top, stack.stack.data() + stack.stack_top);
+    std::copy(stack.stack + stack.stack_top - 2, stack.stack + stack.stack_top, stack.stack + stack.stack_top);
     stack.stack_top += 2;
 }
 
-Error execute(InstrStream&& instrs) noexcept {
-    Stack stack;
-    Program prog {
-        .instrs = std::move(instrs),
-        .pc = 0,
+/// Compile-time features of an instantiation of the interpreter loop. Every
+/// combination that is used gets its own copy of the loop, so features which
+/// are not requested cost nothing.
+enum RunFeatures : uint32_t {
+    RUN_DEFAULT = 0,
+    /// Stop after a given number of instructions.
+    RUN_BUDGETED = 1 << 0,
+    /// Append `print` output to Vm::output instead of writing to stdout.
+    RUN_BUFFERED = 1 << 1,
+    /// Count executed instructions in Vm::instructions.
+    RUN_COUNTED = 1 << 2,
+    /// Count executions of every instruction, and taken conditional jumps, in
+    /// Vm::profile.
+    RUN_PROFILED = 1 << 3,
+    /// Record hot loops into traces, and run those instead, see trace.h.
+    RUN_TRACED = 1 << 4,
+    /// Fault on overflowing arithmetic, see VmConfig::checked_arith.
+    RUN_CHECKED = 1 << 5,
+};
+
+/// a + b, a - b and a * b. With RUN_CHECKED, they return false instead if
+/// the result overflows.
+template<uint32_t Features>
+static inline bool add(int64_t a, int64_t b, int64_t& result) {
+    if constexpr ((Features & RUN_CHECKED) != 0) {
+        return !__builtin_add_overflow(a, b, &result);
+    }
+    result = a + b;
+    return true;
+}
+
+template<uint32_t Features>
+static inline bool sub(int64_t a, int64_t b, int64_t& result) {
+    if constexpr ((Features & RUN_CHECKED) != 0) {
+        return !__builtin_sub_overflow(a, b, &result);
+    }
+    result = a - b;
+    return true;
+}
+
+template<uint32_t Features>
+static inline bool mul(int64_t a, int64_t b, int64_t& result) {
+    if constexpr ((Features & RUN_CHECKED) != 0) {
+        return !__builtin_mul_overflow(a, b, &result);
+    }
+    result = a * b;
+    return true;
+}
+
+/// Whether `inc` (or `dec` with `by` = -1) of the top value may be executed,
+/// which is only false with RUN_CHECKED if it would overflow.
+template<uint32_t Features>
+static inline bool can_step(StackRegs& stack, int64_t by) {
+    if constexpr ((Features & RUN_CHECKED) != 0) {
+        return at_offset(stack, -1) != (by > 0 ? INT64_MAX : INT64_MIN);
+    }
+    return true;
+}
+
+/// Whether `a / b` and `a % b` may be executed for a non-zero b, which is only
+/// false with RUN_CHECKED for INT64_MIN and -1, where the hardware traps.
+template<uint32_t Features>
+static inline bool can_divide(int64_t a, int64_t b) {
+    if constexpr ((Features & RUN_CHECKED) != 0) {
+        return !(a == INT64_MIN && b == -1);
+    }
+    return true;
+}
+
+/// Checks the argument of `divp2`, `modp2`, `divc` and `modc`, and returns
+/// the argument the loaded program uses instead: the shift for `divp2` and
+/// `modp2`, an index into Program::div_magics for `divc` and `modc`.
+static Result<int64_t> load_div_argument(Program& prog, std::unordered_map<int64_t, size_t>& magic_indices, Op op, int64_t val, size_t pc) {
+    if (op == DIVC || op == MODC) {
+        if (!has_div_magic(val)) {
+            return { "Invalid divisor {} for '{}'. pc={}", val, to_string(op), pc };
+        }
+        // precompute the magic numbers of constant divisors, once per divisor
+        auto [it, inserted] = magic_indices.try_emplace(val, prog.div_magics.size());
+        if (inserted) {
+            prog.div_magics.push_back(div_magic(val));
+        }
+        return int64_t(it->second);
+    }
+    if (val <= 0 || val >= 63) {
+        return { "Invalid shift {} for '{}'. pc={}", val, to_string(op), pc };
+    }
+    return int64_t { val };
+}
+
+static bool is_div_with_argument(Op op) {
+    return op == DIVP2 || op == MODP2 || op == DIVC || op == MODC;
+}
+
+Result<Vm> Vm::create(InstrStream&& instrs, const VmConfig& cfg) {
+    auto stack = Stack::create(cfg.stack_size, cfg.placement);
+    if (!stack) {
+        return { "{}", stack.error };
+    }
+    Vm vm {
+        .prog = {
+            .instrs = std::move(instrs),
+            .pc = 0,
+        },
+        .stack = stack.move(),
+    };
+    vm.prog.instrs.push_back(Instr { .s = { .op = HALT, .val = 0 } });
+
+    std::unordered_map<int64_t, size_t> magic_indices;
+    for (size_t pc = 0; pc < vm.prog.instrs.size(); ++pc) {
+        auto& instr = vm.prog.instrs[pc];
+        if (is_div_with_argument(instr.s.op)) {
+            auto val = load_div_argument(vm.prog, magic_indices, instr.s.op, instr.s.val, pc);
+            if (!val) {
+                return { "{}", val.error };
+            }
+            set_instr_val(instr, val.value());
+        }
+    }
+    if (cfg.predecode) {
+        auto& prog = vm.prog;
+        prog.ops = PlacedVector<Op>(prog.instrs.size(), PlacedAllocator<Op>(cfg.placement));
+        prog.args = PlacedVector<int64_t>(prog.instrs.size(), PlacedAllocator<int64_t>(cfg.placement));
+        for (size_t pc = 0; pc < prog.instrs.size(); ++pc) {
+            prog.ops[pc] = prog.instrs[pc].s.op;
+            prog.args[pc] = prog.instrs[pc].s.val;
+        }
+        prog.instrs = {};
+    }
+    if (cfg.profile) {
+        vm.profile.counts.resize(vm.prog.ops.empty() ? vm.prog.instrs.size() : vm.prog.ops.size());
+        vm.profile.taken.resize(vm.profile.counts.size());
+    } else if (cfg.trace && !cfg.checked_arith) {
+        vm.traces.init(vm.prog.ops.empty() ? vm.prog.instrs.size() : vm.prog.ops.size());
+    } else if (cfg.registers && !cfg.checked_arith) {
+        const auto& prog = vm.prog;
+        if (!prog.ops.empty()) {
+            vm.reg_code = translate_to_registers(prog.ops, prog.args, prog.div_magics, vm.stack.size);
+        } else {
+            std::vector<Op> ops(prog.instrs.size());
+            std::vector<int64_t> args(prog.instrs.size());
+            for (size_t pc = 0; pc < prog.instrs.size(); ++pc) {
+                ops[pc] = prog.instrs[pc].s.op;
+                args[pc] = prog.instrs[pc].s.val;
+            }
+            vm.reg_code = translate_to_registers(ops, args, prog.div_magics, vm.stack.size);
+        }
+    }
+    vm.checked_arith = cfg.checked_arith;
+    return vm;
+}
+
+Result<Vm> Vm::create_dense(DenseCode&& code, const VmConfig& cfg) {
+    auto err = validate_dense(code);
+    if (err) {
+        return { "Invalid dense code: {}", err.error };
+    }
+    auto stack = Stack::create(cfg.stack_size, cfg.placement);
+    if (!stack) {
+        return { "{}", stack.error };
+    }
+    Vm vm {
+        .prog = {
+            .instrs = {},
+            .dense = std::move(code),
+            .pc = 0,
+        },
+        .stack = stack.move(),
+    };
+    auto& dense = vm.prog.dense;
+    dense.push_back(HALT);
+    dense.resize(dense.size() + DENSE_PADDING, 0);
+
+    std::unordered_map<int64_t, size_t> magic_indices;
+    for (size_t pc = 0; pc < dense.size() - DENSE_PADDING; pc += DENSE_LENGTHS[dense[pc]]) {
+        auto* at = dense.data() + pc;
+        const auto op = dense_op(at);
+        if (is_div_with_argument(op)) {
+            auto val = load_div_argument(vm.prog, magic_indices, op, dense_imm(at), pc);
+            if (!val) {
+                return { "{}", val.error };
+            }
+            if (!dense_set_imm(at, val.value())) {
+                return { "Argument of '{}' is too small to be loaded. pc={}", to_string(op), pc };
+            }
+        }
+    }
+    if (cfg.profile) {
+        vm.profile.counts.resize(dense.size());
+        vm.profile.taken.resize(dense.size());
+    } else if (cfg.trace && !cfg.checked_arith) {
+        vm.traces.init(dense.size());
+    }
+    vm.checked_arith = cfg.checked_arith;
+    return vm;
+}
+
+/// How the interpreter loop reads instructions, so that the same loop can run
+/// over fixed size instructions and over the dense encoding. `pc` is whatever
+/// the code form uses to address an instruction.
+///
+/// next() is the following instruction of an op without immediate, and
+/// next_imm() that of an op with one. They are separate so that for most ops,
+/// the next pc doesn't depend on loading the current instruction.
+struct FixedCode {
+    const Instr* instrs;
+
+    Op op(size_t pc) const { return instrs[pc].s.op; }
+    int64_t imm(size_t pc) const { return instrs[pc].s.val; }
+    size_t next(size_t pc) const { return pc + 1; }
+    size_t next_imm(size_t pc) const { return pc + 1; }
+};
+
+struct DecodedCode {
+    const Op* ops;
+    const int64_t* args;
+
+    Op op(size_t pc) const { return ops[pc]; }
+    int64_t imm(size_t pc) const { return args[pc]; }
+    size_t next(size_t pc) const { return pc + 1; }
+    size_t next_imm(size_t pc) const { return pc + 1; }
+};
+
+struct DenseCodeReader {
+    const uint8_t* bytes;
+
+    Op op(size_t pc) const { return dense_op(bytes + pc); }
+    int64_t imm(size_t pc) const { return dense_imm(bytes + pc); }
+    size_t next(size_t pc) const { return pc + 1; }
+    size_t next_imm(size_t pc) const { return pc + 1 + dense_imm_size(bytes + pc); }
+};
+
+/// Gives up recording the loop at `start`, it won't be tried again.
+static void abort_recording(Traces& traces, size_t& start) {
+    traces.entry[start] = Traces::FAILED;
+    ++traces.stats.aborted;
+    start = SIZE_MAX;
+}
+
+/// Appends the instruction at `pc`, which has just been executed, to the
+/// recording, and compiles the trace once the loop is closed.
+template<typename Code>
+static void record(Traces& traces, size_t& start, const Code code, size_t pc, size_t next_pc, const DivMagic* div_magics, size_t div_magic_count) {
+    const auto op = code.op(pc);
+    traces.recording.push_back({
+        .pc = pc,
+        .op = op,
+        .imm = op_requires_i64_argument(op) ? code.imm(pc) : 0,
+        .next_pc = next_pc,
+        .fallthrough_pc = op_requires_i64_argument(op) ? code.next_imm(pc) : code.next(pc),
+    });
+    if (next_pc != start) {
+        if (traces.recording.size() >= Traces::MAX_LENGTH) {
+            abort_recording(traces, start);
+        }
+        return;
+    }
+    auto trace = compile_trace(traces.recording, { div_magics, div_magic_count });
+    if (!trace) {
+        abort_recording(traces, start);
+        return;
+    }
+    traces.entry[start] = int32_t(traces.traces.size());
+    traces.traces.push_back(trace.move());
+    ++traces.stats.recorded;
+    start = SIZE_MAX;
+}
+
+// Never inlined into run_guarded(), because the compiler has to keep locals of
+// a function which calls sigsetjmp() in memory, which would slow down the loop.
+template<uint32_t Features, typename Code>
+[[gnu::noinline]] static VmStatus run_impl(Vm& vm, uint64_t budget, const Code code) noexcept {
+    Program& prog = vm.prog;
+    // keep the program counter, code pointer and stack in locals, so they can
+    // live in registers; they are written back whenever the loop is left.
+    const DivMagic* div_magics = prog.div_magics.data();
+    size_t pc = prog.pc;
+    StackRegs stack { vm.stack.stack, vm.stack.stack_top };
+    uint64_t instructions = vm.instructions;
+    // Ops which grow the stack store the pc first, as it's only in a register
+    // otherwise, so that a stack overflow, which is a fault on the guard page,
+    // knows where it happened. See run_guarded().
+    const auto may_overflow = [&] {
+        prog.pc = pc;
+    };
+    // start of the loop being recorded, or SIZE_MAX
+    size_t recording_start = SIZE_MAX;
+    const auto leave = [&](VmStatus status, size_t at_pc) {
+        prog.pc = at_pc;
+        vm.stack.stack_top = stack.stack_top;
+        if constexpr ((Features & RUN_COUNTED) != 0) {
+            vm.instructions = instructions;
+        }
+        return status;
     };
-    prog.instrs.push_back(Instr { .s = { .op = HALT, .val = 0 } });
 
     while (true) {
+        if constexpr ((Features & RUN_BUDGETED) != 0) {
+            if (budget == 0) [[unlikely]] {
+                return leave(VmStatus::BudgetExhausted, pc);
+            }
+            --budget;
+        }
+        if constexpr ((Features & RUN_COUNTED) != 0) {
+            ++instructions;
+        }
+        if constexpr ((Features & RUN_PROFILED) != 0) {
+            ++vm.profile.counts[pc];
+        }
 #ifdef _DEBUG
         std::string ins = "";
-        if (op_requires_i64_argument(prog.instrs[prog.pc].s.op)) {
-            ins = fmt::format("{} {}", to_string(prog.instrs[prog.pc].s.op), int64_t(prog.instrs[prog.pc].s.val));
+        if (op_requires_i64_argument(code.op(pc))) {
+            ins = fmt::format("{} {}", to_string(code.op(pc)), int64_t(code.imm(pc)));
         } else {
-            ins = fmt::format("{}", to_string(prog.instrs[prog.pc].s.op));
+            ins = fmt::format("{}", to_string(code.op(pc)));
         }
         std::string stack_fmt = "";
         for (size_t i = 0; i < stack.stack_top; ++i) {
-            stack_fmt += fmt::format("{} ", stack.stack.at(i));
+            stack_fmt += fmt::format("{} ", stack.stack[i]);
         }
         fmt::print("dbg: {:<7} | {}\n", ins, stack_fmt);
 #endif
-        size_t next_pc = size_t(-1);
-        switch (prog.instrs[prog.pc].s.op) {
+        if constexpr ((Features & RUN_TRACED) != 0) {
+            if (recording_start != SIZE_MAX) [[unlikely]] {
+                const auto op = code.op(pc);
+                if (op == PRINT || op == HALT || op == CLEAR || op == CALL || op == RET || op == NOT_AN_INSTRUCTION) {
+                    abort_recording(vm.traces, recording_start);
+                }
+            }
+        }
+        // ops with an immediate and jumps overwrite this
+        size_t next_pc = code.next(pc);
+        switch (code.op(pc)) {
         case NOT_AN_INSTRUCTION:
-            return Error("Invalid instruction. pc={}, stack_top={}", prog.pc, stack.stack_top);
+            vm.error = Error("Invalid instruction. pc={}, stack_top={}", pc, stack.stack_top);
+            return leave(VmStatus::Faulted, pc);
         case POP:
             pop_ignore(stack);
             break;
         case ADD: {
             const auto b = pop(stack);
             const auto a = pop(stack);
-            push(stack, a + b);
+            int64_t result;
+            if (!add<Features>(a, b, result)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {} + {}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            push(stack, result);
             break;
         }
         case INC: {
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
             inc(stack);
             break;
         }
         case DEC: {
+            if (!can_step<Features>(stack, -1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: dec of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
             dec(stack);
             break;
         }
         case SUB: {
             const auto b = pop(stack);
             const auto a = pop(stack);
-            push(stack, a - b);
+            int64_t result;
+            if (!sub<Features>(a, b, result)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {} - {}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            push(stack, result);
             break;
         }
         case MUL: {
             const auto b = pop(stack);
             const auto a = pop(stack);
-            push(stack, a * b);
+            int64_t result;
+            if (!mul<Features>(a, b, result)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {} * {}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            push(stack, result);
             break;
         }
         case DIV: {
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (b == 0) [[unlikely]] {
-                return Error("Division by zero: {}/{}. pc={}", a, b, prog.pc);
+                vm.error = Error("Division by zero: {}/{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (!can_divide<Features>(a, b)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {}/{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (const auto* magic = cached_div_magic(vm.div_cache, b)) {
+                push(stack, div_by_magic(a, *magic));
+            } else {
+                push(stack, a / b);
             }
-            push(stack, a / b);
             break;
         }
         case MOD: {
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (b == 0) [[unlikely]] {
-                return Error("Modulo division by zero: {}/{}. pc={}", a, b, prog.pc);
+                vm.error = Error("Modulo division by zero: {}/{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (!can_divide<Features>(a, b)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {}%{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
             }
-            push(stack, a % b);
+            if (const auto* magic = cached_div_magic(vm.div_cache, b)) {
+                push(stack, mod_by_magic(a, *magic));
+            } else {
+                push(stack, a % b);
+            }
+            break;
+        }
+        case DIVP2: {
+            next_pc = code.next_imm(pc);
+            const auto a = pop(stack);
+            push(stack, div_by_pow2(a, code.imm(pc)));
+            break;
+        }
+        case MODP2: {
+            next_pc = code.next_imm(pc);
+            const auto a = pop(stack);
+            push(stack, mod_by_pow2(a, code.imm(pc)));
+            break;
+        }
+        case DIVC: {
+            next_pc = code.next_imm(pc);
+            const auto a = pop(stack);
+            push(stack, div_by_magic(a, div_magics[code.imm(pc)]));
+            break;
+        }
+        case MODC: {
+            next_pc = code.next_imm(pc);
+            const auto a = pop(stack);
+            push(stack, mod_by_magic(a, div_magics[code.imm(pc)]));
             break;
         }
         case PRINT:
-            fmt::print("{}\n", pop(stack));
+            if constexpr ((Features & RUN_BUFFERED) != 0) {
+                fmt::format_to(std::back_inserter(vm.output), "{}\n", pop(stack));
+                if (vm.output.size() >= vm.output_limit) {
+                    return leave(VmStatus::OutputFull, next_pc);
+                }
+            } else {
+                fmt::print("{}\n", pop(stack));
+            }
             break;
         case HALT:
-            return {};
+            return leave(VmStatus::Halted, pc);
         case DUP:
+            may_overflow();
             push(stack, at_offset(stack, -1));
             break;
         case DUP2:
+            may_overflow();
             dup2(stack);
             break;
         case SWAP:
@@ -179,83 +676,353 @@ Error execute(InstrStream&& instrs) noexcept {
             stack.stack_top = 0;
             break;
         case OVER:
+            may_overflow();
             push(stack, at_offset(stack, -2));
             break;
         case PUSH:
-            push(stack, prog.instrs[prog.pc].s.val);
+            next_pc = code.next_imm(pc);
+            may_overflow();
+            push(stack, code.imm(pc));
             break;
         case JE: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a == b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JN: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a != b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JG: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a > b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JL: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a < b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JGE: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a >= b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JLE: {
+            next_pc = code.next_imm(pc);
             const auto b = pop(stack);
             const auto a = pop(stack);
             if (a <= b) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JMP:
-            next_pc = size_t(prog.instrs[prog.pc].s.val);
+            next_pc = size_t(code.imm(pc));
             break;
         case JZ: {
+            next_pc = code.next_imm(pc);
             const auto a = pop(stack);
             if (a == 0) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
         case JNZ: {
+            next_pc = code.next_imm(pc);
             const auto a = pop(stack);
             if (a != 0) {
-                next_pc = size_t(prog.instrs[prog.pc].s.val);
+                next_pc = size_t(code.imm(pc));
             }
             break;
         }
+        case INCJE: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) == at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
         }
-        if (next_pc == size_t(-1)) [[likely]] {
-            ++prog.pc;
-        } else {
-            prog.pc = next_pc;
+        case INCJN: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) != at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case INCJG: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) > at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case INCJL: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) < at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case INCJGE: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) >= at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
         }
+        case INCJLE: {
+            next_pc = code.next_imm(pc);
+            if (!can_step<Features>(stack, 1)) [[unlikely]] {
+                vm.error = Error("Integer overflow: inc of {}. pc={}", at_offset(stack, -1), pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            inc(stack);
+            if (at_offset(stack, -2) <= at_offset(stack, -1)) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case MODJZ: {
+            next_pc = code.next_imm(pc);
+            const auto b = at_offset(stack, -1);
+            const auto a = at_offset(stack, -2);
+            if (b == 0) [[unlikely]] {
+                vm.error = Error("Modulo division by zero: {}/{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (!can_divide<Features>(a, b)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {}%{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (a % b == 0) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case MODJNZ: {
+            next_pc = code.next_imm(pc);
+            const auto b = at_offset(stack, -1);
+            const auto a = at_offset(stack, -2);
+            if (b == 0) [[unlikely]] {
+                vm.error = Error("Modulo division by zero: {}/{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (!can_divide<Features>(a, b)) [[unlikely]] {
+                vm.error = Error("Integer overflow: {}%{}. pc={}", a, b, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            if (a % b != 0) {
+                next_pc = size_t(code.imm(pc));
+            }
+            break;
+        }
+        case CALL:
+            if (vm.calls.size() == Vm::MAX_CALL_DEPTH) [[unlikely]] {
+                vm.error = Error("Call stack overflow: more than {} nested calls. pc={}", Vm::MAX_CALL_DEPTH, pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            vm.calls.push_back(code.next_imm(pc));
+            next_pc = size_t(code.imm(pc));
+            break;
+        case RET:
+            if (vm.calls.empty()) [[unlikely]] {
+                vm.error = Error("Return without a call. pc={}", pc);
+                return leave(VmStatus::Faulted, pc);
+            }
+            next_pc = vm.calls.back();
+            vm.calls.pop_back();
+            break;
+        }
+        if constexpr ((Features & RUN_PROFILED) != 0) {
+            if (op_is_conditional_jump(code.op(pc)) && next_pc != code.next_imm(pc)) {
+                ++vm.profile.taken[pc];
+            }
+        }
+        if constexpr ((Features & RUN_TRACED) != 0) {
+            auto& traces = vm.traces;
+            if (recording_start != SIZE_MAX) [[unlikely]] {
+                record(traces, recording_start, code, pc, next_pc, div_magics, prog.div_magics.size());
+            } else if (next_pc < pc) {
+                // a taken backward jump, so next_pc may be a loop header
+                const auto entry = traces.entry[next_pc];
+                if (entry >= 0) {
+                    auto& trace = traces.traces[size_t(entry)];
+                    const auto result = run_trace(trace, stack.stack, stack.stack_top, vm.stack.size);
+                    stack.stack_top = result.stack_top;
+                    traces.stats.iterations += result.iterations;
+                    if (result.pc != trace.start_pc) {
+                        ++traces.stats.exits;
+                    }
+                    if constexpr ((Features & RUN_COUNTED) != 0) {
+                        instructions += result.iterations * trace.recorded;
+                    }
+                    next_pc = result.pc;
+                } else if (entry == Traces::NONE && ++traces.hotness[next_pc] == Traces::HOT_THRESHOLD) {
+                    recording_start = next_pc;
+                    traces.recording.clear();
+                }
+            }
+        }
+        pc = next_pc;
     }
     // not really reachable
+    return VmStatus::Halted;
+}
+
+/// Runs the interpreter loop with the stack's guard page armed, turning a
+/// fault on it into an Error.
+template<uint32_t Features>
+static VmStatus run_guarded(Vm& vm, uint64_t budget) noexcept {
+    install_segv_handler();
+    const auto page_size = uintptr_t(sysconf(_SC_PAGESIZE));
+    StackGuard guard {
+        .begin = reinterpret_cast<uintptr_t>(vm.stack.stack + vm.stack.size),
+        .end = reinterpret_cast<uintptr_t>(vm.stack.stack + vm.stack.size) + page_size,
+        .on_overflow = {},
+    };
+    auto* previous_guard = t_stack_guard;
+    // savemask=0: saving the signal mask is a syscall, and SA_NODEFER keeps it intact
+    if (sigsetjmp(guard.on_overflow, 0) != 0) {
+        t_stack_guard = previous_guard;
+        // vm.prog.pc is the pc of the op which overflowed, see run_impl()
+        vm.stack.stack_top = vm.stack.size;
+        vm.error = Error("Stack overflow: The stack can only hold {} values. pc={}", vm.stack.size, vm.prog.pc);
+        return VmStatus::Faulted;
+    }
+    t_stack_guard = &guard;
+    VmStatus status;
+    if (!vm.prog.ops.empty()) {
+        status = run_impl<Features>(vm, budget, DecodedCode { vm.prog.ops.data(), vm.prog.args.data() });
+    } else if (!vm.prog.dense.empty()) {
+        status = run_impl<Features>(vm, budget, DenseCodeReader { vm.prog.dense.data() });
+    } else {
+        status = run_impl<Features>(vm, budget, FixedCode { vm.prog.instrs.data() });
+    }
+    t_stack_guard = previous_guard;
+    return status;
+}
+
+/// run_guarded(), with RUN_CHECKED added if the vm checks arithmetic.
+template<uint32_t Features>
+static VmStatus run_checked_if(Vm& vm, uint64_t budget) noexcept {
+    if (vm.checked_arith) {
+        return run_guarded<Features | RUN_CHECKED>(vm, budget);
+    }
+    return run_guarded<Features>(vm, budget);
+}
+
+VmStatus run(Vm& vm, uint64_t budget) noexcept {
+    return run_checked_if<RUN_BUDGETED | RUN_BUFFERED>(vm, budget);
+}
+
+/// Runs a freshly created vm until it halts or faults.
+static Error run_to_end(Result<Vm>&& vm_res, ExecStats* stats, size_t* fault_pc) noexcept {
+    if (!vm_res) {
+        return Error("{}", vm_res.error);
+    }
+    auto vm = vm_res.move();
+    VmStatus status;
+    if (vm.reg_code.enabled()) {
+        auto result = run_registers(vm.reg_code, vm.stack.stack, vm.div_cache, vm.prog.div_magics.data(), stats != nullptr);
+        vm.instructions = result.dispatched;
+        vm.prog.pc = result.pc;
+        if (result.how == RegExit::Halted) {
+            status = VmStatus::Halted;
+        } else if (result.how == RegExit::Faulted) {
+            vm.error = std::move(result.error);
+            status = VmStatus::Faulted;
+        } else {
+            // the stack is as the interpreter would have left it at this pc
+            vm.stack.stack_top = result.stack_top;
+            status = stats ? run_guarded<RUN_COUNTED>(vm, 0) : run_guarded<RUN_DEFAULT>(vm, 0);
+        }
+        if (stats) {
+            stats->instructions = vm.instructions - (status == VmStatus::Halted ? 1 : 0);
+            stats->registers = vm.reg_code.stats;
+            stats->registers.fell_back = result.how == RegExit::Interpreter;
+            stats->registers.fallback_pc = result.how == RegExit::Interpreter ? result.pc : 0;
+        }
+    } else if (vm.traces.enabled()) {
+        if (stats) {
+            status = run_guarded<RUN_COUNTED | RUN_TRACED>(vm, 0);
+            stats->instructions = vm.instructions - (status == VmStatus::Halted ? 1 : 0);
+            stats->traces = vm.traces.stats;
+        } else {
+            status = run_guarded<RUN_TRACED>(vm, 0);
+        }
+    } else if (!vm.profile.counts.empty()) {
+        status = run_checked_if<RUN_COUNTED | RUN_PROFILED>(vm, 0);
+        if (stats) {
+            stats->instructions = vm.instructions - (status == VmStatus::Halted ? 1 : 0);
+            stats->profile = std::move(vm.profile);
+        }
+    } else if (stats) {
+        status = run_checked_if<RUN_COUNTED>(vm, 0);
+        // the final `halt` doesn't count
+        stats->instructions = vm.instructions - (status == VmStatus::Halted ? 1 : 0);
+    } else {
+        status = run_checked_if<RUN_DEFAULT>(vm, 0);
+    }
+    if (status == VmStatus::Faulted) {
+        if (fault_pc) {
+            *fault_pc = vm.prog.pc;
+        }
+        return vm.error;
+    }
     return {};
 }
+
+Error execute(InstrStream&& instrs, const VmConfig& cfg, ExecStats* stats, size_t* fault_pc) noexcept {
+    return run_to_end(Vm::create(std::move(instrs), cfg), stats, fault_pc);
+}
+
+Error execute_dense(DenseCode&& code, const VmConfig& cfg, ExecStats* stats, size_t* fault_pc) noexcept {
+    return run_to_end(Vm::create_dense(std::move(code), cfg), stats, fault_pc);
+}
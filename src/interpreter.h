@@ -1,17 +1,172 @@
 #pragma once
 
 #include "compiler.h"
+#include "dense.h"
+#include "divide.h"
 #include "error.h"
+#include "placement.h"
+#include "regvm.h"
+#include "trace.h"
+#include <cstdint>
+#include <string>
+#include <vector>
 
+/// The data stack of a VM.
+///
+/// The memory is mapped with a PROT_NONE guard page directly after the last
+/// slot, so a push onto a full stack faults instead of every push needing a
+/// bounds check. run() turns that fault into an Error.
 struct Stack {
-    static constexpr size_t STACK_SIZE = 4096;
-    std::array<int64_t, STACK_SIZE> stack {};
+    static constexpr size_t DEFAULT_STACK_SIZE = 4096;
+
+    /// Maps a stack which can hold `size` values. Pages are only backed by
+    /// memory once they are touched, so large stacks are cheap until used,
+    /// unless the placement prefaults them.
+    static Result<Stack> create(size_t size, const Placement& placement = {});
+
+    Stack() = default;
+    Stack(Stack&& other) noexcept;
+    Stack& operator=(Stack&& other) noexcept;
+    Stack(const Stack&) = delete;
+    Stack& operator=(const Stack&) = delete;
+    ~Stack();
+
+    int64_t* stack { nullptr };
+    /// Number of values the stack can hold.
+    size_t size { 0 };
     size_t stack_top { 0 };
+
+    /// The whole mapping, including the guard page.
+    void* mapping { nullptr };
+    size_t mapping_size { 0 };
 };
 
 struct Program {
+    /// The code as loaded. Only kept if VmConfig::predecode is off, otherwise
+    /// it's converted into `ops` and `args`.
     InstrStream instrs;
+    /// The pre-decoded code, which the interpreter runs by default: all ops in
+    /// one array, and their arguments in a parallel one, already sign-extended
+    /// to 64 bits. Jump arguments are instruction indices.
+    /// Large programs put them where VmConfig::placement says.
+    PlacedVector<Op> ops {};
+    PlacedVector<int64_t> args {};
+    /// If not empty, the program runs from this dense encoding instead of
+    /// `instrs`, and `pc` is a byte offset into it.
+    DenseCode dense {};
+    /// After a fault, the pc of the faulting instruction, or SIZE_MAX after a
+    /// stack overflow, as the pc isn't known then.
     size_t pc;
+    /// Magic numbers for `divc` and `modc`. When a program is loaded, the
+    /// argument of these is replaced by an index into this table.
+    std::vector<DivMagic> div_magics {};
 };
 
-[[nodiscard]] Error execute(InstrStream&& instrs) noexcept;
+/// Why run() returned control to the caller.
+enum class VmStatus {
+    /// The program executed `halt` (or ran off the end).
+    Halted,
+    /// The program faulted, see Vm::error.
+    Faulted,
+    /// The instruction budget given to run() was used up.
+    BudgetExhausted,
+    /// `print` filled the output buffer up to Vm::output_limit.
+    OutputFull,
+};
+
+struct VmConfig {
+    /// Number of values the stack can hold. 0 selects Stack::DEFAULT_STACK_SIZE.
+    size_t stack_size { 0 };
+    /// Whether to pre-decode the instructions into Program::ops and
+    /// Program::args when loading. Turning this off runs the packed Instrs
+    /// directly, which is mostly interesting for benchmarks.
+    bool predecode { true };
+    /// Whether execute() fills ExecStats::profile. Makes execution much slower.
+    bool profile { false };
+    /// Whether execute() records hot loops into traces and runs those instead,
+    /// see trace.h. Ignored together with `profile` or `checked_arith`.
+    bool trace { false };
+    /// Whether `add`, `sub`, `mul`, `inc` and `dec` (also as part of fused
+    /// instructions) fault when they overflow, instead of wrapping around, and
+    /// `div` and `mod` of INT64_MIN by -1 fault instead of trapping.
+    bool checked_arith { false };
+    /// Whether execute() translates the program into register code and runs
+    /// that, see regvm.h. Ignored together with `profile`, `trace` or
+    /// `checked_arith`, and by execute_dense().
+    bool registers { false };
+    /// Where the stack and the pre-decoded instructions go. Create the Vm on
+    /// the thread which runs it, so that they're local to that thread.
+    Placement placement {};
+};
+
+/// Execution counts by pc, see VmConfig::profile. For dense code the pc is a
+/// byte offset, so only the counts at the start of an instruction are used.
+struct ExecProfile {
+    /// Number of times the instruction at each pc was executed.
+    std::vector<uint64_t> counts {};
+    /// Number of times the conditional jump at each pc was taken.
+    std::vector<uint64_t> taken {};
+};
+
+/// The complete state of one virtual machine. A Vm can be suspended by
+/// returning from run() at an instruction boundary, and resumed later by
+/// calling run() again.
+struct Vm {
+    /// Number of calls which can be nested before `call` faults.
+    static constexpr size_t MAX_CALL_DEPTH = 64 * 1024;
+
+    static Result<Vm> create(InstrStream&& instrs, const VmConfig& cfg = {});
+    /// Creates a Vm which runs dense code (see dense.h) without decoding it first.
+    static Result<Vm> create_dense(DenseCode&& code, const VmConfig& cfg = {});
+
+    Program prog;
+    Stack stack;
+    DivisorCache div_cache {};
+    /// Return addresses of the calls which haven't returned yet, innermost
+    /// last. Separate from the data stack, which `call` and `ret` don't touch.
+    std::vector<size_t> calls {};
+    /// Output of `print`, if the VM runs with buffered output.
+    std::string output {};
+    /// Once the output buffer holds this many bytes, run() returns
+    /// VmStatus::OutputFull.
+    size_t output_limit { 4096 };
+    /// Set if run() returned VmStatus::Faulted.
+    Error error {};
+    /// Number of executed instructions, only counted by execute() with ExecStats.
+    uint64_t instructions { 0 };
+    /// Only allocated if the vm was created with VmConfig::profile.
+    ExecProfile profile {};
+    /// Only allocated if the vm was created with VmConfig::trace.
+    Traces traces {};
+    /// Only translated if the vm was created with VmConfig::registers.
+    RegCode reg_code {};
+    /// See VmConfig::checked_arith.
+    bool checked_arith { false };
+};
+
+struct ExecStats {
+    /// Number of instructions executed, not counting the final `halt`. With
+    /// VmConfig::trace, instructions of trace iterations which were left
+    /// through a guard aren't counted.
+    uint64_t instructions { 0 };
+    /// Only filled if the program ran with VmConfig::profile.
+    ExecProfile profile {};
+    /// Only filled if the program ran with VmConfig::trace.
+    TraceStats traces {};
+    /// Only filled if the program ran with VmConfig::registers. Each register
+    /// op which ran counts as one instruction.
+    RegStats registers {};
+};
+
+/// Runs the vm until it halts, faults, or has executed `budget` instructions.
+/// Output of `print` is appended to vm.output instead of being written to stdout.
+/// Can be called again to resume a vm which didn't halt or fault.
+[[nodiscard]] VmStatus run(Vm& vm, uint64_t budget) noexcept;
+
+/// Runs the program until it halts or faults. If `stats` is given, they are
+/// filled in, which makes execution a bit slower. If `fault_pc` is given and
+/// an instruction faults, it's set to the pc of that instruction, or to
+/// SIZE_MAX if that isn't known (like for a stack overflow).
+[[nodiscard]] Error execute(InstrStream&& instrs, const VmConfig& cfg = {}, ExecStats* stats = nullptr, size_t* fault_pc = nullptr) noexcept;
+/// Like execute(), but for a program in the dense encoding.
+[[nodiscard]] Error execute_dense(DenseCode&& code, const VmConfig& cfg = {}, ExecStats* stats = nullptr, size_t* fault_pc = nullptr) noexcept;
@@ -0,0 +1,690 @@
+#include "lanes.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fmt/core.h>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <utility>
+
+// Functions taking and returning quads (see below) change their ABI with
+// AVX, but they are all inlined.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+Result<std::vector<LaneInput>> read_lane_inputs(const std::string& filename) {
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(std::fopen(filename.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        return { "Failed to open '{}': {}", filename, std::strerror(errno) };
+    }
+    std::string text;
+    char buffer[64 * 1024];
+    size_t n = 0;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+        text.append(buffer, n);
+    }
+    if (std::ferror(file.get())) {
+        return { "Failed to read '{}': {}", filename, std::strerror(errno) };
+    }
+    std::vector<LaneInput> inputs;
+    size_t line_number = 0;
+    for (size_t start = 0; start < text.size();) {
+        auto end = text.find('\n', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        const auto line = std::string_view(text).substr(start, end - start);
+        start = end + 1;
+        ++line_number;
+        if (line.find_first_not_of(" \t\r") == std::string_view::npos || line.starts_with('#')) {
+            continue;
+        }
+        LaneInput input;
+        for (size_t i = 0; i < line.size();) {
+            if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+                ++i;
+                continue;
+            }
+            const auto token_end = std::min(line.find_first_of(" \t\r", i), line.size());
+            const auto token = line.substr(i, token_end - i);
+            int64_t value = 0;
+            const auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+            if (ec != std::errc {} || ptr != token.data() + token.size()) {
+                return { "{}:{}: '{}' is not a 64-bit integer.", filename, line_number, token };
+            }
+            input.push_back(value);
+            i = token_end;
+        }
+        inputs.push_back(std::move(input));
+    }
+    return inputs;
+}
+
+namespace {
+
+/// Four lanes. GCC and Clang compile operations on these into one AVX2
+/// instruction, two SSE2 ones, or whatever the target has, as long as both
+/// operands are vectors.
+using Quad [[gnu::vector_size(32)]] = int64_t;
+using UQuad [[gnu::vector_size(32)]] = uint64_t;
+using QuadF [[gnu::vector_size(32)]] = double;
+
+constexpr size_t QUADS = LANE_COUNT / 4;
+
+/// The values at one height of the stack of a group, one per lane. Only
+/// touched as whole quads in the group loop, as a quad load which follows
+/// narrower stores can't be forwarded from them, which costs more than the
+/// operation itself.
+struct alignas(64) Row {
+    Quad q[QUADS];
+
+    int64_t lane(size_t l) const { return q[l / 4][l % 4]; }
+    void set_lane(size_t l, int64_t value) { q[l / 4][l % 4] = value; }
+};
+
+struct HeightRange {
+    size_t min;
+    size_t max;
+};
+
+/// One bit per lane of a group.
+using LaneMask = uint32_t;
+
+/// A run which isn't part of a group right now.
+struct Waiting {
+    size_t input;
+    size_t pc;
+    std::vector<int64_t> stack;
+};
+
+/// The lanes whose quad element is -1, like comparisons of quads produce.
+[[gnu::always_inline]] inline LaneMask lane_mask(const Row& flags) {
+    Quad bits {};
+    for (size_t i = 0; i < QUADS; ++i) {
+        bits |= flags.q[i] & (Quad { 1, 2, 4, 8 } << int64_t(4 * i));
+    }
+    return LaneMask(bits[0] | bits[1] | bits[2] | bits[3]);
+}
+
+/// Whether any quad element is -1.
+[[gnu::always_inline]] inline bool any_lane(const Row& flags) {
+    Quad any {};
+    for (size_t i = 0; i < QUADS; ++i) {
+        any |= flags.q[i];
+    }
+    return (any[0] | any[1] | any[2] | any[3]) != 0;
+}
+
+/// 2^52 + 2^51. Added to a double in (-2^51, 2^51), the sum's mantissa holds
+/// the integer value in two's complement, rounded to the nearest integer. That
+/// converts between int64_t and double with one add each way, where SSE2 and
+/// AVX2 have no instruction for it.
+constexpr double CONVERT_MAGIC = 6755399441055744.0;
+/// Operands of divisions below this are divided in doubles, see divide_quad().
+constexpr int64_t DOUBLE_DIVISION_LIMIT = int64_t(1) << 50;
+
+[[gnu::always_inline]] inline QuadF to_double(const Quad& x) {
+    const QuadF magic = QuadF {} + CONVERT_MAGIC;
+    return std::bit_cast<QuadF>(x + std::bit_cast<Quad>(magic)) - magic;
+}
+
+[[gnu::always_inline]] inline Quad to_int(const QuadF& x) {
+    const QuadF magic = QuadF {} + CONVERT_MAGIC;
+    return std::bit_cast<Quad>(x + magic) - std::bit_cast<Quad>(magic);
+}
+
+/// Truncating division and remainder of four lanes, where a and b are below
+/// DOUBLE_DIVISION_LIMIT and b isn't 0, in doubles. The quotient rounded to
+/// the nearest integer is at most one off, which makes the remainder at most
+/// |b| off, with the wrong sign or too large. All products stay below 2^51,
+/// so everything else is exact.
+[[gnu::always_inline]] inline void divide_quad(const Quad& a, const Quad& b, Quad* quotient, Quad* remainder) {
+    const Quad zero {};
+    const QuadF magic = QuadF {} + CONVERT_MAGIC;
+    const auto ad = to_double(a);
+    const auto bd = to_double(b);
+    const auto qd = (ad / bd + magic) - magic;
+    auto r = a - to_int(qd * bd);
+    const Quad abs_b = b < zero ? -b : b;
+    const Quad b_like_a = a < zero ? -abs_b : abs_b;
+    r += (((r < zero) & (a > zero)) | ((r > zero) & (a < zero))) & b_like_a;
+    const Quad abs_r = r < zero ? -r : r;
+    r -= (abs_r >= abs_b) & b_like_a;
+    if (quotient) {
+        // exact, as a - r is a multiple of b
+        *quotient = to_int(to_double(a - r) / bd);
+    }
+    if (remainder) {
+        *remainder = r;
+    }
+}
+
+LaneMask lanes_below(size_t width) {
+    return (LaneMask(1) << width) - 1;
+}
+
+template<typename Fn>
+[[gnu::always_inline]] inline void binary(Row& a, const Row& b, Fn fn) {
+    for (size_t i = 0; i < QUADS; ++i) {
+        a.q[i] = std::bit_cast<Quad>(fn(std::bit_cast<UQuad>(a.q[i]), std::bit_cast<UQuad>(b.q[i])));
+    }
+}
+
+template<typename Fn>
+[[gnu::always_inline]] inline void unary(Row& a, Fn fn) {
+    for (size_t i = 0; i < QUADS; ++i) {
+        a.q[i] = std::bit_cast<Quad>(fn(std::bit_cast<UQuad>(a.q[i])));
+    }
+}
+
+/// Like unary(), one lane at a time, for what quads can't do.
+template<typename Fn>
+[[gnu::always_inline]] inline void each_lane(Row& a, size_t width, Fn fn) {
+    for (size_t l = 0; l < width; ++l) {
+        a.set_lane(l, fn(a.lane(l)));
+    }
+}
+
+template<typename Fn>
+[[gnu::always_inline]] inline LaneMask compare(const Row& a, const Row& b, Fn fn) {
+    Row flags;
+    for (size_t i = 0; i < QUADS; ++i) {
+        flags.q[i] = fn(a.q[i], b.q[i]);
+    }
+    return lane_mask(flags);
+}
+
+/// a / b and a % b of the first `width` lanes, in doubles. Returns false,
+/// without dividing, if any divisor is 0 or any operand is too large for
+/// that.
+[[gnu::always_inline]] inline bool divide_quads(const Row& a, const Row& b, size_t width, Row* quotient, Row* remainder) {
+    const Quad zero {};
+    Row in_use;
+    Row unusual;
+    for (size_t i = 0; i < QUADS; ++i) {
+        in_use.q[i] = (Quad { 0, 1, 2, 3 } + int64_t(4 * i)) < int64_t(width);
+        unusual.q[i] = in_use.q[i]
+            & ((b.q[i] == zero) | (a.q[i] <= -DOUBLE_DIVISION_LIMIT) | (a.q[i] >= DOUBLE_DIVISION_LIMIT)
+                | (b.q[i] <= -DOUBLE_DIVISION_LIMIT) | (b.q[i] >= DOUBLE_DIVISION_LIMIT));
+    }
+    if (any_lane(unusual)) [[unlikely]] {
+        return false;
+    }
+    for (size_t i = 0; i < QUADS; ++i) {
+        // lanes which aren't in use may hold anything, including 0
+        const Quad divisor = in_use.q[i] ? b.q[i] : Quad {} + 1;
+        divide_quad(a.q[i], divisor, quotient ? &quotient->q[i] : nullptr, remainder ? &remainder->q[i] : nullptr);
+    }
+    return true;
+}
+
+// x86-64 gets a second copy of the group loop for AVX2, picked when the
+// program starts, where a quad is one register instead of two.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LANES_TARGET_CLONES [[gnu::target_clones("avx2", "default")]]
+#else
+#define LANES_TARGET_CLONES
+#endif
+
+class LockstepRunner {
+public:
+    LockstepRunner(Vm& vm, std::vector<LaneRun>& runs, LaneStats& stats)
+        : m_vm(vm)
+        , m_ops(vm.prog.ops.data())
+        , m_args(vm.prog.args.data())
+        , m_magics(vm.prog.div_magics.data())
+        , m_stack_size(vm.stack.size)
+        , m_rows(vm.stack.size)
+        , m_runs(runs)
+        , m_stats(stats) {
+        m_heights.reserve(vm.prog.ops.size());
+        for (const auto op : vm.prog.ops) {
+            if (op == CALL || op == RET) {
+                // runs don't share return addresses, so calls run in the
+                // interpreter, through the same exit as underflows
+                m_heights.push_back({ .min = SIZE_MAX, .max = 0 });
+                continue;
+            }
+            const auto effect = op_stack_effect(op);
+            m_heights.push_back({ .min = effect.pops, .max = m_stack_size + effect.pops - std::min<size_t>(effect.pushes, m_stack_size + effect.pops) });
+        }
+    }
+
+    void add(size_t input, std::span<const int64_t> values) {
+        m_waiting[{ 0, values.size() }].push_back({ .input = input, .pc = 0, .stack = { values.begin(), values.end() } });
+    }
+
+    /// Runs until every run has halted or faulted.
+    void run_all();
+
+private:
+    LaneMask active() const { return lanes_below(m_width); }
+
+    bool form_group();
+    /// Takes waiting lanes into the group until it's full.
+    void join(std::vector<Waiting>& lanes);
+    /// Runs the group until it halts, or it's down to one lane, or it waits for
+    /// other lanes. The state of the group lives in locals while it runs, and
+    /// goes back into the members before calling any of the functions below.
+    LANES_TARGET_CLONES void run_group();
+    void run_scalar(const Waiting& lane);
+    /// Takes the lanes in `lanes` out of the group, to wait at `pc`, or, with
+    /// `scalar`, to continue in the interpreter.
+    void leave(LaneMask lanes, size_t pc, bool scalar);
+    /// Where the group goes at a conditional jump, where the lanes in `taken`
+    /// jump and the others don't: the smaller part leaves the group.
+    size_t diverge(LaneMask taken, size_t target, size_t fallthrough);
+    /// Called at a backward jump to `target`: takes in lanes waiting there, and
+    /// if the group is still small, makes it wait there too, so that others can
+    /// catch up. Returns whether the group still runs.
+    bool regroup(size_t target);
+    /// a / b and a % b one lane at a time, for divisors of 0 and large
+    /// operands. Lanes which would fault leave the group first, to run the
+    /// division in the interpreter, which reports the fault.
+    void divide_lanes(const Row& a, const Row& b, Row* quotient, Row* remainder);
+
+    Vm& m_vm;
+    const Op* m_ops;
+    const int64_t* m_args;
+    const DivMagic* m_magics;
+    /// By pc, the stack heights at which the instruction neither underflows
+    /// nor overflows the stack, and none for `call` and `ret`.
+    std::vector<HeightRange> m_heights {};
+    size_t m_stack_size;
+    std::vector<Row> m_rows;
+    std::vector<LaneRun>& m_runs;
+    LaneStats& m_stats;
+    /// Waiting runs by pc and stack height, which can form a group.
+    std::map<std::pair<size_t, size_t>, std::vector<Waiting>> m_waiting {};
+    /// Runs which fault at their pc, or would if their group ran on.
+    std::vector<Waiting> m_faulting {};
+
+    // the group which is running
+    size_t m_pc { 0 };
+    size_t m_height { 0 };
+    size_t m_width { 0 };
+    /// The largest width the group had since it formed.
+    size_t m_full_width { 0 };
+    size_t m_lanes[LANE_COUNT] {};
+};
+
+void LockstepRunner::run_all() {
+    while (!m_faulting.empty() || !m_waiting.empty()) {
+        if (!m_faulting.empty()) {
+            const auto lane = std::move(m_faulting.back());
+            m_faulting.pop_back();
+            run_scalar(lane);
+        } else if (form_group()) {
+            run_group();
+        }
+    }
+}
+
+/// Forms a group of the most runs which wait at the same place, or runs one
+/// in the interpreter if no two runs do. Returns whether there is a group.
+bool LockstepRunner::form_group() {
+    const auto largest = std::max_element(m_waiting.begin(), m_waiting.end(), [](const auto& a, const auto& b) {
+        return a.second.size() < b.second.size();
+    });
+    auto& lanes = largest->second;
+    if (lanes.size() == 1) {
+        const auto lane = std::move(lanes.back());
+        m_waiting.erase(largest);
+        run_scalar(lane);
+        return false;
+    }
+    m_pc = largest->first.first;
+    m_height = largest->first.second;
+    m_width = 0;
+    join(lanes);
+    if (lanes.empty()) {
+        m_waiting.erase(largest);
+    }
+    m_full_width = m_width;
+    return true;
+}
+
+void LockstepRunner::join(std::vector<Waiting>& lanes) {
+    while (m_width < LANE_COUNT && !lanes.empty()) {
+        const auto& lane = lanes.back();
+        for (size_t h = 0; h < m_height; ++h) {
+            m_rows[h].set_lane(m_width, lane.stack[h]);
+        }
+        m_lanes[m_width++] = lane.input;
+        lanes.pop_back();
+    }
+}
+
+bool LockstepRunner::regroup(size_t target) {
+    const auto waiting = m_waiting.find({ target, m_height });
+    if (waiting != m_waiting.end()) {
+        join(waiting->second);
+        if (waiting->second.empty()) {
+            m_waiting.erase(waiting);
+        }
+        m_full_width = std::max(m_full_width, m_width);
+    }
+    // only after lanes left, so that a group which is small anyway doesn't
+    // wait again and again
+    if (m_width < m_full_width && m_width <= LANE_COUNT / 2 && (!m_waiting.empty() || !m_faulting.empty())) {
+        leave(active(), target, false);
+        return false;
+    }
+    return true;
+}
+
+void LockstepRunner::run_scalar(const Waiting& lane) {
+    ++m_stats.scalar_runs;
+    auto& vm = m_vm;
+    std::copy(lane.stack.begin(), lane.stack.end(), vm.stack.stack);
+    vm.stack.stack_top = lane.stack.size();
+    vm.prog.pc = lane.pc;
+    vm.calls.clear();
+    vm.output.clear();
+    vm.error = {};
+    vm.div_cache = {};
+    VmStatus status;
+    do {
+        status = run(vm, UINT64_MAX);
+    } while (status == VmStatus::BudgetExhausted);
+    auto& result = m_runs[lane.input];
+    result.output += vm.output;
+    if (status == VmStatus::Faulted) {
+        result.error = vm.error;
+        result.fault_pc = vm.prog.pc;
+    }
+}
+
+void LockstepRunner::leave(LaneMask lanes, size_t pc, bool scalar) {
+    // from the last lane down, so that the lane moved into a freed slot
+    // never is one which has to leave
+    for (size_t l = m_width; l-- > 0;) {
+        if ((lanes & (LaneMask(1) << l)) == 0) {
+            continue;
+        }
+        Waiting waiting { .input = m_lanes[l], .pc = pc, .stack = std::vector<int64_t>(m_height) };
+        const auto last = m_width - 1;
+        for (size_t h = 0; h < m_height; ++h) {
+            waiting.stack[h] = m_rows[h].lane(l);
+            m_rows[h].set_lane(l, m_rows[h].lane(last));
+        }
+        m_lanes[l] = m_lanes[last];
+        --m_width;
+        if (scalar) {
+            m_faulting.push_back(std::move(waiting));
+        } else {
+            m_waiting[{ pc, m_height }].push_back(std::move(waiting));
+        }
+    }
+}
+
+size_t LockstepRunner::diverge(LaneMask taken, size_t target, size_t fallthrough) {
+    ++m_stats.divergences;
+    // ties go the way of the jump, which is where loops go back to
+    const bool jump = 2 * size_t(std::popcount(taken)) >= m_width;
+    leave(jump ? active() & ~taken : taken, jump ? fallthrough : target, false);
+    return jump ? target : fallthrough;
+}
+
+void LockstepRunner::divide_lanes(const Row& a, const Row& b, Row* quotient, Row* remainder) {
+    LaneMask faulting = 0;
+    for (size_t l = 0; l < m_width; ++l) {
+        if (b.lane(l) == 0 || (a.lane(l) == INT64_MIN && b.lane(l) == -1)) {
+            faulting |= LaneMask(1) << l;
+        }
+    }
+    if (faulting != 0) {
+        leave(faulting, m_pc, true);
+    }
+    for (size_t l = 0; l < m_width; ++l) {
+        const auto x = a.lane(l);
+        const auto y = b.lane(l);
+        if (quotient) {
+            quotient->set_lane(l, x / y);
+        }
+        if (remainder) {
+            remainder->set_lane(l, x % y);
+        }
+    }
+}
+
+void LockstepRunner::run_group() {
+    Row* const rows = m_rows.data();
+    size_t pc = m_pc;
+    size_t height = m_height;
+    size_t width = m_width;
+    const auto at = [&](size_t offset) -> Row& { return rows[height - offset]; };
+    const auto sync = [&] {
+        m_pc = pc;
+        m_height = height;
+    };
+    const auto branch = [&](LaneMask taken, size_t target, size_t fallthrough) {
+        taken &= lanes_below(width);
+        if (taken == 0) {
+            return fallthrough;
+        } else if (taken == lanes_below(width)) {
+            return target;
+        }
+        sync();
+        const auto next_pc = diverge(taken, target, fallthrough);
+        width = m_width;
+        return next_pc;
+    };
+    uint64_t instructions = 0;
+    uint64_t lane_instructions = 0;
+    while (width > 1) {
+        const auto op = m_ops[pc];
+        const auto imm = m_args[pc];
+        const auto heights = m_heights[pc];
+        if (op == NOT_AN_INSTRUCTION || height < heights.min || height > heights.max) [[unlikely]] {
+            // the interpreter faults (or does whatever it does on underflow, or
+            // calls)
+            sync();
+            leave(active(), pc, true);
+            width = 0;
+            break;
+        }
+        ++instructions;
+        lane_instructions += width;
+        size_t next_pc = pc + 1;
+        switch (op) {
+        case NOT_AN_INSTRUCTION:
+        case CALL:
+        case RET:
+            break;
+        case POP:
+            --height;
+            break;
+        case ADD:
+            binary(at(2), at(1), [](const UQuad& a, const UQuad& b) { return a + b; });
+            --height;
+            break;
+        case SUB:
+            binary(at(2), at(1), [](const UQuad& a, const UQuad& b) { return a - b; });
+            --height;
+            break;
+        case MUL:
+            binary(at(2), at(1), [](const UQuad& a, const UQuad& b) { return a * b; });
+            --height;
+            break;
+        case INC:
+            unary(at(1), [](const UQuad& a) { return a + 1; });
+            break;
+        case DEC:
+            unary(at(1), [](const UQuad& a) { return a - 1; });
+            break;
+        case DIV:
+        case MOD: {
+            auto* const quotient = op == DIV ? &at(2) : nullptr;
+            auto* const remainder = op == MOD ? &at(2) : nullptr;
+            if (!divide_quads(at(2), at(1), width, quotient, remainder)) [[unlikely]] {
+                sync();
+                divide_lanes(at(2), at(1), quotient, remainder);
+                width = m_width;
+            }
+            --height;
+            break;
+        }
+        case DIVP2:
+            each_lane(at(1), width, [imm](int64_t a) { return div_by_pow2(a, imm); });
+            break;
+        case MODP2:
+            each_lane(at(1), width, [imm](int64_t a) { return mod_by_pow2(a, imm); });
+            break;
+        case DIVC: {
+            const auto& magic = m_magics[imm];
+            each_lane(at(1), width, [&](int64_t a) { return div_by_magic(a, magic); });
+            break;
+        }
+        case MODC: {
+            const auto& magic = m_magics[imm];
+            each_lane(at(1), width, [&](int64_t a) { return mod_by_magic(a, magic); });
+            break;
+        }
+        case PRINT: {
+            const auto& a = at(1);
+            for (size_t l = 0; l < width; ++l) {
+                fmt::format_to(std::back_inserter(m_runs[m_lanes[l]].output), "{}\n", a.lane(l));
+            }
+            --height;
+            break;
+        }
+        case HALT:
+            m_width = 0;
+            width = 0;
+            continue;
+        case DUP:
+            rows[height] = at(1);
+            ++height;
+            break;
+        case DUP2:
+            rows[height] = at(2);
+            rows[height + 1] = at(1);
+            height += 2;
+            break;
+        case SWAP:
+            std::swap(at(1), at(2));
+            break;
+        case CLEAR:
+            height = 0;
+            break;
+        case OVER:
+            rows[height] = at(2);
+            ++height;
+            break;
+        case PUSH:
+            for (auto& quad : rows[height].q) {
+                quad = Quad {} + imm;
+            }
+            ++height;
+            break;
+        case JE:
+        case JN:
+        case JG:
+        case JL:
+        case JGE:
+        case JLE:
+        case INCJE:
+        case INCJN:
+        case INCJG:
+        case INCJL:
+        case INCJGE:
+        case INCJLE: {
+            const bool fused = op >= INCJE && op <= INCJLE;
+            if (fused) {
+                unary(at(1), [](const UQuad& a) { return a + 1; });
+            }
+            const auto& a = at(2);
+            const auto& b = at(1);
+            // the fused ones compare like the plain ones, in the same order
+            const auto condition = fused ? Op(op - INCJE + JE) : op;
+            LaneMask taken = 0;
+            if (condition == JE) {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x == y; });
+            } else if (condition == JN) {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x != y; });
+            } else if (condition == JG) {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x > y; });
+            } else if (condition == JL) {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x < y; });
+            } else if (condition == JGE) {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x >= y; });
+            } else {
+                taken = compare(a, b, [](const Quad& x, const Quad& y) { return x <= y; });
+            }
+            if (!fused) {
+                height -= 2;
+            }
+            next_pc = branch(taken, size_t(imm), pc + 1);
+            break;
+        }
+        case JMP:
+            next_pc = size_t(imm);
+            break;
+        case JZ:
+        case JNZ: {
+            const auto zero = compare(at(1), at(1), [](const Quad& x, const Quad&) { return x == 0; });
+            --height;
+            next_pc = branch(op == JZ ? zero : ~zero, size_t(imm), pc + 1);
+            break;
+        }
+        case MODJZ:
+        case MODJNZ: {
+            Row remainder;
+            if (!divide_quads(at(2), at(1), width, nullptr, &remainder)) [[unlikely]] {
+                sync();
+                divide_lanes(at(2), at(1), nullptr, &remainder);
+                width = m_width;
+            }
+            const auto zero = compare(remainder, remainder, [](const Quad& x, const Quad&) { return x == 0; });
+            next_pc = branch(op == MODJZ ? zero : ~zero, size_t(imm), pc + 1);
+            break;
+        }
+        }
+        if (next_pc <= pc && width > 1 && width < LANE_COUNT) {
+            sync();
+            width = regroup(next_pc) ? m_width : 0;
+        }
+        pc = next_pc;
+    }
+    if (width == 1) {
+        // on its own, it's better off in the interpreter, unless others catch
+        // up with it
+        sync();
+        leave(active(), pc, false);
+    }
+    m_stats.group_instructions += instructions;
+    m_stats.lane_instructions += lane_instructions;
+}
+
+}
+
+Result<std::vector<LaneRun>> execute_lanes(InstrStream&& instrs, std::span<const LaneInput> inputs, const VmConfig& cfg, LaneStats* stats) {
+    if (cfg.checked_arith) {
+        return { "Lockstep execution doesn't check arithmetic for overflow." };
+    }
+    auto vm_res = Vm::create(std::move(instrs), VmConfig { .stack_size = cfg.stack_size });
+    if (!vm_res) {
+        return { "{}", vm_res.error };
+    }
+    auto vm = vm_res.move();
+    vm.output_limit = SIZE_MAX;
+    std::vector<LaneRun> runs(inputs.size());
+    LaneStats lane_stats;
+    LockstepRunner runner(vm, runs, lane_stats);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs[i].size() > vm.stack.size) {
+            runs[i].error = Error("Stack overflow: The stack can only hold {} values.", vm.stack.size);
+            continue;
+        }
+        runner.add(i, inputs[i]);
+    }
+    runner.run_all();
+    if (stats) {
+        *stats = lane_stats;
+    }
+    return runs;
+}
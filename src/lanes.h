@@ -0,0 +1,61 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include "interpreter.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+/// Lockstep execution: one program run over many inputs at once.
+///
+/// Up to LANE_COUNT runs which are at the same instruction, with equally high
+/// stacks, form a group, and each instruction is dispatched once for the whole
+/// group. The stack of a group holds one row per height, with one value per
+/// lane, so that arithmetic on a row is a vector operation. Where the lanes of
+/// a group go different ways at a conditional jump, the larger part goes on,
+/// and the other lanes wait until they can form a group with other waiting
+/// lanes at the same instruction. A lane which is left on its own, which
+/// would fault, or which calls a subroutine, continues in the normal
+/// interpreter.
+
+/// Number of lanes in a group.
+constexpr size_t LANE_COUNT = 8;
+
+/// The values a run starts with on its stack, the last one on top.
+using LaneInput = std::vector<int64_t>;
+
+/// Reads inputs for execute_lanes(), one per line, as numbers separated by
+/// whitespace. Empty lines, and lines starting with `#`, are skipped.
+[[nodiscard]] Result<std::vector<LaneInput>> read_lane_inputs(const std::string& filename);
+
+/// The outcome of the run on one input.
+struct LaneRun {
+    /// Output of `print`.
+    std::string output {};
+    /// Set if the run faulted.
+    Error error {};
+    /// The pc of the faulting instruction, like execute() reports it.
+    size_t fault_pc { SIZE_MAX };
+};
+
+struct LaneStats {
+    /// Instructions dispatched for a group, and how many runs executed them in
+    /// total, so the average group width is their quotient.
+    uint64_t group_instructions { 0 };
+    uint64_t lane_instructions { 0 };
+    /// Conditional jumps at which the lanes of a group went different ways.
+    uint64_t divergences { 0 };
+    /// Number of times a run continued in the interpreter.
+    size_t scalar_runs { 0 };
+};
+
+/// Runs the program once for each input, with the input on the stack, and
+/// returns what each run printed and whether it faulted, in the order of the
+/// inputs. Each run prints and faults exactly like execute() would, if its
+/// stack started out with the input on it. Fails if the program can't be
+/// loaded, or with VmConfig::checked_arith, which lockstep execution doesn't
+/// implement; other VmConfig options than the stack size are ignored.
+[[nodiscard]] Result<std::vector<LaneRun>> execute_lanes(InstrStream&& instrs, std::span<const LaneInput> inputs, const VmConfig& cfg = {}, LaneStats* stats = nullptr);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// The pieces parse_line() splits and classifies words with. They're
+// constexpr, so that embed.h runs the same lexer at C++ compile time.
+
+/// Whether the character can be part of a word. Any other character
+/// separates words.
+constexpr bool is_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == ':';
+}
+
+/// Like std::isspace() in the "C" locale.
+constexpr bool is_space_char(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+constexpr std::string_view trim_spaces(std::string_view str) {
+    while (!str.empty() && is_space_char(str.front())) {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && is_space_char(str.back())) {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+/// The line up to its `#` comment, if any.
+constexpr std::string_view strip_comment(std::string_view line) {
+    return line.substr(0, line.find('#'));
+}
+
+/// Calls `word(text, column)` for each word of the line, outside of its
+/// comment. The column is 1-based, and counts from the first character which
+/// isn't whitespace. Stops as soon as `word` returns false, and returns false
+/// then.
+template<typename Word>
+constexpr bool for_each_word(std::string_view line, Word&& word) {
+    line = strip_comment(trim_spaces(line));
+    std::string_view::size_type start = 0;
+    while (start < line.size()) {
+        if (!is_word_char(line[start])) {
+            ++start;
+            continue;
+        }
+        auto end = start;
+        while (end < line.size() && is_word_char(line[end])) {
+            ++end;
+        }
+        if (!word(line.substr(start, end - start), start + 1)) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+enum class WordKind {
+    /// An instruction, or a label with a leading `:`, `:?[a-zA-Z_][a-zA-Z_0-9]*`.
+    Name,
+    /// `[-+]?[0-9]+`
+    Integer,
+    /// `[-+]?0x[0-9a-f]+`
+    HexInteger,
+    Invalid,
+};
+
+constexpr WordKind classify_word(std::string_view word) {
+    const auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+    const auto is_name_start = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; };
+    if (word.empty()) {
+        return WordKind::Invalid;
+    }
+    auto name = word.front() == ':' ? word.substr(1) : word;
+    if (!name.empty() && is_name_start(name.front())) {
+        for (char c : name) {
+            if (!is_name_start(c) && !is_digit(c)) {
+                return WordKind::Invalid;
+            }
+        }
+        return WordKind::Name;
+    }
+    auto digits = word.front() == '-' || word.front() == '+' ? word.substr(1) : word;
+    auto kind = WordKind::Integer;
+    if (digits.starts_with("0x")) {
+        digits.remove_prefix(2);
+        kind = WordKind::HexInteger;
+    }
+    if (digits.empty()) {
+        return WordKind::Invalid;
+    }
+    for (char c : digits) {
+        if (!is_digit(c) && !(kind == WordKind::HexInteger && c >= 'a' && c <= 'f')) {
+            return WordKind::Invalid;
+        }
+    }
+    return kind;
+}
+
+/// The value of an Integer or HexInteger word, or nothing if it's too large.
+/// INT64_MAX and INT64_MIN count as too large, as they always did, since
+/// strtoll() saturates to them.
+constexpr std::optional<int64_t> word_value(std::string_view word, WordKind kind) {
+    const bool negative = word.front() == '-';
+    if (word.front() == '-' || word.front() == '+') {
+        word.remove_prefix(1);
+    }
+    uint64_t base = 10;
+    if (kind == WordKind::HexInteger) {
+        word.remove_prefix(2);
+        base = 16;
+    }
+    const uint64_t limit = negative ? uint64_t(INT64_MAX) : uint64_t(INT64_MAX) - 1;
+    uint64_t magnitude = 0;
+    for (char c : word) {
+        const uint64_t digit = c <= '9' ? uint64_t(c - '0') : uint64_t(c - 'a' + 10);
+        if (magnitude > (limit - digit) / base) {
+            return std::nullopt;
+        }
+        magnitude = magnitude * base + digit;
+    }
+    return negative ? -int64_t(magnitude) : int64_t(magnitude);
+}
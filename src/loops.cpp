@@ -0,0 +1,421 @@
+#include "cfg.h"
+#include "compiler.h"
+#include "instruction.h"
+#include <cstdint>
+#include <unordered_set>
+
+/// A value on the stack while simulating one loop iteration.
+struct SymValue {
+    enum Kind {
+        Unknown,
+        Const,
+        /// The value in stack slot `slot` when entering the loop, plus `value`.
+        Entry,
+    } kind;
+    size_t slot;
+    int64_t value;
+};
+
+/// Simulates the stack over one iteration of a loop, in terms of the stack at
+/// loop entry.
+struct LoopSimulation {
+    std::vector<SymValue> stack {};
+    /// Number of slots below the entry stack top which have been touched.
+    size_t entry_slots { 0 };
+    /// Pairs of values compared by conditional jumps, as (a, b) of `a <cc> b`.
+    std::vector<std::pair<SymValue, SymValue>> compares {};
+    bool failed { false };
+
+    SymValue pop() {
+        if (stack.empty()) {
+            return { SymValue::Entry, entry_slots++, 0 };
+        }
+        auto value = stack.back();
+        stack.pop_back();
+        return value;
+    }
+    void push(SymValue value) { stack.push_back(value); }
+
+    static SymValue add(SymValue a, SymValue b, int64_t sign) {
+        if (a.kind == SymValue::Const && b.kind == SymValue::Const) {
+            return { SymValue::Const, 0, int64_t(uint64_t(a.value) + uint64_t(sign * b.value)) };
+        } else if (a.kind == SymValue::Entry && b.kind == SymValue::Const) {
+            return { SymValue::Entry, a.slot, int64_t(uint64_t(a.value) + uint64_t(sign * b.value)) };
+        } else if (sign > 0 && a.kind == SymValue::Const && b.kind == SymValue::Entry) {
+            return { SymValue::Entry, b.slot, int64_t(uint64_t(a.value) + uint64_t(b.value)) };
+        }
+        return { SymValue::Unknown, 0, 0 };
+    }
+
+    void step(const Instr& instr) {
+        const auto op = instr.s.op;
+        switch (op) {
+        case NOT_AN_INSTRUCTION:
+        case JMP:
+            break;
+        case PUSH:
+            push({ SymValue::Const, 0, instr.s.val });
+            break;
+        case INC:
+        case DEC:
+            push(add(pop(), { SymValue::Const, 0, 1 }, op == INC ? 1 : -1));
+            break;
+        case ADD:
+        case SUB: {
+            auto b = pop();
+            auto a = pop();
+            push(add(a, b, op == ADD ? 1 : -1));
+            break;
+        }
+        case DUP: {
+            auto a = pop();
+            push(a);
+            push(a);
+            break;
+        }
+        case DUP2: {
+            auto b = pop();
+            auto a = pop();
+            push(a);
+            push(b);
+            push(a);
+            push(b);
+            break;
+        }
+        case OVER: {
+            auto b = pop();
+            auto a = pop();
+            push(a);
+            push(b);
+            push(a);
+            break;
+        }
+        case SWAP: {
+            auto b = pop();
+            auto a = pop();
+            push(b);
+            push(a);
+            break;
+        }
+        case JE:
+        case JN:
+        case JG:
+        case JL:
+        case JGE:
+        case JLE: {
+            auto b = pop();
+            auto a = pop();
+            compares.emplace_back(a, b);
+            break;
+        }
+        case INCJE:
+        case INCJN:
+        case INCJG:
+        case INCJL:
+        case INCJGE:
+        case INCJLE: {
+            auto b = add(pop(), { SymValue::Const, 0, 1 }, 1);
+            auto a = pop();
+            compares.emplace_back(a, b);
+            push(a);
+            push(b);
+            break;
+        }
+        case CLEAR:
+        case HALT:
+        // what the subroutine does to the stack isn't known here
+        case CALL:
+        case RET:
+            failed = true;
+            break;
+        case POP:
+        case MUL:
+        case DIV:
+        case MOD:
+        case PRINT:
+        case JZ:
+        case JNZ:
+        case DIVP2:
+        case MODP2:
+        case DIVC:
+        case MODC:
+        case MODJZ:
+        case MODJNZ: {
+            // everything else produces values we don't track
+            auto effect = op_stack_effect(op);
+            for (size_t i = 0; i < effect.pops; ++i) {
+                pop();
+            }
+            for (size_t i = 0; i < effect.pushes; ++i) {
+                push({ SymValue::Unknown, 0, 0 });
+            }
+            break;
+        }
+        }
+    }
+};
+
+/// The blocks one iteration runs through, if all iterations take the same path,
+/// starting at the header and ending at the latch.
+static std::optional<std::vector<size_t>> iteration_path(const Cfg& cfg, const NaturalLoop& loop) {
+    std::vector<size_t> path { loop.header };
+    while (true) {
+        size_t next = SIZE_MAX;
+        for (auto succ : cfg.blocks[path.back()].succs) {
+            if (loop.contains(succ)) {
+                if (next != SIZE_MAX) {
+                    // more than one way to stay in the loop
+                    return std::nullopt;
+                }
+                next = succ;
+            }
+        }
+        if (next == loop.header) {
+            return path;
+        }
+        if (next == SIZE_MAX || path.size() > loop.blocks.size()) {
+            return std::nullopt;
+        }
+        path.push_back(next);
+    }
+}
+
+static size_t count_instrs(const AbstractInstrStream& abstracts, const Cfg& cfg, const std::vector<size_t>& path) {
+    size_t count = 0;
+    for (auto b : path) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; ++i) {
+            if (abstracts[i].instr.s.op != NOT_AN_INSTRUCTION) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+/// Looks for a stack slot which changes by a constant each iteration, while
+/// all other slots stay the same.
+static void find_induction_variable(const AbstractInstrStream& abstracts, const Cfg& cfg, const std::vector<size_t>& path, LoopReport& report) {
+    LoopSimulation sim;
+    for (auto b : path) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end && !sim.failed; ++i) {
+            sim.step(abstracts[i].instr);
+        }
+    }
+    if (sim.failed || sim.stack.size() != sim.entry_slots) {
+        return;
+    }
+    std::optional<size_t> induction_slot;
+    int64_t step = 0;
+    for (size_t i = 0; i < sim.stack.size(); ++i) {
+        const auto slot = sim.stack.size() - 1 - i;
+        const auto& value = sim.stack[i];
+        if (value.kind != SymValue::Entry || value.slot != slot) {
+            return;
+        }
+        if (value.value != 0) {
+            if (induction_slot.has_value()) {
+                return;
+            }
+            induction_slot = slot;
+            step = value.value;
+        }
+    }
+    if (!induction_slot.has_value()) {
+        return;
+    }
+    report.induction_slot = induction_slot;
+    report.induction_step = step;
+    for (const auto& [a, b] : sim.compares) {
+        if (a.kind != SymValue::Entry || b.kind != SymValue::Entry) {
+            continue;
+        }
+        if (a.slot == *induction_slot && b.slot != *induction_slot && b.value == 0) {
+            report.bound_slot = b.slot;
+        } else if (b.slot == *induction_slot && a.slot != *induction_slot && a.value == 0) {
+            report.bound_slot = a.slot;
+        }
+    }
+}
+
+static Op fuse_inc_jump(Op jump) {
+    switch (jump) {
+    case JE:
+        return INCJE;
+    case JN:
+        return INCJN;
+    case JG:
+        return INCJG;
+    case JL:
+        return INCJL;
+    case JGE:
+        return INCJGE;
+    case JLE:
+        return INCJLE;
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case ADD:
+    case INC:
+    case DEC:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case PUSH:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+    case RET:
+        return NOT_AN_INSTRUCTION;
+    }
+    return NOT_AN_INSTRUCTION;
+}
+
+static inline Op op_at(const AbstractInstrStream& abstracts, size_t i) {
+    return i < abstracts.size() ? abstracts[i].instr.s.op : NOT_AN_INSTRUCTION;
+}
+
+void fuse_superinstructions(AbstractInstrStream& abstracts, const std::vector<bool>& eligible, std::vector<bool>& remove) {
+    for (size_t i = 0; i + 2 < abstracts.size(); ++i) {
+        if (!eligible[i] || remove[i]) {
+            continue;
+        }
+        auto& abstract = abstracts[i];
+        const auto op2 = op_at(abstracts, i + 2);
+        Op fused = NOT_AN_INSTRUCTION;
+        // `inc; dup2; jcc :label` -> `incjcc :label`, the increment-compare-branch of a counted loop
+        if (abstract.instr.s.op == INC && op_at(abstracts, i + 1) == DUP2) {
+            fused = fuse_inc_jump(op2);
+        }
+        // `dup2; mod; jz :label` -> `modjz :label`
+        if (abstract.instr.s.op == DUP2 && op_at(abstracts, i + 1) == MOD && (op2 == JZ || op2 == JNZ)) {
+            fused = op2 == JZ ? MODJZ : MODJNZ;
+        }
+        if (fused == NOT_AN_INSTRUCTION || remove[i + 1] || remove[i + 2]) {
+            continue;
+        }
+        abstract.instr.s.op = fused;
+        abstract.instr.s.val = 0;
+        abstract.unresolved_label = abstracts[i + 2].unresolved_label;
+        if (abstract.location.line == abstracts[i + 2].location.line) {
+            abstract.location.col_end = abstracts[i + 2].location.col_end;
+        }
+        remove[i + 1] = true;
+        remove[i + 2] = true;
+        i += 2;
+    }
+}
+
+void remove_marked(AbstractInstrStream& abstracts, const std::vector<bool>& remove) {
+    size_t kept = 0;
+    for (size_t i = 0; i < abstracts.size(); ++i) {
+        if (!remove[i]) {
+            if (kept != i) {
+                abstracts[kept] = std::move(abstracts[i]);
+            }
+            ++kept;
+        }
+    }
+    abstracts.resize(kept);
+}
+
+Error optimize_loops(AbstractInstrStream& abstracts, std::vector<LoopReport>* reports) {
+    auto cfg_res = build_cfg(abstracts);
+    if (!cfg_res) {
+        // not an error, there's just nothing we can do for this program
+        return {};
+    }
+    const auto& cfg = cfg_res.value();
+    const auto loops = find_natural_loops(cfg);
+    if (loops.empty()) {
+        return {};
+    }
+
+    std::vector<bool> in_loop(abstracts.size(), false);
+    std::unordered_set<size_t> latch_jumps;
+    std::vector<LoopReport> found;
+    for (const auto& loop : loops) {
+        for (auto b : loop.blocks) {
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; ++i) {
+                in_loop[i] = true;
+            }
+        }
+        for (auto latch : loop.latches) {
+            const auto& block = cfg.blocks[latch];
+            if (block.end > block.begin && abstracts[block.end - 1].instr.s.op == JMP) {
+                latch_jumps.insert(block.end - 1);
+            }
+        }
+        LoopReport report {
+            .header = abstracts[cfg.blocks[loop.header].begin].unresolved_label.value_or(""),
+            .blocks = loop.blocks.size(),
+            .induction_slot = std::nullopt,
+            .induction_step = 0,
+            .bound_slot = std::nullopt,
+            .instrs_before = std::nullopt,
+            .instrs_after = std::nullopt,
+        };
+        if (auto path = iteration_path(cfg, loop)) {
+            report.instrs_before = count_instrs(abstracts, cfg, *path);
+            find_induction_variable(abstracts, cfg, *path, report);
+        }
+        found.push_back(std::move(report));
+    }
+
+    std::vector<bool> remove(abstracts.size(), false);
+    for (size_t i = 0; i < abstracts.size(); ++i) {
+        if (!in_loop[i] || remove[i]) {
+            continue;
+        }
+        auto& abstract = abstracts[i];
+        // rotate the loop: `jcc :exit; jmp :header; :exit` -> `j!cc :header; :exit`,
+        // so the back edge is taken by the conditional jump itself
+        if (op_is_conditional_jump(abstract.instr.s.op)
+            && latch_jumps.contains(i + 1)
+            && op_at(abstracts, i + 2) == NOT_AN_INSTRUCTION
+            && abstracts[i + 2].unresolved_label == abstract.unresolved_label) {
+            abstract.instr.s.op = invert_condition(abstract.instr.s.op);
+            abstract.unresolved_label = abstracts[i + 1].unresolved_label;
+            remove[i + 1] = true;
+        }
+    }
+    fuse_superinstructions(abstracts, in_loop, remove);
+    remove_marked(abstracts, remove);
+
+    if (reports) {
+        // analyze again, to see what the rewrites gained per iteration
+        if (auto new_cfg = build_cfg(abstracts)) {
+            for (const auto& loop : find_natural_loops(new_cfg.value())) {
+                const auto& header = abstracts[new_cfg.value().blocks[loop.header].begin].unresolved_label;
+                for (auto& report : found) {
+                    if (header.has_value() && report.header == *header) {
+                        if (auto path = iteration_path(new_cfg.value(), loop)) {
+                            report.instrs_after = count_instrs(abstracts, new_cfg.value(), *path);
+                        }
+                    }
+                }
+            }
+        }
+        *reports = std::move(found);
+    }
+    return {};
+}
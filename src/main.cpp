@@ -1,26 +1,68 @@
+#include "bytecode.h"
 #include "compiler.h"
+#include "decompiler.h"
 #include "instruction.h"
 #include "interpreter.h"
+#include "lanes.h"
+#include "mem_stats.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "server.h"
+#include "stream_compiler.h"
 #include <algorithm>
 #include <cerrno>
+#include <charconv>
 #include <compare>
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fmt/core.h>
 #include <fstream>
 #include <ios>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
 
+using FilePtr = std::unique_ptr<std::FILE, int (*)(std::FILE*)>;
+
 struct Config {
     bool compile_only = false;
     bool exec_only = false;
     bool optimize = true;
     bool decompile = false;
+    bool stats = false;
+    bool dense = false;
+    bool stream = false;
+    bool strip = false;
+    bool trace = false;
+    bool registers = false;
+    bool checked_arith = false;
+    bool serve = false;
+    bool client = false;
+    bool mem_stats = false;
+    bool pin_workers = false;
+    Placement placement {};
+    /// empty if not specified
+    std::string_view socket_path {};
+    /// empty if not specified
+    std::string_view profile_generate {};
+    /// empty if not specified
+    std::string_view profile_use {};
+    /// empty if not specified
+    std::string_view output {};
+    /// empty if not specified
+    std::string_view inputs {};
+    /// empty if not specified
+    std::string_view mem_stats_json {};
+    /// 0 if not specified
+    size_t stack_size = 0;
     std::vector<std::string_view> files {};
 };
 
@@ -33,10 +75,30 @@ static Result<Config> parse_config_from_argv(int argc, char** argv) {
                 fmt::print("Usage:\n\t{} [OPTION...] <FILE...>\n\nOptions:\n"
                            "\t--help\t\t Displays help\n"
                            "\t--version\t Displays version\n"
-                           "\t--decompile\t Decompiles one or more given executable .mclb file(s)\n"
+                           "\t--decompile\t Decompiles one or more given executable .mclb file(s). With --output, also writes a source map of the output to <FILE>.map\n"
                            "\t--dont-optimize\t Disables optimizations (optimizations are enabled by default)\n"
                            "\t--compile\t Enables compiling bytecode and not running the code. First specified file becomes output file ending in .mclb\n"
-                           "\t--exec\t\t Expects files to be bytecode executables, and runs them\n",
+                           "\t--exec\t\t Expects files to be bytecode executables, and runs them\n"
+                           "\t--stack-size=<N>\t Number of values the stack can hold. When compiling, this is stored in the .mclb as a hint\n"
+                           "\t--stream\t Compiles while reading the source, without holding all of it in memory. Optimizes less\n"
+                           "\t--output=<FILE>\t Name of the compiled file, instead of the source file name ending in .mclb. Needed when compiling from stdin (`-`)\n"
+                           "\t--dense\t\t Writes the compiled .mclb in the compact variable-length encoding\n"
+                           "\t--strip\t\t Leaves the source map, which maps faults back to source lines, out of the compiled .mclb\n"
+                           "\t--profile-generate=<FILE>\t Counts how often each instruction runs and each jump is taken, and writes them to FILE\n"
+                           "\t--profile-use=<FILE>\t Optimizes for the counts in FILE, which --profile-generate wrote for the same source and options\n"
+                           "\t--trace\t\t Records hot loops while running, and runs them as traces which keep the stack in registers\n"
+                           "\t--registers\t Translates the program into register code before running it, which keeps the stack in registers wherever its height is known\n"
+                           "\t--inputs=<FILE>\t Runs the program once for each line of FILE, with the numbers on it on the stack, several runs at once in lockstep\n"
+                           "\t--checked-arith\t Faults on integer overflow instead of wrapping around. Also pass it when compiling, so that constants aren't folded into wrapped values\n"
+                           "\t--serve\t\t Runs a server which compiles and runs the programs clients send it, caching compiled programs\n"
+                           "\t--client\t Sends the source files to the server to run, instead of running them in this process\n"
+                           "\t--socket=<PATH>\t Socket of --serve and --client, instead of $XDG_RUNTIME_DIR/mcl.sock\n"
+                           "\t--huge-pages=<transparent|explicit>\t Puts the instructions of large programs into transparent huge pages, or into reserved ones (see /proc/sys/vm/nr_hugepages)\n"
+                           "\t--prefault\t Backs the whole stack with memory before running, instead of as it grows\n"
+                           "\t--pin-workers\t Pins each worker of --serve to a CPU, so that it stays next to the memory of the programs it runs\n"
+                           "\t--stats\t\t Prints what the loop optimizations found, and the number of executed instructions\n"
+                           "\t--mem-stats\t Prints the allocations, the peak of allocated memory and the peak RSS of each stage of compiling and running\n"
+                           "\t--mem-stats=<FILE>\t Writes what --mem-stats prints to FILE, as JSON\n",
                     argv[0]);
                 std::exit(0);
             } else if (arg == "--version") {
@@ -50,6 +112,58 @@ static Result<Config> parse_config_from_argv(int argc, char** argv) {
                 cfg.compile_only = true;
             } else if (arg == "--exec") {
                 cfg.exec_only = true;
+            } else if (arg == "--stream") {
+                cfg.stream = true;
+            } else if (arg.starts_with("--output=")) {
+                cfg.output = arg.substr(std::string_view("--output=").size());
+            } else if (arg.starts_with("--inputs=")) {
+                cfg.inputs = arg.substr(std::string_view("--inputs=").size());
+            } else if (arg == "--dense") {
+                cfg.dense = true;
+            } else if (arg == "--strip") {
+                cfg.strip = true;
+            } else if (arg.starts_with("--profile-generate=")) {
+                cfg.profile_generate = arg.substr(std::string_view("--profile-generate=").size());
+            } else if (arg.starts_with("--profile-use=")) {
+                cfg.profile_use = arg.substr(std::string_view("--profile-use=").size());
+            } else if (arg == "--trace") {
+                cfg.trace = true;
+            } else if (arg == "--registers") {
+                cfg.registers = true;
+            } else if (arg == "--checked-arith") {
+                cfg.checked_arith = true;
+            } else if (arg == "--serve") {
+                cfg.serve = true;
+            } else if (arg == "--client") {
+                cfg.client = true;
+            } else if (arg.starts_with("--huge-pages=")) {
+                auto value = arg.substr(std::string_view("--huge-pages=").size());
+                if (value == "transparent") {
+                    cfg.placement.huge_pages = HugePages::Transparent;
+                } else if (value == "explicit") {
+                    cfg.placement.huge_pages = HugePages::Explicit;
+                } else {
+                    return { "Invalid huge pages '{}', expected 'transparent' or 'explicit'.", value };
+                }
+            } else if (arg == "--prefault") {
+                cfg.placement.prefault = true;
+            } else if (arg == "--pin-workers") {
+                cfg.pin_workers = true;
+            } else if (arg.starts_with("--socket=")) {
+                cfg.socket_path = arg.substr(std::string_view("--socket=").size());
+            } else if (arg == "--stats") {
+                cfg.stats = true;
+            } else if (arg == "--mem-stats") {
+                cfg.mem_stats = true;
+            } else if (arg.starts_with("--mem-stats=")) {
+                cfg.mem_stats = true;
+                cfg.mem_stats_json = arg.substr(std::string_view("--mem-stats=").size());
+            } else if (arg.starts_with("--stack-size=")) {
+                auto value = arg.substr(std::string_view("--stack-size=").size());
+                auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), cfg.stack_size);
+                if (ec != std::errc() || end != value.data() + value.size() || cfg.stack_size == 0) {
+                    return { "Invalid stack size '{}', expected a positive number of values.", value };
+                }
             } else {
                 return { "Unknown argument '{}', run '{} --help' for help.", arg, argv[0] };
             }
@@ -60,6 +174,277 @@ static Result<Config> parse_config_from_argv(int argc, char** argv) {
     return cfg;
 }
 
+static void print_fold_diagnostics(const std::vector<FoldDiagnostic>& diagnostics) {
+    for (const auto& diagnostic : diagnostics) {
+        fmt::print("Warning: {}: {}\n", to_string(diagnostic.location), diagnostic.message);
+    }
+}
+
+/// Name of the .mclb file which the given source file compiles into.
+static std::string output_filename(std::string_view filename, const Config& cfg) {
+    if (!cfg.output.empty()) {
+        return std::string(cfg.output);
+    }
+    return std::filesystem::path(filename).replace_extension("mclb").string();
+}
+
+/// Prints the source lines which executed the most instructions, using the
+/// source map of the file.
+static void print_hot_lines(const std::string& filename, const Profile& profile) {
+    auto source_map = read_source_map(filename);
+    if (!source_map) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, std::string>> lines;
+    std::unordered_map<std::string, size_t> line_index;
+    const auto rows = source_map.value().decode();
+    for (size_t r = 0; r < rows.size(); ++r) {
+        const auto end = r + 1 < rows.size() ? rows[r + 1].pc : profile.counts.size();
+        const auto name = fmt::format("{}:{}", rows[r].loc.file, rows[r].loc.line);
+        auto [it, inserted] = line_index.try_emplace(name, lines.size());
+        if (inserted) {
+            lines.emplace_back(0, name);
+        }
+        for (size_t pc = rows[r].pc; pc < end && pc < profile.counts.size(); ++pc) {
+            lines[it->second].first += profile.counts[pc];
+        }
+    }
+    std::stable_sort(lines.begin(), lines.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    fmt::print("Hottest source lines:\n");
+    for (size_t i = 0; i < lines.size() && i < 5 && lines[i].first != 0; ++i) {
+        fmt::print("  {:>12} instructions  {}\n", lines[i].first, lines[i].second);
+    }
+}
+
+/// Runs the program once for each of the inputs, see execute_lanes(), and
+/// prints what each run printed, in the order of the inputs, up to the first
+/// run which faulted.
+static Error execute_inputs(const std::string& filename, Bytecode&& bytecode, size_t stack_size, const Config& cfg) {
+    auto inputs = read_lane_inputs(std::string(cfg.inputs));
+    if (!inputs) {
+        return Error("{}", inputs.error);
+    }
+    const auto flags = bytecode.header.flags;
+    InstrStream instrs;
+    std::vector<size_t> offsets;
+    if ((flags & BYTECODE_DENSE) != 0) {
+        // lanes run pre-decoded instructions, and faults are reported by byte offset
+        auto decoded = decode_dense(bytecode.dense);
+        if (!decoded) {
+            return Error("{}", decoded.error);
+        }
+        instrs = decoded.move();
+        offsets = dense_offsets(bytecode.dense);
+    } else {
+        instrs = std::move(bytecode.instrs);
+    }
+    LaneStats stats;
+    auto runs = execute_lanes(std::move(instrs), inputs.value(), VmConfig { .stack_size = stack_size, .placement = cfg.placement }, cfg.stats ? &stats : nullptr);
+    if (!runs) {
+        return Error("{}", runs.error);
+    }
+    if (cfg.stats) {
+        fmt::print("Ran {} inputs: {} instructions for groups of {:.2f} lanes on average, {} divergences, {} runs in the interpreter.\n",
+            inputs.value().size(), stats.group_instructions,
+            stats.group_instructions == 0 ? 0.0 : double(stats.lane_instructions) / double(stats.group_instructions),
+            stats.divergences, stats.scalar_runs);
+    }
+    for (size_t i = 0; i < runs.value().size(); ++i) {
+        const auto& run = runs.value()[i];
+        std::fwrite(run.output.data(), 1, run.output.size(), stdout);
+        if (!run.error) {
+            continue;
+        }
+        auto fault_pc = run.fault_pc;
+        if (fault_pc != SIZE_MAX && !offsets.empty()) {
+            fault_pc = fault_pc < offsets.size() ? offsets[fault_pc] : SIZE_MAX;
+        }
+        if (fault_pc != SIZE_MAX && (flags & BYTECODE_SOURCE_MAP) != 0) {
+            auto source_map = read_source_map(filename);
+            if (!source_map) {
+                return Error("Input {}: {} (no source location: {})", i + 1, run.error.error, source_map.error);
+            }
+            auto loc = source_map.value().lookup(fault_pc);
+            if (loc.has_value()) {
+                return Error("Input {}: {}, at {}", i + 1, run.error.error, to_string(*loc));
+            }
+        }
+        return Error("Input {}: {}", i + 1, run.error.error);
+    }
+    return {};
+}
+
+/// Reads a .mclb file and runs it. The stack size given on the command line
+/// wins over the hint in the file.
+static Error load_and_execute(const std::string& filename, const Config& cfg) {
+    auto bytecode = read_bytecode(filename);
+    if (!bytecode) {
+        return Error("{}", bytecode.error);
+    }
+    auto stack_size = cfg.stack_size != 0 ? cfg.stack_size : size_t(bytecode.value().header.stack_size);
+    if (!cfg.inputs.empty()) {
+        return execute_inputs(filename, bytecode.move(), stack_size, cfg);
+    }
+    VmConfig vm_cfg { .stack_size = stack_size, .placement = cfg.placement };
+    const auto flags = bytecode.value().header.flags;
+    const bool profiling = !cfg.profile_generate.empty();
+    vm_cfg.profile = profiling;
+    vm_cfg.trace = cfg.trace;
+    vm_cfg.registers = cfg.registers;
+    vm_cfg.checked_arith = cfg.checked_arith;
+    // remember where each instruction is, to key the profile by instruction
+    std::vector<Op> ops;
+    std::vector<size_t> pcs;
+    if (profiling && (flags & BYTECODE_DENSE) != 0) {
+        pcs = dense_offsets(bytecode.value().dense);
+        for (auto pc : pcs) {
+            ops.push_back(dense_op(bytecode.value().dense.data() + pc));
+        }
+    } else if (profiling) {
+        for (const auto& instr : bytecode.value().instrs) {
+            pcs.push_back(ops.size());
+            ops.push_back(instr.s.op);
+        }
+    }
+    ExecStats stats;
+    size_t fault_pc = SIZE_MAX;
+    Error err;
+    if ((flags & BYTECODE_DENSE) != 0 && cfg.registers) {
+        return Error("`--registers` can't run dense code, which only runs in the stack interpreter.");
+    }
+    if ((flags & BYTECODE_DENSE) != 0) {
+        err = execute_dense(std::move(bytecode.move().dense), vm_cfg, cfg.stats || profiling ? &stats : nullptr, &fault_pc);
+    } else {
+        err = execute(std::move(bytecode.move().instrs), vm_cfg, cfg.stats || profiling ? &stats : nullptr, &fault_pc);
+    }
+    if (cfg.stats) {
+        fmt::print("Executed {} instructions.\n", stats.instructions);
+        if (cfg.trace) {
+            fmt::print("Recorded {} traces ({} aborted), which ran {} iterations and were left {} times through a guard.\n",
+                stats.traces.recorded, stats.traces.aborted, stats.traces.iterations, stats.traces.exits);
+        }
+        if (cfg.registers) {
+            const auto& regs = stats.registers;
+            fmt::print("Translated {} instructions into {} register ops", regs.translated, regs.ops);
+            if (regs.fell_back) {
+                fmt::print(", and continued in the stack interpreter at pc={}.\n", regs.fallback_pc);
+            } else {
+                fmt::print(".\n");
+            }
+        }
+    }
+    if (profiling) {
+        // a program which faulted still ran, so its profile is worth keeping
+        auto profile = make_profile(ops, pcs, stats.profile);
+        auto write_err = write_profile(std::string(cfg.profile_generate), profile);
+        if (write_err) {
+            return write_err;
+        }
+        if (cfg.stats && (flags & BYTECODE_SOURCE_MAP) != 0) {
+            print_hot_lines(filename, profile);
+        }
+    }
+    if (err && fault_pc != SIZE_MAX && (flags & BYTECODE_SOURCE_MAP) != 0) {
+        // only now is the source map worth reading
+        auto source_map = read_source_map(filename);
+        if (!source_map) {
+            return Error("{} (no source location: {})", err.error, source_map.error);
+        }
+        auto loc = source_map.value().lookup(fault_pc);
+        if (loc.has_value()) {
+            return Error("{}, at {}", err.error, to_string(*loc));
+        }
+    }
+    return err;
+}
+
+static void print_loop_reports(const std::vector<LoopReport>& reports) {
+    const auto optional_str = [](const std::optional<size_t>& value) {
+        return value.has_value() ? std::to_string(*value) : std::string("?");
+    };
+    for (const auto& report : reports) {
+        fmt::print("Loop at :{} ({} blocks): ", report.header, report.blocks);
+        if (report.induction_slot.has_value()) {
+            fmt::print("induction variable in stack slot {} with step {}, ", *report.induction_slot, report.induction_step);
+            if (report.bound_slot.has_value()) {
+                fmt::print("bound in stack slot {}, ", *report.bound_slot);
+            }
+        } else {
+            fmt::print("no induction variable, ");
+        }
+        fmt::print("{} -> {} instructions per iteration.\n", optional_str(report.instrs_before), optional_str(report.instrs_after));
+    }
+}
+
+static void print_inline_reports(const std::vector<InlineReport>& reports) {
+    for (const auto& report : reports) {
+        fmt::print("Subroutine :{} ({} instructions): {} calls inlined, {} kept{}.\n", report.label, report.instrs,
+            report.inlined_calls, report.kept_calls, report.removed ? ", removed" : "");
+    }
+}
+
+/// Prints what a stage of compile_lines() did, and the reports it filled in.
+static void print_compile_stage(CompileStage stage, size_t count, const CompileOptions& options) {
+    switch (stage) {
+    case CompileStage::Parse:
+        fmt::print("Parsed {} tokens.\n", count);
+        break;
+    case CompileStage::Translate:
+        fmt::print("Translated into {} abstract instructions.\n", count);
+        break;
+    case CompileStage::Inline:
+        fmt::print("Applied inlining resulting in {} abstract instructions.\n", count);
+        if (options.inline_reports) {
+            print_inline_reports(*options.inline_reports);
+        }
+        break;
+    case CompileStage::Peephole:
+        if (options.diagnostics) {
+            print_fold_diagnostics(*options.diagnostics);
+        }
+        fmt::print("Applied peephole optimizations resulting in {} abstract instructions.\n", count);
+        break;
+    case CompileStage::StrengthReduce:
+        fmt::print("Applied strength reduction optimizations resulting in {} abstract instructions.\n", count);
+        break;
+    case CompileStage::Loops:
+        fmt::print("Applied loop optimizations resulting in {} abstract instructions.\n", count);
+        if (options.loop_reports) {
+            print_loop_reports(*options.loop_reports);
+        }
+        break;
+    case CompileStage::Profile: {
+        const auto& report = *options.profile_report;
+        fmt::print("Applied profile-guided optimizations resulting in {} abstract instructions: "
+                   "{} hot blocks, {} moved, {} jumps inverted, {} removed, {} added, {} blocks duplicated, {} instructions fused.\n",
+            count, report.hot_blocks, report.moved_blocks, report.inverted_jumps,
+            report.removed_jumps, report.added_jumps, report.duplicated_blocks, report.fused);
+        break;
+    }
+    case CompileStage::Finalize:
+        fmt::print("Finalized into {} instructions.\n", count);
+        break;
+    }
+}
+
+/// Prints or writes what `--mem-stats` recorded. Returns the exit code.
+static int report_mem_stats(MemRecorder& mem, const Config& cfg) {
+    if (!cfg.mem_stats) {
+        return 0;
+    }
+    mem.finish();
+    if (cfg.mem_stats_json.empty()) {
+        print_mem_stats(mem.stages());
+        return 0;
+    }
+    auto err = write_mem_stats_json(std::string(cfg.mem_stats_json), mem.stages());
+    if (err) {
+        fmt::print("Error: {}\n", err.error);
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     Config cfg;
     auto cfg_res = parse_config_from_argv(argc, argv);
@@ -69,72 +454,149 @@ int main(int argc, char** argv) {
         fmt::print("Error: {}\n", cfg_res.error);
         return 1;
     }
+    const auto socket_path = cfg.socket_path.empty() ? default_socket_path() : std::string(cfg.socket_path);
+    if (cfg.serve) {
+        if (cfg.mem_stats) {
+            fmt::print("Error: `--mem-stats` measures a single run, it can't be used with `--serve`.\n");
+            return 1;
+        }
+        if (!cfg.files.empty() || cfg.client) {
+            fmt::print("Error: `--serve` runs the programs clients send it, it doesn't take files.\n");
+            return 1;
+        }
+        auto err = serve(ServerConfig { .socket_path = socket_path, .placement = cfg.placement, .pin_workers = cfg.pin_workers });
+        if (err) {
+            fmt::print("Error: {}\n", err.error);
+            return 1;
+        }
+        return 0;
+    }
+    if (cfg.pin_workers) {
+        fmt::print("Error: `--pin-workers` pins the workers of `--serve`, it can only be used with it.\n");
+        return 1;
+    }
     if (cfg.files.empty()) {
         fmt::print("Error: No file(s) specified. See '{} --help' for help.\n", argv[0]);
         return 1;
     }
 
+    if (!cfg.output.empty() && cfg.files.size() != 1) {
+        fmt::print("Error: `--output` can only be used with a single file.\n");
+        return 1;
+    }
+    if (cfg.stream && cfg.dense) {
+        fmt::print("Error: `--stream` can't write the dense encoding, as that needs the whole program.\n");
+        return 1;
+    }
+
+    if (!cfg.profile_generate.empty() && (cfg.compile_only || cfg.files.size() != 1)) {
+        fmt::print("Error: `--profile-generate` runs a single program, it can't be used with `--compile` or several files.\n");
+        return 1;
+    }
+    if (cfg.trace && cfg.checked_arith) {
+        fmt::print("Error: `--trace` can't be used with `--checked-arith`, as traces don't check for overflow.\n");
+        return 1;
+    }
+    if (cfg.registers && (cfg.trace || cfg.checked_arith || !cfg.profile_generate.empty())) {
+        fmt::print("Error: `--registers` can't be used with `--trace`, `--checked-arith` or `--profile-generate`.\n");
+        return 1;
+    }
+    if (cfg.registers && cfg.dense) {
+        fmt::print("Error: `--registers` can't be used with `--dense`, as dense code runs in the stack interpreter.\n");
+        return 1;
+    }
+    if (!cfg.inputs.empty() && (cfg.compile_only || cfg.trace || cfg.registers || cfg.checked_arith || cfg.client || !cfg.profile_generate.empty())) {
+        fmt::print("Error: `--inputs` runs programs in lockstep, it can't be used with `--compile`, `--trace`, `--registers`, `--checked-arith`, `--client` or `--profile-generate`.\n");
+        return 1;
+    }
+    if (cfg.trace && !cfg.profile_generate.empty()) {
+        fmt::print("Error: `--trace` can't be used with `--profile-generate`, which has to see every instruction.\n");
+        return 1;
+    }
+    if (!cfg.profile_use.empty() && (!cfg.optimize || cfg.stream)) {
+        fmt::print("Error: `--profile-use` is an optimization, it can't be used with `--dont-optimize` or `--stream`.\n");
+        return 1;
+    }
+
     if (cfg.exec_only && cfg.compile_only) {
         fmt::print("Error: `exec` and `compile` not allowed at the same time. Run without arguments either of these arguments to compile and interpret source code in one go.\n");
         return 1;
     }
 
-    if (cfg.decompile) {
-        std::srand(0);
+    if (cfg.client) {
+        if (cfg.compile_only || cfg.exec_only || cfg.decompile || cfg.stream || cfg.trace || cfg.registers || cfg.stats || cfg.mem_stats || !cfg.profile_generate.empty() || !cfg.profile_use.empty()
+            || cfg.placement.huge_pages != HugePages::Off || cfg.placement.prefault) {
+            fmt::print("Error: `--client` only sends sources to run, together with `--dont-optimize`, `--checked-arith` and `--stack-size`. Pass `--huge-pages` and `--prefault` to `--serve`.\n");
+            return 1;
+        }
         for (const auto& filename : cfg.files) {
-            fmt::print("# decompiled from '{}'\n"
-                       "# all label names are generated pseudo-randomly\n",
-                filename);
-            std::ifstream file(filename.data(), std::ios::binary);
-            InstrStream instrs;
-            instrs.resize(std::filesystem::file_size(filename.data()) / sizeof(Instr));
-            file.read(reinterpret_cast<char*>(instrs.data()), std::streamsize(instrs.size() * sizeof(Instr)));
-            std::unordered_map<size_t, std::string> labels;
-            size_t i = 0;
-            constexpr const char ak[] = "bcdfghjklmnprstvws";
-            constexpr const char av[] = "aeuioy";
-            for (const auto& instr : instrs) {
-                // is jump?
-                if (instr.s.op >= JE) {
-                    auto off = size_t(std::rand());
-                    labels[size_t(instr.s.val)] = fmt::format("{}{}{}{}{}{}",
-                        ak[(i + off) % (sizeof(ak) - 1)],
-                        av[(i + off / 2) % (sizeof(av) - 1)],
-                        ak[(i + off / 3) % (sizeof(ak) - 1)],
-                        av[(i + off / 4) % (sizeof(av) - 1)],
-                        ak[(i + off / 5) % (sizeof(ak) - 1)],
-                        av[(i + off / 6) % (sizeof(av) - 1)]);
-                }
-                ++i;
+            if (filename.ends_with("mclb")) {
+                fmt::print("Error: `--client` sends sources, and the server caches what it compiled from them. Run '{}' without `--client`.\n", filename);
+                return 1;
             }
-            i = 0;
-            for (const auto& instr : instrs) {
-                if (instr.s.op == NOT_AN_INSTRUCTION) {
-                    fmt::print("# encountered NOT_AN_INSTRUCTION, assuming end of file\n");
-                    break;
-                }
-                if (labels.contains(i)) {
-                    fmt::print("\n:{} \t # addr={}\n", labels[i], i);
-                }
-                if (instr.s.op >= JE) {
-                    auto val = size_t(instr.s.val);
-                    fmt::print("{} :{} \t # ->{}\n", to_string(instr.s.op), labels.at(val), val);
-                } else if (op_requires_i64_argument(instr.s.op)) {
-                    auto val = int64_t(instr.s.val);
-                    if (val > 100'000 && val % 1000 != 0) {
-                        fmt::print("{} 0x{:x}\n", to_string(instr.s.op), val);
-                    } else {
-                        fmt::print("{} {}\n", to_string(instr.s.op), val);
-                    }
-                } else {
-                    fmt::print("{}\n", to_string(instr.s.op));
+            std::ifstream file_stream;
+            if (filename != "-") {
+                file_stream.open(std::string(filename), std::ios::binary);
+                if (!file_stream) {
+                    fmt::print("Error: Failed to open '{}': {}\n", filename, std::strerror(errno));
+                    return 1;
                 }
-                ++i;
+            }
+            std::istream& file = filename == "-" ? std::cin : file_stream;
+            std::ostringstream source;
+            source << file.rdbuf();
+            ClientRequest request {
+                .name = std::string(filename),
+                .source = std::move(source).str(),
+                .optimize = cfg.optimize,
+                .checked_arith = cfg.checked_arith,
+                .stack_size = cfg.stack_size,
+            };
+            auto result = run_on_server(socket_path, request, stdout);
+            std::fflush(stdout);
+            if (result.error) {
+                fmt::print("Error: {}\n", result.error.error);
+                return 1;
+            }
+            if (result.program_error) {
+                fmt::print("Error executing '{}': {}\n", filename, result.program_error.error);
+                return 1;
             }
         }
         return 0;
     }
 
+    MemRecorder mem(cfg.mem_stats);
+    if (cfg.decompile) {
+        for (const auto& filename : cfg.files) {
+            mem.stage(filename, "decompile");
+            // with an output file, the source map goes next to it
+            FilePtr out(cfg.output.empty() ? stdout : std::fopen(std::string(cfg.output).c_str(), "w"), cfg.output.empty() ? [](std::FILE*) { return 0; } : &std::fclose);
+            if (!out) {
+                fmt::print("Error: Failed to open '{}' for writing: {}\n", cfg.output, std::strerror(errno));
+                return 1;
+            }
+            SourceMap source_map;
+            const DecompileConfig decompile_cfg { .output_name = std::string(cfg.output) };
+            auto res = decompile_file(std::string(filename), out.get(), decompile_cfg, cfg.output.empty() ? nullptr : &source_map);
+            if (!res) {
+                fmt::print("Error: {}\n", res.error);
+                return 1;
+            }
+            if (!cfg.output.empty()) {
+                auto err = write_source_map(fmt::format("{}.map", cfg.output), source_map);
+                if (err) {
+                    fmt::print("Error: {}\n", err.error);
+                    return 1;
+                }
+            }
+            if (cfg.stats) {
+                fmt::print(stderr, "Decompiled {} instructions with {} labels into {} bytes.\n", res.value().instructions, res.value().labels, res.value().bytes);
+            }
+        }
+        return report_mem_stats(mem, cfg);
+    }
+
     bool interpret = !cfg.compile_only && !cfg.exec_only;
 
     if (cfg.compile_only || interpret) {
@@ -143,70 +605,105 @@ int main(int argc, char** argv) {
                 fmt::print("Error: Passed `.mclb` file '{}' to the compiler, but `.mclb` is the extension of files which have already been compiled. Not allowing this.\n", filename);
                 return 1;
             }
-            std::ifstream file((std::string(filename)));
+            if (filename == "-" && cfg.output.empty()) {
+                fmt::print("Error: Compiling from stdin needs an output file, see `--output`.\n");
+                return 1;
+            }
+            if (cfg.stream) {
+                mem.stage(filename, "stream");
+                FilePtr input(filename == "-" ? stdin : std::fopen(std::string(filename).c_str(), "r"), filename == "-" ? [](std::FILE*) { return 0; } : &std::fclose);
+                if (!input) {
+                    fmt::print("Error: Failed to open '{}': {}\n", filename, std::strerror(errno));
+                    return 1;
+                }
+                auto res = compile_stream(input.get(), std::string(filename), output_filename(filename, cfg),
+                    StreamConfig { .optimize = cfg.optimize, .checked_arith = cfg.checked_arith, .stack_size = cfg.stack_size });
+                if (!res) {
+                    fmt::print("Error while compiling: {}\n", res.error);
+                    return 1;
+                }
+                print_fold_diagnostics(res.value().diagnostics);
+                fmt::print("Compiled {} lines into {} instructions with {} labels. At most {} references were waiting for their label.\n",
+                    res.value().lines, res.value().instructions, res.value().labels, res.value().max_pending_refs);
+                continue;
+            }
+            mem.stage(filename, "read");
+            std::ifstream file_stream;
+            if (filename != "-") {
+                file_stream.open(std::string(filename));
+            }
+            std::istream& file = filename == "-" ? std::cin : file_stream;
             std::string line;
             std::vector<std::string> lines;
             while (std::getline(file, line)) {
                 lines.push_back(line);
             }
-            auto parse_res = parse(lines, filename.data());
-            TokenStream tokens;
-            if (parse_res) {
-                tokens = parse_res.move();
-                fmt::print("Parsed {} tokens.\n", tokens.size());
-            } else {
-                fmt::print("Error while parsing: {}\n", parse_res.error);
-                return 1;
+            std::optional<Profile> profile;
+            if (cfg.optimize && !cfg.profile_use.empty()) {
+                auto read = read_profile(std::string(cfg.profile_use));
+                if (!read) {
+                    fmt::print("Error: {}\n", read.error);
+                    return 1;
+                }
+                profile = read.move();
             }
-            auto translate_res = translate(tokens);
-            AbstractInstrStream abstract_instrs;
-            if (translate_res) {
-                abstract_instrs = translate_res.move();
-                fmt::print("Translated into {} abstract instructions.\n", abstract_instrs.size());
-            } else {
-                fmt::print("Error while translating: {}\n", translate_res.error);
+
+            SourceMap source_map;
+            std::vector<InlineReport> inline_reports;
+            std::vector<FoldDiagnostic> diagnostics;
+            std::vector<LoopReport> loop_reports;
+            ProfileReport profile_report;
+            CompileOptions options {
+                .optimize = cfg.optimize,
+                .checked_arith = cfg.checked_arith,
+                .profile = profile ? &*profile : nullptr,
+                .source_map = cfg.strip ? nullptr : &source_map,
+                .inline_reports = cfg.stats ? &inline_reports : nullptr,
+                .diagnostics = &diagnostics,
+                .loop_reports = cfg.stats ? &loop_reports : nullptr,
+                .profile_report = &profile_report,
+                .before_stage = [&](CompileStage stage) { mem.stage(filename, to_string(stage)); },
+            };
+            options.after_stage = [&](CompileStage stage, size_t count) { print_compile_stage(stage, count, options); };
+            auto compiled = compile_lines(lines, std::string(filename), options);
+            if (!compiled) {
+                fmt::print("{}\n", compiled.error);
                 return 1;
             }
-
-            if (cfg.optimize) {
-                auto err = optimize_substitute(abstract_instrs);
-                if (err) {
-                    fmt::print("Error while applying substitution optimizations: {}\n", err.error);
-                    return 1;
-                } else {
-                    fmt::print("Applied substitution optimizations resulting in {} abstract instructions.\n", abstract_instrs.size());
-                }
-                err = optimize_fold(abstract_instrs);
-                if (err) {
-                    fmt::print("Error while applying fold optimizations: {}\n", err.error);
+            // now write to file
+            Bytecode bytecode {
+                .header = {},
+                .instrs = compiled.move(),
+                .source_map = std::move(source_map),
+            };
+            bytecode.header.stack_size = cfg.stack_size;
+            if (cfg.dense) {
+                mem.stage(filename, "encode");
+                auto dense = encode_dense(bytecode.instrs);
+                if (!dense) {
+                    fmt::print("Error while encoding: {}\n", dense.error);
                     return 1;
-                } else {
-                    fmt::print("Applied fold optimizations resulting in {} abstract instructions.\n", abstract_instrs.size());
                 }
+                bytecode.dense = dense.move();
+                bytecode.instrs.clear();
+                // the interpreter reports byte offsets as the pc of dense code
+                bytecode.source_map.remap(dense_offsets(bytecode.dense));
+                bytecode.header.flags = uint16_t(bytecode.header.flags | BYTECODE_DENSE);
+                fmt::print("Encoded into {} bytes.\n", bytecode.dense.size());
             }
-
-            auto finalize_res = finalize(std::move(abstract_instrs));
-            InstrStream instrs;
-            if (finalize_res) {
-                instrs = finalize_res.move();
-                fmt::print("Finalized into {} instructions.\n", instrs.size());
-            } else {
-                fmt::print("Error while finalizing: {}\n", finalize_res.error);
+            mem.stage(filename, "write");
+            auto write_err = write_bytecode(output_filename(filename, cfg), bytecode);
+            if (write_err) {
+                fmt::print("Error: {}\n", write_err.error);
                 return 1;
             }
-            // now write to file
-            std::ofstream outfile(std::filesystem::path(filename).replace_extension("mclb").string(), std::ios::trunc | std::ios::binary);
-            outfile.write(reinterpret_cast<const char*>(instrs.data()), std::streamsize(instrs.size() * sizeof(Instr)));
         }
     }
     if (interpret) {
         for (const auto& filename_mcl : cfg.files) {
-            auto filename = std::filesystem::path(filename_mcl).replace_extension("mclb").string();
-            std::ifstream file(filename, std::ios::binary);
-            InstrStream instrs;
-            instrs.resize(std::filesystem::file_size(filename) / sizeof(Instr));
-            file.read(reinterpret_cast<char*>(instrs.data()), std::streamsize(instrs.size() * sizeof(Instr)));
-            auto err = execute(std::move(instrs));
+            auto filename = output_filename(filename_mcl, cfg);
+            mem.stage(filename, "execute");
+            auto err = load_and_execute(filename, cfg);
             if (err) {
                 fmt::print("Error executing '{}': {}\n", filename, err.error);
                 return 1;
@@ -218,16 +715,13 @@ int main(int argc, char** argv) {
                 fmt::print("Error: '{}' ends in '.mcl', which indicates it's a source file. For `--exec` mode, you must only pass compiled binary objects.", filename);
                 return 1;
             }
-            std::ifstream file(filename.data(), std::ios::binary);
-            InstrStream instrs;
-            instrs.resize(std::filesystem::file_size(filename.data()) / sizeof(Instr));
-            file.read(reinterpret_cast<char*>(instrs.data()), std::streamsize(instrs.size() * sizeof(Instr)));
-            auto err = execute(std::move(instrs));
+            mem.stage(filename, "execute");
+            auto err = load_and_execute(std::string(filename), cfg);
             if (err) {
                 fmt::print("Error executing '{}': {}\n", filename, err.error);
                 return 1;
             }
         }
     }
-    return 0;
+    return report_mem_stats(mem, cfg);
 }
@@ -0,0 +1,96 @@
+// mcl-run: runs compiled .mclb files, and does nothing else. It's linked from
+// the loader and the interpreter only, without the compiler, the decompiler
+// or the server, and uses stdio instead of iostreams, so that it starts as fast
+// as possible. Use `mcl --exec` for stats, profiles, traces or register code.
+#include "bytecode.h"
+#include "interpreter.h"
+#include <charconv>
+#include <cstdint>
+#include <fmt/core.h>
+#include <string>
+#include <string_view>
+#include <utility>
+
+static void print_usage(const char* name) {
+    fmt::print("Usage:\n"
+               "\t{} [OPTION...] <FILE.mclb...>\n"
+               "Options:\n"
+               "\t--stack-size=<N>\t Number of values the stack holds, instead of the size stored in the file, or 4096\n"
+               "\t--checked-arith\t Faults on integer overflow in add, sub, mul, inc and dec, instead of wrapping around\n"
+               "\t--help\t\t Prints this help\n",
+        name);
+}
+
+/// Like `mcl --exec`: the stack size given on the command line wins over the
+/// hint in the file, and faults get their source location from the source map
+/// section, if the file has one.
+static Error load_and_execute(const std::string& filename, size_t stack_size, bool checked_arith) {
+    auto bytecode = read_bytecode(filename);
+    if (!bytecode) {
+        return Error("{}", bytecode.error);
+    }
+    const auto flags = bytecode.value().header.flags;
+    const VmConfig cfg {
+        .stack_size = stack_size != 0 ? stack_size : size_t(bytecode.value().header.stack_size),
+        .checked_arith = checked_arith,
+    };
+    size_t fault_pc = SIZE_MAX;
+    Error err;
+    if ((flags & BYTECODE_DENSE) != 0) {
+        err = execute_dense(std::move(bytecode.move().dense), cfg, nullptr, &fault_pc);
+    } else {
+        err = execute(std::move(bytecode.move().instrs), cfg, nullptr, &fault_pc);
+    }
+    if (err && fault_pc != SIZE_MAX && (flags & BYTECODE_SOURCE_MAP) != 0) {
+        auto source_map = read_source_map(filename);
+        if (!source_map) {
+            return Error("{} (no source location: {})", err.error, source_map.error);
+        }
+        auto loc = source_map.value().lookup(fault_pc);
+        if (loc.has_value()) {
+            return Error("{}, at {}", err.error, to_string(*loc));
+        }
+    }
+    return err;
+}
+
+int main(int argc, char** argv) {
+    size_t stack_size = 0;
+    bool checked_arith = false;
+    int first_file = argc;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg.starts_with("--stack-size=")) {
+            const auto value = arg.substr(std::string_view("--stack-size=").size());
+            const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), stack_size);
+            if (ec != std::errc {} || end != value.data() + value.size() || stack_size == 0) {
+                fmt::print("Error: Invalid stack size '{}', expected a positive number of values.\n", value);
+                return 1;
+            }
+        } else if (arg == "--checked-arith") {
+            checked_arith = true;
+        } else if (arg.starts_with("-")) {
+            fmt::print("Error: Unknown argument '{}', run '{} --help' for help.\n", arg, argv[0]);
+            return 1;
+        } else {
+            first_file = i;
+            break;
+        }
+    }
+    if (first_file == argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    for (int i = first_file; i < argc; ++i) {
+        const std::string filename = argv[i];
+        auto err = load_and_execute(filename, stack_size, checked_arith);
+        if (err) {
+            fmt::print("Error executing '{}': {}\n", filename, err.error);
+            return 1;
+        }
+    }
+    return 0;
+}
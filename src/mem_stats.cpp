@@ -0,0 +1,240 @@
+#include "mem_stats.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <malloc.h>
+#include <memory>
+#include <new>
+
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+namespace {
+
+// All relaxed, the counters are only read once the threads of a stage joined.
+std::atomic<bool> g_counting { false };
+std::atomic<uint64_t> g_allocations { 0 };
+std::atomic<uint64_t> g_bytes { 0 };
+std::atomic<uint64_t> g_frees { 0 };
+std::atomic<int64_t> g_live { 0 };
+std::atomic<int64_t> g_peak { 0 };
+
+void count_allocation(void* ptr, size_t size) {
+    if (!ptr || !g_counting.load(std::memory_order_relaxed)) {
+        return;
+    }
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_bytes.fetch_add(size, std::memory_order_relaxed);
+    const auto usable = int64_t(malloc_usable_size(ptr));
+    const auto live = g_live.fetch_add(usable, std::memory_order_relaxed) + usable;
+    auto peak = g_peak.load(std::memory_order_relaxed);
+    while (live > peak && !g_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+}
+
+void count_free(void* ptr) {
+    if (!ptr || !g_counting.load(std::memory_order_relaxed)) {
+        return;
+    }
+    g_frees.fetch_add(1, std::memory_order_relaxed);
+    g_live.fetch_sub(int64_t(malloc_usable_size(ptr)), std::memory_order_relaxed);
+}
+
+void* allocate(size_t size, size_t alignment) {
+    size = size == 0 ? 1 : size;
+    void* ptr = nullptr;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        ptr = std::malloc(size);
+    } else if (posix_memalign(&ptr, alignment, size) != 0) {
+        ptr = nullptr;
+    }
+    count_allocation(ptr, size);
+    return ptr;
+}
+
+void* allocate_or_throw(size_t size, size_t alignment) {
+    while (true) {
+        if (auto* ptr = allocate(size, alignment)) {
+            return ptr;
+        }
+        auto handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void deallocate(void* ptr) {
+    count_free(ptr);
+    std::free(ptr);
+}
+
+}
+
+// The replacements of the global allocation functions. Every variant is
+// replaced, so that none of them bypasses the counters by way of the
+// standard library's own definitions.
+
+void* operator new(size_t size) { return allocate_or_throw(size, 0); }
+void* operator new[](size_t size) { return allocate_or_throw(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate_or_throw(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate_or_throw(size, size_t(alignment)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, size_t(alignment)); }
+
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(ptr); }
+
+void enable_mem_counting() {
+    g_counting.store(true, std::memory_order_relaxed);
+}
+
+MemCounters mem_counters() {
+    return MemCounters {
+        .allocations = g_allocations.load(std::memory_order_relaxed),
+        .bytes = g_bytes.load(std::memory_order_relaxed),
+        .frees = g_frees.load(std::memory_order_relaxed),
+        .live_bytes = g_live.load(std::memory_order_relaxed),
+        .peak_live_bytes = g_peak.load(std::memory_order_relaxed),
+    };
+}
+
+void reset_mem_peak() {
+    g_peak.store(g_live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+size_t peak_rss() {
+    FilePtr file(std::fopen("/proc/self/status", "r"), &std::fclose);
+    if (!file) {
+        return 0;
+    }
+    char line[256];
+    while (std::fgets(line, sizeof(line), file.get())) {
+        if (std::strncmp(line, "VmHWM:", 6) == 0) {
+            return size_t(std::strtoull(line + 6, nullptr, 10)) * 1024;
+        }
+    }
+    return 0;
+}
+
+bool reset_peak_rss() {
+    FilePtr file(std::fopen("/proc/self/clear_refs", "w"), &std::fclose);
+    // "5" resets the peak, and leaves the page tables alone
+    return file && std::fputs("5", file.get()) >= 0 && std::fclose(file.release()) == 0;
+}
+
+MemRecorder::MemRecorder(bool enabled)
+    : m_enabled(enabled) {
+    if (m_enabled) {
+        enable_mem_counting();
+        // growing the list mid-run would count towards a stage
+        m_stages.reserve(64);
+    }
+}
+
+void MemRecorder::stage(std::string_view file, std::string_view name) {
+    if (!m_enabled) {
+        return;
+    }
+    finish();
+    m_stages.push_back(MemStage { .file = std::string(file), .name = std::string(name) });
+    m_in_stage = true;
+    reset_peak_rss();
+    reset_mem_peak();
+    m_start = mem_counters();
+}
+
+void MemRecorder::finish() {
+    if (!m_in_stage) {
+        return;
+    }
+    const auto end = mem_counters();
+    auto& stage = m_stages.back();
+    stage.allocations = end.allocations - m_start.allocations;
+    stage.bytes = end.bytes - m_start.bytes;
+    stage.frees = end.frees - m_start.frees;
+    stage.retained_bytes = end.live_bytes - m_start.live_bytes;
+    stage.peak_live_bytes = end.peak_live_bytes;
+    stage.peak_rss = peak_rss();
+    m_in_stage = false;
+}
+
+/// Like "12.3 MiB".
+static std::string format_bytes(int64_t bytes) {
+    const auto magnitude = double(bytes < 0 ? -bytes : bytes);
+    if (magnitude < 1024.0) {
+        return fmt::format("{} B", bytes);
+    }
+    if (magnitude < 1024.0 * 1024.0) {
+        return fmt::format("{:.1f} KiB", double(bytes) / 1024.0);
+    }
+    return fmt::format("{:.1f} MiB", double(bytes) / (1024.0 * 1024.0));
+}
+
+void print_mem_stats(const std::vector<MemStage>& stages) {
+    fmt::print("{:<20} {:<18} {:>12} {:>12} {:>12} {:>12} {:>12}\n",
+        "File", "Stage", "Allocations", "Allocated", "Retained", "Peak live", "Peak RSS");
+    size_t max_rss = 0;
+    int64_t max_live = 0;
+    for (const auto& stage : stages) {
+        fmt::print("{:<20} {:<18} {:>12} {:>12} {:>12} {:>12} {:>12}\n",
+            stage.file, stage.name, stage.allocations, format_bytes(int64_t(stage.bytes)),
+            format_bytes(stage.retained_bytes), format_bytes(stage.peak_live_bytes), format_bytes(int64_t(stage.peak_rss)));
+        max_rss = std::max(max_rss, stage.peak_rss);
+        max_live = std::max(max_live, stage.peak_live_bytes);
+    }
+    fmt::print("Peak live: {}, peak RSS: {}.\n", format_bytes(max_live), format_bytes(int64_t(std::max(max_rss, peak_rss()))));
+}
+
+/// The string as a JSON string literal.
+static std::string json_string(std::string_view str) {
+    std::string result = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (uint8_t(c) < 0x20) {
+            result += fmt::format("\\u{:04x}", int(c));
+        } else {
+            result += c;
+        }
+    }
+    result += '"';
+    return result;
+}
+
+Error write_mem_stats_json(const std::string& filename, const std::vector<MemStage>& stages) {
+    FilePtr file(std::fopen(filename.c_str(), "w"), &std::fclose);
+    if (!file) {
+        return Error("Failed to open '{}' for writing: {}", filename, std::strerror(errno));
+    }
+    fmt::print(file.get(), "{{\n  \"peak_rss\": {},\n  \"stages\": [", peak_rss());
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const auto& stage = stages[i];
+        fmt::print(file.get(),
+            "{}\n    {{ \"file\": {}, \"stage\": {}, \"allocations\": {}, \"bytes\": {}, \"frees\": {}, "
+            "\"retained_bytes\": {}, \"peak_live_bytes\": {}, \"peak_rss\": {} }}",
+            i == 0 ? "" : ",", json_string(stage.file), json_string(stage.name), stage.allocations, stage.bytes,
+            stage.frees, stage.retained_bytes, stage.peak_live_bytes, stage.peak_rss);
+    }
+    fmt::print(file.get(), "\n  ]\n}}\n");
+    if (std::ferror(file.get()) || std::fclose(file.release()) != 0) {
+        return Error("Failed to write '{}': {}", filename, std::strerror(errno));
+    }
+    return {};
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "error.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// What the allocator hook in mem_stats.cpp counted since
+/// enable_mem_counting(), over all threads.
+struct MemCounters {
+    uint64_t allocations { 0 };
+    /// Bytes requested, summed over all allocations.
+    uint64_t bytes { 0 };
+    uint64_t frees { 0 };
+    /// Usable bytes of the blocks which weren't freed yet, as malloc rounds
+    /// them up. Blocks allocated before counting started are subtracted when
+    /// they're freed, so this is only meaningful as a difference.
+    int64_t live_bytes { 0 };
+    /// Highest live_bytes since the last reset_mem_peak().
+    int64_t peak_live_bytes { 0 };
+};
+
+/// Makes the replaced operator new and delete count. Until then, they only
+/// check a flag, so that the other executables don't pay for the hook.
+void enable_mem_counting();
+MemCounters mem_counters();
+/// Lowers the peak of live bytes to the bytes which are live now.
+void reset_mem_peak();
+
+/// Peak resident set size of the process (VmHWM in /proc/self/status) in
+/// bytes, or 0 if it can't be read.
+size_t peak_rss();
+/// Lowers the peak resident set size to the current one, so that peak_rss()
+/// tells the peak since. Needs Linux 4.0 or later, returns false otherwise.
+bool reset_peak_rss();
+
+/// What was allocated during one stage of compiling or running a file.
+struct MemStage {
+    std::string file;
+    std::string name;
+    uint64_t allocations { 0 };
+    uint64_t bytes { 0 };
+    uint64_t frees { 0 };
+    /// Bytes live at the end of the stage, minus those live at its start.
+    int64_t retained_bytes { 0 };
+    /// Highest number of bytes live during the stage, including those which
+    /// earlier stages left live.
+    int64_t peak_live_bytes { 0 };
+    /// Peak resident set size during the stage, or since the process started
+    /// if it can't be reset.
+    size_t peak_rss { 0 };
+};
+
+/// Splits the run of mcl into stages for `--mem-stats`. A disabled recorder
+/// does nothing.
+class MemRecorder {
+public:
+    explicit MemRecorder(bool enabled);
+
+    /// Ends the current stage, if any, and starts the given one.
+    void stage(std::string_view file, std::string_view name);
+    /// Ends the current stage.
+    void finish();
+
+    const std::vector<MemStage>& stages() const { return m_stages; }
+
+private:
+    bool m_enabled;
+    bool m_in_stage { false };
+    MemCounters m_start {};
+    std::vector<MemStage> m_stages {};
+};
+
+/// Prints a table of the stages, and the peak of the whole run.
+void print_mem_stats(const std::vector<MemStage>& stages);
+/// Writes the stages as a JSON object, for scripts which track memory use.
+[[nodiscard]] Error write_mem_stats_json(const std::string& filename, const std::vector<MemStage>& stages);
@@ -0,0 +1,207 @@
+#include "compiler.h"
+#include "fold.h"
+#include "instruction.h"
+#include "peephole.h"
+#include <array>
+#include <fmt/core.h>
+#include <set>
+#include <span>
+#include <string>
+#include <tuple>
+#include <utility>
+
+static constexpr PeepholeRule PEEPHOLE_RULES[] = {
+    // shorter forms
+    { { push_equal(1), match(ADD) }, { emit(INC, 0, PeepholeValue::Zero) } },
+    { { push_equal(1), match(SUB) }, { emit(DEC, 0, PeepholeValue::Zero) } },
+    { { push_equal(0), match(JE) }, { emit(JZ, 1) } },
+    { { push_equal(0), match(JN) }, { emit(JNZ, 1) } },
+    { { match(OVER), match(OVER) }, { emit(DUP2, 0) } },
+
+    // arithmetic on constants
+    { { push_constant(), push_constant(), match(ADD) }, { emit_fold(0, ADD, 1, 2) } },
+    { { push_constant(), push_constant(), match(SUB) }, { emit_fold(0, SUB, 1, 2) } },
+    { { push_constant(), push_constant(), match(MUL) }, { emit_fold(0, MUL, 1, 2) } },
+    { { push_constant(), push_constant(), match(DIV) }, { emit_fold(0, DIV, 1, 2) } },
+    { { push_constant(), push_constant(), match(MOD) }, { emit_fold(0, MOD, 1, 2) } },
+    { { push_constant(), match(INC) }, { emit_fold_constant(0, ADD, 1, 1) } },
+    { { push_constant(), match(DEC) }, { emit_fold_constant(0, SUB, 1, 1) } },
+
+    // operations which leave the value as it is
+    { { push_equal(0), match(ADD) }, {} },
+    { { push_equal(0), match(SUB) }, {} },
+    { { push_equal(1), match(MUL) }, {} },
+    { { push_equal(1), match(DIV) }, {} },
+
+    // stack shuffling which cancels out
+    { { match(SWAP), match(SWAP) }, {} },
+    { { match(DUP), match(POP) }, {} },
+    { { match(OVER), match(POP) }, {} },
+    { { match(PUSH), match(POP) }, {} },
+    { { match(DUP2), match(POP), match(POP) }, {} },
+
+    // stack shuffling of constants, which leaves more constants next to
+    // the operations after it to fold
+    { { match(PUSH), match(PUSH), match(SWAP) }, { emit_at(PUSH, 1, 0), emit_at(PUSH, 0, 1) } },
+    { { match(PUSH), match(DUP) }, { emit(PUSH, 0), emit_at(PUSH, 0, 1) } },
+};
+
+static_assert(peephole_rules_terminate(PEEPHOLE_RULES));
+
+static constexpr auto PEEPHOLE_AUTOMATON = build_peephole_automaton<peephole_state_bound(PEEPHOLE_RULES)>(PEEPHOLE_RULES);
+
+namespace {
+
+/// Appends instructions one at a time, and rewrites the end of what it
+/// appended whenever a rule matches there. The replacement is appended
+/// again, so that it can complete other patterns together with the
+/// instructions before it, like a folded constant the next operation.
+class PeepholeRewriter {
+public:
+    PeepholeRewriter(size_t size, bool checked_arith, std::vector<FoldDiagnostic>* diagnostics)
+        : m_checked_arith(checked_arith)
+        , m_diagnostics(diagnostics) {
+        m_result.reserve(size);
+        m_states.reserve(size + 1);
+        m_states.push_back(0);
+    }
+
+    void append(AbstractInstr&& abstract);
+
+    AbstractInstrStream result() { return std::move(m_result); }
+
+private:
+    bool apply(const PeepholeRule& rule);
+    bool fold(const PeepholeEmit& emitted, std::span<const AbstractInstr> matched, int64_t& result);
+    void diagnose(const AbstractInstr& at, Op op, int64_t a, int64_t b, FoldOutcome outcome, int64_t wrapped);
+
+    bool m_checked_arith;
+    std::vector<FoldDiagnostic>* m_diagnostics;
+    /// Location and operands of each fold diagnosed, as appending a
+    /// replacement again can try the same fold more than once.
+    std::set<std::tuple<std::string, size_t, size_t, size_t, Op, int64_t, int64_t>> m_diagnosed {};
+    AbstractInstrStream m_result {};
+    /// The state of the automaton before each instruction of the result, and
+    /// after the last one.
+    std::vector<uint16_t> m_states {};
+    /// Replacements still to be appended, the next one last.
+    AbstractInstrStream m_pending {};
+};
+
+}
+
+void PeepholeRewriter::append(AbstractInstr&& abstract) {
+    m_pending.push_back(std::move(abstract));
+    while (!m_pending.empty()) {
+        m_result.push_back(std::move(m_pending.back()));
+        m_pending.pop_back();
+        m_states.push_back(PEEPHOLE_AUTOMATON.next[m_states.back()][m_result.back().instr.s.op]);
+        PEEPHOLE_AUTOMATON.for_each_match(m_states.back(), [&](size_t rule) {
+            return apply(PEEPHOLE_RULES[rule]);
+        });
+    }
+}
+
+/// Replaces the end of the result, which the ops of the rule's pattern match,
+/// unless the operands don't.
+bool PeepholeRewriter::apply(const PeepholeRule& rule) {
+    const auto matched = std::span<const AbstractInstr>(m_result).last(rule.pattern_size);
+    for (size_t i = 0; i < rule.pattern_size; ++i) {
+        const auto& match = rule.pattern[i];
+        const bool constant = !matched[i].unresolved_label.has_value();
+        if ((match.operand == PeepholeOperand::Constant && !constant)
+            || (match.operand == PeepholeOperand::Equal && (!constant || matched[i].instr.s.val != match.value))) {
+            return false;
+        }
+    }
+    std::array<int64_t, MAX_PEEPHOLE_PATTERN> values {};
+    for (size_t i = 0; i < rule.replacement_size; ++i) {
+        const auto& emitted = rule.replacement[i];
+        if (emitted.value == PeepholeValue::Fold && !fold(emitted, matched, values[i])) {
+            return false;
+        }
+    }
+    for (size_t i = rule.replacement_size; i > 0; --i) {
+        const auto& emitted = rule.replacement[i - 1];
+        auto replacement = matched[emitted.from];
+        replacement.instr.s.op = emitted.op;
+        if (emitted.at != PeepholeEmit::NO_OPERAND) {
+            replacement.location = matched[emitted.at].location;
+        }
+        if (emitted.value != PeepholeValue::Keep) {
+            set_instr_val(replacement.instr, values[i - 1]);
+        }
+        m_pending.push_back(std::move(replacement));
+    }
+    m_result.resize(m_result.size() - rule.pattern_size);
+    m_states.resize(m_states.size() - rule.pattern_size);
+    return true;
+}
+
+/// Computes the value of a folded constant. Returns false if the operation
+/// has to be left for the interpreter.
+bool PeepholeRewriter::fold(const PeepholeEmit& emitted, std::span<const AbstractInstr> matched, int64_t& result) {
+    const auto& at = matched[emitted.fold_at];
+    const auto op = emitted.fold_op;
+    const int64_t a = matched[emitted.from].instr.s.val;
+    const int64_t b = emitted.fold_b == PeepholeEmit::NO_OPERAND ? emitted.fold_constant : matched[emitted.fold_b].instr.s.val;
+    const auto outcome = fold_binary(op, a, b, result);
+    if (outcome != FoldOutcome::Folded) {
+        diagnose(at, op, a, b, outcome, result);
+    }
+    switch (outcome) {
+    case FoldOutcome::Folded:
+        break;
+    case FoldOutcome::Overflow:
+        if (m_checked_arith) {
+            return false;
+        }
+        break;
+    case FoldOutcome::DivisionByZero:
+    case FoldOutcome::DivisionOverflow:
+        return false;
+    }
+    // doesn't fit into the instruction, so it has to be computed at runtime
+    return result >= INSTR_VAL_MIN && result <= INSTR_VAL_MAX;
+}
+
+/// Tells what's wrong with folding `a op b`, once for each location and operands.
+void PeepholeRewriter::diagnose(const AbstractInstr& at, Op op, int64_t a, int64_t b, FoldOutcome outcome, int64_t wrapped) {
+    if (!m_diagnostics) {
+        return;
+    }
+    const auto& loc = at.location;
+    if (!m_diagnosed.emplace(loc.file, loc.line, loc.col_start, loc.col_end, op, a, b).second) {
+        return;
+    }
+    // as the operation is written in the source
+    const auto operation = at.instr.s.op == INC || at.instr.s.op == DEC
+        ? fmt::format("'{}' of {}", to_string(at.instr.s.op), a)
+        : fmt::format("'{} {} {}'", a, to_string(op), b);
+    std::string message;
+    switch (outcome) {
+    case FoldOutcome::Folded:
+        return;
+    case FoldOutcome::Overflow:
+        message = m_checked_arith
+            ? fmt::format("{} overflows, and faults when executed.", operation)
+            : fmt::format("{} overflows, and wraps around to {}.", operation, wrapped);
+        break;
+    case FoldOutcome::DivisionByZero:
+        message = fmt::format("{} divides by zero, and faults when executed.", operation);
+        break;
+    case FoldOutcome::DivisionOverflow:
+        message = fmt::format("{} overflows, and traps when executed.", operation);
+        break;
+    }
+    m_diagnostics->push_back({ .location = loc, .message = std::move(message) });
+}
+
+Error optimize_peephole(AbstractInstrStream& abstracts, bool checked_arith, std::vector<FoldDiagnostic>* diagnostics) {
+    PeepholeRewriter rewriter(abstracts.size(), checked_arith, diagnostics);
+    for (auto& abstract : abstracts) {
+        rewriter.append(std::move(abstract));
+    }
+    abstracts = rewriter.result();
+    return {};
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "instruction.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
+
+// The rewrites of optimize_peephole() are a table of rules, each a short
+// pattern of instructions and what replaces them. At compile time, the table
+// becomes an Aho-Corasick automaton over the ops of the patterns, which finds
+// every pattern ending at an instruction in one step per instruction, no
+// matter how many rules there are.
+
+/// Longest pattern, and longest replacement, a rule can have.
+inline constexpr size_t MAX_PEEPHOLE_PATTERN = 4;
+/// Number of ops, the alphabet of the automaton.
+inline constexpr size_t OP_COUNT = size_t(RET) + 1;
+
+enum class PeepholeOperand : uint8_t {
+    Any,
+    /// A `push` of a number, not of the address of a label.
+    Constant,
+    /// A constant equal to PeepholeMatch::value.
+    Equal,
+};
+
+/// What an instruction of a pattern has to be.
+struct PeepholeMatch {
+    Op op { NOT_AN_INSTRUCTION };
+    PeepholeOperand operand { PeepholeOperand::Any };
+    int64_t value { 0 };
+};
+
+enum class PeepholeValue : uint8_t {
+    /// The value, or label, of the instruction it's made from.
+    Keep,
+    Zero,
+    /// The value of the instruction it's made from, folded with the
+    /// fold_op, see PeepholeEmit.
+    Fold,
+};
+
+/// An instruction of a replacement. It's made from one of the matched
+/// instructions, and keeps its source location unless `at` says otherwise.
+struct PeepholeEmit {
+    Op op { NOT_AN_INSTRUCTION };
+    /// Index of the matched instruction it's made from.
+    uint8_t from { 0 };
+    /// Index of the matched instruction it replaces, whose location it takes
+    /// so that faults are reported there. `from` if NO_OPERAND.
+    uint8_t at { NO_OPERAND };
+    PeepholeValue value { PeepholeValue::Keep };
+    /// For Fold: the value is `fold_op(value of from, b)`, where b is the
+    /// value of the matched instruction `fold_b`, or `fold_constant` if that's
+    /// NO_OPERAND. The rule doesn't apply if that faults or overflows where
+    /// it shouldn't be folded, which is reported at the matched instruction
+    /// `fold_at`.
+    Op fold_op { NOT_AN_INSTRUCTION };
+    uint8_t fold_at { 0 };
+    uint8_t fold_b { NO_OPERAND };
+    int64_t fold_constant { 0 };
+
+    static constexpr uint8_t NO_OPERAND = UINT8_MAX;
+};
+
+struct PeepholeRule {
+    constexpr PeepholeRule(std::initializer_list<PeepholeMatch> matches, std::initializer_list<PeepholeEmit> emits) {
+        for (const auto& match : matches) {
+            pattern[pattern_size++] = match;
+        }
+        for (const auto& emit : emits) {
+            replacement[replacement_size++] = emit;
+        }
+    }
+
+    constexpr std::span<const PeepholeMatch> matches() const { return { pattern.data(), pattern_size }; }
+    constexpr std::span<const PeepholeEmit> emits() const { return { replacement.data(), replacement_size }; }
+
+    std::array<PeepholeMatch, MAX_PEEPHOLE_PATTERN> pattern {};
+    size_t pattern_size { 0 };
+    std::array<PeepholeEmit, MAX_PEEPHOLE_PATTERN> replacement {};
+    size_t replacement_size { 0 };
+};
+
+// Shorthands for writing rule tables.
+
+constexpr PeepholeMatch match(Op op) {
+    return { .op = op };
+}
+constexpr PeepholeMatch push_constant() {
+    return { .op = PUSH, .operand = PeepholeOperand::Constant };
+}
+constexpr PeepholeMatch push_equal(int64_t value) {
+    return { .op = PUSH, .operand = PeepholeOperand::Equal, .value = value };
+}
+
+constexpr PeepholeEmit emit(Op op, uint8_t from, PeepholeValue value = PeepholeValue::Keep) {
+    return { .op = op, .from = from, .value = value };
+}
+/// Like emit(), but located at the matched instruction `at`.
+constexpr PeepholeEmit emit_at(Op op, uint8_t from, uint8_t at) {
+    return { .op = op, .from = from, .at = at };
+}
+/// `push (value of from) fold_op (value of b)`
+constexpr PeepholeEmit emit_fold(uint8_t from, Op fold_op, uint8_t b, uint8_t at) {
+    return { .op = PUSH, .from = from, .value = PeepholeValue::Fold, .fold_op = fold_op, .fold_at = at, .fold_b = b };
+}
+/// `push (value of from) fold_op constant`
+constexpr PeepholeEmit emit_fold_constant(uint8_t from, Op fold_op, int64_t constant, uint8_t at) {
+    return { .op = PUSH, .from = from, .value = PeepholeValue::Fold, .fold_op = fold_op, .fold_at = at, .fold_constant = constant };
+}
+
+/// Whether rewriting with the rules always ends. The replacement of a rule is
+/// matched again, together with what's before it, so a replacement which
+/// isn't shorter than its pattern must not end any pattern.
+template<size_t Rules>
+constexpr bool peephole_rules_terminate(const PeepholeRule (&rules)[Rules]) {
+    for (const auto& rule : rules) {
+        if (rule.replacement_size < rule.pattern_size) {
+            continue;
+        }
+        for (const auto& emitted : rule.emits()) {
+            for (const auto& other : rules) {
+                if (other.pattern[other.pattern_size - 1].op == emitted.op) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/// Upper bound of the states of the automaton of the rules: one per
+/// instruction of a pattern, and the start.
+template<size_t Rules>
+constexpr size_t peephole_state_bound(const PeepholeRule (&rules)[Rules]) {
+    size_t states = 1;
+    for (const auto& rule : rules) {
+        states += rule.pattern_size;
+    }
+    return states;
+}
+
+/// The Aho-Corasick automaton of a rule table. Its state after a sequence of
+/// ops stands for the longest suffix of the sequence which starts a pattern.
+template<size_t States, size_t Rules>
+struct PeepholeAutomaton {
+    static constexpr uint16_t NONE = UINT16_MAX;
+
+    /// The state after the op.
+    std::array<std::array<uint16_t, OP_COUNT>, States> next {};
+    /// First rule whose pattern ends exactly at the state, in table order.
+    std::array<uint16_t, States> first_rule {};
+    /// The rule after this one with the same pattern.
+    std::array<uint16_t, Rules> next_rule {};
+    /// The state of the longest shorter suffix which ends a pattern.
+    std::array<uint16_t, States> output_link {};
+
+    /// Calls `apply(rule)` for each rule whose pattern ends the ops which led
+    /// to the state, longest pattern first, and rules of the same pattern in
+    /// table order, until it returns true. Returns whether it did.
+    template<typename Apply>
+    constexpr bool for_each_match(uint16_t state, Apply&& apply) const {
+        if (first_rule[state] == NONE) {
+            state = output_link[state];
+        }
+        while (state != NONE) {
+            for (auto rule = first_rule[state]; rule != NONE; rule = next_rule[rule]) {
+                if (apply(size_t(rule))) {
+                    return true;
+                }
+            }
+            state = output_link[state];
+        }
+        return false;
+    }
+};
+
+template<size_t States, size_t Rules>
+constexpr PeepholeAutomaton<States, Rules> build_peephole_automaton(const PeepholeRule (&rules)[Rules]) {
+    constexpr auto NONE = PeepholeAutomaton<States, Rules>::NONE;
+    PeepholeAutomaton<States, Rules> automaton;
+    auto& next = automaton.next;
+    for (auto& row : next) {
+        row.fill(NONE);
+    }
+    automaton.first_rule.fill(NONE);
+    automaton.next_rule.fill(NONE);
+    automaton.output_link.fill(NONE);
+    // the trie of the patterns
+    std::array<uint16_t, States> last_rule {};
+    size_t states = 1;
+    for (size_t r = 0; r < Rules; ++r) {
+        uint16_t state = 0;
+        for (const auto& match : rules[r].matches()) {
+            if (next[state][match.op] == NONE) {
+                next[state][match.op] = uint16_t(states++);
+            }
+            state = next[state][match.op];
+        }
+        if (automaton.first_rule[state] == NONE) {
+            automaton.first_rule[state] = uint16_t(r);
+        } else {
+            automaton.next_rule[last_rule[state]] = uint16_t(r);
+        }
+        last_rule[state] = uint16_t(r);
+    }
+    // breadth first, so that the suffix of a state is complete before it's
+    // followed: missing transitions go where the suffix's transition goes
+    std::array<uint16_t, States> fail {};
+    std::array<uint16_t, States> queue {};
+    size_t head = 0;
+    size_t tail = 0;
+    for (auto& target : next[0]) {
+        if (target == NONE) {
+            target = 0;
+        } else {
+            fail[target] = 0;
+            queue[tail++] = target;
+        }
+    }
+    while (head < tail) {
+        const auto state = queue[head++];
+        const auto suffix = fail[state];
+        automaton.output_link[state] = automaton.first_rule[suffix] != NONE ? suffix : automaton.output_link[suffix];
+        for (size_t op = 0; op < OP_COUNT; ++op) {
+            auto& target = next[state][op];
+            if (target == NONE) {
+                target = next[suffix][op];
+            } else {
+                fail[target] = next[suffix][op];
+                queue[tail++] = target;
+            }
+        }
+    }
+    return automaton;
+}
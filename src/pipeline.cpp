@@ -0,0 +1,109 @@
+#include "pipeline.h"
+
+std::vector<std::string> split_lines(std::string_view source) {
+    std::vector<std::string> lines;
+    std::string::size_type start = 0;
+    while (start < source.size()) {
+        auto end = source.find('\n', start);
+        if (end == std::string_view::npos) {
+            end = source.size();
+        }
+        lines.emplace_back(source.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+std::string_view to_string(CompileStage stage) {
+    switch (stage) {
+    case CompileStage::Parse:
+        return "parse";
+    case CompileStage::Translate:
+        return "translate";
+    case CompileStage::Inline:
+        return "inline";
+    case CompileStage::Peephole:
+        return "peephole";
+    case CompileStage::StrengthReduce:
+        return "strength reduce";
+    case CompileStage::Loops:
+        return "loops";
+    case CompileStage::Profile:
+        return "profile";
+    case CompileStage::Finalize:
+        return "finalize";
+    }
+    return "unknown";
+}
+
+Result<InstrStream> compile_lines(std::span<const std::string> lines, const std::string& filename, const CompileOptions& options) {
+    const auto before = [&](CompileStage stage) {
+        if (options.before_stage) {
+            options.before_stage(stage);
+        }
+    };
+    const auto after = [&](CompileStage stage, size_t count) {
+        if (options.after_stage) {
+            options.after_stage(stage, count);
+        }
+    };
+
+    before(CompileStage::Parse);
+    auto tokens = parse_chunked(lines, filename);
+    if (!tokens) {
+        return { "Error while parsing: {}", tokens.error };
+    }
+    after(CompileStage::Parse, tokens.value().token_count());
+    before(CompileStage::Translate);
+    auto translated = translate_chunked(tokens.value());
+    // the tokens aren't needed any more
+    tokens = TokenChunks {};
+    if (!translated) {
+        return { "Error while translating: {}", translated.error };
+    }
+    auto abstracts = translated.move();
+    after(CompileStage::Translate, abstracts.size());
+
+    if (options.optimize) {
+        before(CompileStage::Inline);
+        auto err = optimize_inline(abstracts, options.inline_reports);
+        if (err) {
+            return { "Error while inlining subroutines: {}", err.error };
+        }
+        after(CompileStage::Inline, abstracts.size());
+        before(CompileStage::Peephole);
+        err = optimize_peephole(abstracts, options.checked_arith, options.diagnostics);
+        if (err) {
+            return { "Error while applying peephole optimizations: {}", err.error };
+        }
+        after(CompileStage::Peephole, abstracts.size());
+        before(CompileStage::StrengthReduce);
+        err = optimize_strength_reduce(abstracts);
+        if (err) {
+            return { "Error while applying strength reduction optimizations: {}", err.error };
+        }
+        after(CompileStage::StrengthReduce, abstracts.size());
+        before(CompileStage::Loops);
+        err = optimize_loops(abstracts, options.loop_reports);
+        if (err) {
+            return { "Error while applying loop optimizations: {}", err.error };
+        }
+        after(CompileStage::Loops, abstracts.size());
+        if (options.profile) {
+            before(CompileStage::Profile);
+            err = optimize_profile(abstracts, *options.profile, options.profile_report);
+            if (err) {
+                return { "Error while applying profile-guided optimizations: {}", err.error };
+            }
+            after(CompileStage::Profile, abstracts.size());
+        }
+    }
+
+    before(CompileStage::Finalize);
+    auto instrs = finalize(std::move(abstracts), options.source_map);
+    if (!instrs) {
+        return { "Error while finalizing: {}", instrs.error };
+    }
+    after(CompileStage::Finalize, instrs.value().size());
+    return instrs;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include "profile.h"
+#include "source_map.h"
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Splits source into lines, as parse() expects them. A newline at the end
+/// doesn't start another line.
+std::vector<std::string> split_lines(std::string_view source);
+
+/// Steps of compile_lines(), in the order they run.
+enum class CompileStage {
+    Parse,
+    Translate,
+    Inline,
+    Peephole,
+    StrengthReduce,
+    Loops,
+    Profile,
+    Finalize,
+};
+
+/// Name of the stage, as --mem-stats shows it.
+std::string_view to_string(CompileStage stage);
+
+struct CompileOptions {
+    /// Runs the inline, peephole, strength reduction and loop passes.
+    bool optimize { true };
+    /// See optimize_peephole().
+    bool checked_arith { false };
+    /// Applied after the other optimizations, if given and `optimize` is set.
+    const Profile* profile { nullptr };
+    /// Each of these is filled in, if given.
+    SourceMap* source_map { nullptr };
+    std::vector<InlineReport>* inline_reports { nullptr };
+    std::vector<FoldDiagnostic>* diagnostics { nullptr };
+    std::vector<LoopReport>* loop_reports { nullptr };
+    ProfileReport* profile_report { nullptr };
+    /// Called before each stage runs.
+    std::function<void(CompileStage)> before_stage {};
+    /// Called after each stage which succeeded, with the number of tokens for
+    /// CompileStage::Parse, and the number of instructions after the others.
+    std::function<void(CompileStage, size_t)> after_stage {};
+};
+
+/// Compiles the lines of a source file the way `mcl --compile` does: parse,
+/// translate, the optimization passes and finalize. Large sources are parsed
+/// and translated in chunks on all hardware threads. The error says which
+/// stage failed.
+Result<InstrStream> compile_lines(std::span<const std::string> lines, const std::string& filename, const CompileOptions& options = {});
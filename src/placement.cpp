@@ -0,0 +1,81 @@
+#include "placement.h"
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+void* map_placed(size_t size, const Placement& placement) {
+    size = round_up(size, HUGE_PAGE_SIZE);
+    if (placement.huge_pages == HugePages::Explicit) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            return ptr;
+        }
+    }
+    // a transparent huge page has to be aligned to its size, so map one more
+    // and cut off what's before and after the aligned part
+    auto* mapping = static_cast<char*>(mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+    auto* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(mapping), HUGE_PAGE_SIZE));
+    if (aligned != mapping) {
+        munmap(mapping, size_t(aligned - mapping));
+    }
+    munmap(aligned + size, HUGE_PAGE_SIZE - size_t(aligned - mapping));
+    // only a hint, the pages just stay small if the kernel doesn't do it
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+void unmap_placed(void* ptr, size_t size) {
+    munmap(ptr, round_up(size, HUGE_PAGE_SIZE));
+}
+
+void prefault(void* ptr, size_t size) {
+    const auto page_size = size_t(sysconf(_SC_PAGESIZE));
+    auto* bytes = static_cast<volatile char*>(ptr);
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        bytes[offset] = 0;
+    }
+}
+
+size_t allowed_cpu_count() {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return 1;
+    }
+    return size_t(CPU_COUNT(&cpus));
+}
+
+Error pin_thread(size_t index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return Error("Failed to get the CPUs of the thread: {}", std::strerror(errno));
+    }
+    index %= size_t(CPU_COUNT(&allowed));
+    for (size_t cpu = 0; cpu < size_t(CPU_SETSIZE); ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (index > 0) {
+            --index;
+            continue;
+        }
+        cpu_set_t pinned;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+        if (err != 0) {
+            return Error("Failed to pin a thread to CPU {}: {}", cpu, std::strerror(err));
+        }
+        return {};
+    }
+    return {};
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "error.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Where the memory a VM runs on comes from: the decoded instructions, which
+// are read on every step, and the stack. By default it comes from malloc and
+// ordinary pages. Large programs run faster from huge pages, which need
+// fewer TLB entries, and a VM runs fastest from memory on the NUMA node of
+// the CPU it runs on. Linux places a page on the node of the thread which
+// first touches it, so memory which the thread running the VM maps and
+// prefaults is local to it, as long as the thread stays on that node, see
+// pin_thread().
+
+enum class HugePages : uint8_t {
+    Off,
+    /// Aligned mappings, with madvise(MADV_HUGEPAGE), for when transparent
+    /// huge pages are in `madvise` mode.
+    Transparent,
+    /// Mappings from the pool of reserved huge pages (MAP_HUGETLB, see
+    /// /proc/sys/vm/nr_hugepages). Falls back to Transparent if the pool is
+    /// empty.
+    Explicit,
+};
+
+/// Size of a huge page on x86-64 and arm64 with 4 KiB pages. Arrays smaller
+/// than this aren't put into huge pages.
+inline constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+struct Placement {
+    HugePages huge_pages { HugePages::Off };
+    /// Whether the stack is touched when it's mapped, instead of page by
+    /// page as the VM grows it, so that it's backed before the VM runs, by
+    /// memory local to the mapping thread. The decoded instructions are
+    /// written while loading anyway.
+    bool prefault { false };
+};
+
+/// Maps `size` bytes for an array of at least HUGE_PAGE_SIZE, in huge pages
+/// as the placement says, and returns nullptr if that fails. Unmap with
+/// unmap_placed().
+void* map_placed(size_t size, const Placement& placement);
+void unmap_placed(void* ptr, size_t size);
+/// Whether an array of `size` bytes goes through map_placed() instead of
+/// malloc.
+constexpr bool is_placed(size_t size, const Placement& placement) {
+    return placement.huge_pages != HugePages::Off && size >= HUGE_PAGE_SIZE;
+}
+
+/// Writes to each page of the memory, so that it's backed from now on.
+void prefault(void* ptr, size_t size);
+
+/// Number of CPUs the calling thread may run on, which the threads it starts
+/// inherit.
+size_t allowed_cpu_count();
+/// Pins the calling thread to the index-th CPU it may run on, counting around
+/// if there are fewer.
+[[nodiscard]] Error pin_thread(size_t index);
+
+/// Allocator of the arrays of a Program, which puts large ones where the
+/// placement says. Small arrays come from malloc, as a huge page would mostly
+/// be wasted on them.
+template<typename T>
+class PlacedAllocator {
+public:
+    using value_type = T;
+    // so that assigning a vector made with a placement gives it that
+    // placement, instead of copying into memory of the old one
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    PlacedAllocator() = default;
+    explicit PlacedAllocator(const Placement& placement)
+        : m_placement(placement) { }
+    template<typename U>
+    PlacedAllocator(const PlacedAllocator<U>& other)
+        : m_placement(other.placement()) { }
+
+    T* allocate(size_t n) {
+        const auto size = n * sizeof(T);
+        if (is_placed(size, m_placement)) {
+            if (auto* ptr = map_placed(size, m_placement)) {
+                return static_cast<T*>(ptr);
+            }
+            throw std::bad_alloc();
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        const auto size = n * sizeof(T);
+        if (is_placed(size, m_placement)) {
+            unmap_placed(ptr, size);
+            return;
+        }
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    const Placement& placement() const { return m_placement; }
+
+    template<typename U>
+    bool operator==(const PlacedAllocator<U>& other) const {
+        return m_placement.huge_pages == other.placement().huge_pages;
+    }
+
+private:
+    Placement m_placement {};
+};
+
+template<typename T>
+using PlacedVector = std::vector<T, PlacedAllocator<T>>;
@@ -0,0 +1,432 @@
+#include "profile.h"
+#include "cfg.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+/// Blocks with at most this many instructions are copied into hot jumps to them.
+static constexpr size_t MAX_DUPLICATED_INSTRS = 4;
+
+uint64_t hash_ops(std::span<const Op> ops) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (auto op : ops) {
+        hash = (hash ^ uint64_t(op)) * 0x100000001b3;
+    }
+    return hash;
+}
+
+Profile make_profile(std::span<const Op> ops, std::span<const size_t> pcs, const ExecProfile& exec) {
+    Profile profile {
+        .instructions = ops.size(),
+        .ops_hash = hash_ops(ops),
+        .counts = std::vector<uint64_t>(ops.size(), 0),
+        .taken = std::vector<uint64_t>(ops.size(), 0),
+    };
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (pcs[i] < exec.counts.size()) {
+            profile.counts[i] = exec.counts[pcs[i]];
+            profile.taken[i] = exec.taken[pcs[i]];
+        }
+    }
+    return profile;
+}
+
+Error write_profile(const std::string& filename, const Profile& profile) {
+    FilePtr file(std::fopen(filename.c_str(), "w"), &std::fclose);
+    if (!file) {
+        return Error("Failed to open '{}' for writing: {}", filename, std::strerror(errno));
+    }
+    fmt::print(file.get(), "mcl-profile 1\n{} {:016x}\n", profile.instructions, profile.ops_hash);
+    for (size_t i = 0; i < profile.counts.size(); ++i) {
+        if (profile.counts[i] != 0) {
+            fmt::print(file.get(), "{} {} {}\n", i, profile.counts[i], profile.taken[i]);
+        }
+    }
+    if (std::ferror(file.get()) || std::fclose(file.release()) != 0) {
+        return Error("Failed to write '{}': {}", filename, std::strerror(errno));
+    }
+    return {};
+}
+
+Result<Profile> read_profile(const std::string& filename) {
+    FilePtr file(std::fopen(filename.c_str(), "r"), &std::fclose);
+    if (!file) {
+        return { "Failed to open '{}': {}", filename, std::strerror(errno) };
+    }
+    int version = 0;
+    Profile profile;
+    if (std::fscanf(file.get(), "mcl-profile %d %zu %" SCNx64, &version, &profile.instructions, &profile.ops_hash) != 3 || version != 1) {
+        return { "'{}' is not a profile written by `--profile-generate`.", filename };
+    }
+    profile.counts.resize(profile.instructions, 0);
+    profile.taken.resize(profile.instructions, 0);
+    size_t index = 0;
+    uint64_t count = 0;
+    uint64_t taken = 0;
+    int read = 0;
+    while ((read = std::fscanf(file.get(), "%zu %" SCNu64 " %" SCNu64, &index, &count, &taken)) == 3) {
+        if (index >= profile.instructions || taken > count) {
+            return { "'{}' is corrupt: invalid entry for instruction {}.", filename, index };
+        }
+        profile.counts[index] = count;
+        profile.taken[index] = taken;
+    }
+    if (read != EOF) {
+        return { "'{}' is corrupt: expected `<instruction> <count> <taken>`.", filename };
+    }
+    return profile;
+}
+
+namespace {
+
+/// How control leaves a block.
+enum class ExitKind {
+    /// Falls through into the next block.
+    Fallthrough,
+    /// Runs off the end of the program, which halts it.
+    OffEnd,
+    /// `halt` or `ret`, which don't go anywhere in this block's subroutine.
+    Halt,
+    Jump,
+    /// Jumps to `target`, or falls through into `fallthrough`.
+    Conditional,
+};
+
+struct BlockExit {
+    ExitKind kind;
+    /// Index of the last instruction, or SIZE_MAX if the block only has labels.
+    size_t last;
+    size_t target { SIZE_MAX };
+    /// SIZE_MAX if falling through runs off the end of the program.
+    size_t fallthrough { SIZE_MAX };
+    uint64_t target_weight { 0 };
+    uint64_t fallthrough_weight { 0 };
+};
+
+}
+
+static std::vector<BlockExit> block_exits(const AbstractInstrStream& abstracts, const Cfg& cfg, const std::vector<uint64_t>& counts, const std::vector<uint64_t>& taken) {
+    std::vector<BlockExit> exits;
+    exits.reserve(cfg.blocks.size());
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        const auto& block = cfg.blocks[b];
+        const size_t next = b + 1 < cfg.blocks.size() ? b + 1 : SIZE_MAX;
+        size_t last = SIZE_MAX;
+        for (size_t i = block.end; i > block.begin; --i) {
+            if (abstracts[i - 1].instr.s.op != NOT_AN_INSTRUCTION) {
+                last = i - 1;
+                break;
+            }
+        }
+        BlockExit exit { .kind = next == SIZE_MAX ? ExitKind::OffEnd : ExitKind::Fallthrough, .last = last, .fallthrough = next };
+        if (last == SIZE_MAX) {
+            exits.push_back(exit);
+            continue;
+        }
+        const auto op = abstracts[last].instr.s.op;
+        const auto count = counts[last];
+        if (op == HALT || op == RET) {
+            exit.kind = ExitKind::Halt;
+            exit.fallthrough = SIZE_MAX;
+        } else if (op == JMP) {
+            exit.kind = ExitKind::Jump;
+            exit.target = cfg.label_blocks.at(abstracts[last].unresolved_label.value());
+            exit.target_weight = count;
+            exit.fallthrough = SIZE_MAX;
+        } else if (op_is_conditional_jump(op)) {
+            exit.kind = ExitKind::Conditional;
+            exit.target = cfg.label_blocks.at(abstracts[last].unresolved_label.value());
+            exit.target_weight = taken[last];
+            exit.fallthrough_weight = count - taken[last];
+        } else {
+            exit.fallthrough_weight = count;
+        }
+        exits.push_back(exit);
+    }
+    return exits;
+}
+
+/// Orders the blocks into chains, each following the most common successor
+/// of its last block. The entry stays first, chains starting at hotter
+/// blocks come first, and blocks which never ran go last in their original
+/// order.
+static std::vector<size_t> layout_blocks(const std::vector<BlockExit>& exits, const std::vector<uint64_t>& block_counts) {
+    const auto n = exits.size();
+    std::vector<bool> placed(n, false);
+    std::vector<size_t> order;
+    order.reserve(n);
+    const auto chain = [&](size_t b) {
+        while (b != SIZE_MAX && !placed[b]) {
+            placed[b] = true;
+            order.push_back(b);
+            const auto& exit = exits[b];
+            // the fallthrough comes first, so it wins ties and blocks stay where they were
+            size_t best = SIZE_MAX;
+            uint64_t best_weight = 0;
+            if (exit.fallthrough != SIZE_MAX && !placed[exit.fallthrough] && exit.fallthrough_weight > best_weight) {
+                best = exit.fallthrough;
+                best_weight = exit.fallthrough_weight;
+            }
+            if (exit.target != SIZE_MAX && !placed[exit.target] && exit.target_weight > best_weight) {
+                best = exit.target;
+            }
+            b = best;
+        }
+    };
+    chain(0);
+    std::vector<size_t> by_count;
+    for (size_t b = 0; b < n; ++b) {
+        if (block_counts[b] != 0) {
+            by_count.push_back(b);
+        }
+    }
+    std::stable_sort(by_count.begin(), by_count.end(), [&](size_t a, size_t b) { return block_counts[a] > block_counts[b]; });
+    for (auto b : by_count) {
+        chain(b);
+    }
+    for (size_t b = 0; b < n; ++b) {
+        chain(b);
+    }
+    return order;
+}
+
+static AbstractInstr make_instr(Op op, const SourceLocation& location, std::optional<std::string> label = std::nullopt) {
+    return AbstractInstr {
+        .instr = { .s = { .op = op, .val = 0 } },
+        .location = location,
+        .unresolved_symbol = std::nullopt,
+        .unresolved_label = std::move(label),
+    };
+}
+
+Error optimize_profile(AbstractInstrStream& abstracts, const Profile& profile, ProfileReport* report) {
+    std::vector<Op> ops;
+    for (const auto& abstract : abstracts) {
+        if (abstract.instr.s.op != NOT_AN_INSTRUCTION) {
+            ops.push_back(abstract.instr.s.op);
+        }
+    }
+    if (ops.size() != profile.instructions || hash_ops(ops) != profile.ops_hash) {
+        return Error("The profile doesn't match the program: it has {} instructions, the program has {}. It has to be generated from the same source, compiled with the same options.", profile.instructions, ops.size());
+    }
+    // counts by index into `abstracts`, 0 for labels
+    std::vector<uint64_t> counts(abstracts.size(), 0);
+    std::vector<uint64_t> taken(abstracts.size(), 0);
+    for (size_t i = 0, pc = 0; i < abstracts.size(); ++i) {
+        if (abstracts[i].instr.s.op != NOT_AN_INSTRUCTION) {
+            counts[i] = profile.counts[pc];
+            taken[i] = profile.taken[pc];
+            ++pc;
+        }
+    }
+
+    auto cfg_res = build_cfg(abstracts);
+    if (abstracts.empty() || !cfg_res) {
+        // not an error, there's just nothing we can do for this program
+        return {};
+    }
+    const auto& cfg = cfg_res.value();
+    const auto exits = block_exits(abstracts, cfg, counts, taken);
+    std::vector<uint64_t> block_counts(cfg.blocks.size(), 0);
+    ProfileReport found;
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; ++i) {
+            if (abstracts[i].instr.s.op != NOT_AN_INSTRUCTION) {
+                block_counts[b] = counts[i];
+                break;
+            }
+        }
+        if (block_counts[b] != 0) {
+            ++found.hot_blocks;
+        }
+    }
+    const auto order = layout_blocks(exits, block_counts);
+
+    // decide how every block ends in its new position, before emitting
+    // anything, as a block may need a label before the jump to it is emitted
+    struct Tail {
+        /// Replaces the op of the block's last instruction, NOT_AN_INSTRUCTION
+        /// removes it.
+        std::optional<Op> op {};
+        size_t target { SIZE_MAX };
+        /// Appended after the block: a `jmp` to `append_target`, or `halt`.
+        std::optional<Op> append {};
+        size_t append_target { SIZE_MAX };
+    };
+    std::vector<Tail> tails(order.size());
+    std::vector<bool> needs_label(cfg.blocks.size(), false);
+    const auto jump_to = [&](size_t b) {
+        needs_label[b] = true;
+        return b;
+    };
+    for (size_t p = 0; p < order.size(); ++p) {
+        const auto b = order[p];
+        const size_t next = p + 1 < order.size() ? order[p + 1] : SIZE_MAX;
+        const auto& exit = exits[b];
+        auto& tail = tails[p];
+        if (b != p) {
+            ++found.moved_blocks;
+        }
+        switch (exit.kind) {
+        case ExitKind::Fallthrough:
+            if (exit.fallthrough != next) {
+                tail.append = JMP;
+                tail.append_target = jump_to(exit.fallthrough);
+                ++found.added_jumps;
+            }
+            break;
+        case ExitKind::OffEnd:
+            if (next != SIZE_MAX) {
+                tail.append = HALT;
+            }
+            break;
+        case ExitKind::Halt:
+            break;
+        case ExitKind::Jump:
+            if (exit.target == next) {
+                tail.op = NOT_AN_INSTRUCTION;
+                ++found.removed_jumps;
+            } else {
+                tail.target = jump_to(exit.target);
+            }
+            break;
+        case ExitKind::Conditional:
+            if (exit.fallthrough == next) {
+                tail.target = jump_to(exit.target);
+            } else if (exit.target == next && exit.fallthrough != SIZE_MAX) {
+                tail.op = invert_condition(abstracts[exit.last].instr.s.op);
+                tail.target = jump_to(exit.fallthrough);
+                ++found.inverted_jumps;
+            } else {
+                tail.target = jump_to(exit.target);
+                if (exit.fallthrough == SIZE_MAX) {
+                    if (next != SIZE_MAX) {
+                        tail.append = HALT;
+                    }
+                } else {
+                    tail.append = JMP;
+                    tail.append_target = jump_to(exit.fallthrough);
+                    ++found.added_jumps;
+                }
+            }
+            break;
+        }
+    }
+
+    std::vector<std::string> block_labels(cfg.blocks.size());
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        const auto& first = abstracts[cfg.blocks[b].begin];
+        if (first.instr.s.op == NOT_AN_INSTRUCTION) {
+            block_labels[b] = first.unresolved_label.value();
+        } else if (needs_label[b]) {
+            block_labels[b] = fmt::format("__profile_block_{}", b);
+        }
+    }
+
+    AbstractInstrStream laid_out;
+    std::vector<uint64_t> laid_out_counts;
+    laid_out.reserve(abstracts.size() + order.size());
+    laid_out_counts.reserve(abstracts.size() + order.size());
+    for (size_t p = 0; p < order.size(); ++p) {
+        const auto b = order[p];
+        const auto& block = cfg.blocks[b];
+        const auto& exit = exits[b];
+        const auto& tail = tails[p];
+        if (abstracts[block.begin].instr.s.op != NOT_AN_INSTRUCTION && needs_label[b]) {
+            laid_out.push_back(make_instr(NOT_AN_INSTRUCTION, abstracts[block.begin].location, block_labels[b]));
+            laid_out_counts.push_back(0);
+        }
+        for (size_t i = block.begin; i < block.end; ++i) {
+            auto abstract = std::move(abstracts[i]);
+            if (i == exit.last) {
+                if (tail.op == NOT_AN_INSTRUCTION) {
+                    continue;
+                }
+                if (tail.op.has_value()) {
+                    abstract.instr.s.op = *tail.op;
+                }
+                if (tail.target != SIZE_MAX) {
+                    abstract.unresolved_label = block_labels[tail.target];
+                }
+            }
+            laid_out.push_back(std::move(abstract));
+            laid_out_counts.push_back(counts[i]);
+        }
+        if (tail.append.has_value()) {
+            const auto& location = laid_out.back().location;
+            if (*tail.append == JMP) {
+                laid_out.push_back(make_instr(JMP, location, block_labels[tail.append_target]));
+                laid_out_counts.push_back(exit.fallthrough_weight);
+            } else {
+                laid_out.push_back(make_instr(HALT, location));
+                laid_out_counts.push_back(0);
+            }
+        }
+    }
+
+    // replace hot jumps to short blocks which end in `jmp`, `halt` or `ret` by a copy of that block
+    std::unordered_map<std::string_view, size_t> label_index;
+    for (size_t i = 0; i < laid_out.size(); ++i) {
+        if (laid_out[i].instr.s.op == NOT_AN_INSTRUCTION) {
+            label_index[laid_out[i].unresolved_label.value()] = i;
+        }
+    }
+    const auto duplicable = [&](size_t jump) -> std::pair<size_t, size_t> {
+        auto it = label_index.find(laid_out[jump].unresolved_label.value());
+        if (it == label_index.end()) {
+            return { 0, 0 };
+        }
+        auto begin = it->second;
+        while (begin < laid_out.size() && laid_out[begin].instr.s.op == NOT_AN_INSTRUCTION) {
+            ++begin;
+        }
+        for (size_t i = begin; i < laid_out.size() && i - begin < MAX_DUPLICATED_INSTRS; ++i) {
+            const auto op = laid_out[i].instr.s.op;
+            if (op == NOT_AN_INSTRUCTION || i == jump) {
+                break;
+            }
+            if (op == JMP || op == HALT || op == RET) {
+                return { begin, i + 1 };
+            }
+        }
+        return { 0, 0 };
+    };
+    AbstractInstrStream duplicated;
+    std::vector<bool> hot;
+    duplicated.reserve(laid_out.size());
+    hot.reserve(laid_out.size());
+    for (size_t i = 0; i < laid_out.size(); ++i) {
+        const bool is_hot = laid_out_counts[i] != 0;
+        if (laid_out[i].instr.s.op == JMP && is_hot) {
+            auto [begin, end] = duplicable(i);
+            if (begin != end) {
+                for (size_t k = begin; k < end; ++k) {
+                    duplicated.push_back(laid_out[k]);
+                    hot.push_back(true);
+                }
+                ++found.duplicated_blocks;
+                continue;
+            }
+        }
+        duplicated.push_back(laid_out[i]);
+        hot.push_back(is_hot);
+    }
+
+    std::vector<bool> remove(duplicated.size(), false);
+    fuse_superinstructions(duplicated, hot, remove);
+    found.fused = size_t(std::count(remove.begin(), remove.end(), true)) / 2;
+    remove_marked(duplicated, remove);
+
+    abstracts = std::move(duplicated);
+    if (report) {
+        *report = found;
+    }
+    return {};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include "instruction.h"
+#include "interpreter.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+/// Execution counts of a program by instruction index, as written by
+/// `--profile-generate` and read back by `--profile-use`.
+///
+/// Instruction indices are only stable as long as the program is compiled
+/// from the same source with the same options, so the profile remembers the
+/// number of instructions and a hash of their ops, and optimize_profile()
+/// refuses profiles which don't match.
+struct Profile {
+    size_t instructions { 0 };
+    uint64_t ops_hash { 0 };
+    /// Number of times each instruction was executed.
+    std::vector<uint64_t> counts {};
+    /// Number of times each conditional jump was taken, 0 for other instructions.
+    std::vector<uint64_t> taken {};
+};
+
+uint64_t hash_ops(std::span<const Op> ops);
+
+/// Builds the profile of a program from what the interpreter counted.
+/// `pcs` holds the pc of every instruction, which is its index for fixed size
+/// instructions and its byte offset for dense code.
+Profile make_profile(std::span<const Op> ops, std::span<const size_t> pcs, const ExecProfile& exec);
+
+/// Profiles are text, one line per executed instruction, so they can be
+/// inspected and diffed.
+[[nodiscard]] Error write_profile(const std::string& filename, const Profile& profile);
+[[nodiscard]] Result<Profile> read_profile(const std::string& filename);
+
+struct ProfileReport {
+    /// Blocks which were executed at all.
+    size_t hot_blocks { 0 };
+    /// Blocks which ended up at a different position.
+    size_t moved_blocks { 0 };
+    /// Conditional jumps inverted so that the more common direction falls through.
+    size_t inverted_jumps { 0 };
+    /// Jumps which were removed because their target now follows them.
+    size_t removed_jumps { 0 };
+    /// Jumps which had to be added because a block's fallthrough moved away.
+    size_t added_jumps { 0 };
+    /// Hot jumps replaced by a copy of the short block they jump to.
+    size_t duplicated_blocks { 0 };
+    /// Superinstructions formed in hot code which isn't part of a loop.
+    size_t fused { 0 };
+};
+
+/// Optimizes the program for the execution counts in the profile: hot blocks
+/// are laid out so that their most common successor falls through, inverting
+/// conditional jumps where the taken direction is the common one; hot jumps to
+/// short blocks ending in a jump, `halt` or `ret` are replaced by a copy of that
+/// block; and superinstructions are formed in all hot code, not only in loops.
+///
+/// Run this last, right before finalize(), on a program that went through the
+/// same passes as the one which was profiled.
+[[nodiscard]] Error optimize_profile(AbstractInstrStream& abstracts, const Profile& profile, ProfileReport* report = nullptr);
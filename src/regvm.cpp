@@ -0,0 +1,932 @@
+#include "regvm.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include <map>
+#include <utility>
+
+namespace {
+
+/// Conditions of the compare-and-branch ops, in the order of JE to JLE.
+enum Cond : uint8_t {
+    C_EQ,
+    C_NE,
+    C_GT,
+    C_LT,
+    C_GE,
+    C_LE,
+};
+
+constexpr Cond INVERTED[] = { C_NE, C_EQ, C_LE, C_GE, C_LT, C_GT };
+/// The condition which holds for (b, a) whenever `cond` holds for (a, b).
+constexpr Cond MIRRORED[] = { C_EQ, C_NE, C_LT, C_GT, C_LE, C_GE };
+
+bool holds(Cond cond, int64_t a, int64_t b) {
+    switch (cond) {
+    case C_EQ:
+        return a == b;
+    case C_NE:
+        return a != b;
+    case C_GT:
+        return a > b;
+    case C_LT:
+        return a < b;
+    case C_GE:
+        return a >= b;
+    case C_LE:
+        return a <= b;
+    }
+    return false;
+}
+
+/// The op of a group of six compare-and-branch ops, starting at `first`.
+RegOpKind with_cond(RegOpKind first, Cond cond) {
+    return RegOpKind(int(first) + int(cond));
+}
+
+bool is_conditional(RegOpKind kind) {
+    return kind >= R_JE && kind <= R_JMODNZ;
+}
+
+RegOpKind inverted(RegOpKind kind) {
+    if (kind == R_JMODZ || kind == R_JMODNZ) {
+        return kind == R_JMODZ ? R_JMODNZ : R_JMODZ;
+    }
+    // the three groups of six conditions
+    const auto group = RegOpKind(R_JE + (kind - R_JE) / 6 * 6);
+    return with_cond(group, INVERTED[(kind - R_JE) % 6]);
+}
+
+/// How many values an instruction needs on the stack, and how it changes the
+/// height. `clear` is special, as it empties the stack.
+struct StackEffect {
+    size_t needs;
+    int64_t change;
+};
+
+StackEffect stack_effect(Op op) {
+    switch (op) {
+    case POP:
+    case PRINT:
+    case JZ:
+    case JNZ:
+        return { 1, -1 };
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+        return { 2, -1 };
+    case INC:
+    case DEC:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+        return { 1, 0 };
+    case DUP:
+        return { 1, 1 };
+    case DUP2:
+        return { 2, 2 };
+    case SWAP:
+        return { 2, 0 };
+    case OVER:
+        return { 2, 1 };
+    case PUSH:
+        return { 0, 1 };
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+        return { 2, -2 };
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+        return { 2, 0 };
+    case NOT_AN_INSTRUCTION:
+    case HALT:
+    case CLEAR:
+    case JMP:
+    case CALL:
+    case RET:
+        break;
+    }
+    return { 0, 0 };
+}
+
+bool falls_through(Op op) {
+    return op != JMP && op != HALT && op != RET && op != NOT_AN_INSTRUCTION;
+}
+
+constexpr int64_t UNVISITED = -1;
+/// Reached with different stack heights.
+constexpr int64_t CONFLICT = -2;
+
+/// The stack height before every instruction, as far as it's the same on all
+/// paths which reach it.
+struct Heights {
+    std::vector<int64_t> height;
+    /// Instructions reached with a known height which the register code still
+    /// leaves to the interpreter, as they would underflow or overflow the
+    /// stack, are calls or returns, or aren't valid instructions.
+    std::vector<bool> exit;
+    /// First instructions of basic blocks, and those of them jumped to.
+    std::vector<bool> leader;
+    std::vector<bool> target;
+    size_t max_height;
+};
+
+Heights compute_heights(std::span<const Op> ops, std::span<const int64_t> args, size_t stack_size) {
+    const size_t n = ops.size();
+    Heights heights {
+        .height = std::vector<int64_t>(n, UNVISITED),
+        .exit = std::vector<bool>(n, false),
+        .leader = std::vector<bool>(n, false),
+        .target = std::vector<bool>(n, false),
+        .max_height = 0,
+    };
+    std::vector<size_t> work;
+    const auto reach = [&](size_t pc, int64_t height) {
+        if (pc >= n) {
+            return;
+        }
+        auto& known = heights.height[pc];
+        if (known == UNVISITED) {
+            known = height;
+            work.push_back(pc);
+        } else if (known != height) {
+            known = CONFLICT;
+        }
+    };
+    reach(0, 0);
+    // every height only changes twice, so this ends after a few passes at most
+    while (!work.empty()) {
+        const auto pc = work.back();
+        work.pop_back();
+        const auto height = heights.height[pc];
+        if (height == CONFLICT) {
+            continue;
+        }
+        const auto op = ops[pc];
+        const auto effect = stack_effect(op);
+        const auto after = op == CLEAR ? 0 : height + effect.change;
+        // calls are left to the interpreter, which keeps the return addresses
+        if (op == NOT_AN_INSTRUCTION || op == CALL || op == RET || size_t(height) < effect.needs || after > int64_t(stack_size)) {
+            heights.exit[pc] = true;
+            continue;
+        }
+        heights.max_height = std::max(heights.max_height, size_t(std::max(height, after)));
+        if (op_accepts_label_argument(op)) {
+            reach(size_t(args[pc]), after);
+        }
+        if (falls_through(op)) {
+            reach(pc + 1, after);
+        }
+    }
+    heights.leader[0] = true;
+    for (size_t pc = 0; pc < n; ++pc) {
+        if (op_accepts_label_argument(ops[pc]) && size_t(args[pc]) < n) {
+            heights.leader[size_t(args[pc])] = true;
+            heights.target[size_t(args[pc])] = true;
+        }
+        if ((op_accepts_label_argument(ops[pc]) || !falls_through(ops[pc])) && pc + 1 < n) {
+            heights.leader[pc + 1] = true;
+        }
+    }
+    return heights;
+}
+
+/// A value while translating: a constant, or the register which holds it.
+struct Value {
+    bool is_const;
+    int64_t constant;
+    uint32_t reg;
+};
+
+/// A jump whose target op is only known once all blocks are translated.
+struct Fixup {
+    size_t op;
+    size_t target_pc;
+    /// Stack height at the jump, for an exit to the interpreter.
+    size_t height;
+    /// pc of the jump instruction.
+    size_t from_pc;
+};
+
+/// Symbolic stack machine which translates one basic block at a time.
+class RegTranslator {
+public:
+    RegTranslator(std::span<const Op> ops, std::span<const int64_t> args, std::span<const DivMagic> magics, Heights&& heights)
+        : m_code_ops(ops)
+        , m_args(args)
+        , m_magics(magics)
+        , m_heights(std::move(heights))
+        , m_entry(ops.size(), NO_ENTRY) { }
+
+    RegCode translate();
+
+private:
+    static constexpr size_t NO_ENTRY = SIZE_MAX;
+
+    static Value constant(int64_t value) { return { .is_const = true, .constant = value, .reg = 0 }; }
+    static Value reg(uint32_t reg) { return { .is_const = false, .constant = 0, .reg = reg }; }
+
+    bool translated(size_t pc) const {
+        return pc < m_code_ops.size() && m_heights.height[pc] >= 0 && !m_heights.exit[pc];
+    }
+    uint32_t temp() {
+        const auto reg = m_next_temp++;
+        m_reg_count = std::max<size_t>(m_reg_count, m_next_temp);
+        return reg;
+    }
+    Value pop() {
+        auto value = m_stack.back();
+        m_stack.pop_back();
+        return value;
+    }
+    Value top(size_t offset) const { return m_stack[m_stack.size() - offset]; }
+    void emit(RegOpKind kind, uint32_t dst, uint32_t a, uint32_t b, int64_t imm, size_t pc) {
+        m_ops.push_back({ .kind = kind, .dst = dst, .a = a, .b = b, .target = 0, .imm = imm });
+        m_pcs.push_back(pc);
+    }
+    void emit_jump(RegOpKind kind, uint32_t a, uint32_t b, int64_t imm, size_t pc, size_t target_pc) {
+        emit(kind, 0, a, b, imm, pc);
+        m_fixups.push_back({ .op = m_ops.size() - 1, .target_pc = target_pc, .height = m_stack.size(), .from_pc = pc });
+    }
+    void emit_exit(size_t pc) {
+        emit(R_EXIT, uint32_t(m_stack.size()), 0, 0, int64_t(pc), pc);
+    }
+    /// The register of `value`, loading constants into a temporary.
+    uint32_t reg_of(Value value, size_t pc) {
+        if (!value.is_const) {
+            return value.reg;
+        }
+        const auto reg = temp();
+        emit(R_CONST, reg, 0, 0, value.constant, pc);
+        return reg;
+    }
+    /// Where to put the result of an operation which is about to be pushed:
+    /// its own slot, unless another value on the stack still lives there.
+    uint32_t result_reg() {
+        const auto slot = uint32_t(m_stack.size());
+        for (const auto& value : m_stack) {
+            if (!value.is_const && value.reg == slot) {
+                return temp();
+            }
+        }
+        return slot;
+    }
+    /// Copies `value` into a temporary if materialize() would overwrite it.
+    Value protect(Value value, size_t pc) {
+        if (value.is_const || value.reg >= m_stack.size()) {
+            return value;
+        }
+        const auto& there = m_stack[value.reg];
+        if (!there.is_const && there.reg == value.reg) {
+            return value;
+        }
+        const auto copy = temp();
+        emit(R_MOVE, copy, value.reg, 0, 0, pc);
+        return reg(copy);
+    }
+
+    void materialize(size_t pc);
+    void translate_block(size_t begin);
+    bool fold_jump_over(size_t pc);
+    bool instruction(size_t pc);
+    void binary(Op op, size_t pc);
+    bool compare_and_jump(Cond cond, Value a, Value b, size_t pc, size_t target_pc);
+
+    std::span<const Op> m_code_ops;
+    std::span<const int64_t> m_args;
+    std::span<const DivMagic> m_magics;
+    Heights m_heights;
+    /// Index of the first op of the block starting at each pc.
+    std::vector<size_t> m_entry;
+    std::vector<RegOp> m_ops {};
+    std::vector<size_t> m_pcs {};
+    std::vector<Fixup> m_fixups {};
+    std::vector<Value> m_stack {};
+    /// Scratch space for materialize().
+    std::vector<std::pair<uint32_t, uint32_t>> m_moves {};
+    size_t m_block_begin { 0 };
+    uint32_t m_next_temp { 0 };
+    size_t m_reg_count { 0 };
+    size_t m_translated { 0 };
+};
+
+/// Writes every value into its own slot, so that the stack looks as the
+/// interpreter would have left it. The moves are a parallel copy, as a slot
+/// may be read by one move and written by another.
+void RegTranslator::materialize(size_t pc) {
+    m_moves.clear();
+    for (size_t slot = 0; slot < m_stack.size(); ++slot) {
+        const auto& value = m_stack[slot];
+        if (!value.is_const && value.reg != slot) {
+            m_moves.emplace_back(uint32_t(slot), value.reg);
+        }
+    }
+    while (!m_moves.empty()) {
+        const auto ready = std::find_if(m_moves.begin(), m_moves.end(), [&](const auto& move) {
+            return std::none_of(m_moves.begin(), m_moves.end(), [&](const auto& other) { return other.second == move.first; });
+        });
+        if (ready != m_moves.end()) {
+            emit(R_MOVE, ready->first, ready->second, 0, 0, pc);
+            m_moves.erase(ready);
+            continue;
+        }
+        // only cycles are left: save one destination, then it can be written
+        const auto dst = m_moves.front().first;
+        const auto saved = temp();
+        emit(R_MOVE, saved, dst, 0, 0, pc);
+        for (auto& move : m_moves) {
+            if (move.second == dst) {
+                move.second = saved;
+            }
+        }
+    }
+    for (size_t slot = 0; slot < m_stack.size(); ++slot) {
+        if (m_stack[slot].is_const) {
+            emit(R_CONST, uint32_t(slot), 0, 0, m_stack[slot].constant, pc);
+        }
+        m_stack[slot] = reg(uint32_t(slot));
+    }
+}
+
+/// A block which is only a `jmp`, right after a conditional jump over it, is
+/// folded into the conditional jump by inverting it.
+bool RegTranslator::fold_jump_over(size_t pc) {
+    if (m_code_ops[pc] != JMP || m_heights.target[pc] || m_fixups.empty()) {
+        return false;
+    }
+    auto& fixup = m_fixups.back();
+    if (fixup.op + 1 != m_ops.size() || fixup.from_pc + 1 != pc || fixup.target_pc != pc + 1 || !is_conditional(m_ops[fixup.op].kind)) {
+        return false;
+    }
+    m_ops[fixup.op].kind = inverted(m_ops[fixup.op].kind);
+    fixup.target_pc = size_t(m_args[pc]);
+    ++m_translated;
+    return true;
+}
+
+void RegTranslator::translate_block(size_t begin) {
+    m_stack.clear();
+    for (int64_t slot = 0; slot < m_heights.height[begin]; ++slot) {
+        m_stack.push_back(reg(uint32_t(slot)));
+    }
+    m_next_temp = uint32_t(m_heights.max_height);
+    if (translated(begin) && fold_jump_over(begin)) {
+        return;
+    }
+    m_block_begin = m_ops.size();
+    m_entry[begin] = m_ops.size();
+    for (size_t pc = begin;; ++pc) {
+        if (pc != begin && pc < m_code_ops.size() && m_heights.leader[pc]) {
+            // falls through into the next block, which is translated right
+            // after this one if its height is known
+            materialize(pc);
+            if (m_heights.height[pc] < 0) {
+                emit_exit(pc);
+            }
+            return;
+        }
+        if (!translated(pc)) {
+            materialize(pc);
+            emit_exit(pc);
+            return;
+        }
+        ++m_translated;
+        if (!instruction(pc)) {
+            return;
+        }
+    }
+}
+
+void RegTranslator::binary(Op op, size_t pc) {
+    auto b = pop();
+    auto a = pop();
+    if (a.is_const && b.is_const) {
+        const auto x = uint64_t(a.constant);
+        const auto y = uint64_t(b.constant);
+        const bool divides = b.constant != 0 && !(a.constant == INT64_MIN && b.constant == -1);
+        if (op == ADD) {
+            m_stack.push_back(constant(int64_t(x + y)));
+            return;
+        } else if (op == SUB) {
+            m_stack.push_back(constant(int64_t(x - y)));
+            return;
+        } else if (op == MUL) {
+            m_stack.push_back(constant(int64_t(x * y)));
+            return;
+        } else if (divides) {
+            m_stack.push_back(constant(op == DIV ? a.constant / b.constant : a.constant % b.constant));
+            return;
+        }
+        // faults when it runs
+    }
+    if ((op == ADD || op == MUL) && a.is_const) {
+        std::swap(a, b);
+    }
+    const auto dst = result_reg();
+    switch (op) {
+    case ADD:
+    case MUL:
+        if (b.is_const) {
+            emit(op == ADD ? R_ADDI : R_MULI, dst, a.reg, 0, b.constant, pc);
+        } else {
+            emit(op == ADD ? R_ADD : R_MUL, dst, a.reg, b.reg, 0, pc);
+        }
+        break;
+    case SUB:
+        if (b.is_const) {
+            emit(R_ADDI, dst, a.reg, 0, int64_t(0 - uint64_t(b.constant)), pc);
+        } else {
+            emit(R_SUB, dst, reg_of(a, pc), b.reg, 0, pc);
+        }
+        break;
+    case DIV:
+    case MOD: {
+        const auto ra = reg_of(a, pc);
+        emit(op == DIV ? R_DIV : R_MOD, dst, ra, reg_of(b, pc), 0, pc);
+        break;
+    }
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case INC:
+    case DEC:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case PUSH:
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+    case RET:
+        // not binary operations
+        break;
+    }
+    m_stack.push_back(reg(dst));
+}
+
+bool RegTranslator::compare_and_jump(Cond cond, Value a, Value b, size_t pc, size_t target_pc) {
+    if (a.is_const && b.is_const) {
+        if (!holds(cond, a.constant, b.constant)) {
+            return true;
+        }
+        materialize(pc);
+        emit_jump(R_JMP, 0, 0, 0, pc, target_pc);
+        return false;
+    }
+    if (a.is_const) {
+        std::swap(a, b);
+        cond = MIRRORED[cond];
+    }
+    a = protect(a, pc);
+    b = protect(b, pc);
+    materialize(pc);
+    // fuse with the op right before, if nothing else needs its result
+    auto* last = m_ops.size() > m_block_begin ? &m_ops.back() : nullptr;
+    if (last && b.is_const && b.constant == 0 && (cond == C_EQ || cond == C_NE) && last->kind == R_MOD && last->dst == a.reg && a.reg >= m_stack.size()) {
+        last->kind = cond == C_EQ ? R_JMODZ : R_JMODNZ;
+        last->dst = 0;
+        m_fixups.push_back({ .op = m_ops.size() - 1, .target_pc = target_pc, .height = m_stack.size(), .from_pc = pc });
+        return true;
+    }
+    if (b.is_const) {
+        emit_jump(with_cond(R_JEI, cond), a.reg, 0, b.constant, pc, target_pc);
+        return true;
+    }
+    if (last && last->kind == R_ADDI && last->dst == last->a && (last->dst == a.reg || last->dst == b.reg)) {
+        if (last->dst != b.reg) {
+            std::swap(a, b);
+            cond = MIRRORED[cond];
+        }
+        last->kind = with_cond(R_ADDJE, cond);
+        last->a = a.reg;
+        last->b = b.reg;
+        last->dst = 0;
+        m_fixups.push_back({ .op = m_ops.size() - 1, .target_pc = target_pc, .height = m_stack.size(), .from_pc = pc });
+        return true;
+    }
+    emit_jump(with_cond(R_JE, cond), a.reg, b.reg, 0, pc, target_pc);
+    return true;
+}
+
+/// Translates one instruction. Returns false if it ends the block.
+bool RegTranslator::instruction(size_t pc) {
+    const auto op = m_code_ops[pc];
+    const auto arg = m_args[pc];
+    switch (op) {
+    case POP:
+        m_stack.pop_back();
+        break;
+    case PUSH:
+        m_stack.push_back(constant(arg));
+        break;
+    case DUP:
+        m_stack.push_back(top(1));
+        break;
+    case DUP2: {
+        const auto a = top(2);
+        const auto b = top(1);
+        m_stack.push_back(a);
+        m_stack.push_back(b);
+        break;
+    }
+    case OVER:
+        m_stack.push_back(top(2));
+        break;
+    case SWAP:
+        std::swap(m_stack[m_stack.size() - 1], m_stack[m_stack.size() - 2]);
+        break;
+    case CLEAR:
+        m_stack.clear();
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+        binary(op, pc);
+        break;
+    case INC:
+    case DEC: {
+        const auto value = pop();
+        const int64_t step = op == INC ? 1 : -1;
+        if (value.is_const) {
+            m_stack.push_back(constant(int64_t(uint64_t(value.constant) + uint64_t(step))));
+            break;
+        }
+        const auto dst = result_reg();
+        emit(R_ADDI, dst, value.reg, 0, step, pc);
+        m_stack.push_back(reg(dst));
+        break;
+    }
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC: {
+        const auto value = pop();
+        if (value.is_const) {
+            const auto a = value.constant;
+            switch (op) {
+            case DIVP2:
+                m_stack.push_back(constant(div_by_pow2(a, arg)));
+                break;
+            case MODP2:
+                m_stack.push_back(constant(mod_by_pow2(a, arg)));
+                break;
+            case DIVC:
+                m_stack.push_back(constant(div_by_magic(a, m_magics[size_t(arg)])));
+                break;
+            case MODC:
+                m_stack.push_back(constant(mod_by_magic(a, m_magics[size_t(arg)])));
+                break;
+            case NOT_AN_INSTRUCTION:
+            case POP:
+            case ADD:
+            case INC:
+            case DEC:
+            case SUB:
+            case MUL:
+            case DIV:
+            case MOD:
+            case PRINT:
+            case HALT:
+            case DUP:
+            case DUP2:
+            case SWAP:
+            case CLEAR:
+            case OVER:
+            case PUSH:
+            case JE:
+            case JN:
+            case JG:
+            case JL:
+            case JGE:
+            case JLE:
+            case JMP:
+            case JZ:
+            case JNZ:
+            case INCJE:
+            case INCJN:
+            case INCJG:
+            case INCJL:
+            case INCJGE:
+            case INCJLE:
+            case MODJZ:
+            case MODJNZ:
+            case CALL:
+            case RET:
+                break;
+            }
+            break;
+        }
+        const auto dst = result_reg();
+        emit(RegOpKind(R_DIVP2 + (op - DIVP2)), dst, value.reg, 0, arg, pc);
+        m_stack.push_back(reg(dst));
+        break;
+    }
+    case PRINT: {
+        const auto value = pop();
+        emit(R_PRINT, 0, reg_of(value, pc), 0, 0, pc);
+        break;
+    }
+    case HALT:
+        emit(R_HALT, 0, 0, 0, 0, pc);
+        return false;
+    case JMP:
+        materialize(pc);
+        emit_jump(R_JMP, 0, 0, 0, pc, size_t(arg));
+        return false;
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE: {
+        const auto b = pop();
+        const auto a = pop();
+        return compare_and_jump(Cond(op - JE), a, b, pc, size_t(arg));
+    }
+    case JZ:
+    case JNZ:
+        return compare_and_jump(op == JZ ? C_EQ : C_NE, pop(), constant(0), pc, size_t(arg));
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE: {
+        materialize(pc);
+        const auto height = uint32_t(m_stack.size());
+        emit_jump(RegOpKind(R_ADDJE + (op - INCJE)), height - 2, height - 1, 1, pc, size_t(arg));
+        break;
+    }
+    case MODJZ:
+    case MODJNZ: {
+        materialize(pc);
+        const auto height = uint32_t(m_stack.size());
+        emit_jump(op == MODJZ ? R_JMODZ : R_JMODNZ, height - 2, height - 1, 0, pc, size_t(arg));
+        break;
+    }
+    case NOT_AN_INSTRUCTION:
+    case CALL:
+    case RET:
+        // never translated
+        break;
+    }
+    return true;
+}
+
+RegCode RegTranslator::translate() {
+    m_reg_count = m_heights.max_height;
+    for (size_t pc = 0; pc < m_code_ops.size(); ++pc) {
+        if (m_heights.leader[pc] && m_heights.height[pc] >= 0) {
+            translate_block(pc);
+        }
+    }
+    // jumps to code which isn't translated exit to the interpreter, through
+    // one exit per target and height
+    std::map<std::pair<size_t, size_t>, size_t> exits;
+    for (const auto& fixup : m_fixups) {
+        size_t target;
+        if (fixup.target_pc < m_entry.size() && m_entry[fixup.target_pc] != NO_ENTRY) {
+            target = m_entry[fixup.target_pc];
+        } else {
+            auto [it, inserted] = exits.try_emplace({ fixup.target_pc, fixup.height }, m_ops.size());
+            if (inserted) {
+                m_ops.push_back({ .kind = R_EXIT, .dst = uint32_t(fixup.height), .a = 0, .b = 0, .target = 0, .imm = int64_t(fixup.target_pc) });
+                m_pcs.push_back(fixup.target_pc);
+            }
+            target = it->second;
+        }
+        m_ops[fixup.op].target = uint32_t(target);
+    }
+    RegCode code;
+    code.reg_count = m_reg_count;
+    code.stats = { .translated = m_translated, .ops = m_ops.size(), .fell_back = false, .fallback_pc = 0 };
+    code.ops = std::move(m_ops);
+    code.pcs = std::move(m_pcs);
+    return code;
+}
+
+}
+
+RegCode translate_to_registers(std::span<const Op> ops, std::span<const int64_t> args, std::span<const DivMagic> magics, size_t stack_size) {
+    if (ops.empty() || ops.size() >= UINT32_MAX) {
+        return {};
+    }
+    RegTranslator translator(ops, args, magics, compute_heights(ops, args, stack_size));
+    auto code = translator.translate();
+    if (code.reg_count > stack_size) {
+        return {};
+    }
+    return code;
+}
+
+/// Kept out of the loop, so that the compiler doesn't have to keep room for
+/// an Error in it.
+[[gnu::cold, gnu::noinline]] static RegResult division_fault(const RegCode& code, size_t i, const int64_t* regs, uint64_t dispatched) {
+    const auto& op = code.ops[i];
+    const auto a = regs[op.a];
+    const auto b = regs[op.b];
+    const auto pc = code.pcs[i];
+    return {
+        .how = RegExit::Faulted,
+        .pc = pc,
+        .stack_top = 0,
+        .dispatched = dispatched,
+        .error = op.kind == R_DIV ? Error("Division by zero: {}/{}. pc={}", a, b, pc) : Error("Modulo division by zero: {}/{}. pc={}", a, b, pc),
+    };
+}
+
+template<bool Counted>
+static RegResult run_loop(const RegCode& code, int64_t* regs, DivisorCache& div_cache, const DivMagic* magics) noexcept {
+    const RegOp* ops = code.ops.data();
+    size_t i = 0;
+    uint64_t dispatched = 0;
+    while (true) {
+        const auto& op = ops[i];
+        if constexpr (Counted) {
+            ++dispatched;
+        }
+        size_t next = i + 1;
+        switch (op.kind) {
+        case R_CONST:
+            regs[op.dst] = op.imm;
+            break;
+        case R_MOVE:
+            regs[op.dst] = regs[op.a];
+            break;
+        case R_ADD:
+            regs[op.dst] = int64_t(uint64_t(regs[op.a]) + uint64_t(regs[op.b]));
+            break;
+        case R_SUB:
+            regs[op.dst] = int64_t(uint64_t(regs[op.a]) - uint64_t(regs[op.b]));
+            break;
+        case R_MUL:
+            regs[op.dst] = int64_t(uint64_t(regs[op.a]) * uint64_t(regs[op.b]));
+            break;
+        case R_ADDI:
+            regs[op.dst] = int64_t(uint64_t(regs[op.a]) + uint64_t(op.imm));
+            break;
+        case R_MULI:
+            regs[op.dst] = int64_t(uint64_t(regs[op.a]) * uint64_t(op.imm));
+            break;
+        case R_DIV:
+        case R_MOD: {
+            const auto a = regs[op.a];
+            const auto b = regs[op.b];
+            if (b == 0) [[unlikely]] {
+                return division_fault(code, i, regs, dispatched);
+            }
+            const auto* magic = cached_div_magic(div_cache, b);
+            if (op.kind == R_DIV) {
+                regs[op.dst] = magic ? div_by_magic(a, *magic) : a / b;
+            } else {
+                regs[op.dst] = magic ? mod_by_magic(a, *magic) : a % b;
+            }
+            break;
+        }
+        case R_DIVP2:
+            regs[op.dst] = div_by_pow2(regs[op.a], op.imm);
+            break;
+        case R_MODP2:
+            regs[op.dst] = mod_by_pow2(regs[op.a], op.imm);
+            break;
+        case R_DIVC:
+            regs[op.dst] = div_by_magic(regs[op.a], magics[op.imm]);
+            break;
+        case R_MODC:
+            regs[op.dst] = mod_by_magic(regs[op.a], magics[op.imm]);
+            break;
+        case R_PRINT:
+            fmt::print("{}\n", regs[op.a]);
+            break;
+        case R_JMP:
+            next = op.target;
+            break;
+        case R_JE:
+            next = regs[op.a] == regs[op.b] ? op.target : next;
+            break;
+        case R_JN:
+            next = regs[op.a] != regs[op.b] ? op.target : next;
+            break;
+        case R_JG:
+            next = regs[op.a] > regs[op.b] ? op.target : next;
+            break;
+        case R_JL:
+            next = regs[op.a] < regs[op.b] ? op.target : next;
+            break;
+        case R_JGE:
+            next = regs[op.a] >= regs[op.b] ? op.target : next;
+            break;
+        case R_JLE:
+            next = regs[op.a] <= regs[op.b] ? op.target : next;
+            break;
+        case R_JEI:
+            next = regs[op.a] == op.imm ? op.target : next;
+            break;
+        case R_JNI:
+            next = regs[op.a] != op.imm ? op.target : next;
+            break;
+        case R_JGI:
+            next = regs[op.a] > op.imm ? op.target : next;
+            break;
+        case R_JLI:
+            next = regs[op.a] < op.imm ? op.target : next;
+            break;
+        case R_JGEI:
+            next = regs[op.a] >= op.imm ? op.target : next;
+            break;
+        case R_JLEI:
+            next = regs[op.a] <= op.imm ? op.target : next;
+            break;
+        case R_ADDJE:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] == regs[op.b] ? op.target : next;
+            break;
+        case R_ADDJN:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] != regs[op.b] ? op.target : next;
+            break;
+        case R_ADDJG:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] > regs[op.b] ? op.target : next;
+            break;
+        case R_ADDJL:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] < regs[op.b] ? op.target : next;
+            break;
+        case R_ADDJGE:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] >= regs[op.b] ? op.target : next;
+            break;
+        case R_ADDJLE:
+            regs[op.b] = int64_t(uint64_t(regs[op.b]) + uint64_t(op.imm));
+            next = regs[op.a] <= regs[op.b] ? op.target : next;
+            break;
+        case R_JMODZ:
+            if (regs[op.b] == 0) [[unlikely]] {
+                return division_fault(code, i, regs, dispatched);
+            }
+            // like `modjz`, without the divisor cache: in loops, b is
+            // usually a different value every time
+            if (regs[op.a] % regs[op.b] == 0) {
+                next = op.target;
+            }
+            break;
+        case R_JMODNZ:
+            if (regs[op.b] == 0) [[unlikely]] {
+                return division_fault(code, i, regs, dispatched);
+            }
+            if (regs[op.a] % regs[op.b] != 0) {
+                next = op.target;
+            }
+            break;
+        case R_HALT:
+            return { .how = RegExit::Halted, .pc = code.pcs[i], .stack_top = 0, .dispatched = dispatched, .error = {} };
+        case R_EXIT:
+            // the exit isn't an instruction of the program
+            return { .how = RegExit::Interpreter, .pc = size_t(op.imm), .stack_top = op.dst, .dispatched = dispatched - (Counted ? 1 : 0), .error = {} };
+        }
+        i = next;
+    }
+}
+
+RegResult run_registers(const RegCode& code, int64_t* stack, DivisorCache& div_cache, const DivMagic* magics, bool count) noexcept {
+    if (count) {
+        return run_loop<true>(code, stack, div_cache, magics);
+    }
+    return run_loop<false>(code, stack, div_cache, magics);
+}
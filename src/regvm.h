@@ -0,0 +1,134 @@
+#pragma once
+
+#include "divide.h"
+#include "error.h"
+#include "instruction.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/// Register code: a loaded program translated from stack operations into
+/// three-address operations, for execute() with VmConfig::registers.
+///
+/// Wherever the height of the stack before an instruction is the same on
+/// every path that reaches it, each stack slot is a register: the value at
+/// height i lives in stack[i], and temporaries above the highest slot. Stack
+/// shuffling (`dup`, `swap`, `over`, `pop`, `push`) only changes which
+/// register the translator knows a value in, operations on constants are
+/// folded, and a value is only copied into its slot at the end of a basic
+/// block. Where the height isn't known, like in loops which grow the stack,
+/// the register code ends and the stack interpreter continues, with the stack
+/// exactly as it would have left it.
+
+enum RegOpKind : uint8_t {
+    /// dst = imm
+    R_CONST,
+    /// dst = a
+    R_MOVE,
+    R_ADD,
+    R_SUB,
+    R_MUL,
+    /// dst = a + imm
+    R_ADDI,
+    /// dst = a * imm
+    R_MULI,
+    /// faults if b is 0
+    R_DIV,
+    R_MOD,
+    /// dst = a / 2^imm
+    R_DIVP2,
+    R_MODP2,
+    /// dst = a / magics[imm], the magic numbers of the loaded program
+    R_DIVC,
+    R_MODC,
+    /// prints a
+    R_PRINT,
+    R_JMP,
+    /// jump to `target` if the comparison of a and b holds, in the order of
+    /// the conditions of JE to JLE
+    R_JE,
+    R_JN,
+    R_JG,
+    R_JL,
+    R_JGE,
+    R_JLE,
+    /// like R_JE to R_JLE, comparing a to imm
+    R_JEI,
+    R_JNI,
+    R_JGI,
+    R_JLI,
+    R_JGEI,
+    R_JLEI,
+    /// b += imm, then like R_JE to R_JLE
+    R_ADDJE,
+    R_ADDJN,
+    R_ADDJG,
+    R_ADDJL,
+    R_ADDJGE,
+    R_ADDJLE,
+    /// jump to `target` if a % b is (R_JMODZ) or isn't 0; faults if b is 0
+    R_JMODZ,
+    R_JMODNZ,
+    R_HALT,
+    /// continue in the stack interpreter at pc imm, with dst values on the stack
+    R_EXIT,
+};
+
+struct RegOp {
+    RegOpKind kind;
+    uint32_t dst;
+    uint32_t a;
+    uint32_t b;
+    uint32_t target;
+    int64_t imm;
+};
+
+struct RegStats {
+    /// Instructions which were translated, and the register ops they became.
+    size_t translated { 0 };
+    size_t ops { 0 };
+    /// Whether the program went on in the stack interpreter, and at which pc.
+    bool fell_back { false };
+    size_t fallback_pc { 0 };
+};
+
+struct RegCode {
+    std::vector<RegOp> ops {};
+    /// pc of the instruction each op was translated from, for faults.
+    std::vector<size_t> pcs {};
+    /// Number of stack slots the ops use as registers.
+    size_t reg_count { 0 };
+    RegStats stats {};
+
+    bool enabled() const { return !ops.empty(); }
+};
+
+/// Translates loaded code, with jump arguments as instruction indices and the
+/// arguments of `divc` and `modc` as indices into `magics`. Returns empty code
+/// if the registers wouldn't fit into a stack of `stack_size` values, as then
+/// nothing is gained over the interpreter.
+[[nodiscard]] RegCode translate_to_registers(std::span<const Op> ops, std::span<const int64_t> args, std::span<const DivMagic> magics, size_t stack_size);
+
+enum class RegExit {
+    Halted,
+    Faulted,
+    /// The stack interpreter has to continue at `pc`.
+    Interpreter,
+};
+
+struct RegResult {
+    RegExit how;
+    /// The pc of the `halt`, of the instruction which faulted, or where the
+    /// interpreter continues.
+    size_t pc;
+    size_t stack_top;
+    /// Number of ops which ran, only counted if asked for.
+    uint64_t dispatched;
+    /// Set if how is RegExit::Faulted.
+    Error error;
+};
+
+/// Runs the register code from its start, with the stack memory as registers.
+/// `print` writes to stdout.
+RegResult run_registers(const RegCode& code, int64_t* stack, DivisorCache& div_cache, const DivMagic* magics, bool count) noexcept;
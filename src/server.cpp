@@ -0,0 +1,510 @@
+#include "server.h"
+#include "compiler.h"
+#include "interpreter.h"
+#include "pipeline.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+std::string default_socket_path() {
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        return fmt::format("{}/mcl.sock", runtime_dir);
+    }
+    return fmt::format("/tmp/mcl-{}.sock", getuid());
+}
+
+static bool send_all(int fd, const void* data, size_t size) {
+    const auto* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        // MSG_NOSIGNAL, so that a peer which went away is an error instead of SIGPIPE
+        const auto n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size) {
+    auto* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        const auto n = recv(fd, bytes, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static bool send_frame(int fd, FrameType type, std::string_view payload) {
+    std::string frame;
+    frame.reserve(sizeof(uint8_t) + sizeof(uint32_t) + payload.size());
+    const auto size = uint32_t(payload.size());
+    frame.push_back(char(type));
+    frame.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    frame.append(payload);
+    return send_all(fd, frame.data(), frame.size());
+}
+
+static Error recv_frame(int fd, FrameType& type, std::string& payload) {
+    uint8_t type_byte = 0;
+    uint32_t size = 0;
+    if (!recv_all(fd, &type_byte, sizeof(type_byte)) || !recv_all(fd, &size, sizeof(size))) {
+        return Error("Connection closed.");
+    }
+    if (size > MAX_FRAME_SIZE) {
+        return Error("Frame of {} bytes is too large.", size);
+    }
+    type = FrameType(type_byte);
+    payload.resize(size);
+    if (!recv_all(fd, payload.data(), size)) {
+        return Error("Connection closed in the middle of a frame.");
+    }
+    return {};
+}
+
+/// A unix socket bound to or connected to `path`.
+static Result<int> open_socket(const std::string& path, sockaddr_un& addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return { "Socket path '{}' is too long.", path };
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return { "Failed to create a socket: {}", std::strerror(errno) };
+    }
+    return int { fd };
+}
+
+static Result<int> connect_to(const std::string& path) {
+    sockaddr_un addr;
+    auto fd = open_socket(path, addr);
+    if (!fd) {
+        return { "{}", fd.error };
+    }
+    if (connect(fd.value(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        const int err = errno;
+        close(fd.value());
+        return { "Failed to connect to '{}': {}", path, std::strerror(err) };
+    }
+    return int { fd.value() };
+}
+
+namespace {
+
+struct CompiledProgram {
+    InstrStream instrs;
+    SourceMap source_map;
+};
+
+/// Compiled programs by a hash of their source, name and compile options.
+class ProgramCache {
+public:
+    explicit ProgramCache(size_t capacity)
+        : m_capacity(capacity) { }
+
+    std::shared_ptr<const CompiledProgram> find(uint64_t hash, const std::string& key) {
+        std::lock_guard lock(m_mutex);
+        auto it = m_entries.find(hash);
+        // the key is compared too, so a hash collision is only a miss
+        if (it == m_entries.end() || it->second.key != key) {
+            return nullptr;
+        }
+        return it->second.program;
+    }
+
+    void insert(uint64_t hash, std::string key, std::shared_ptr<const CompiledProgram> program) {
+        std::lock_guard lock(m_mutex);
+        auto [it, inserted] = m_entries.insert_or_assign(hash, Entry { .key = std::move(key), .program = std::move(program) });
+        if (!inserted) {
+            return;
+        }
+        m_order.push_back(hash);
+        if (m_order.size() > m_capacity) {
+            m_entries.erase(m_order.front());
+            m_order.pop_front();
+        }
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const CompiledProgram> program;
+    };
+
+    std::mutex m_mutex;
+    std::unordered_map<uint64_t, Entry> m_entries;
+    /// Oldest first.
+    std::deque<uint64_t> m_order;
+    size_t m_capacity;
+};
+
+/// Accepted connections waiting for a worker.
+class ConnectionQueue {
+public:
+    void push(int fd) {
+        {
+            std::lock_guard lock(m_mutex);
+            m_fds.push_back(fd);
+        }
+        m_cv.notify_one();
+    }
+
+    /// Blocks until there is a connection, or returns nullopt once closed.
+    std::optional<int> pop() {
+        std::unique_lock lock(m_mutex);
+        m_cv.wait(lock, [this] { return !m_fds.empty() || m_closed; });
+        if (m_fds.empty()) {
+            return std::nullopt;
+        }
+        const int fd = m_fds.front();
+        m_fds.pop_front();
+        return fd;
+    }
+
+    void close() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<int> m_fds;
+    bool m_closed { false };
+};
+
+struct ServerStats {
+    std::atomic<uint64_t> requests { 0 };
+    std::atomic<uint64_t> cache_hits { 0 };
+};
+
+}
+
+/// One line per request, flushed right away as the log is usually a file.
+template<typename... Args>
+static void log_line(fmt::format_string<Args...> s, Args&&... args) {
+    fmt::print("{}\n", fmt::format(s, std::forward<Args>(args)...));
+    std::fflush(stdout);
+}
+
+static uint64_t hash_key(std::string_view key) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char c : key) {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/// The same passes as `mcl --compile`, without writing a file.
+static Result<CompiledProgram> compile_source(const std::string& name, std::string_view source, bool optimize, bool checked_arith) {
+    CompiledProgram program;
+    const auto lines = split_lines(source);
+    auto instrs = compile_lines(lines, name, CompileOptions { .optimize = optimize, .checked_arith = checked_arith, .source_map = &program.source_map });
+    if (!instrs) {
+        return { "{}", instrs.error };
+    }
+    program.instrs = instrs.move();
+    return program;
+}
+
+/// Whether the client closed the connection, or it broke. Doesn't wait.
+static bool client_gone(int fd) {
+    // hangups and errors are reported without asking for them
+    pollfd pfd { .fd = fd, .events = 0, .revents = 0 };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+/// Runs the program, sending its output as it goes. Returns the error the
+/// program ended with, or nullopt if the client went away. Between slices of
+/// ServerConfig::flush_interval instructions, the program is stopped if it
+/// ran out of time, if the client went away, or if the server is `stopping`.
+static std::optional<Error> run_streaming(int fd, const CompiledProgram& program, const VmConfig& vm_cfg, const ServerConfig& cfg, const std::atomic<bool>& stopping) {
+    auto vm_res = Vm::create(InstrStream(program.instrs), vm_cfg);
+    if (!vm_res) {
+        return Error("{}", vm_res.error);
+    }
+    auto vm = vm_res.move();
+    vm.output_limit = 64 * 1024;
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+        const auto status = run(vm, cfg.flush_interval);
+        if (!vm.output.empty()) {
+            if (!send_frame(fd, FRAME_OUTPUT, vm.output)) {
+                return std::nullopt;
+            }
+            vm.output.clear();
+        }
+        switch (status) {
+        case VmStatus::Halted:
+            return Error {};
+        case VmStatus::Faulted: {
+            if (vm.prog.pc != SIZE_MAX) {
+                auto loc = program.source_map.lookup(vm.prog.pc);
+                if (loc.has_value()) {
+                    return Error("{}, at {}", vm.error.error, to_string(*loc));
+                }
+            }
+            return vm.error;
+        }
+        case VmStatus::BudgetExhausted:
+        case VmStatus::OutputFull:
+            break;
+        }
+        if (stopping.load()) {
+            return Error("Stopped, as the server is shutting down.");
+        }
+        if (client_gone(fd)) {
+            return std::nullopt;
+        }
+        if (cfg.time_limit.count() != 0 && std::chrono::steady_clock::now() - start > cfg.time_limit) {
+            return Error("Stopped after running for the time limit of {} ms.", cfg.time_limit.count());
+        }
+    }
+}
+
+static void handle_connection(int fd, ProgramCache& cache, ServerStats& stats, const ServerConfig& cfg, const std::atomic<bool>& stopping) {
+    const auto start = std::chrono::steady_clock::now();
+    FrameType type;
+    std::string payload;
+    auto err = recv_frame(fd, type, payload);
+    constexpr size_t header_size = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    if (!err && (type != FRAME_RUN || payload.size() < header_size)) {
+        err = Error("Expected a request.");
+    }
+    if (err) {
+        (void)send_frame(fd, FRAME_RESULT, err.error.str());
+        return;
+    }
+    const auto flags = uint8_t(payload[0]);
+    uint64_t stack_size;
+    uint32_t name_size;
+    std::memcpy(&stack_size, payload.data() + 1, sizeof(stack_size));
+    std::memcpy(&name_size, payload.data() + 1 + sizeof(stack_size), sizeof(name_size));
+    if (name_size > payload.size() - header_size) {
+        (void)send_frame(fd, FRAME_RESULT, "Malformed request.");
+        return;
+    }
+    if (stack_size > cfg.max_stack_size) {
+        (void)send_frame(fd, FRAME_RESULT, fmt::format("A stack of {} values is larger than the {} the server allows.", stack_size, cfg.max_stack_size));
+        return;
+    }
+    const std::string name = payload.substr(header_size, name_size);
+    const std::string_view source = std::string_view(payload).substr(header_size + name_size);
+    const bool optimize = (flags & REQUEST_OPTIMIZE) != 0;
+    const bool checked_arith = (flags & REQUEST_CHECKED_ARITH) != 0;
+
+    // everything which changes the compiled program is part of the key
+    std::string key;
+    key.reserve(1 + name.size() + 1 + source.size());
+    key.push_back(char(flags & (REQUEST_OPTIMIZE | REQUEST_CHECKED_ARITH)));
+    key.append(name);
+    key.push_back('\0');
+    key.append(source);
+    const auto hash = hash_key(key);
+    ++stats.requests;
+    auto program = cache.find(hash, key);
+    const bool cached = program != nullptr;
+    if (cached) {
+        ++stats.cache_hits;
+    } else {
+        auto compiled = compile_source(name, source, optimize, checked_arith);
+        if (!compiled) {
+            (void)send_frame(fd, FRAME_RESULT, compiled.error.str());
+            if (cfg.log_requests) {
+                log_line("{}: {}", name, compiled.error);
+            }
+            return;
+        }
+        program = std::make_shared<const CompiledProgram>(compiled.move());
+        cache.insert(hash, std::move(key), program);
+    }
+    const VmConfig vm_cfg { .stack_size = size_t(stack_size), .checked_arith = checked_arith, .placement = cfg.placement };
+    auto result = run_streaming(fd, *program, vm_cfg, cfg, stopping);
+    const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!result.has_value()) {
+        if (cfg.log_requests) {
+            log_line("{}: client went away, after {:.2f} ms", name, ms);
+        }
+        return;
+    }
+    const std::string message = *result ? result->error.str() : std::string {};
+    (void)send_frame(fd, FRAME_RESULT, message);
+    if (cfg.log_requests) {
+        log_line("{}: {} {:.2f} ms{}{}", name, cached ? "cached," : "compiled,", ms, *result ? ", " : "", message);
+    }
+}
+
+static volatile std::sig_atomic_t s_stop_signal = 0;
+
+static void on_stop_signal(int) {
+    if (s_stop_signal) {
+        // asked twice, so don't wait for running programs
+        _exit(1);
+    }
+    s_stop_signal = 1;
+}
+
+Error serve(const ServerConfig& cfg, const std::atomic<bool>* stop) {
+    // a server which still answers means the socket isn't stale
+    auto probe = connect_to(cfg.socket_path);
+    if (probe) {
+        close(probe.value());
+        return Error("Another server is already listening on '{}'.", cfg.socket_path);
+    }
+    unlink(cfg.socket_path.c_str());
+    sockaddr_un addr;
+    auto listen_fd = open_socket(cfg.socket_path, addr);
+    if (!listen_fd) {
+        return Error("{}", listen_fd.error);
+    }
+    const int fd = listen_fd.value();
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        const int err = errno;
+        close(fd);
+        return Error("Failed to listen on '{}': {}", cfg.socket_path, std::strerror(err));
+    }
+    if (!stop) {
+        struct sigaction action {};
+        action.sa_handler = on_stop_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+    }
+
+    ProgramCache cache(cfg.cache_entries);
+    ServerStats stats;
+    ConnectionQueue queue;
+    // set once no more connections are accepted
+    std::atomic<bool> stopping { false };
+    const size_t worker_count = cfg.workers != 0 ? cfg.workers : std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < worker_count; ++i) {
+        workers.emplace_back([&, i] {
+            // pinned before the first program, so that all its memory is
+            // mapped on the node the worker stays on
+            if (cfg.pin_workers) {
+                auto pin_err = pin_thread(i);
+                if (pin_err) {
+                    log_line("Worker {}: {}", i, pin_err.error);
+                }
+            }
+            while (auto client = queue.pop()) {
+                if (stopping.load()) {
+                    (void)send_frame(*client, FRAME_RESULT, "Refused, as the server is shutting down.");
+                } else {
+                    handle_connection(*client, cache, stats, cfg, stopping);
+                }
+                close(*client);
+            }
+        });
+    }
+    log_line("Listening on '{}' with {} workers.", cfg.socket_path, worker_count);
+
+    Error err;
+    while (!(stop ? stop->load() : s_stop_signal != 0)) {
+        // wake up regularly to check whether to stop
+        pollfd pfd { .fd = fd, .events = POLLIN, .revents = 0 };
+        const int ready = poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            err = Error("Failed to wait for connections: {}", std::strerror(errno));
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        const int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        queue.push(client);
+    }
+    close(fd);
+    unlink(cfg.socket_path.c_str());
+    stopping = true;
+    queue.close();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    s_stop_signal = 0;
+    log_line("Served {} requests, {} from the cache.", stats.requests.load(), stats.cache_hits.load());
+    return err;
+}
+
+ClientResult run_on_server(const std::string& socket_path, const ClientRequest& request, std::FILE* out) {
+    auto fd_res = connect_to(socket_path);
+    if (!fd_res) {
+        return { .error = Error("{}", fd_res.error), .program_error = {} };
+    }
+    const int fd = fd_res.value();
+    std::string payload;
+    uint8_t flags = 0;
+    if (request.optimize) {
+        flags |= REQUEST_OPTIMIZE;
+    }
+    if (request.checked_arith) {
+        flags |= REQUEST_CHECKED_ARITH;
+    }
+    const auto name_size = uint32_t(request.name.size());
+    payload.push_back(char(flags));
+    payload.append(reinterpret_cast<const char*>(&request.stack_size), sizeof(request.stack_size));
+    payload.append(reinterpret_cast<const char*>(&name_size), sizeof(name_size));
+    payload.append(request.name);
+    payload.append(request.source);
+    ClientResult result;
+    if (payload.size() > MAX_FRAME_SIZE) {
+        result.error = Error("'{}' is too large to send.", request.name);
+    } else if (!send_frame(fd, FRAME_RUN, payload)) {
+        result.error = Error("Failed to send the request: {}", std::strerror(errno));
+    }
+    while (!result.error) {
+        FrameType type;
+        auto err = recv_frame(fd, type, payload);
+        if (err) {
+            result.error = Error("Lost the connection to the server: {}", err.error);
+        } else if (type == FRAME_OUTPUT) {
+            std::fwrite(payload.data(), 1, payload.size(), out);
+        } else if (type == FRAME_RESULT) {
+            if (!payload.empty()) {
+                result.program_error = Error("{}", payload);
+            }
+            break;
+        } else {
+            result.error = Error("Unexpected frame {} from the server.", int(type));
+        }
+    }
+    close(fd);
+    return result;
+}
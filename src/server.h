@@ -0,0 +1,100 @@
+#pragma once
+
+#include "error.h"
+#include "placement.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/// A daemon which compiles and runs programs sent to it over a Unix domain
+/// socket, so that a job doesn't pay for starting a process, loading
+/// libraries and compiling the same source again.
+///
+/// Every connection carries one request and its replies, as frames: a
+/// FrameType byte, the payload size as a uint32_t, and the payload, all in
+/// native byte order, as both ends run on the same machine.
+
+enum FrameType : uint8_t {
+    /// Client to server: RequestFlags as one byte, the stack size as a
+    /// uint64_t, the length of the name as a uint32_t, the name, and the
+    /// source for the rest of the payload.
+    FRAME_RUN = 1,
+    /// Server to client: output of `print`, sent while the program runs.
+    FRAME_OUTPUT = 2,
+    /// Server to client, the last frame: empty if the program halted, the
+    /// error message otherwise.
+    FRAME_RESULT = 3,
+};
+
+enum RequestFlags : uint8_t {
+    REQUEST_OPTIMIZE = 1 << 0,
+    REQUEST_CHECKED_ARITH = 1 << 1,
+};
+
+/// Frames larger than this are refused.
+constexpr uint32_t MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+struct ServerConfig {
+    std::string socket_path;
+    /// Number of programs run at the same time. 0 selects one per hardware
+    /// thread.
+    size_t workers { 0 };
+    /// Number of compiled programs kept. Once full, the oldest is dropped.
+    size_t cache_entries { 256 };
+    /// Instructions a program runs before its output so far is sent, so that
+    /// output of long running programs arrives while they run. Also how often
+    /// the time limit, the client and shutdown are checked.
+    uint64_t flush_interval { 1 << 20 };
+    /// Wall time a program may run for before it's stopped with an error, so
+    /// that a program which never halts doesn't hold its worker forever. 0
+    /// means no limit.
+    std::chrono::milliseconds time_limit { 60'000 };
+    /// Largest stack, in values, a request may ask for. Requests for more are
+    /// refused, so that a client can't make the server reserve any amount of
+    /// memory.
+    uint64_t max_stack_size { 1 << 24 };
+    /// Whether to print a line for every request, with its time and whether
+    /// the compiled program came from the cache.
+    bool log_requests { true };
+    /// Where the VMs put their memory. Each VM is created by the worker
+    /// which runs it, so its memory is local to that worker.
+    Placement placement {};
+    /// Whether each worker is pinned to a CPU of its own, as far as there
+    /// are enough, so that it stays next to its memory.
+    bool pin_workers { false };
+};
+
+/// `$XDG_RUNTIME_DIR/mcl.sock`, or `/tmp/mcl-<uid>.sock` if that isn't set.
+std::string default_socket_path();
+
+/// Listens on the socket and serves requests until `stop` is set, or until
+/// SIGINT or SIGTERM if it isn't given. Programs still running then are
+/// stopped with an error, and requests still waiting are refused. A stale
+/// socket file is replaced, but it's an error if another server is still
+/// listening on it.
+[[nodiscard]] Error serve(const ServerConfig& cfg, const std::atomic<bool>* stop = nullptr);
+
+struct ClientRequest {
+    /// Used as the file name in source locations.
+    std::string name;
+    std::string source;
+    bool optimize { true };
+    bool checked_arith { false };
+    /// 0 selects the default.
+    uint64_t stack_size { 0 };
+};
+
+/// Result of a request: `error` is set if the server couldn't be reached or
+/// the connection broke, `program_error` if the program didn't compile or
+/// faulted.
+struct ClientResult {
+    Error error {};
+    Error program_error {};
+};
+
+/// Sends the program to the server, and writes its output to `out` as it
+/// arrives.
+ClientResult run_on_server(const std::string& socket_path, const ClientRequest& request, std::FILE* out);
@@ -0,0 +1,173 @@
+#include "source_map.h"
+#include <algorithm>
+#include <cstring>
+
+static void write_uleb(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(uint8_t(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+static void write_sleb(std::vector<uint8_t>& out, int64_t value) {
+    // zigzag, so small negative deltas stay small
+    write_uleb(out, (uint64_t(value) << 1) ^ uint64_t(value >> 63));
+}
+
+/// Reads rows and serialized sections. Reading past the end sets `failed`
+/// instead of faulting, so corrupt files are reported.
+struct ByteReader {
+    std::span<const uint8_t> data;
+    size_t offset { 0 };
+    bool failed { false };
+
+    bool at_end() const { return offset >= data.size(); }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (at_end()) {
+                failed = true;
+                return 0;
+            }
+            const auto byte = data[offset++];
+            value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        failed = true;
+        return 0;
+    }
+
+    int64_t sleb() {
+        const auto raw = uleb();
+        return int64_t(raw >> 1) ^ -int64_t(raw & 1);
+    }
+
+    template<typename T>
+    T fixed() {
+        T value {};
+        if (data.size() - offset < sizeof(T) || offset > data.size()) {
+            failed = true;
+            return value;
+        }
+        std::memcpy(&value, data.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+};
+
+/// Decodes one row, continuing from `row`, which holds the previous one.
+static bool decode_row(ByteReader& reader, SourceMap::Row& row, size_t& file) {
+    const auto pc_field = reader.uleb();
+    row.pc += size_t(pc_field >> 1);
+    if ((pc_field & 1) != 0) {
+        file = size_t(reader.uleb());
+    }
+    row.loc.line = size_t(int64_t(row.loc.line) + reader.sleb());
+    row.loc.col_start = size_t(reader.uleb());
+    row.loc.col_end = row.loc.col_start + size_t(reader.uleb());
+    return !reader.failed;
+}
+
+void SourceMap::add(size_t pc, const SourceLocation& loc) {
+    auto file_it = std::find(files.begin(), files.end(), loc.file);
+    const auto file = size_t(file_it - files.begin());
+    if (file_it == files.end()) {
+        files.push_back(loc.file);
+    }
+    if (!m_empty && file == m_last_file && loc.line == m_last_line
+        && loc.col_start == m_last_col_start && loc.col_end == m_last_col_end) {
+        return;
+    }
+    const bool file_changed = m_empty ? file != 0 : file != m_last_file;
+    write_uleb(rows, uint64_t(pc - m_last_pc) << 1 | (file_changed ? 1 : 0));
+    if (file_changed) {
+        write_uleb(rows, file);
+    }
+    write_sleb(rows, int64_t(loc.line) - int64_t(m_last_line));
+    write_uleb(rows, loc.col_start);
+    write_uleb(rows, loc.col_end - loc.col_start);
+    m_last_pc = pc;
+    m_last_file = file;
+    m_last_line = loc.line;
+    m_last_col_start = loc.col_start;
+    m_last_col_end = loc.col_end;
+    m_empty = false;
+}
+
+std::optional<SourceLocation> SourceMap::lookup(size_t pc) const {
+    ByteReader reader { .data = rows };
+    Row row { .pc = 0, .loc = { .file = {}, .line = 0, .col_start = 0, .col_end = 0 } };
+    size_t file = 0;
+    std::optional<SourceLocation> found {};
+    while (!reader.at_end() && decode_row(reader, row, file) && row.pc <= pc) {
+        found = row.loc;
+        found->file = file < files.size() ? files[file] : std::string("?");
+    }
+    return found;
+}
+
+std::vector<SourceMap::Row> SourceMap::decode() const {
+    ByteReader reader { .data = rows };
+    std::vector<Row> result;
+    Row row { .pc = 0, .loc = { .file = {}, .line = 0, .col_start = 0, .col_end = 0 } };
+    size_t file = 0;
+    while (!reader.at_end() && decode_row(reader, row, file)) {
+        result.push_back(row);
+        result.back().loc.file = file < files.size() ? files[file] : std::string("?");
+    }
+    return result;
+}
+
+void SourceMap::remap(std::span<const size_t> new_pcs) {
+    const auto old_rows = decode();
+    SourceMap remapped;
+    for (const auto& row : old_rows) {
+        if (row.pc < new_pcs.size()) {
+            remapped.add(new_pcs[row.pc], row.loc);
+        }
+    }
+    *this = std::move(remapped);
+}
+
+std::vector<uint8_t> serialize_source_map(const SourceMap& map) {
+    std::vector<uint8_t> out;
+    const auto append = [&](const void* data, size_t size) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), bytes, bytes + size);
+    };
+    const auto file_count = uint32_t(map.files.size());
+    append(&file_count, sizeof(file_count));
+    for (const auto& file : map.files) {
+        const auto size = uint32_t(file.size());
+        append(&size, sizeof(size));
+        append(file.data(), file.size());
+    }
+    const auto rows_size = uint64_t(map.rows.size());
+    append(&rows_size, sizeof(rows_size));
+    append(map.rows.data(), map.rows.size());
+    return out;
+}
+
+Result<SourceMap> deserialize_source_map(std::span<const uint8_t> data) {
+    ByteReader reader { .data = data };
+    SourceMap map;
+    const auto file_count = reader.fixed<uint32_t>();
+    for (uint32_t i = 0; i < file_count && !reader.failed; ++i) {
+        const auto size = reader.fixed<uint32_t>();
+        if (reader.failed || data.size() - reader.offset < size) {
+            return { "Source map is corrupt: file name {} is cut off.", i };
+        }
+        map.files.emplace_back(reinterpret_cast<const char*>(data.data() + reader.offset), size);
+        reader.offset += size;
+    }
+    const auto rows_size = reader.fixed<uint64_t>();
+    if (reader.failed || data.size() - reader.offset != rows_size) {
+        return { "Source map is corrupt: expected {} bytes of rows, but {} are left.", rows_size, data.size() - std::min(reader.offset, data.size()) };
+    }
+    map.rows.assign(data.begin() + long(reader.offset), data.end());
+    return map;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "error.h"
+#include "source_location.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+/// Maps program counters back to the source location of the instruction
+/// which was compiled there.
+///
+/// Only instructions whose location differs from the one before get a row,
+/// and every row is delta-encoded against the previous one as LEB128 varints:
+///
+///     (pc delta << 1 | file changed), [file index], line delta (zigzag),
+///     column start, column length
+///
+/// which is 4-5 bytes per source line. Nothing about the map is needed while
+/// running, it's only decoded to report faults or profiles.
+struct SourceMap {
+    /// Names of the source files, indexed by the file index of a row.
+    std::vector<std::string> files {};
+    /// The rows, encoded as described above.
+    std::vector<uint8_t> rows {};
+
+    /// Appends a row. `pc` must be larger than that of the previous row.
+    /// Does nothing if the location is the same as that of the previous row.
+    void add(size_t pc, const SourceLocation& loc);
+    /// Location of the instruction at `pc`, or nullopt if there is no row at
+    /// or before it. Decodes the rows up to `pc`, so only use this for a few
+    /// lookups; see decode() for many.
+    std::optional<SourceLocation> lookup(size_t pc) const;
+
+    struct Row {
+        size_t pc;
+        SourceLocation loc;
+    };
+    /// All rows, sorted by pc.
+    std::vector<Row> decode() const;
+
+    /// Replaces the pc of every row by `new_pcs[pc]`, for when the code is
+    /// re-encoded with different pcs, like the dense encoding.
+    void remap(std::span<const size_t> new_pcs);
+
+private:
+    // state of the last row added, to delta-encode the next one
+    size_t m_last_pc { 0 };
+    size_t m_last_file { 0 };
+    size_t m_last_line { 0 };
+    size_t m_last_col_start { 0 };
+    size_t m_last_col_end { 0 };
+    bool m_empty { true };
+};
+
+/// Serializes the map into the section format of .mclb files.
+std::vector<uint8_t> serialize_source_map(const SourceMap& map);
+[[nodiscard]] Result<SourceMap> deserialize_source_map(std::span<const uint8_t> data);
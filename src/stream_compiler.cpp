@@ -0,0 +1,248 @@
+#include "stream_compiler.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "symbols.h"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+/// A reference to a label which wasn't defined yet when it was emitted.
+struct PendingRef {
+    /// Index of the instruction which has to be patched.
+    size_t index;
+    /// The whole instruction, so that patching it doesn't have to read it back.
+    Instr instr;
+    /// For the error message, if the label is never defined.
+    size_t line;
+};
+
+/// Writes instructions to the output file, and resolves labels as it goes.
+struct StreamEmitter {
+    static constexpr size_t BUFFER_SIZE = 8192;
+    static constexpr size_t UNDEFINED = SIZE_MAX;
+
+    std::FILE* file;
+    std::string filename;
+    /// Instructions which haven't been written to the file yet.
+    std::vector<Instr> buffer {};
+    /// Number of instructions already in the file.
+    size_t written { 0 };
+    SymbolTable labels {};
+    /// By label id.
+    std::vector<size_t> addresses {};
+    std::vector<std::vector<PendingRef>> pending {};
+    size_t pending_count { 0 };
+    StreamStats stats {};
+
+    size_t next_index() const { return written + buffer.size(); }
+
+    Error flush() {
+        if (std::fwrite(buffer.data(), sizeof(Instr), buffer.size(), file) != buffer.size()) {
+            return Error("Failed to write '{}': {}", filename, std::strerror(errno));
+        }
+        written += buffer.size();
+        buffer.clear();
+        return {};
+    }
+
+    Error patch(const PendingRef& ref, size_t address) {
+        auto instr = ref.instr;
+        set_instr_val(instr, int64_t(address));
+        if (ref.index >= written) {
+            buffer[ref.index - written] = instr;
+            return {};
+        }
+        const auto offset = long(sizeof(BytecodeHeader) + ref.index * sizeof(Instr));
+        if (std::fseek(file, offset, SEEK_SET) != 0
+            || std::fwrite(&instr, sizeof(instr), 1, file) != 1
+            || std::fseek(file, 0, SEEK_END) != 0) {
+            return Error("Failed to patch '{}': {}", filename, std::strerror(errno));
+        }
+        return {};
+    }
+
+    uint32_t label_id(const std::string& name) {
+        const auto id = labels.intern(name);
+        if (id == addresses.size()) {
+            addresses.push_back(UNDEFINED);
+            pending.emplace_back();
+        }
+        return id;
+    }
+
+    Error define_label(const AbstractInstr& abstract) {
+        const auto id = label_id(abstract.unresolved_label.value());
+        if (addresses[id] != UNDEFINED) {
+            return Error("{}: Label '{}' is defined twice, which isn't supported when streaming.", to_string(abstract.location), abstract.unresolved_label.value());
+        }
+        addresses[id] = next_index();
+        for (const auto& ref : pending[id]) {
+            auto err = patch(ref, addresses[id]);
+            if (err) {
+                return err;
+            }
+        }
+        pending_count -= pending[id].size();
+        // release the memory, as this label is done
+        std::vector<PendingRef>().swap(pending[id]);
+        return {};
+    }
+
+    Error emit(const AbstractInstr& abstract) {
+        if (abstract.instr.s.op == NOT_AN_INSTRUCTION) {
+            return define_label(abstract);
+        }
+        auto instr = abstract.instr;
+        if (abstract.unresolved_label.has_value()) {
+            const auto id = label_id(abstract.unresolved_label.value());
+            if (addresses[id] != UNDEFINED) {
+                set_instr_val(instr, int64_t(addresses[id]));
+            } else {
+                pending[id].push_back(PendingRef { .index = next_index(), .instr = instr, .line = abstract.location.line });
+                ++pending_count;
+                stats.max_pending_refs = std::max(stats.max_pending_refs, pending_count);
+            }
+        }
+        buffer.push_back(instr);
+        if (buffer.size() >= BUFFER_SIZE) {
+            return flush();
+        }
+        return {};
+    }
+};
+
+/// Optimizes the window and hands it to the emitter.
+static Error emit_window(StreamEmitter& emitter, AbstractInstrStream& window, const StreamConfig& cfg) {
+    if (cfg.optimize) {
+        auto err = optimize_peephole(window, cfg.checked_arith, &emitter.stats.diagnostics);
+        if (!err) {
+            err = optimize_strength_reduce(window);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    for (const auto& abstract : window) {
+        auto err = emitter.emit(abstract);
+        if (err) {
+            return err;
+        }
+    }
+    window.clear();
+    return {};
+}
+
+static Result<StreamStats> compile_stream_to(std::FILE* input, const std::string& input_name, const std::string& output_filename, const StreamConfig& cfg) {
+    FilePtr file(std::fopen(output_filename.c_str(), "wb+"), &std::fclose);
+    if (!file) {
+        return { "Failed to open '{}' for writing: {}", output_filename, std::strerror(errno) };
+    }
+    BytecodeHeader header {};
+    header.stack_size = cfg.stack_size;
+    // written again with the code size at the end
+    if (std::fwrite(&header, sizeof(header), 1, file.get()) != 1) {
+        return { "Failed to write '{}': {}", output_filename, std::strerror(errno) };
+    }
+    StreamEmitter emitter { .file = file.get(), .filename = output_filename };
+    emitter.buffer.reserve(StreamEmitter::BUFFER_SIZE);
+
+    SourceLocation loc {
+        .file = input_name,
+        .line = 0,
+        .col_start = 0,
+        .col_end = 0,
+    };
+    // tokens of an instruction which isn't complete yet, usually none
+    TokenStream tokens;
+    AbstractInstrStream window;
+    const auto process_line = [&](const std::string& text, bool more_input) -> Error {
+        ++loc.line;
+        auto err = parse_line(text, loc, tokens);
+        if (err) {
+            return err;
+        }
+        std::span<const Token> span(tokens.begin(), tokens.end());
+        err = translate_partial(span, window, more_input);
+        if (err) {
+            return err;
+        }
+        tokens.erase(tokens.begin(), tokens.end() - long(span.size()));
+        if (window.size() >= cfg.window_size) {
+            return emit_window(emitter, window, cfg);
+        }
+        return {};
+    };
+
+    std::vector<char> chunk(cfg.chunk_size);
+    std::string line;
+    while (true) {
+        const auto n = std::fread(chunk.data(), 1, chunk.size(), input);
+        if (n == 0) {
+            break;
+        }
+        size_t start = 0;
+        for (auto* newline = static_cast<char*>(std::memchr(chunk.data(), '\n', n)); newline;
+             newline = static_cast<char*>(std::memchr(chunk.data() + start, '\n', n - start))) {
+            const auto end = size_t(newline - chunk.data());
+            line.append(chunk.data() + start, end - start);
+            auto err = process_line(line, true);
+            if (err) {
+                return { "{}", err.error };
+            }
+            line.clear();
+            start = end + 1;
+        }
+        line.append(chunk.data() + start, n - start);
+    }
+    if (std::ferror(input)) {
+        return { "Failed to read '{}': {}", input_name, std::strerror(errno) };
+    }
+    Error err;
+    // the last line, if it doesn't end in a newline
+    if (!line.empty()) {
+        err = process_line(line, true);
+    }
+    if (!err) {
+        // no more input, so whatever is left has to be complete now
+        std::span<const Token> rest(tokens.begin(), tokens.end());
+        err = translate_partial(rest, window, false);
+    }
+    if (!err) {
+        err = emit_window(emitter, window, cfg);
+    }
+    if (!err) {
+        err = emitter.flush();
+    }
+    if (err) {
+        return { "{}", err.error };
+    }
+
+    for (size_t id = 0; id < emitter.pending.size(); ++id) {
+        if (!emitter.pending[id].empty()) {
+            return { "Failed to resolve label(s): {}:{}: Could not find label '{}'.", input_name, emitter.pending[id].front().line, emitter.labels.name(uint32_t(id)) };
+        }
+    }
+    header.code_size = emitter.written * sizeof(Instr);
+    if (std::fseek(file.get(), 0, SEEK_SET) != 0
+        || std::fwrite(&header, sizeof(header), 1, file.get()) != 1) {
+        return { "Failed to write '{}': {}", output_filename, std::strerror(errno) };
+    }
+    if (std::fclose(file.release()) != 0) {
+        return { "Failed to write '{}': {}", output_filename, std::strerror(errno) };
+    }
+    emitter.stats.lines = loc.line;
+    emitter.stats.instructions = emitter.written;
+    emitter.stats.labels = emitter.labels.size();
+    return std::move(emitter.stats);
+}
+
+Result<StreamStats> compile_stream(std::FILE* input, const std::string& input_name, const std::string& output_filename, const StreamConfig& cfg) {
+    auto res = compile_stream_to(input, input_name, output_filename, cfg);
+    if (!res) {
+        // don't leave a half written file behind
+        std::remove(output_filename.c_str());
+    }
+    return res;
+}
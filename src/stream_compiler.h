@@ -0,0 +1,42 @@
+#pragma once
+
+#include "compiler.h"
+#include "error.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct StreamConfig {
+    /// Number of bytes read from the input at once.
+    size_t chunk_size { 64 * 1024 };
+    /// Number of abstract instructions collected before they are optimized
+    /// and written out. Patterns which span two windows aren't optimized.
+    size_t window_size { 4096 };
+    bool optimize { true };
+    /// See optimize_peephole().
+    bool checked_arith { false };
+    /// Written to the header, see BytecodeHeader::stack_size.
+    uint64_t stack_size { 0 };
+};
+
+struct StreamStats {
+    size_t lines { 0 };
+    size_t instructions { 0 };
+    size_t labels { 0 };
+    /// Most forward references which were waiting for their label at once.
+    size_t max_pending_refs { 0 };
+    /// What folding constants found, see optimize_peephole().
+    std::vector<FoldDiagnostic> diagnostics {};
+};
+
+/// Compiles MCL source from `input` into a .mclb file without holding the
+/// whole program in memory. The input is read in chunks, every line is parsed
+/// and translated once it's complete, and the instructions are optimized and
+/// written out window by window. References to labels which aren't defined
+/// yet are backpatched in the output file once the label is defined.
+///
+/// Memory use grows with the number of labels and of forward references which
+/// are still waiting for their label, but not with the size of the source.
+/// Unlike finalize(), defining a label twice is an error.
+[[nodiscard]] Result<StreamStats> compile_stream(std::FILE* input, const std::string& input_name, const std::string& output_filename, const StreamConfig& cfg = {});
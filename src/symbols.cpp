@@ -0,0 +1,72 @@
+#include "symbols.h"
+#include <algorithm>
+#include <bit>
+
+uint32_t SymbolTable::hash(std::string_view name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    return hash;
+}
+
+size_t SymbolTable::probe(std::string_view name, uint32_t hash) const {
+    const auto mask = m_slots.size() - 1;
+    auto i = size_t(hash) & mask;
+    while (m_slots[i].id != NO_SYMBOL
+        && (m_slots[i].hash != hash || this->name(m_slots[i].id) != name)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void SymbolTable::rehash(size_t slot_count) {
+    std::vector<Slot> old = std::move(m_slots);
+    m_slots.assign(slot_count, Slot {});
+    const auto mask = slot_count - 1;
+    for (const auto& slot : old) {
+        if (slot.id != NO_SYMBOL) {
+            auto i = size_t(slot.hash) & mask;
+            while (m_slots[i].id != NO_SYMBOL) {
+                i = (i + 1) & mask;
+            }
+            m_slots[i] = slot;
+        }
+    }
+}
+
+void SymbolTable::reserve(size_t count) {
+    // keep the load factor at or below 1/2
+    const auto slot_count = std::bit_ceil(count * 2);
+    if (slot_count > m_slots.size()) {
+        rehash(slot_count);
+    }
+    m_offsets.reserve(count + 1);
+}
+
+uint32_t SymbolTable::intern(std::string_view name) {
+    if ((size() + 1) * 2 > m_slots.size()) {
+        rehash(std::max<size_t>(16, m_slots.size() * 2));
+    }
+    const auto h = hash(name);
+    auto& slot = m_slots[probe(name, h)];
+    if (slot.id == NO_SYMBOL) {
+        slot.hash = h;
+        slot.id = uint32_t(size());
+        m_chars.append(name);
+        m_offsets.push_back(m_chars.size());
+    }
+    return slot.id;
+}
+
+uint32_t SymbolTable::find(std::string_view name) const {
+    if (m_slots.empty()) {
+        return NO_SYMBOL;
+    }
+    return m_slots[probe(name, hash(name))].id;
+}
+
+std::string_view SymbolTable::name(uint32_t id) const {
+    return std::string_view(m_chars).substr(m_offsets[id], m_offsets[id + 1] - m_offsets[id]);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Interns strings: every distinct string gets an id, and ids are dense,
+/// starting at 0, so they can index plain vectors.
+///
+/// Lookup uses open addressing with linear probing over a flat table, and all
+/// strings are kept in one buffer, so interning a string doesn't allocate
+/// unless one of those has to grow.
+class SymbolTable {
+public:
+    static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+    /// Returns the id of the string, adding it if it's new.
+    uint32_t intern(std::string_view name);
+    /// Returns the id of the string, or NO_SYMBOL if it wasn't interned.
+    uint32_t find(std::string_view name) const;
+    std::string_view name(uint32_t id) const;
+    /// Number of distinct strings.
+    size_t size() const { return m_offsets.size() - 1; }
+    /// Makes room for `count` strings without rehashing.
+    void reserve(size_t count);
+
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t id { NO_SYMBOL };
+    };
+
+    static uint32_t hash(std::string_view name);
+    /// Index of the slot which holds the string, or of the empty slot where it
+    /// would go.
+    size_t probe(std::string_view name, uint32_t hash) const;
+    void rehash(size_t slot_count);
+
+    std::vector<Slot> m_slots {};
+    std::string m_chars {};
+    /// Start of each string in m_chars, followed by the end of the last one.
+    std::vector<size_t> m_offsets { 0 };
+};
@@ -0,0 +1,104 @@
+#include "task.h"
+#include <cstdio>
+
+VmTask VmTask::promise_type::get_return_object() noexcept {
+    return VmTask(Handle::from_promise(*this));
+}
+
+VmTask& VmTask::operator=(VmTask&& other) noexcept {
+    if (this != &other) {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+        m_handle = std::exchange(other.m_handle, nullptr);
+    }
+    return *this;
+}
+
+VmTask::~VmTask() {
+    if (m_handle) {
+        m_handle.destroy();
+    }
+}
+
+VmTask make_vm_task(InstrStream instrs, TaskConfig cfg) {
+    auto vm_res = Vm::create(std::move(instrs), cfg.vm);
+    if (!vm_res) {
+        co_return Error("{}", vm_res.error);
+    }
+    auto vm = vm_res.move();
+    vm.output_limit = cfg.output_limit;
+    while (true) {
+        switch (run(vm, cfg.budget)) {
+        case VmStatus::Halted:
+            // hand out the rest of the output before finishing, as the
+            // buffer dies with the coroutine's locals
+            if (!vm.output.empty()) {
+                co_await Yield { YieldReason::Output, &vm.output };
+            }
+            co_return Error {};
+        case VmStatus::Faulted:
+            if (!vm.output.empty()) {
+                co_await Yield { YieldReason::Output, &vm.output };
+            }
+            co_return vm.error;
+        case VmStatus::BudgetExhausted:
+            co_await Yield { YieldReason::Budget, &vm.output };
+            break;
+        case VmStatus::OutputFull:
+            co_await Yield { YieldReason::Output, &vm.output };
+            break;
+        }
+    }
+}
+
+Executor::Executor()
+    : m_sink([](TaskId, std::string_view out) { std::fwrite(out.data(), 1, out.size(), stdout); }) {
+}
+
+Executor::Executor(OutputSink sink, ResultSink results)
+    : m_sink(std::move(sink))
+    , m_results(std::move(results)) {
+}
+
+Executor::TaskId Executor::spawn(InstrStream&& instrs, const TaskConfig& cfg) {
+    auto id = m_next_id++;
+    m_ready.push_back({ id, make_vm_task(std::move(instrs), cfg) });
+    return id;
+}
+
+bool Executor::step(Entry& entry) {
+    auto& task = entry.task;
+    task.resume();
+    // output is drained whenever a task yields, not only when the buffer
+    // is full, so that the order of output between tasks stays sensible.
+    auto* out = task.output();
+    if (out && !out->empty()) {
+        m_sink(entry.id, *out);
+        out->clear();
+    }
+    if (!task.done()) {
+        return false;
+    }
+    if (m_results) {
+        m_results(entry.id, task.result());
+    }
+    return true;
+}
+
+bool Executor::run_once() {
+    auto n = m_ready.size();
+    for (size_t i = 0; i < n; ++i) {
+        auto entry = std::move(m_ready.front());
+        m_ready.pop_front();
+        if (!step(entry)) {
+            m_ready.push_back(std::move(entry));
+        }
+    }
+    return !m_ready.empty();
+}
+
+void Executor::run() {
+    while (run_once()) {
+    }
+}
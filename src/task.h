@@ -0,0 +1,138 @@
+#pragma once
+
+#include "error.h"
+#include "interpreter.h"
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+struct TaskConfig {
+    /// Number of instructions a task may run before it yields to the executor.
+    uint64_t budget { 10'000 };
+    /// Size of the output buffer, in bytes. A task yields once its buffered
+    /// `print` output reaches this size.
+    size_t output_limit { 4096 };
+    VmConfig vm {};
+};
+
+/// Why a VmTask is suspended.
+enum class YieldReason {
+    /// Not started yet, or finished.
+    None,
+    /// Ran out of its instruction budget.
+    Budget,
+    /// The output buffer has to be drained before it can continue.
+    Output,
+    /// Waiting for I/O. Reserved for I/O instructions, which MCL doesn't have yet.
+    Io,
+};
+
+/// A VM running as a C++20 coroutine. The task suspends whenever it yields
+/// (see YieldReason), and finishes with the Error which the program ended with.
+///
+/// Owns the coroutine, so it can't be copied, only moved.
+class VmTask {
+public:
+    struct promise_type {
+        VmTask get_return_object() noexcept;
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(Error err) noexcept {
+            result = std::move(err);
+            output = nullptr;
+        }
+        void unhandled_exception() noexcept { result = Error("Unhandled exception in VM task"); }
+
+        Error result {};
+        YieldReason reason { YieldReason::None };
+        /// Output buffer of the VM, valid while the task is suspended.
+        std::string* output { nullptr };
+    };
+    using Handle = std::coroutine_handle<promise_type>;
+
+    VmTask() = default;
+    explicit VmTask(Handle handle) noexcept
+        : m_handle(handle) { }
+    VmTask(VmTask&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr)) { }
+    VmTask& operator=(VmTask&& other) noexcept;
+    VmTask(const VmTask&) = delete;
+    VmTask& operator=(const VmTask&) = delete;
+    ~VmTask();
+
+    /// Runs the task until it suspends next.
+    void resume() { m_handle.resume(); }
+    bool done() const { return m_handle.done(); }
+    YieldReason reason() const { return m_handle.promise().reason; }
+    /// Output buffer of the suspended task. The caller is expected to consume
+    /// and clear it before resuming. Null once the task is done.
+    std::string* output() const { return m_handle.promise().output; }
+    /// Result of the program, only valid once done() is true.
+    const Error& result() const { return m_handle.promise().result; }
+
+private:
+    Handle m_handle { nullptr };
+};
+
+/// Awaitable which suspends a VmTask with the given reason.
+struct Yield {
+    YieldReason reason;
+    std::string* output { nullptr };
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(VmTask::Handle handle) const noexcept {
+        handle.promise().reason = reason;
+        handle.promise().output = output;
+    }
+    void await_resume() const noexcept { }
+};
+
+/// Creates a task which runs the given program. It does nothing until resumed.
+VmTask make_vm_task(InstrStream instrs, TaskConfig cfg);
+
+/// Runs many VmTasks concurrently on the calling thread, switching between them
+/// whenever one of them yields. Tasks are scheduled round-robin, and destroyed
+/// as soon as they are done, so that an executor can run for as long as tasks
+/// keep coming.
+class Executor {
+public:
+    using TaskId = size_t;
+    /// Receives all output of a task, in order, in chunks.
+    using OutputSink = std::function<void(TaskId, std::string_view)>;
+    /// Receives the result of a task once it's done, right before the task
+    /// is destroyed.
+    using ResultSink = std::function<void(TaskId, const Error&)>;
+
+    /// The default output sink writes to stdout, and results are dropped.
+    Executor();
+    explicit Executor(OutputSink sink, ResultSink results = {});
+
+    /// Adds a program as a new task, which runs once run() or run_once() is
+    /// called. Ids aren't reused.
+    TaskId spawn(InstrStream&& instrs, const TaskConfig& cfg = {});
+    /// Resumes each runnable task once. Returns false once all tasks are done.
+    bool run_once();
+    /// Runs until all tasks are done.
+    void run();
+
+    /// Number of tasks which aren't done yet.
+    size_t task_count() const { return m_ready.size(); }
+
+private:
+    struct Entry {
+        TaskId id;
+        VmTask task;
+    };
+
+    /// Returns whether the task is done.
+    bool step(Entry& entry);
+
+    OutputSink m_sink;
+    ResultSink m_results;
+    TaskId m_next_id { 0 };
+    std::deque<Entry> m_ready;
+};
@@ -0,0 +1,660 @@
+#include "trace.h"
+#include <algorithm>
+#include <unordered_map>
+
+void Traces::init(size_t code_size) {
+    entry.assign(code_size, NONE);
+    hotness.assign(code_size, 0);
+}
+
+namespace {
+
+/// A value while compiling a trace: a constant, or the register of a value
+/// only known at runtime. Registers are numbered from 0 here, and moved
+/// behind the constants once all constants are known.
+struct Value {
+    bool is_const;
+    int64_t constant;
+    uint16_t reg;
+};
+
+/// Symbolic stack machine which turns the recorded instructions into TraceOps.
+class TraceBuilder {
+public:
+    explicit TraceBuilder(std::span<const DivMagic> magics)
+        : m_program_magics(magics) { }
+
+    Error add(const RecordedInstr& instr);
+    Trace finish(size_t start_pc, size_t recorded);
+
+private:
+    static Value constant(int64_t value) { return { .is_const = true, .constant = value, .reg = 0 }; }
+
+    Value new_reg() {
+        m_load_depth.push_back(0);
+        return { .is_const = false, .constant = 0, .reg = uint16_t(m_load_depth.size() - 1) };
+    }
+    /// Makes sure the symbolic stack holds at least `count` values, loading
+    /// more from below the entry top if needed.
+    void ensure(size_t count) {
+        while (m_stack.size() < count) {
+            auto reg = new_reg();
+            ++m_consumed;
+            m_load_depth[reg.reg] = m_consumed;
+            m_ops.push_back({ .kind = T_LOAD, .dst = reg, .a = {}, .b = {}, .exit = 0, .imm = int64_t(m_consumed) });
+            m_stack.insert(m_stack.begin(), reg);
+        }
+    }
+    Value pop() {
+        ensure(1);
+        auto value = m_stack.back();
+        m_stack.pop_back();
+        return value;
+    }
+    Value& top(size_t offset) {
+        ensure(offset);
+        return m_stack[m_stack.size() - offset];
+    }
+    /// Exit to `pc` with the current stack.
+    uint32_t exit_to(size_t pc) {
+        m_exits.push_back({ .pc = pc, .consumed = m_consumed, .stack = m_stack });
+        return uint32_t(m_exits.size() - 1);
+    }
+    Value binary(TraceOpKind kind, Value a, Value b, uint32_t exit = 0, int64_t imm = 0) {
+        auto dst = new_reg();
+        m_ops.push_back({ .kind = kind, .dst = dst, .a = a, .b = b, .exit = exit, .imm = imm });
+        return dst;
+    }
+    void guard(TraceOpKind kind, Value a, Value b, uint32_t exit, int64_t imm = 0) {
+        m_ops.push_back({ .kind = kind, .dst = {}, .a = a, .b = b, .exit = exit, .imm = imm });
+    }
+    uint32_t magic_index(const DivMagic& magic) {
+        for (size_t i = 0; i < m_magics.size(); ++i) {
+            if (m_magics[i].divisor == magic.divisor) {
+                return uint32_t(i);
+            }
+        }
+        m_magics.push_back(magic);
+        return uint32_t(m_magics.size() - 1);
+    }
+    /// Removes ops whose results aren't used. With `keep_loads`, loads are
+    /// kept, as a carried trace writes them back when it's left.
+    void remove_dead_ops(bool keep_loads);
+    /// Whether the value is what the stack slot `depth` below the entry top
+    /// held on entry, so it doesn't have to be written back there.
+    bool is_unchanged(const Value& value, size_t depth) const {
+        return !value.is_const && m_load_depth[value.reg] == depth;
+    }
+
+    /// Like TraceOp, but with Values as operands.
+    struct PendingOp {
+        TraceOpKind kind;
+        Value dst;
+        Value a;
+        Value b;
+        uint32_t exit;
+        int64_t imm;
+    };
+    struct PendingExit {
+        size_t pc;
+        size_t consumed;
+        std::vector<Value> stack;
+    };
+
+    std::span<const DivMagic> m_program_magics;
+    std::vector<PendingOp> m_ops {};
+    std::vector<PendingExit> m_exits {};
+    std::vector<Value> m_stack {};
+    std::vector<DivMagic> m_magics {};
+    /// By register: the depth it was loaded from, or 0 if it's computed.
+    std::vector<size_t> m_load_depth {};
+    size_t m_consumed { 0 };
+    size_t m_div_caches { 0 };
+};
+
+}
+
+/// The guard which holds exactly when the jump `op` is taken.
+static TraceOpKind guard_for(Op op) {
+    switch (op) {
+    case JE:
+    case INCJE:
+        return T_GUARD_EQ;
+    case JN:
+    case INCJN:
+        return T_GUARD_NE;
+    case JG:
+    case INCJG:
+        return T_GUARD_GT;
+    case JL:
+    case INCJL:
+        return T_GUARD_LT;
+    case JGE:
+    case INCJGE:
+        return T_GUARD_GE;
+    case JLE:
+    case INCJLE:
+        return T_GUARD_LE;
+    case NOT_AN_INSTRUCTION:
+    case POP:
+    case ADD:
+    case INC:
+    case DEC:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+    case PRINT:
+    case HALT:
+    case DUP:
+    case DUP2:
+    case SWAP:
+    case CLEAR:
+    case OVER:
+    case PUSH:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case DIVP2:
+    case MODP2:
+    case DIVC:
+    case MODC:
+    case MODJZ:
+    case MODJNZ:
+    case CALL:
+    case RET:
+        break;
+    }
+    return T_GUARD_EQ;
+}
+
+static TraceOpKind invert_guard(TraceOpKind kind) {
+    switch (kind) {
+    case T_GUARD_EQ:
+        return T_GUARD_NE;
+    case T_GUARD_NE:
+        return T_GUARD_EQ;
+    case T_GUARD_GT:
+        return T_GUARD_LE;
+    case T_GUARD_LE:
+        return T_GUARD_GT;
+    case T_GUARD_LT:
+        return T_GUARD_GE;
+    case T_GUARD_GE:
+        return T_GUARD_LT;
+    case T_GUARD_DIVISIBLE:
+        return T_GUARD_NOT_DIVISIBLE;
+    case T_GUARD_NOT_DIVISIBLE:
+        return T_GUARD_DIVISIBLE;
+    case T_LOAD:
+    case T_ADD:
+    case T_SUB:
+    case T_MUL:
+    case T_DIV:
+    case T_MOD:
+    case T_DIVP2:
+    case T_MODP2:
+    case T_DIVC:
+    case T_MODC:
+        break;
+    }
+    return kind;
+}
+
+Error TraceBuilder::add(const RecordedInstr& instr) {
+    const bool taken = instr.next_pc != instr.fallthrough_pc;
+    // the other way the jump could have gone
+    const size_t other_pc = taken ? instr.fallthrough_pc : size_t(instr.imm);
+    switch (instr.op) {
+    case POP:
+        pop();
+        break;
+    case ADD:
+    case SUB:
+    case MUL: {
+        const auto b = pop();
+        const auto a = pop();
+        const auto kind = instr.op == ADD ? T_ADD : instr.op == SUB ? T_SUB : T_MUL;
+        if (a.is_const && b.is_const) {
+            // wraps like the interpreter does
+            const auto ua = uint64_t(a.constant);
+            const auto ub = uint64_t(b.constant);
+            m_stack.push_back(constant(int64_t(kind == T_ADD ? ua + ub : kind == T_SUB ? ua - ub : ua * ub)));
+        } else if (b.is_const && b.constant == 0 && kind != T_MUL) {
+            m_stack.push_back(a);
+        } else {
+            m_stack.push_back(binary(kind, a, b));
+        }
+        break;
+    }
+    case INC:
+    case DEC: {
+        const auto a = pop();
+        if (a.is_const) {
+            m_stack.push_back(constant(int64_t(uint64_t(a.constant) + (instr.op == INC ? 1 : uint64_t(-1)))));
+        } else {
+            m_stack.push_back(binary(instr.op == INC ? T_ADD : T_SUB, a, constant(1)));
+        }
+        break;
+    }
+    case DIV:
+    case MOD: {
+        // division by zero exits before the instruction, so the interpreter reports it
+        ensure(2);
+        const auto exit = exit_to(instr.pc);
+        const auto b = pop();
+        const auto a = pop();
+        const bool is_div = instr.op == DIV;
+        if (b.is_const && a.is_const && b.constant != 0 && !(b.constant == -1 && a.constant == INT64_MIN)) {
+            m_stack.push_back(constant(is_div ? a.constant / b.constant : a.constant % b.constant));
+        } else if (b.is_const && has_div_magic(b.constant)) {
+            // the divisor turned out to be constant, specialize for it
+            const auto index = magic_index(div_magic(b.constant));
+            m_stack.push_back(binary(is_div ? T_DIVC : T_MODC, a, constant(0), 0, index));
+        } else {
+            m_stack.push_back(binary(is_div ? T_DIV : T_MOD, a, b, exit, int64_t(m_div_caches++)));
+        }
+        break;
+    }
+    case DIVP2:
+    case MODP2: {
+        const auto a = pop();
+        const bool is_div = instr.op == DIVP2;
+        if (a.is_const) {
+            m_stack.push_back(constant(is_div ? div_by_pow2(a.constant, instr.imm) : mod_by_pow2(a.constant, instr.imm)));
+        } else {
+            m_stack.push_back(binary(is_div ? T_DIVP2 : T_MODP2, a, constant(0), 0, instr.imm));
+        }
+        break;
+    }
+    case DIVC:
+    case MODC: {
+        const auto a = pop();
+        const auto& magic = m_program_magics[size_t(instr.imm)];
+        const bool is_div = instr.op == DIVC;
+        if (a.is_const) {
+            m_stack.push_back(constant(is_div ? div_by_magic(a.constant, magic) : mod_by_magic(a.constant, magic)));
+        } else {
+            m_stack.push_back(binary(is_div ? T_DIVC : T_MODC, a, constant(0), 0, magic_index(magic)));
+        }
+        break;
+    }
+    case DUP:
+        m_stack.push_back(top(1));
+        break;
+    case DUP2: {
+        ensure(2);
+        const auto a = top(2);
+        const auto b = top(1);
+        m_stack.push_back(a);
+        m_stack.push_back(b);
+        break;
+    }
+    case SWAP:
+        ensure(2);
+        std::swap(top(1), top(2));
+        break;
+    case OVER:
+        m_stack.push_back(top(2));
+        break;
+    case PUSH:
+        m_stack.push_back(constant(instr.imm));
+        break;
+    case JMP:
+        break;
+    case JE:
+    case JN:
+    case JG:
+    case JL:
+    case JGE:
+    case JLE:
+    case JZ:
+    case JNZ: {
+        const auto b = instr.op == JZ || instr.op == JNZ ? constant(0) : pop();
+        const auto a = pop();
+        const auto kind = instr.op == JZ ? T_GUARD_EQ : instr.op == JNZ ? T_GUARD_NE : guard_for(instr.op);
+        if (!a.is_const || !b.is_const) {
+            guard(taken ? kind : invert_guard(kind), a, b, exit_to(other_pc));
+        }
+        break;
+    }
+    case INCJE:
+    case INCJN:
+    case INCJG:
+    case INCJL:
+    case INCJGE:
+    case INCJLE: {
+        ensure(2);
+        auto& counter = top(1);
+        counter = counter.is_const ? constant(int64_t(uint64_t(counter.constant) + 1)) : binary(T_ADD, counter, constant(1));
+        const auto a = top(2);
+        const auto b = top(1);
+        if (!a.is_const || !b.is_const) {
+            const auto kind = guard_for(instr.op);
+            guard(taken ? kind : invert_guard(kind), a, b, exit_to(other_pc));
+        }
+        break;
+    }
+    case MODJZ:
+    case MODJNZ: {
+        ensure(2);
+        const auto a = top(2);
+        const auto b = top(1);
+        const auto zero_exit = exit_to(instr.pc);
+        const auto kind = instr.op == MODJZ ? T_GUARD_DIVISIBLE : T_GUARD_NOT_DIVISIBLE;
+        guard(taken ? kind : invert_guard(kind), a, b, exit_to(other_pc), zero_exit);
+        break;
+    }
+    case NOT_AN_INSTRUCTION:
+    case PRINT:
+    case HALT:
+    case CLEAR:
+    case CALL:
+    case RET:
+        return Error("'{}' can't be traced.", to_string(instr.op));
+    }
+    return {};
+}
+
+void TraceBuilder::remove_dead_ops(bool keep_loads) {
+    std::vector<bool> live(m_load_depth.size(), false);
+    const auto use = [&](const Value& value) {
+        if (!value.is_const) {
+            live[value.reg] = true;
+        }
+    };
+    for (const auto& exit : m_exits) {
+        for (const auto& value : exit.stack) {
+            use(value);
+        }
+    }
+    for (const auto& value : m_stack) {
+        use(value);
+    }
+    std::vector<PendingOp> kept;
+    for (auto it = m_ops.rbegin(); it != m_ops.rend(); ++it) {
+        const bool has_dst = it->kind < T_GUARD_EQ;
+        // ops which may exit are never dead
+        const bool may_exit = !has_dst || it->kind == T_DIV || it->kind == T_MOD;
+        const bool kept_load = keep_loads && it->kind == T_LOAD;
+        if (has_dst && !may_exit && !kept_load && !live[it->dst.reg]) {
+            continue;
+        }
+        use(it->a);
+        use(it->b);
+        kept.push_back(*it);
+    }
+    std::reverse(kept.begin(), kept.end());
+    m_ops = std::move(kept);
+}
+
+Trace TraceBuilder::finish(size_t start_pc, size_t recorded) {
+    const bool carried = m_stack.size() == m_consumed;
+    remove_dead_ops(carried);
+    if (carried) {
+        // loads only read the stack as it was on entry, so they can go first
+        std::stable_partition(m_ops.begin(), m_ops.end(), [](const PendingOp& op) { return op.kind == T_LOAD; });
+    }
+    Trace trace;
+    trace.carried = carried;
+    trace.start_pc = start_pc;
+    trace.recorded = recorded;
+    trace.magics = std::move(m_magics);
+    trace.div_caches.resize(m_div_caches);
+    trace.consumed = m_consumed;
+
+    // constants go into the first registers, computed values after them
+    std::unordered_map<int64_t, uint16_t> const_regs;
+    const auto collect = [&](const Value& value) {
+        if (value.is_const && !const_regs.contains(value.constant)) {
+            const_regs.emplace(value.constant, uint16_t(trace.consts.size()));
+            trace.consts.push_back(value.constant);
+        }
+    };
+    for (const auto& op : m_ops) {
+        collect(op.a);
+        collect(op.b);
+    }
+    for (const auto& exit : m_exits) {
+        for (const auto& value : exit.stack) {
+            collect(value);
+        }
+    }
+    for (const auto& value : m_stack) {
+        collect(value);
+    }
+    const auto reg = [&](const Value& value) {
+        return value.is_const ? const_regs.at(value.constant) : uint16_t(trace.consts.size() + value.reg);
+    };
+    for (const auto& op : m_ops) {
+        const bool has_dst = op.kind < T_GUARD_EQ;
+        trace.ops.push_back({
+            .kind = op.kind,
+            .dst = has_dst ? reg(op.dst) : uint16_t(0),
+            .a = op.kind == T_LOAD ? uint16_t(0) : reg(op.a),
+            .b = op.kind == T_LOAD ? uint16_t(0) : reg(op.b),
+            .exit = op.exit,
+            .imm = op.imm,
+        });
+    }
+    const auto lower_exit = [&](size_t pc, size_t consumed, const std::vector<Value>& stack) {
+        TraceExit exit { .pc = pc, .consumed = consumed, .stack = {} };
+        for (size_t i = 0; i < stack.size(); ++i) {
+            exit.stack.push_back(i < consumed && is_unchanged(stack[i], consumed - i) ? Trace::NO_REG : reg(stack[i]));
+        }
+        trace.max_growth = std::max(trace.max_growth, int64_t(stack.size()) - int64_t(consumed));
+        return exit;
+    };
+    for (const auto& exit : m_exits) {
+        trace.exits.push_back(lower_exit(exit.pc, exit.consumed, exit.stack));
+    }
+    trace.loop = lower_exit(start_pc, m_consumed, m_stack);
+    if (carried) {
+        trace.load_count = size_t(std::count_if(m_ops.begin(), m_ops.end(), [](const PendingOp& op) { return op.kind == T_LOAD; }));
+        // the register each slot is loaded into, which the next iteration reads
+        std::vector<uint16_t> load_regs(m_consumed + 1, Trace::NO_REG);
+        for (size_t i = 0; i < trace.load_count; ++i) {
+            load_regs[size_t(trace.ops[i].imm)] = trace.ops[i].dst;
+        }
+        for (size_t i = 0; i < trace.loop.stack.size(); ++i) {
+            if (trace.loop.stack[i] != Trace::NO_REG) {
+                trace.carry.push_back({ .dst = load_regs[m_consumed - i], .src = trace.loop.stack[i] });
+            }
+        }
+        trace.carry_values.resize(trace.carry.size());
+    }
+    trace.reg_count = trace.consts.size() + m_load_depth.size();
+    trace.regs.assign(trace.reg_count, 0);
+    std::copy(trace.consts.begin(), trace.consts.end(), trace.regs.begin());
+    return trace;
+}
+
+Result<Trace> compile_trace(std::span<const RecordedInstr> recorded, std::span<const DivMagic> magics) {
+    if (recorded.empty() || recorded.back().next_pc != recorded.front().pc) {
+        return { "The recording doesn't end where it started." };
+    }
+    // leave room for the constants, which are numbered before the registers
+    if (recorded.size() * 3 > Trace::NO_REG) {
+        return { "The recording is too long." };
+    }
+    TraceBuilder builder(magics);
+    for (const auto& instr : recorded) {
+        auto err = builder.add(instr);
+        if (err) {
+            return { "{} pc={}", err.error, instr.pc };
+        }
+    }
+    auto trace = builder.finish(recorded.front().pc, recorded.size());
+    // every op and every written stack slot or carried register costs about
+    // as much as an instruction
+    size_t cost;
+    if (trace.carried) {
+        cost = trace.ops.size() - trace.load_count + trace.carry.size();
+    } else {
+        cost = trace.ops.size() + size_t(std::count_if(trace.loop.stack.begin(), trace.loop.stack.end(), [](uint16_t reg) { return reg != Trace::NO_REG; }));
+    }
+    if (cost >= recorded.size()) {
+        return { "A trace costing {} ops wouldn't be faster than {} instructions.", cost, recorded.size() };
+    }
+    return trace;
+}
+
+/// Writes the stack as it is at the exit, returns the new top.
+static inline size_t write_back(const TraceExit& exit, const int64_t* regs, int64_t* stack, size_t entry_top) {
+    const auto base = entry_top - exit.consumed;
+    for (size_t i = 0; i < exit.stack.size(); ++i) {
+        if (exit.stack[i] != Trace::NO_REG) {
+            stack[base + i] = regs[exit.stack[i]];
+        }
+    }
+    return base + exit.stack.size();
+}
+
+static constexpr uint32_t NO_EXIT = UINT32_MAX;
+
+/// Runs ops [begin, end) of the trace, returns the exit it took or NO_EXIT.
+[[gnu::always_inline]] static inline uint32_t run_ops(Trace& trace, int64_t* regs, size_t begin, size_t end, const int64_t* entry) {
+    const TraceOp* ops = trace.ops.data();
+    for (size_t i = begin; i < end; ++i) {
+        const auto& op = ops[i];
+        const auto a = regs[op.a];
+        const auto b = regs[op.b];
+        switch (op.kind) {
+        case T_LOAD:
+            regs[op.dst] = entry[-op.imm];
+            break;
+        case T_ADD:
+            regs[op.dst] = a + b;
+            break;
+        case T_SUB:
+            regs[op.dst] = a - b;
+            break;
+        case T_MUL:
+            regs[op.dst] = a * b;
+            break;
+        case T_DIV:
+            if (b == 0) [[unlikely]] {
+                return op.exit;
+            }
+            if (const auto* magic = cached_div_magic(trace.div_caches[size_t(op.imm)], b)) {
+                regs[op.dst] = div_by_magic(a, *magic);
+            } else {
+                regs[op.dst] = a / b;
+            }
+            break;
+        case T_MOD:
+            if (b == 0) [[unlikely]] {
+                return op.exit;
+            }
+            if (const auto* magic = cached_div_magic(trace.div_caches[size_t(op.imm)], b)) {
+                regs[op.dst] = mod_by_magic(a, *magic);
+            } else {
+                regs[op.dst] = a % b;
+            }
+            break;
+        case T_DIVP2:
+            regs[op.dst] = div_by_pow2(a, op.imm);
+            break;
+        case T_MODP2:
+            regs[op.dst] = mod_by_pow2(a, op.imm);
+            break;
+        case T_DIVC:
+            regs[op.dst] = div_by_magic(a, trace.magics[size_t(op.imm)]);
+            break;
+        case T_MODC:
+            regs[op.dst] = mod_by_magic(a, trace.magics[size_t(op.imm)]);
+            break;
+        case T_GUARD_EQ:
+            if (a != b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_NE:
+            if (a == b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_GT:
+            if (a <= b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_LT:
+            if (a >= b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_GE:
+            if (a < b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_LE:
+            if (a > b) {
+                return op.exit;
+            }
+            break;
+        case T_GUARD_DIVISIBLE:
+        case T_GUARD_NOT_DIVISIBLE:
+            if (b == 0) [[unlikely]] {
+                return uint32_t(op.imm);
+            }
+            if ((a % b == 0) != (op.kind == T_GUARD_DIVISIBLE)) {
+                return op.exit;
+            }
+            break;
+        }
+    }
+    return NO_EXIT;
+}
+
+/// Runs a carried trace, see Trace::carried. The stack top doesn't move.
+static TraceResult run_carried(Trace& trace, int64_t* stack, size_t stack_top) {
+    int64_t* regs = trace.regs.data();
+    const int64_t* entry = stack + stack_top;
+    const size_t op_count = trace.ops.size();
+    const TraceMove* carry = trace.carry.data();
+    const size_t carry_count = trace.carry.size();
+    int64_t* carry_values = trace.carry_values.data();
+    run_ops(trace, regs, 0, trace.load_count, entry);
+    uint64_t iterations = 0;
+    while (true) {
+        const auto exit = run_ops(trace, regs, trace.load_count, op_count, entry);
+        if (exit != NO_EXIT) [[unlikely]] {
+            // the stack still holds what it held on entry, so first bring it
+            // to the start of this iteration
+            for (size_t i = 0; i < trace.load_count; ++i) {
+                stack[stack_top - size_t(trace.ops[i].imm)] = regs[trace.ops[i].dst];
+            }
+            return { .pc = trace.exits[exit].pc, .stack_top = write_back(trace.exits[exit], regs, stack, stack_top), .iterations = iterations };
+        }
+        // a parallel copy, as a register may be both read and written
+        for (size_t i = 0; i < carry_count; ++i) {
+            carry_values[i] = regs[carry[i].src];
+        }
+        for (size_t i = 0; i < carry_count; ++i) {
+            regs[carry[i].dst] = carry_values[i];
+        }
+        ++iterations;
+    }
+}
+
+TraceResult run_trace(Trace& trace, int64_t* stack, size_t stack_top, size_t stack_size) {
+    int64_t* regs = trace.regs.data();
+    const size_t op_count = trace.ops.size();
+    uint64_t iterations = 0;
+    while (true) {
+        if (stack_top < trace.consumed || int64_t(stack_top) + trace.max_growth > int64_t(stack_size)) [[unlikely]] {
+            return { .pc = trace.start_pc, .stack_top = stack_top, .iterations = iterations };
+        }
+        if (trace.carried) {
+            return run_carried(trace, stack, stack_top);
+        }
+        const auto exit = run_ops(trace, regs, 0, op_count, stack + stack_top);
+        if (exit != NO_EXIT) [[unlikely]] {
+            return { .pc = trace.exits[exit].pc, .stack_top = write_back(trace.exits[exit], regs, stack, stack_top), .iterations = iterations };
+        }
+        stack_top = write_back(trace.loop, regs, stack, stack_top);
+        ++iterations;
+    }
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "divide.h"
+#include "error.h"
+#include "instruction.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/// Traces: hot loops, recorded while the interpreter runs them, and compiled
+/// into a straight line of register operations which repeats until one of the
+/// branches goes the other way than while recording.
+///
+/// A trace only ever reads the stack below the top it was entered with, and
+/// only writes the stack at the end of an iteration or when a guard fails, or
+/// for loops which keep the stack height, only when it's left. In between,
+/// all values live in registers, so stack shuffling
+/// (`dup`, `swap`, `over`, `pop`, `push`) costs nothing, and operations on
+/// constants are folded.
+
+/// One instruction as it was executed while recording.
+struct RecordedInstr {
+    size_t pc;
+    Op op;
+    /// The immediate as the loaded program has it, so an index into the
+    /// magic numbers for `divc` and `modc`.
+    int64_t imm;
+    /// The pc that was executed next, which tells which way a jump went.
+    size_t next_pc;
+    /// The pc after this instruction, if it doesn't jump.
+    size_t fallthrough_pc;
+};
+
+enum TraceOpKind : uint8_t {
+    /// dst = the value `imm` slots below the top the trace was entered with
+    T_LOAD,
+    T_ADD,
+    T_SUB,
+    T_MUL,
+    /// exits at `exit` if b is 0, divides using div_caches[imm]
+    T_DIV,
+    T_MOD,
+    /// dst = a / 2^imm
+    T_DIVP2,
+    T_MODP2,
+    /// dst = a / magics[imm]
+    T_DIVC,
+    T_MODC,
+    /// exit at `exit` unless the comparison of a and b holds
+    T_GUARD_EQ,
+    T_GUARD_NE,
+    T_GUARD_GT,
+    T_GUARD_LT,
+    T_GUARD_GE,
+    T_GUARD_LE,
+    /// exit at `exit` unless a % b is (T_GUARD_DIVISIBLE) or isn't 0;
+    /// exits at `imm` if b is 0
+    T_GUARD_DIVISIBLE,
+    T_GUARD_NOT_DIVISIBLE,
+};
+
+struct TraceOp {
+    TraceOpKind kind;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    uint32_t exit;
+    int64_t imm;
+};
+
+/// Where a trace is left, and what the stack looks like then.
+struct TraceExit {
+    size_t pc;
+    /// Number of slots below the entry top which the trace had read up to
+    /// this exit; `stack` replaces those.
+    size_t consumed;
+    /// Registers holding the new values of the stack from entry top -
+    /// `consumed` upwards, bottom first. Trace::NO_REG marks slots which
+    /// still hold the right value.
+    std::vector<uint16_t> stack;
+};
+
+/// Copies a register at the end of an iteration, see Trace::carried.
+struct TraceMove {
+    uint16_t dst;
+    uint16_t src;
+};
+
+struct Trace {
+    static constexpr uint16_t NO_REG = UINT16_MAX;
+
+    /// pc of the loop header, where the trace starts and ends.
+    size_t start_pc { 0 };
+    std::vector<TraceOp> ops {};
+    /// Registers [0, consts.size()) hold these constants.
+    std::vector<int64_t> consts {};
+    std::vector<DivMagic> magics {};
+    /// One per T_DIV and T_MOD, as the interpreter has one for all of them.
+    std::vector<DivisorCache> div_caches {};
+    size_t reg_count { 0 };
+    /// Number of slots below the entry top which the trace reads. The stack
+    /// has to hold at least that many values to enter it.
+    size_t consumed { 0 };
+    /// The most any exit grows the stack by, to check that it fits before
+    /// entering.
+    int64_t max_growth { 0 };
+    std::vector<TraceExit> exits {};
+    /// The state at the end of an iteration, with pc == start_pc.
+    TraceExit loop { .pc = 0, .consumed = 0, .stack = {} };
+    /// Whether the loop leaves the stack as high as it found it. Then the
+    /// values it reads stay in registers from one iteration to the next: the
+    /// T_LOAD ops come first and only run once, `carry` moves the values of
+    /// `loop` into their registers after every iteration, and the stack is
+    /// only written when the trace is left.
+    bool carried { false };
+    size_t load_count { 0 };
+    std::vector<TraceMove> carry {};
+    /// Number of instructions recorded, to compare with ops.size().
+    size_t recorded { 0 };
+    /// Scratch space for the registers while running, and for `carry`.
+    std::vector<int64_t> regs {};
+    std::vector<int64_t> carry_values {};
+};
+
+/// Compiles one recorded iteration of a loop, starting and ending at
+/// recorded.front().pc. Fails if it contains an instruction traces don't
+/// support, which are those with side effects (`print`, `halt`, `clear`), or
+/// if the trace wouldn't do less work per iteration than the interpreter,
+/// which is the case for loops the optimizer already fused into one or two
+/// instructions. `magics` are the magic numbers of the loaded program.
+[[nodiscard]] Result<Trace> compile_trace(std::span<const RecordedInstr> recorded, std::span<const DivMagic> magics);
+
+struct TraceResult {
+    /// Where the interpreter has to continue.
+    size_t pc;
+    size_t stack_top;
+    /// Number of whole iterations the trace ran.
+    uint64_t iterations;
+};
+
+/// Runs the trace until a guard fails, or until the stack can't hold what an
+/// iteration may write. In that case, it returns to the start of the loop,
+/// which the interpreter then runs instead.
+TraceResult run_trace(Trace& trace, int64_t* stack, size_t stack_top, size_t stack_size);
+
+struct TraceStats {
+    /// Traces which were compiled.
+    size_t recorded { 0 };
+    /// Loops whose recording was given up, as they contained an unsupported
+    /// instruction, weren't closed within Traces::MAX_LENGTH instructions, or
+    /// wouldn't run faster as a trace.
+    size_t aborted { 0 };
+    /// Iterations run in traces, and exits through a guard.
+    uint64_t iterations { 0 };
+    uint64_t exits { 0 };
+};
+
+/// The traces of a vm, and the counters which find hot loops.
+struct Traces {
+    /// A backward jump has to be taken to a pc this often before the loop
+    /// there is recorded.
+    static constexpr uint16_t HOT_THRESHOLD = 64;
+    /// Recordings which don't get back to their start within this many
+    /// instructions are given up.
+    static constexpr size_t MAX_LENGTH = 256;
+    static constexpr int32_t NONE = -1;
+    static constexpr int32_t FAILED = -2;
+
+    /// Index into `traces` of the trace starting at each pc, or NONE or FAILED.
+    std::vector<int32_t> entry {};
+    std::vector<uint16_t> hotness {};
+    std::vector<Trace> traces {};
+    /// Reused while recording.
+    std::vector<RecordedInstr> recording {};
+    TraceStats stats {};
+
+    /// Sizes the tables for code where pcs are below `code_size`.
+    void init(size_t code_size);
+    bool enabled() const { return !entry.empty(); }
+};
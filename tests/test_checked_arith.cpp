@@ -0,0 +1,85 @@
+#include "compiler.h"
+#include "fold.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+// INT64_MAX and INT64_MIN don't fit into a `push`
+const std::string PUSH_MAX = "push 36028797018963967\npush 256\nmul\npush 255\nadd\n";
+const std::string PUSH_MIN = "push -36028797018963968\npush 256\nmul\n";
+
+/// Checks that `operation` on the values pushed by `operands` wraps around to
+/// `wrapped`, and faults with checked arithmetic.
+void check_overflow(const std::string& operands, const std::string& operation, int64_t wrapped) {
+    const auto source = operands + operation + "\nprint\nhalt\n";
+    const auto wrapping = test::run(source);
+    CHECK(wrapping.status == VmStatus::Halted);
+    CHECK(wrapping.output == fmt::format("{}\n", wrapped));
+
+    const auto checked = test::run(source, VmConfig { .checked_arith = true });
+    CHECK(checked.status == VmStatus::Faulted);
+    CHECK(fmt::format("{}", checked.error.error).starts_with("Integer overflow"));
+    CHECK(checked.output.empty());
+}
+
+std::vector<FoldDiagnostic> fold_diagnostics(const std::string& source, bool checked_arith) {
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    std::vector<FoldDiagnostic> diagnostics;
+    CHECK_FALSE(optimize_peephole(instrs, checked_arith, &diagnostics));
+    return diagnostics;
+}
+
+}
+
+TEST_CASE("checked arithmetic faults where the result would wrap around") {
+    check_overflow(PUSH_MAX + "push 1\n", "add", INT64_MIN);
+    check_overflow(PUSH_MIN + "push 1\n", "sub", INT64_MAX);
+    check_overflow(PUSH_MAX + "push 2\n", "mul", -2);
+    check_overflow(PUSH_MAX, "inc", INT64_MIN);
+    check_overflow(PUSH_MIN, "dec", INT64_MAX);
+
+    const auto divided = test::run(PUSH_MIN + "push -1\ndiv\nprint\nhalt\n", VmConfig { .checked_arith = true });
+    CHECK(divided.status == VmStatus::Faulted);
+    CHECK(fmt::format("{}", divided.error.error).starts_with("Integer overflow"));
+
+    const auto fine = test::run(PUSH_MAX + "push -1\nadd\nprint\nhalt\n", VmConfig { .checked_arith = true });
+    CHECK(fine.status == VmStatus::Halted);
+    CHECK(fine.output == "9223372036854775806\n");
+}
+
+TEST_CASE("fold_binary reports what it can't fold") {
+    int64_t result = 0;
+    CHECK(fold_binary(ADD, 2, 3, result) == FoldOutcome::Folded);
+    CHECK(result == 5);
+    CHECK(fold_binary(MOD, -7, 2, result) == FoldOutcome::Folded);
+    CHECK(result == -1);
+    CHECK(fold_binary(MUL, INT64_MAX, 2, result) == FoldOutcome::Overflow);
+    CHECK(result == -2);
+    CHECK(fold_binary(SUB, INT64_MIN, 1, result) == FoldOutcome::Overflow);
+    CHECK(result == INT64_MAX);
+    CHECK(fold_binary(DIV, 1, 0, result) == FoldOutcome::DivisionByZero);
+    CHECK(fold_binary(MOD, INT64_MIN, -1, result) == FoldOutcome::DivisionOverflow);
+}
+
+TEST_CASE("folding warns about constant operations which overflow") {
+    const std::string mul = "push 36028797018963967\npush 36028797018963967\nmul\nprint\nhalt\n";
+    const auto wrapping = fold_diagnostics(mul, false);
+    REQUIRE(wrapping.size() == 1);
+    CHECK(wrapping[0].message.find("wraps around") != std::string::npos);
+    CHECK(wrapping[0].location.line == 3);
+
+    const auto checked = fold_diagnostics(mul, true);
+    REQUIRE(checked.size() == 1);
+    CHECK(checked[0].message.find("faults when executed") != std::string::npos);
+
+    const auto by_zero = fold_diagnostics("push 5\npush 0\ndiv\nprint\nhalt\n", false);
+    REQUIRE(by_zero.size() == 1);
+    CHECK(by_zero[0].message.find("divides by zero") != std::string::npos);
+
+    CHECK(fold_diagnostics("push 5\npush 6\nmul\nprint\nhalt\n", true).empty());
+}
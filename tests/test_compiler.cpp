@@ -0,0 +1,95 @@
+#include "compiler.h"
+#include "pipeline.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+
+namespace {
+
+/// Runs the optimizations which look at a few instructions at a time, and
+/// returns the ops which are left.
+std::vector<Op> optimize(const std::string& source) {
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    CHECK_FALSE(optimize_peephole(instrs));
+    CHECK_FALSE(optimize_strength_reduce(instrs));
+    std::vector<Op> ops;
+    for (const auto& abstract : instrs) {
+        ops.push_back(abstract.instr.s.op);
+    }
+    return ops;
+}
+
+}
+
+TEST_CASE("Optimizations handle programs shorter than their patterns") {
+    CHECK(optimize("").empty());
+    CHECK(optimize("halt\n") == std::vector<Op> { HALT });
+    CHECK(optimize("over\n") == std::vector<Op> { OVER });
+    CHECK(optimize("push 1\nadd\n") == std::vector<Op> { INC });
+    CHECK(optimize("push 1\npush 2\nadd\n") == std::vector<Op> { PUSH });
+}
+
+TEST_CASE("Only pairs of over are substituted by dup2") {
+    CHECK(optimize("over\nover\n") == std::vector<Op> { DUP2 });
+    CHECK(optimize("over\nover\nover\n") == std::vector<Op> { DUP2, OVER });
+    CHECK(optimize("over\nover\nover\nover\n") == std::vector<Op> { DUP2, DUP2 });
+}
+
+TEST_CASE("translate and finalize keep arguments at the ends of their range") {
+    const auto source = fmt::format("push {}\npush {}\npush -1\njmp :end\n:end\nhalt\n", INSTR_VAL_MIN, INSTR_VAL_MAX);
+    auto instrs = test::compile(source);
+    REQUIRE(instrs);
+    const auto& code = instrs.value();
+    REQUIRE(code.size() == 5);
+    CHECK(code[0].s.val == INSTR_VAL_MIN);
+    CHECK(code[1].s.val == INSTR_VAL_MAX);
+    CHECK(code[2].s.val == -1);
+    CHECK(code[3].s.val == 4);
+
+    CHECK_FALSE(test::translate(fmt::format("push {}\n", INSTR_VAL_MAX + 1)));
+}
+
+TEST_CASE("split_lines splits at newlines") {
+    CHECK(split_lines("").empty());
+    CHECK(split_lines("halt") == std::vector<std::string> { "halt" });
+    CHECK(split_lines("halt\n") == std::vector<std::string> { "halt" });
+    CHECK(split_lines("push 1\n\nprint\n") == std::vector<std::string> { "push 1", "", "print" });
+}
+
+TEST_CASE("compile_lines runs the stages in order, and names the one which failed") {
+    const auto lines = split_lines("push 1\npush 2\nadd\nprint\nhalt\n");
+    for (const bool optimize : { false, true }) {
+        std::vector<CompileStage> started;
+        std::vector<CompileStage> finished;
+        const CompileOptions options {
+            .optimize = optimize,
+            .checked_arith = false,
+            .profile = nullptr,
+            .source_map = nullptr,
+            .inline_reports = nullptr,
+            .diagnostics = nullptr,
+            .loop_reports = nullptr,
+            .profile_report = nullptr,
+            .before_stage = [&](CompileStage stage) { started.push_back(stage); },
+            .after_stage = [&](CompileStage stage, size_t) { finished.push_back(stage); },
+        };
+        auto instrs = compile_lines(lines, "<test>", options);
+        REQUIRE(instrs);
+        CHECK(instrs.value().size() == (optimize ? 3 : 5));
+        const auto expected = optimize
+            ? std::vector<CompileStage> { CompileStage::Parse, CompileStage::Translate, CompileStage::Inline, CompileStage::Peephole,
+                  CompileStage::StrengthReduce, CompileStage::Loops, CompileStage::Finalize }
+            : std::vector<CompileStage> { CompileStage::Parse, CompileStage::Translate, CompileStage::Finalize };
+        CHECK(started == expected);
+        CHECK(finished == expected);
+    }
+
+    const auto invalid = compile_lines(split_lines("pushx 1\n"), "<test>");
+    REQUIRE_FALSE(invalid);
+    CHECK(fmt::format("{}", invalid.error).starts_with("Error while translating: <test>:1:"));
+    const auto missing = compile_lines(split_lines("jmp :nowhere\n"), "<test>");
+    REQUIRE_FALSE(missing);
+    CHECK(fmt::format("{}", missing.error).starts_with("Error while finalizing: "));
+}
@@ -0,0 +1,75 @@
+#include "bytecode.h"
+#include "decompiler.h"
+#include "test_util.h"
+#include <cstdio>
+#include <doctest/doctest.h>
+#include <string>
+#include <unistd.h>
+
+namespace {
+
+Instr make(Op op, int64_t val = 0) {
+    Instr instr {};
+    instr.s.op = op;
+    set_instr_val(instr, val);
+    return instr;
+}
+
+/// Writes the instructions into a .mclb, and decompiles it.
+Result<std::string> decompile(InstrStream instrs) {
+    const auto filename = fmt::format("/tmp/mcl-test-decompile-{}.mclb", getpid());
+    auto err = write_bytecode(filename, Bytecode { .header = {}, .instrs = std::move(instrs) });
+    if (err) {
+        return { "{}", err.error };
+    }
+    std::FILE* out = std::tmpfile();
+    auto stats = decompile_file(filename, out, DecompileConfig { .threads = 2, .chunk_size = 2 });
+    std::remove(filename.c_str());
+    std::string source;
+    std::rewind(out);
+    char buffer[4096];
+    size_t n = 0;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), out)) > 0) {
+        source.append(buffer, n);
+    }
+    std::fclose(out);
+    if (!stats) {
+        return { "{}", stats.error };
+    }
+    return source;
+}
+
+void check_same(const InstrStream& actual, const InstrStream& expected) {
+    REQUIRE(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        CHECK(actual[i].s.op == expected[i].s.op);
+        CHECK(actual[i].s.val == expected[i].s.val);
+    }
+}
+
+}
+
+TEST_CASE("Decompiled programs compile into the same instructions") {
+    auto compiled = test::compile("push 10\n:loop\ndec\ndup\nprint\ndup\njnz :loop\npop\nhalt\n");
+    REQUIRE(compiled);
+    const auto instrs = compiled.move();
+    auto source = decompile(instrs);
+    REQUIRE(source);
+    auto again = test::compile(source.value());
+    REQUIRE(again);
+    check_same(again.value(), instrs);
+}
+
+TEST_CASE("Jumps past the last instruction keep their target") {
+    const InstrStream instrs { make(PUSH, 1), make(JZ, 7), make(PUSH, 2), make(PRINT), make(JMP, 5) };
+    auto source = decompile(instrs);
+    REQUIRE(source);
+    auto again = test::compile(source.value());
+    REQUIRE(again);
+    // padded with halts up to the furthest target
+    check_same(again.value(), { make(PUSH, 1), make(JZ, 7), make(PUSH, 2), make(PRINT), make(JMP, 5), make(HALT), make(HALT) });
+
+    auto far = decompile({ make(JMP, 1'000'000), make(HALT) });
+    REQUIRE_FALSE(far);
+    CHECK(fmt::format("{}", far.error).find("too far past the last instruction") != std::string::npos);
+}
@@ -0,0 +1,107 @@
+#include "dense.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+
+namespace {
+
+Instr make(Op op, int64_t val = 0) {
+    Instr instr {};
+    instr.s.op = op;
+    set_instr_val(instr, val);
+    return instr;
+}
+
+}
+
+TEST_CASE("set_instr_val keeps the low 56 bits") {
+    for (const auto val : { int64_t(0), int64_t(1), int64_t(-1), INSTR_VAL_MIN, INSTR_VAL_MAX, int64_t(-123456789012) }) {
+        CHECK(make(PUSH, val).s.val == val);
+    }
+    // out of range values wrap around like a plain assignment
+    CHECK(make(PUSH, INSTR_VAL_MAX + 1).s.val == INSTR_VAL_MIN);
+    CHECK(make(PUSH, INSTR_VAL_MIN - 1).s.val == INSTR_VAL_MAX);
+}
+
+TEST_CASE("dense_size_class picks the smallest immediate") {
+    CHECK(dense_size_class(0) == 0);
+    CHECK(dense_size_class(127) == 0);
+    CHECK(dense_size_class(-128) == 0);
+    CHECK(dense_size_class(128) == 1);
+    CHECK(dense_size_class(-32768) == 1);
+    CHECK(dense_size_class(32768) == 2);
+    CHECK(dense_size_class(INT32_MIN) == 2);
+    CHECK(dense_size_class(int64_t(INT32_MAX) + 1) == 3);
+    CHECK(dense_size_class(INSTR_VAL_MIN) == 3);
+    CHECK(dense_size_class(1, 2) == 2);
+}
+
+TEST_CASE("Dense code decodes into the instructions it was encoded from") {
+    const InstrStream instrs {
+        make(PUSH, 5),
+        make(PUSH, -300),
+        make(PUSH, 70'000),
+        make(PUSH, INSTR_VAL_MIN),
+        make(DUP),
+        make(POP),
+        make(JNZ, 0),
+        make(DIVC, 7),
+        make(PRINT),
+        make(JMP, 9),
+        make(HALT),
+    };
+    auto code = encode_dense(instrs);
+    REQUIRE(code);
+    // op bytes for all, and 1 + 2 + 4 + 7 bytes of pushes, 1 + 1 of jumps
+    // and 4 of divc
+    CHECK(code.value().size() == instrs.size() + 1 + 2 + 4 + 7 + 1 + 4 + 1);
+    CHECK_FALSE(validate_dense(code.value()));
+    auto decoded = decode_dense(code.value());
+    REQUIRE(decoded);
+    REQUIRE(decoded.value().size() == instrs.size());
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        CHECK(decoded.value()[i].s.op == instrs[i].s.op);
+        CHECK(decoded.value()[i].s.val == instrs[i].s.val);
+    }
+    const auto offsets = dense_offsets(code.value());
+    REQUIRE(offsets.size() == instrs.size());
+    CHECK(offsets[0] == 0);
+    CHECK(offsets[1] == 2);
+    CHECK(dense_imm(code.value().data() + offsets[3]) == INSTR_VAL_MIN);
+}
+
+TEST_CASE("Malformed dense code is rejected") {
+    auto code = encode_dense(InstrStream { make(PUSH, 1000), make(JMP, 0), make(HALT) });
+    REQUIRE(code);
+    SUBCASE("cut off in an immediate") {
+        auto cut = code.value();
+        cut.resize(2);
+        CHECK(validate_dense(cut));
+        CHECK_FALSE(decode_dense(cut));
+    }
+    SUBCASE("jump into the middle of an instruction") {
+        auto bad = code.value();
+        // the jump's immediate, right after push's three bytes and its op
+        bad[4] = 1;
+        CHECK(validate_dense(bad));
+    }
+    SUBCASE("an op which doesn't exist") {
+        auto bad = code.value();
+        bad.back() = DENSE_OP_MASK;
+        CHECK(validate_dense(bad));
+    }
+}
+
+TEST_CASE("Programs run the same from dense code") {
+    const auto source = "push 10\n:loop\ndup\nprint\npush 3\nsub\ndup\npush 0\njg :loop\nhalt\n";
+    const auto expected = test::run(source);
+    REQUIRE(expected.status == VmStatus::Halted);
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto code = finalize_dense(abstracts.move());
+    REQUIRE(code);
+    auto vm = Vm::create_dense(code.move());
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Halted);
+    CHECK(running.output == expected.output);
+}
@@ -0,0 +1,108 @@
+#include "divide.h"
+#include "test_util.h"
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <vector>
+
+namespace {
+
+std::vector<int64_t> interesting_values() {
+    std::vector<int64_t> values { 0, 1, -1, 2, -2, 3, -3, 7, -7, 10, -10, 641, -641, 1'000'000'007, -1'000'000'007,
+        INT64_MAX, INT64_MAX - 1, INT64_MIN, INT64_MIN + 1, INT64_MAX / 2, INT64_MIN / 2, int64_t(1) << 32, -(int64_t(1) << 32) };
+    // and some spread over the whole range, with a fixed LCG
+    uint64_t x = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < 200; ++i) {
+        x = x * 6364136223846793005 + 1442695040888963407;
+        values.push_back(int64_t(x));
+        values.push_back(int64_t(x >> (i % 63)));
+    }
+    return values;
+}
+
+}
+
+TEST_CASE("has_div_magic excludes the divisors which can't be reduced") {
+    CHECK_FALSE(has_div_magic(0));
+    CHECK_FALSE(has_div_magic(1));
+    CHECK_FALSE(has_div_magic(-1));
+    CHECK_FALSE(has_div_magic(INT64_MIN));
+    CHECK(has_div_magic(2));
+    CHECK(has_div_magic(-2));
+    CHECK(has_div_magic(INT64_MAX));
+    CHECK(has_div_magic(INT64_MIN + 1));
+}
+
+TEST_CASE("div_by_magic and mod_by_magic match / and %") {
+    const auto values = interesting_values();
+    for (const auto divisor : values) {
+        if (!has_div_magic(divisor)) {
+            continue;
+        }
+        const auto magic = div_magic(divisor);
+        CHECK(magic.divisor == divisor);
+        for (const auto dividend : values) {
+            CHECK(div_by_magic(dividend, magic) == dividend / divisor);
+            CHECK(mod_by_magic(dividend, magic) == dividend % divisor);
+        }
+    }
+}
+
+TEST_CASE("div_by_pow2 and mod_by_pow2 round towards zero") {
+    const auto values = interesting_values();
+    for (int64_t shift = 1; shift < 63; ++shift) {
+        const int64_t divisor = int64_t(1) << shift;
+        for (const auto dividend : values) {
+            CHECK(div_by_pow2(dividend, shift) == dividend / divisor);
+            CHECK(mod_by_pow2(dividend, shift) == dividend % divisor);
+        }
+    }
+}
+
+TEST_CASE("Strength reduction keeps the results of div and mod by constants") {
+    std::string source;
+    for (const auto divisor : { 2, 8, -8, 3, -7, 641 }) {
+        for (const auto dividend : { 0, 1, -1, 100, -100, 12345 }) {
+            source += fmt::format("push {}\npush {}\ndiv\nprint\npush {}\npush {}\nmod\nprint\n", dividend, divisor, dividend, divisor);
+        }
+    }
+    // INT64_MIN doesn't fit into a push, so it's computed
+    source += "push -36028797018963968\npush 256\nmul\ndup\npush 3\ndiv\nprint\npush -3\nmod\nprint\nhalt\n";
+    const auto expected = test::run(source);
+    REQUIRE(expected.status == VmStatus::Halted);
+
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto reduced = abstracts.move();
+    REQUIRE_FALSE(optimize_strength_reduce(reduced));
+    const auto uses = [&](Op op) {
+        return std::any_of(reduced.begin(), reduced.end(), [&](const AbstractInstr& abstract) { return abstract.instr.s.op == op; });
+    };
+    CHECK(uses(DIVP2));
+    CHECK(uses(MODP2));
+    CHECK(uses(DIVC));
+    CHECK(uses(MODC));
+    auto instrs = finalize(std::move(reduced));
+    REQUIRE(instrs);
+    auto vm = Vm::create(instrs.move());
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Halted);
+    CHECK(running.output == expected.output);
+}
+
+TEST_CASE("cached_div_magic only kicks in for a repeated divisor") {
+    DivisorCache cache;
+    for (uint32_t i = 0; i < DivisorCache::THRESHOLD; ++i) {
+        CHECK(cached_div_magic(cache, 7) == nullptr);
+    }
+    const auto* magic = cached_div_magic(cache, 7);
+    REQUIRE(magic != nullptr);
+    CHECK(div_by_magic(-50, *magic) == -7);
+    // another divisor starts over
+    CHECK(cached_div_magic(cache, 9) == nullptr);
+    // divisors without a magic number never get one
+    for (uint32_t i = 0; i < 2 * DivisorCache::THRESHOLD; ++i) {
+        CHECK(cached_div_magic(cache, -1) == nullptr);
+    }
+}
+
@@ -0,0 +1,58 @@
+#include "embed.h"
+#include "test_util.h"
+#include <array>
+#include <doctest/doctest.h>
+#include <string>
+
+namespace {
+
+/// Prints the input times 1 to 5, through a subroutine.
+constexpr EmbeddedSource TABLE = "push 1\n"
+                                 ":loop\n"
+                                 "over\n"
+                                 "over\n"
+                                 "call :times\n"
+                                 "print\n"
+                                 "inc\n"
+                                 "dup\n"
+                                 "push 6\n"
+                                 "jn :loop\n"
+                                 "pop\n"
+                                 "halt\n"
+                                 ":times\n"
+                                 "mul\n"
+                                 "ret\n";
+
+}
+
+TEST_CASE("Embedded programs run like the interpreter") {
+    std::array<int64_t, 16> stack { 7 };
+    std::string output;
+    const auto result = run_embedded<TABLE>(stack, 1, [&](int64_t value) { output += fmt::format("{}\n", value); });
+    CHECK(result.status == EmbeddedStatus::Halted);
+    REQUIRE(result.height == 1);
+    CHECK(stack[0] == 7);
+
+    const auto interpreted = test::run(fmt::format("push 7\n{}", TABLE.view()));
+    CHECK(interpreted.status == VmStatus::Halted);
+    CHECK(output == interpreted.output);
+    CHECK(output == "7\n14\n21\n28\n35\n");
+}
+
+TEST_CASE("Embedded programs fold their constants") {
+    std::array<int64_t, 4> stack {};
+    const auto result = run_embedded<"push 6\npush 7\nmul\npush 2\nadd\n">(stack, 0, [](int64_t) { });
+    CHECK(result.status == EmbeddedStatus::Halted);
+    REQUIRE(result.height == 1);
+    CHECK(stack[0] == 44);
+}
+
+TEST_CASE("Embedded programs end with a status where the interpreter faults") {
+    std::array<int64_t, 4> stack { 5 };
+    const auto print = [](int64_t) { };
+    CHECK(run_embedded<"push 0\ndiv\n">(stack, 1, print).status == EmbeddedStatus::DivisionByZero);
+    CHECK(run_embedded<"pop\npop\n">(stack, 1, print).status == EmbeddedStatus::StackUnderflow);
+    CHECK(run_embedded<":loop\ndup\njmp :loop\n">(stack, 1, print).status == EmbeddedStatus::StackOverflow);
+    CHECK(run_embedded<"ret\n">(stack, 1, print).status == EmbeddedStatus::ReturnWithoutCall);
+    CHECK(run_embedded<":deeper\ncall :deeper\n">(stack, 1, print).status == EmbeddedStatus::CallStackOverflow);
+}
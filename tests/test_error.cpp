@@ -0,0 +1,177 @@
+#include "error.h"
+#include <doctest/doctest.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace {
+
+/// Counts how many of it are alive, to check that a Result destroys what it
+/// constructed.
+struct Counted {
+    static inline int alive = 0;
+    int value;
+
+    Counted(int v)
+        : value(v) { ++alive; }
+    Counted(const Counted& other)
+        : value(other.value) { ++alive; }
+    Counted(Counted&& other) noexcept
+        : value(other.value) { ++alive; }
+    Counted& operator=(const Counted&) = default;
+    Counted& operator=(Counted&&) noexcept = default;
+    ~Counted() { --alive; }
+};
+
+Result<Counted> counted(int value) {
+    return Counted(value);
+}
+
+Result<Counted> failed(int code) {
+    return { "failed with {}", code };
+}
+
+}
+
+TEST_CASE("ErrorMessage formats only when displayed") {
+    const std::string name = "file.mcl";
+    ErrorMessage message("failed to open '{}': {} of {}, {} {}", name, -3, size_t(7), true, 'x');
+    CHECK(message.code() == "failed to open '{}': {} of {}, {} {}");
+    CHECK(message.str() == "failed to open 'file.mcl': -3 of 7, true x");
+    CHECK(fmt::format("{}", message) == message.str());
+
+    CHECK(ErrorMessage {}.empty());
+    CHECK(ErrorMessage {}.str() == "Success");
+    CHECK(ErrorMessage {}.code().empty());
+    CHECK_FALSE(ErrorMessage("no arguments").empty());
+    CHECK(ErrorMessage("{}", 2.5).str() == "2.5");
+}
+
+TEST_CASE("ErrorMessage copies are independent") {
+    ErrorMessage message("value {}", std::string("one"));
+    ErrorMessage copy(message);
+    CHECK(copy.str() == "value one");
+    message = ErrorMessage("other {}", 2);
+    CHECK(copy.str() == "value one");
+    CHECK(message.str() == "other 2");
+
+    copy = message;
+    CHECK(copy.code() == "other {}");
+    const auto& same = copy;
+    copy = same;
+    CHECK(copy.str() == "other 2");
+
+    ErrorMessage moved(std::move(copy));
+    CHECK(moved.str() == "other 2");
+    copy = ErrorMessage {};
+    CHECK(copy.empty());
+}
+
+TEST_CASE("ErrorMessage passes on another message as is") {
+    const ErrorMessage inner("line {}: unknown '{}'", 3, "pus");
+    const ErrorMessage passed("{}", inner);
+    CHECK(passed.code() == inner.code());
+    CHECK(passed.str() == inner.str());
+
+    const ErrorMessage wrapped("Error in {}: {}", "a.mcl", inner);
+    CHECK(wrapped.code() == "Error in {}: {}");
+    CHECK(wrapped.str() == "Error in a.mcl: line 3: unknown 'pus'");
+
+    const Error err("{}", inner);
+    CHECK(err);
+    CHECK(err.error.str() == inner.str());
+    CHECK_FALSE(Error {});
+}
+
+TEST_CASE("Result holds either a value or an error") {
+    {
+        auto ok = counted(1);
+        REQUIRE(ok);
+        CHECK(ok.value().value == 1);
+        CHECK(ok.error.empty());
+        auto bad = failed(2);
+        CHECK_FALSE(bad);
+        CHECK(bad.error.str() == "failed with 2");
+        CHECK_THROWS_AS(bad.value(), std::logic_error);
+        CHECK_THROWS_AS(bad.move(), std::logic_error);
+        CHECK(Counted::alive == 1);
+    }
+    CHECK(Counted::alive == 0);
+}
+
+TEST_CASE("Result copies and moves both states") {
+    {
+        const auto ok = counted(1);
+        const auto bad = failed(2);
+
+        auto ok_copy = ok;
+        REQUIRE(ok_copy);
+        CHECK(ok_copy.value().value == 1);
+        auto bad_copy = bad;
+        CHECK_FALSE(bad_copy);
+        CHECK(bad_copy.error.str() == "failed with 2");
+        CHECK(Counted::alive == 2);
+
+        auto bad_moved = std::move(bad_copy);
+        CHECK_FALSE(bad_moved);
+        CHECK(bad_moved.error.str() == "failed with 2");
+        // the moved-from Result still knows it has no value
+        CHECK_FALSE(bad_copy);
+        auto ok_moved = std::move(ok_copy);
+        REQUIRE(ok_moved);
+        CHECK(ok_moved.value().value == 1);
+        CHECK(Counted::alive == 3);
+    }
+    CHECK(Counted::alive == 0);
+}
+
+TEST_CASE("Result assignment handles every combination of states") {
+    {
+        const auto ok = counted(1);
+        const auto bad = failed(2);
+
+        auto target = counted(5);
+        target = ok;
+        REQUIRE(target);
+        CHECK(target.value().value == 1);
+        CHECK(Counted::alive == 2);
+
+        target = bad;
+        CHECK_FALSE(target);
+        CHECK(target.error.str() == "failed with 2");
+        CHECK(Counted::alive == 1);
+
+        target = failed(3);
+        CHECK(target.error.str() == "failed with 3");
+
+        target = ok;
+        REQUIRE(target);
+        CHECK(target.error.empty());
+        CHECK(Counted::alive == 2);
+
+        target = counted(7);
+        REQUIRE(target);
+        CHECK(target.value().value == 7);
+
+        const auto& self = target;
+        target = self;
+        CHECK(target.value().value == 7);
+
+        target = failed(4);
+        CHECK_FALSE(target);
+        target = counted(8);
+        CHECK(target.value().value == 8);
+        CHECK(Counted::alive == 2);
+    }
+    CHECK(Counted::alive == 0);
+}
+
+TEST_CASE("Result with an error assigned destroys its value") {
+    {
+        auto result = counted(1);
+        result.error = ErrorMessage("late {}", 1);
+        CHECK_FALSE(result);
+        CHECK(Counted::alive == 1);
+    }
+    CHECK(Counted::alive == 0);
+}
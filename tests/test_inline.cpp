@@ -0,0 +1,101 @@
+#include "compiler.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr auto SQUARE = "push 7\n"
+                        "call :square\n"
+                        "print\n"
+                        "push 3\n"
+                        "call :square\n"
+                        "print\n"
+                        "halt\n"
+                        ":square\n"
+                        "dup\n"
+                        "mul\n"
+                        "ret\n";
+
+/// Counts down from 5, calling itself until it reaches 0.
+constexpr auto RECURSIVE = "push 5\n"
+                           "call :down\n"
+                           "halt\n"
+                           ":down\n"
+                           "dup\n"
+                           "print\n"
+                           "dec\n"
+                           "dup\n"
+                           "jz :done\n"
+                           "call :down\n"
+                           ":done\n"
+                           "ret\n";
+
+struct Inlined {
+    std::vector<Op> ops;
+    std::vector<InlineReport> reports;
+};
+
+Inlined inline_calls(const std::string& source) {
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    Inlined inlined;
+    CHECK_FALSE(optimize_inline(instrs, &inlined.reports));
+    for (const auto& abstract : instrs) {
+        inlined.ops.push_back(abstract.instr.s.op);
+    }
+    return inlined;
+}
+
+}
+
+TEST_CASE("call and ret run subroutines") {
+    const auto squares = test::run(SQUARE);
+    CHECK(squares.status == VmStatus::Halted);
+    CHECK(squares.output == "49\n9\n");
+
+    const auto recursive = test::run(RECURSIVE);
+    CHECK(recursive.status == VmStatus::Halted);
+    CHECK(recursive.output == "5\n4\n3\n2\n1\n");
+
+    const auto no_call = test::run("push 1\nret\n");
+    CHECK(no_call.status == VmStatus::Faulted);
+    CHECK(fmt::format("{}", no_call.error.error).starts_with("Return without a call."));
+
+    const auto too_deep = test::run(":forever\ncall :forever\n");
+    CHECK(too_deep.status == VmStatus::Faulted);
+    CHECK(fmt::format("{}", too_deep.error.error).starts_with("Call stack overflow"));
+}
+
+TEST_CASE("optimize_inline replaces calls of small subroutines") {
+    const auto inlined = inline_calls(SQUARE);
+    CHECK(inlined.ops == std::vector<Op> { PUSH, DUP, MUL, PRINT, PUSH, DUP, MUL, PRINT, HALT });
+    REQUIRE(inlined.reports.size() == 1);
+    CHECK(inlined.reports[0].label == "square");
+    CHECK(inlined.reports[0].inlined_calls == 2);
+    CHECK(inlined.reports[0].kept_calls == 0);
+    CHECK(inlined.reports[0].removed);
+}
+
+TEST_CASE("optimize_inline keeps recursive calls") {
+    const auto inlined = inline_calls(RECURSIVE);
+    size_t calls = 0;
+    for (const auto op : inlined.ops) {
+        calls += op == CALL ? 1 : 0;
+    }
+    CHECK(calls >= 1);
+
+    auto abstracts = test::translate(RECURSIVE);
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    REQUIRE_FALSE(optimize_inline(instrs));
+    auto finalized = finalize(std::move(instrs));
+    REQUIRE(finalized);
+    auto vm = Vm::create(finalized.move());
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Halted);
+    CHECK(running.output == "5\n4\n3\n2\n1\n");
+}
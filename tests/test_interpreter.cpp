@@ -0,0 +1,60 @@
+#include "interpreter.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+
+TEST_CASE("Stack::create maps the requested size, or the default") {
+    auto stack = Stack::create(0);
+    REQUIRE(stack);
+    CHECK(stack.value().size == Stack::DEFAULT_STACK_SIZE);
+    auto small = Stack::create(10);
+    REQUIRE(small);
+    CHECK(small.value().size == 10);
+    CHECK_FALSE(Stack::create(SIZE_MAX));
+}
+
+TEST_CASE("A full stack holds exactly its size") {
+    const auto fits = test::run("push 1\npush 2\npush 3\npush 4\nadd\nadd\nadd\nprint\nhalt\n", VmConfig { .stack_size = 4 });
+    CHECK(fits.status == VmStatus::Halted);
+    CHECK(fits.output == "10\n");
+}
+
+TEST_CASE("Stack overflow faults at the op which overflowed") {
+    // pc 0: push, 1: dup, 2: jmp
+    const auto source = "push 1\n:loop\ndup\njmp :loop\n";
+    auto instrs = test::compile(source);
+    REQUIRE(instrs);
+    auto vm = Vm::create(instrs.move(), VmConfig { .stack_size = 64 });
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Faulted);
+    CHECK(fmt::format("{}", running.error.error) == "Stack overflow: The stack can only hold 64 values. pc=1");
+    CHECK(running.prog.pc == 1);
+    CHECK(running.stack.stack_top == 64);
+
+    SUBCASE("through execute()") {
+        auto again = test::compile(source);
+        REQUIRE(again);
+        size_t fault_pc = SIZE_MAX;
+        const auto err = execute(again.move(), VmConfig { .stack_size = 64 }, nullptr, &fault_pc);
+        CHECK(fmt::format("{}", err.error) == "Stack overflow: The stack can only hold 64 values. pc=1");
+        CHECK(fault_pc == 1);
+    }
+    SUBCASE("each op which grows the stack") {
+        for (const auto* op : { "push 2", "dup", "over", "dup2" }) {
+            const auto grows = test::run(std::string("push 1\npush 1\n:loop\n") + op + "\njmp :loop\n", VmConfig { .stack_size = 16 });
+            CHECK(grows.status == VmStatus::Faulted);
+            CHECK(fmt::format("{}", grows.error.error) == "Stack overflow: The stack can only hold 16 values. pc=2");
+        }
+    }
+}
+
+TEST_CASE("A thread keeps running VMs after a stack overflow") {
+    for (size_t i = 0; i < 3; ++i) {
+        const auto overflow = test::run(":loop\npush 1\njmp :loop\n", VmConfig { .stack_size = 8 });
+        CHECK(overflow.status == VmStatus::Faulted);
+        const auto fine = test::run("push 6\npush 7\nmul\nprint\nhalt\n");
+        CHECK(fine.status == VmStatus::Halted);
+        CHECK(fine.output == "42\n");
+    }
+}
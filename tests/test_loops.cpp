@@ -0,0 +1,43 @@
+#include "test_util.h"
+#include <algorithm>
+#include <doctest/doctest.h>
+
+TEST_CASE("A counted loop is fused into an increment-compare-branch") {
+    const auto source = "push 5\npush 0\n:loop\ndup\nprint\ninc\ndup2\njg :loop\nhalt\n";
+    const auto expected = test::run(source);
+    REQUIRE(expected.status == VmStatus::Halted);
+    CHECK(expected.output == "0\n1\n2\n3\n4\n");
+
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto fused = abstracts.move();
+    std::vector<LoopReport> reports;
+    REQUIRE_FALSE(optimize_loops(fused, &reports));
+    CHECK(std::any_of(fused.begin(), fused.end(), [](const AbstractInstr& abstract) { return abstract.instr.s.op == INCJG; }));
+    CHECK(std::none_of(fused.begin(), fused.end(), [](const AbstractInstr& abstract) { return abstract.instr.s.op == DUP2; }));
+    REQUIRE(reports.size() == 1);
+    CHECK(reports[0].induction_slot == size_t(0));
+    CHECK(reports[0].induction_step == 1);
+
+    auto instrs = finalize(std::move(fused));
+    REQUIRE(instrs);
+    auto vm = Vm::create(instrs.move());
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Halted);
+    CHECK(running.output == expected.output);
+}
+
+TEST_CASE("invert_condition pairs up the conditional jumps") {
+    for (size_t i = 0; i <= size_t(RET); ++i) {
+        const auto op = Op(i);
+        const auto inverted = invert_condition(op);
+        if (op_is_conditional_jump(op)) {
+            CHECK(op_is_conditional_jump(inverted));
+            CHECK(inverted != op);
+            CHECK(invert_condition(inverted) == op);
+        } else {
+            CHECK(inverted == NOT_AN_INSTRUCTION);
+        }
+    }
+}
@@ -0,0 +1,120 @@
+#include "compiler.h"
+#include "interpreter.h"
+#include "source_map.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+/// The instructions after optimize_peephole(), as in the source, separated by
+/// "; ". Jumps are written without their label, and labels as ":label".
+std::string peephole(const std::string& source) {
+    auto abstracts = test::translate(source);
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    CHECK_FALSE(optimize_peephole(instrs));
+    std::string result;
+    for (const auto& abstract : instrs) {
+        if (!result.empty()) {
+            result += "; ";
+        }
+        const auto op = abstract.instr.s.op;
+        if (op == NOT_AN_INSTRUCTION) {
+            result += ":" + abstract.unresolved_label.value_or("");
+            continue;
+        }
+        result += to_string(op);
+        if (op == PUSH) {
+            result += fmt::format(" {}", int64_t(abstract.instr.s.val));
+        }
+    }
+    return result;
+}
+
+}
+
+TEST_CASE("peephole rules rewrite shorter forms") {
+    CHECK(peephole("push 1\nadd\n") == "inc");
+    CHECK(peephole("push 1\nsub\n") == "dec");
+    CHECK(peephole(":l\npush 0\nje :l\n") == ":l; jz");
+    CHECK(peephole(":l\npush 0\njn :l\n") == ":l; jnz");
+    CHECK(peephole("over\nover\n") == "dup2");
+}
+
+TEST_CASE("peephole rules fold arithmetic on constants") {
+    CHECK(peephole("push 2\npush 3\nadd\n") == "push 5");
+    CHECK(peephole("push 2\npush 3\nsub\n") == "push -1");
+    CHECK(peephole("push 2\npush 3\nmul\n") == "push 6");
+    CHECK(peephole("push -7\npush 2\ndiv\n") == "push -3");
+    CHECK(peephole("push -7\npush 2\nmod\n") == "push -1");
+    CHECK(peephole("push 4\ninc\n") == "push 5");
+    CHECK(peephole("push 4\ndec\n") == "push 3");
+
+    // folded again with what's before
+    CHECK(peephole("push 1\npush 2\nadd\npush 3\nmul\nprint\n") == "push 9; print");
+    CHECK(peephole("push 1\npush 2\nswap\nsub\n") == "push 1");
+    // the result doesn't fit into a push
+    CHECK(peephole("push 36028797018963967\npush 2\nmul\n") == "push 36028797018963967; push 2; mul");
+    CHECK(peephole("push -36028797018963968\ndec\n") == "push -36028797018963968; dec");
+    // faults when it runs
+    CHECK(peephole("push 1\npush 0\ndiv\n") == "push 1; push 0; div");
+    // a label in between is a jump target, so the pushes aren't next to each other
+    CHECK(peephole("push 2\n:l\npush 3\nadd\n") == "push 2; :l; push 3; add");
+}
+
+TEST_CASE("peephole rules remove operations which leave the value as it is") {
+    CHECK(peephole("dup\npush 0\nadd\nprint\n") == "dup; print");
+    CHECK(peephole("dup\npush 0\nsub\nprint\n") == "dup; print");
+    CHECK(peephole("dup\npush 1\nmul\nprint\n") == "dup; print");
+    CHECK(peephole("dup\npush 1\ndiv\nprint\n") == "dup; print");
+    CHECK(peephole("dup\npush 2\ndiv\nprint\n") == "dup; push 2; div; print");
+}
+
+TEST_CASE("peephole rules remove stack shuffling which cancels out") {
+    CHECK(peephole("swap\nswap\nprint\n") == "print");
+    CHECK(peephole("dup\npop\nprint\n") == "print");
+    CHECK(peephole("over\npop\nprint\n") == "print");
+    CHECK(peephole("push 5\npop\nprint\n") == "print");
+    CHECK(peephole("dup2\npop\npop\nprint\n") == "print");
+    CHECK(peephole("swap\nprint\nswap\n") == "swap; print; swap");
+}
+
+TEST_CASE("peephole rules move constants next to the operations after them") {
+    CHECK(peephole("push 1\npush 2\nswap\nprint\n") == "push 2; push 1; print");
+    CHECK(peephole("push 3\ndup\nprint\n") == "push 3; push 3; print");
+    CHECK(peephole("push 3\ndup\nmul\n") == "push 9");
+}
+
+TEST_CASE("peephole diagnostics are reported once per operation") {
+    auto abstracts = test::translate("push 1\npush 0\ndiv\npush 1\npush 0\ndiv\nswap\nswap\n");
+    REQUIRE(abstracts);
+    auto instrs = abstracts.move();
+    std::vector<FoldDiagnostic> diagnostics;
+    CHECK_FALSE(optimize_peephole(instrs, false, &diagnostics));
+    REQUIRE(diagnostics.size() == 2);
+    CHECK(diagnostics[0].location.line == 3);
+    CHECK(diagnostics[1].location.line == 6);
+    CHECK(diagnostics[0].message == "'1 div 0' divides by zero, and faults when executed.");
+}
+
+TEST_CASE("peephole replacements fault at the line of what they replace") {
+    for (const auto* source : { "push 1\ndup\n", "push 1\npush 2\nswap\n" }) {
+        CAPTURE(source);
+        auto abstracts = test::translate(source);
+        REQUIRE(abstracts);
+        auto optimized = abstracts.move();
+        REQUIRE_FALSE(optimize_peephole(optimized));
+        SourceMap source_map;
+        auto instrs = finalize(std::move(optimized), &source_map);
+        REQUIRE(instrs);
+        // only the first value fits, so the second instruction overflows
+        size_t fault_pc = SIZE_MAX;
+        const auto err = execute(instrs.move(), VmConfig { .stack_size = 1 }, nullptr, &fault_pc);
+        CHECK(fmt::format("{}", err.error).starts_with("Stack overflow"));
+        const auto location = source_map.lookup(fault_pc);
+        REQUIRE(location);
+        CHECK(location->line == 2);
+    }
+}
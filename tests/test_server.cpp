@@ -0,0 +1,160 @@
+#include "server.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+/// Prints once, so that the client knows it runs, and then never halts.
+constexpr auto FOREVER = "push 1\nprint\n:loop\njmp :loop\n";
+
+/// A server with a single worker and stacks of up to 1024 values on a socket
+/// of its own, running until destroyed.
+class TestServer {
+public:
+    explicit TestServer(std::chrono::milliseconds time_limit) {
+        m_cfg.socket_path = fmt::format("/tmp/mcl-test-{}.sock", getpid());
+        m_cfg.workers = 1;
+        m_cfg.time_limit = time_limit;
+        m_cfg.max_stack_size = 1024;
+        m_cfg.log_requests = false;
+        m_thread = std::thread([this] { m_error = serve(m_cfg, &m_stop); });
+        // the server is up once it answers
+        for (int i = 0; i < 500; ++i) {
+            if (!run("halt\n").error) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    ~TestServer() {
+        stop();
+    }
+
+    TestServer(const TestServer&) = delete;
+    TestServer& operator=(const TestServer&) = delete;
+
+    /// Stops the server and waits for it to return.
+    Error stop() {
+        m_stop = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        return m_error;
+    }
+
+    ClientResult run(const std::string& source, std::FILE* out = nullptr, uint64_t stack_size = 0) const {
+        ClientRequest request { .name = "<test>", .source = source, .optimize = true, .checked_arith = false, .stack_size = stack_size };
+        std::FILE* sink = out ? out : std::tmpfile();
+        auto result = run_on_server(m_cfg.socket_path, request, sink);
+        if (!out) {
+            std::fclose(sink);
+        }
+        return result;
+    }
+
+    const std::string& socket_path() const { return m_cfg.socket_path; }
+
+private:
+    ServerConfig m_cfg {};
+    std::atomic<bool> m_stop { false };
+    Error m_error {};
+    std::thread m_thread;
+};
+
+/// Reads from the pipe until `expected` arrived.
+void wait_for_output(int fd, std::string_view expected) {
+    std::string output;
+    char c = 0;
+    while (output.size() < expected.size() && read(fd, &c, 1) == 1) {
+        output.push_back(c);
+    }
+    CHECK(output == expected);
+}
+
+}
+
+TEST_CASE("The server stops programs which run out of time") {
+    TestServer server(std::chrono::milliseconds(100));
+    const auto result = server.run(FOREVER);
+    CHECK_FALSE(result.error);
+    CHECK(fmt::format("{}", result.program_error.error) == "Stopped after running for the time limit of 100 ms.");
+
+    // the worker is free again
+    const auto next = server.run("halt\n");
+    CHECK_FALSE(next.error);
+    CHECK_FALSE(next.program_error);
+}
+
+TEST_CASE("The server abandons programs whose client went away") {
+    TestServer server(std::chrono::milliseconds(0));
+
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, server.socket_path().c_str(), server.socket_path().size() + 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    // a FRAME_RUN as run_on_server() sends it, see server.h
+    const std::string_view source = FOREVER;
+    std::string payload;
+    const uint64_t stack_size = 0;
+    const uint32_t name_size = 0;
+    payload.push_back(char(REQUEST_OPTIMIZE));
+    payload.append(reinterpret_cast<const char*>(&stack_size), sizeof(stack_size));
+    payload.append(reinterpret_cast<const char*>(&name_size), sizeof(name_size));
+    payload.append(source);
+    std::string frame;
+    const auto size = uint32_t(payload.size());
+    frame.push_back(char(FRAME_RUN));
+    frame.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    frame.append(payload);
+    REQUIRE(write(fd, frame.data(), frame.size()) == ssize_t(frame.size()));
+    // the output frame of the first `print` means it's running
+    char header[sizeof(uint8_t) + sizeof(uint32_t)];
+    REQUIRE(read(fd, header, sizeof(header)) == ssize_t(sizeof(header)));
+    CHECK(header[0] == char(FRAME_OUTPUT));
+    close(fd);
+
+    // only gets the single worker once the program was abandoned
+    const auto next = server.run("halt\n");
+    CHECK_FALSE(next.error);
+    CHECK_FALSE(next.program_error);
+}
+
+TEST_CASE("Stopping the server stops the programs which still run") {
+    TestServer server(std::chrono::milliseconds(0));
+    int pipe_fds[2];
+    REQUIRE(pipe(pipe_fds) == 0);
+    std::FILE* out = fdopen(pipe_fds[1], "w");
+    REQUIRE(out);
+    std::setvbuf(out, nullptr, _IONBF, 0);
+    ClientResult result;
+    std::thread client([&] { result = server.run(FOREVER, out); });
+    wait_for_output(pipe_fds[0], "1\n");
+
+    CHECK_FALSE(server.stop());
+    client.join();
+    std::fclose(out);
+    close(pipe_fds[0]);
+    CHECK_FALSE(result.error);
+    CHECK(fmt::format("{}", result.program_error.error) == "Stopped, as the server is shutting down.");
+}
+
+TEST_CASE("The server refuses stacks larger than it allows") {
+    TestServer server(std::chrono::milliseconds(0));
+    const auto fits = server.run("push 1\nhalt\n", nullptr, 1024);
+    CHECK_FALSE(fits.error);
+    CHECK_FALSE(fits.program_error);
+
+    const auto too_large = server.run("push 1\nhalt\n", nullptr, 1025);
+    CHECK_FALSE(too_large.error);
+    CHECK(fmt::format("{}", too_large.program_error.error) == "A stack of 1025 values is larger than the 1024 the server allows.");
+}
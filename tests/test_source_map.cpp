@@ -0,0 +1,118 @@
+#include "source_map.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <vector>
+
+namespace {
+
+SourceLocation at(const std::string& file, size_t line, size_t col_start = 1, size_t col_end = 5) {
+    return SourceLocation { .file = file, .line = line, .col_start = col_start, .col_end = col_end };
+}
+
+bool same(const SourceLocation& a, const SourceLocation& b) {
+    return a.file == b.file && a.line == b.line && a.col_start == b.col_start && a.col_end == b.col_end;
+}
+
+/// Rows which need multi-byte varints, negative line deltas and switches
+/// between files.
+std::vector<SourceMap::Row> sample_rows() {
+    return {
+        { 0, at("main.mcl", 1) },
+        { 1, at("main.mcl", 2, 3, 7) },
+        { 5, at("lib.mcl", 200) },
+        { 6, at("main.mcl", 3) },
+        { 130, at("main.mcl", 1, 120, 300) },
+        { 100'000, at("lib.mcl", 1'000'000) },
+        { size_t(1) << 40, at("other.mcl", 7, 1, 1) },
+    };
+}
+
+SourceMap sample_map() {
+    SourceMap map;
+    for (const auto& row : sample_rows()) {
+        map.add(row.pc, row.loc);
+    }
+    return map;
+}
+
+}
+
+TEST_CASE("SourceMap decodes the rows it was given") {
+    const auto map = sample_map();
+    const auto rows = map.decode();
+    const auto expected = sample_rows();
+    REQUIRE(rows.size() == expected.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        CHECK(rows[i].pc == expected[i].pc);
+        CHECK(same(rows[i].loc, expected[i].loc));
+    }
+    CHECK(map.files.size() == 3);
+}
+
+TEST_CASE("SourceMap::lookup finds the row at or before the pc") {
+    const auto map = sample_map();
+    CHECK(same(map.lookup(0).value(), at("main.mcl", 1)));
+    CHECK(same(map.lookup(4).value(), at("main.mcl", 2, 3, 7)));
+    CHECK(same(map.lookup(129).value(), at("main.mcl", 3)));
+    CHECK(same(map.lookup(99'999).value(), at("main.mcl", 1, 120, 300)));
+    CHECK(same(map.lookup(SIZE_MAX).value(), at("other.mcl", 7, 1, 1)));
+
+    SourceMap late;
+    late.add(10, at("a.mcl", 4));
+    CHECK_FALSE(late.lookup(9).has_value());
+    CHECK(SourceMap {}.decode().empty());
+}
+
+TEST_CASE("SourceMap only adds a row where the location changes") {
+    SourceMap map;
+    map.add(0, at("a.mcl", 1));
+    const auto size = map.rows.size();
+    map.add(1, at("a.mcl", 1));
+    map.add(2, at("a.mcl", 1));
+    CHECK(map.rows.size() == size);
+    map.add(3, at("a.mcl", 2));
+    CHECK(map.decode().size() == 2);
+    // a row for a short line in the same file is a few bytes
+    CHECK(map.rows.size() - size <= 5);
+}
+
+TEST_CASE("SourceMap survives serialization and remapping") {
+    const auto map = sample_map();
+    const auto data = serialize_source_map(map);
+    auto read = deserialize_source_map(data);
+    REQUIRE(read);
+    CHECK(read.value().files == map.files);
+    CHECK(read.value().rows == map.rows);
+
+    std::vector<uint8_t> cut(data.begin(), data.end() - 3);
+    CHECK_FALSE(deserialize_source_map(cut));
+    CHECK_FALSE(deserialize_source_map({}));
+
+    SourceMap small;
+    small.add(0, at("a.mcl", 1));
+    small.add(1, at("a.mcl", 2));
+    small.add(2, at("a.mcl", 3));
+    const std::vector<size_t> new_pcs { 0, 3, 5 };
+    small.remap(new_pcs);
+    const auto rows = small.decode();
+    REQUIRE(rows.size() == 3);
+    CHECK(rows[1].pc == 3);
+    CHECK(rows[2].pc == 5);
+    CHECK(rows[2].loc.line == 3);
+}
+
+TEST_CASE("finalize maps every instruction to its source line") {
+    auto abstracts = test::translate("push 1\n\npush 2\n:label\nadd\nprint\nhalt\n");
+    REQUIRE(abstracts);
+    SourceMap map;
+    auto instrs = finalize(abstracts.move(), &map);
+    REQUIRE(instrs);
+    REQUIRE(instrs.value().size() == 5);
+    const size_t lines[] = { 1, 3, 5, 6, 7 };
+    for (size_t pc = 0; pc < 5; ++pc) {
+        const auto loc = map.lookup(pc);
+        REQUIRE(loc.has_value());
+        CHECK(loc->line == lines[pc]);
+        CHECK(loc->file == "<test>");
+    }
+}
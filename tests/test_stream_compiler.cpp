@@ -0,0 +1,59 @@
+#include "bytecode.h"
+#include "stream_compiler.h"
+#include "test_util.h"
+#include <cstdio>
+#include <doctest/doctest.h>
+#include <filesystem>
+#include <string>
+
+namespace {
+
+/// Streams the source through compile_stream() into a temporary file, with
+/// tiny chunks and windows, so that references cross both.
+Result<StreamStats> stream(const std::string& source, const std::string& output) {
+    auto* input = fmemopen(const_cast<char*>(source.data()), source.size(), "r");
+    if (!input) {
+        return { "fmemopen failed" };
+    }
+    auto stats = compile_stream(input, "<test>", output, StreamConfig { .chunk_size = 7, .window_size = 3 });
+    std::fclose(input);
+    return stats;
+}
+
+}
+
+TEST_CASE("Streaming backpatches forward references across chunks and windows") {
+    std::string source = "push 0\njmp :start\n";
+    for (size_t i = 0; i < 50; ++i) {
+        source += ":skip" + std::to_string(i) + "\ninc\njmp :next" + std::to_string(i) + "\n";
+    }
+    source += ":start\n";
+    for (size_t i = 0; i < 50; ++i) {
+        source += "jmp :skip" + std::to_string(i) + "\n:next" + std::to_string(i) + "\n";
+    }
+    source += "print\nhalt\n";
+    const auto expected = test::run(source);
+    REQUIRE(expected.status == VmStatus::Halted);
+    CHECK(expected.output == "50\n");
+
+    const auto output = (std::filesystem::temp_directory_path() / "mcl-test-stream.mclb").string();
+    auto stats = stream(source, output);
+    REQUIRE(stats);
+    CHECK(stats.value().labels == 101);
+    CHECK(stats.value().max_pending_refs >= 50);
+    auto bytecode = read_bytecode(output);
+    std::filesystem::remove(output);
+    REQUIRE(bytecode);
+    auto vm = Vm::create(std::move(bytecode.move().instrs));
+    REQUIRE(vm);
+    auto running = vm.move();
+    CHECK(run(running, UINT64_MAX) == VmStatus::Halted);
+    CHECK(running.output == expected.output);
+}
+
+TEST_CASE("Streaming rejects labels defined twice, and missing labels") {
+    const auto output = (std::filesystem::temp_directory_path() / "mcl-test-stream-error.mclb").string();
+    CHECK_FALSE(stream(":a\npush 1\n:a\nhalt\n", output));
+    CHECK_FALSE(stream("jmp :b\nhalt\n", output));
+    std::filesystem::remove(output);
+}
@@ -0,0 +1,90 @@
+#include "instruction.h"
+#include "symbols.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <string>
+
+static_assert(op_from_string("push") == PUSH);
+static_assert(op_from_string("modjnz") == MODJNZ);
+static_assert(op_from_string("pushh") == NOT_AN_INSTRUCTION);
+
+TEST_CASE("op_from_string finds every mnemonic, and nothing else") {
+    for (const auto& [name, op] : MNEMONICS) {
+        CHECK(op_from_string(name) == op);
+        CHECK(to_string(op) == name);
+    }
+    // every op has a mnemonic
+    for (size_t i = 1; i <= size_t(RET); ++i) {
+        CHECK(op_from_string(to_string(Op(i))) == Op(i));
+    }
+    for (const auto* other : { "", "p", "pus", "pushh", "PUSH", "Push", "not_an_instruction", "jmp ", "incj", "ret2" }) {
+        CHECK(op_from_string(other) == NOT_AN_INSTRUCTION);
+    }
+}
+
+TEST_CASE("Ops which take a label are jumps and call") {
+    for (size_t i = 0; i <= size_t(RET); ++i) {
+        const auto op = Op(i);
+        // the mnemonics of all jumps have a `j` in them
+        const bool jumps = to_string(op).find('j') != std::string_view::npos || op == CALL;
+        CHECK(op_accepts_label_argument(op) == jumps);
+        // a label becomes an address
+        CHECK((!op_accepts_label_argument(op) || op_requires_i64_argument(op)));
+    }
+}
+
+TEST_CASE("SymbolTable gives each distinct string a dense id") {
+    SymbolTable symbols;
+    CHECK(symbols.size() == 0);
+    CHECK(symbols.find("loop") == SymbolTable::NO_SYMBOL);
+    const auto loop = symbols.intern("loop");
+    const auto end = symbols.intern("end");
+    const auto empty = symbols.intern("");
+    CHECK(loop == 0);
+    CHECK(end == 1);
+    CHECK(empty == 2);
+    CHECK(symbols.intern("loop") == loop);
+    CHECK(symbols.find("end") == end);
+    CHECK(symbols.find("") == empty);
+    CHECK(symbols.find("loo") == SymbolTable::NO_SYMBOL);
+    CHECK(symbols.find("loops") == SymbolTable::NO_SYMBOL);
+    CHECK(symbols.name(loop) == "loop");
+    CHECK(symbols.name(empty).empty());
+    CHECK(symbols.size() == 3);
+}
+
+TEST_CASE("SymbolTable keeps its strings through rehashing") {
+    SymbolTable symbols;
+    constexpr uint32_t count = 20'000;
+    for (uint32_t i = 0; i < count; ++i) {
+        CHECK(symbols.intern("label_" + std::to_string(i)) == i);
+    }
+    CHECK(symbols.size() == count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const auto name = "label_" + std::to_string(i);
+        CHECK(symbols.find(name) == i);
+        CHECK(symbols.name(i) == name);
+    }
+
+    SymbolTable reserved;
+    reserved.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        CHECK(reserved.intern(std::to_string(i)) == i);
+    }
+    CHECK(reserved.find("19999") == count - 1);
+}
+
+TEST_CASE("finalize resolves many labels, and reports missing ones") {
+    std::string source;
+    for (size_t i = 0; i < 1000; ++i) {
+        source += "jmp :l" + std::to_string(i) + "\n:l" + std::to_string(i) + "\n";
+    }
+    source += "push 7\nprint\nhalt\n";
+    const auto jumps = test::run(source);
+    CHECK(jumps.status == VmStatus::Halted);
+    CHECK(jumps.output == "7\n");
+
+    const auto missing = test::compile("jmp :nowhere\nhalt\n");
+    REQUIRE_FALSE(missing);
+    CHECK(fmt::format("{}", missing.error).find("Could not find label 'nowhere'") != std::string::npos);
+}
@@ -0,0 +1,55 @@
+#include "task.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+#include <map>
+#include <string>
+
+TEST_CASE("Executor interleaves tasks and reports each result once") {
+    std::map<Executor::TaskId, std::string> output;
+    std::map<Executor::TaskId, int> results;
+    std::map<Executor::TaskId, std::string> errors;
+    Executor executor(
+        [&](Executor::TaskId id, std::string_view out) { output[id] += out; },
+        [&](Executor::TaskId id, const Error& err) {
+            ++results[id];
+            errors[id] = fmt::format("{}", err.error);
+        });
+    auto counting = test::compile("push 3\n:loop\ndup\nprint\ndec\ndup\njnz :loop\nhalt\n");
+    auto faulting = test::compile("push 1\npush 0\ndiv\nhalt\n");
+    REQUIRE(counting);
+    REQUIRE(faulting);
+    const auto a = executor.spawn(InstrStream(counting.value()), TaskConfig { .budget = 2 });
+    const auto b = executor.spawn(InstrStream(faulting.value()));
+    const auto c = executor.spawn(InstrStream(counting.value()), TaskConfig { .budget = 1 });
+    CHECK(executor.task_count() == 3);
+    CHECK(a != b);
+    CHECK(b != c);
+
+    executor.run();
+
+    CHECK(executor.task_count() == 0);
+    CHECK(output[a] == "3\n2\n1\n");
+    CHECK(output[c] == "3\n2\n1\n");
+    CHECK(results[a] == 1);
+    CHECK(results[b] == 1);
+    CHECK(results[c] == 1);
+    CHECK(errors[a] == "Success");
+    CHECK(errors[b].starts_with("Division by zero"));
+}
+
+TEST_CASE("Executor drops finished tasks and keeps running new ones") {
+    size_t finished = 0;
+    Executor executor([](Executor::TaskId, std::string_view) {}, [&](Executor::TaskId, const Error&) { ++finished; });
+    auto instrs = test::compile("push 1\npop\nhalt\n");
+    REQUIRE(instrs);
+    Executor::TaskId last = 0;
+    for (size_t round = 0; round < 100; ++round) {
+        last = executor.spawn(InstrStream(instrs.value()));
+        executor.run_once();
+        // each task finishes in its first slice, so none of them stays around
+        CHECK(executor.task_count() == 0);
+    }
+    CHECK(finished == 100);
+    // ids of finished tasks aren't handed out again
+    CHECK(last == 99);
+}
@@ -0,0 +1,46 @@
+#include "interpreter.h"
+#include "test_util.h"
+#include <doctest/doctest.h>
+
+namespace {
+
+/// Counts down from 1000, dividing by the counter in each iteration, so the
+/// last iteration divides by zero.
+constexpr auto COUNTDOWN = "push 1000\n"
+                           ":loop\n"
+                           "push 1\n"
+                           "sub\n"
+                           "push 10\n"
+                           "over\n"
+                           "div\n"
+                           "pop\n"
+                           "dup\n"
+                           "push -1\n"
+                           "jn :loop\n"
+                           "halt\n";
+
+}
+
+TEST_CASE("traced loops run like the interpreter") {
+    ExecStats plain_stats {};
+    size_t plain_pc = 0;
+    auto plain = test::compile(COUNTDOWN);
+    REQUIRE(plain);
+    const auto plain_error = execute(plain.move(), {}, &plain_stats, &plain_pc);
+
+    ExecStats traced_stats {};
+    size_t traced_pc = 0;
+    auto traced = test::compile(COUNTDOWN);
+    REQUIRE(traced);
+    const auto traced_error = execute(traced.move(), VmConfig { .trace = true }, &traced_stats, &traced_pc);
+
+    REQUIRE(plain_error);
+    CHECK(fmt::format("{}", traced_error.error) == fmt::format("{}", plain_error.error));
+    CHECK(traced_pc == plain_pc);
+    // the iteration which left through a guard isn't counted
+    CHECK(traced_stats.instructions <= plain_stats.instructions);
+    CHECK(traced_stats.instructions + 20 > plain_stats.instructions);
+    CHECK(traced_stats.traces.recorded >= 1);
+    CHECK(traced_stats.traces.iterations > 0);
+    CHECK(traced_stats.traces.exits >= 1);
+}
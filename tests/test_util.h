@@ -0,0 +1,54 @@
+#pragma once
+
+#include "compiler.h"
+#include "interpreter.h"
+#include "pipeline.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace test {
+
+/// Parses and translates the source, up to right before the optimizations.
+inline Result<AbstractInstrStream> translate(std::string_view source) {
+    auto lines = split_lines(source);
+    auto tokens = parse(lines, "<test>");
+    if (!tokens) {
+        return { "{}", tokens.error };
+    }
+    return ::translate(tokens.value());
+}
+
+/// Compiles the source without optimizations.
+inline Result<InstrStream> compile(std::string_view source) {
+    auto abstracts = translate(source);
+    if (!abstracts) {
+        return { "{}", abstracts.error };
+    }
+    return finalize(abstracts.move());
+}
+
+/// Output of a VM which ran to its end.
+struct Run {
+    VmStatus status;
+    std::string output;
+    Error error;
+};
+
+/// Compiles and runs the source. A source which doesn't compile faults with
+/// the compile error.
+inline Run run(std::string_view source, const VmConfig& cfg = {}) {
+    auto instrs = compile(source);
+    if (!instrs) {
+        return { VmStatus::Faulted, {}, Error("{}", instrs.error) };
+    }
+    auto vm = Vm::create(instrs.move(), cfg);
+    if (!vm) {
+        return { VmStatus::Faulted, {}, Error("{}", vm.error) };
+    }
+    auto created = vm.move();
+    const auto status = ::run(created, UINT64_MAX);
+    return { status, created.output, created.error };
+}
+
+}